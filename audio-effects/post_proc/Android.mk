@@ -35,12 +35,13 @@ LOCAL_SRC_FILES:= \
         virtualizer.c \
         reverb.c \
         effect_api.c \
+        sw_dsp.c \
         effect_util.c
 
 # HW_ACCELERATED has been disabled by default since msm8996. File doesn't
 # compile cleanly on tip so don't want to include it, but keeping this
 # as a reference.
-# LOCAL_SRC_FILES += hw_accelerator.c
+# LOCAL_SRC_FILES += hw_accelerator.c hw_accelerator_ring.c
 
 ifeq ($(strip $(AUDIO_FEATURE_ENABLED_INSTANCE_ID)), true)
     LOCAL_CFLAGS += -DINSTANCE_ID_ENABLED
@@ -104,6 +105,89 @@ endif
 
 include $(BUILD_SHARED_LIBRARY)
 
+################################################################################
+# host stress benchmark of the bundle entry points, see bundle_stress.c
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CFLAGS += -Wno-unused-parameter
+LOCAL_CFLAGS += -Wno-unused-function
+LOCAL_CFLAGS += -Wno-sign-compare
+LOCAL_CFLAGS += -Wno-format
+LOCAL_CFLAGS += -D__unused=__attribute__\(\(__unused__\)\)
+LOCAL_CFLAGS += -O2
+
+LOCAL_SRC_FILES:= \
+        bundle.c \
+        equalizer.c \
+        bass_boost.c \
+        virtualizer.c \
+        reverb.c \
+        effect_api.c \
+        sw_dsp.c \
+        bundle_stress.c
+
+LOCAL_HEADER_LIBRARIES := libhardware_headers \
+                          libsystem_headers
+
+LOCAL_C_INCLUDES := \
+        vendor/qcom/opensource/pal \
+        $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include \
+        $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include/audio \
+        $(call include-path-for, audio-effects)
+
+LOCAL_STATIC_LIBRARIES := \
+        libcutils \
+        liblog
+
+LOCAL_LDLIBS := -lm -lpthread
+
+LOCAL_MODULE:= bundle_stress
+
+include $(BUILD_HOST_EXECUTABLE)
+
+################################################################################
+# host benchmark of the software fallback DSP, see sw_dsp_bench.c
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CFLAGS += -Wno-unused-parameter
+LOCAL_CFLAGS += -O2
+
+LOCAL_SRC_FILES:= \
+        sw_dsp.c \
+        sw_dsp_bench.c
+
+LOCAL_HEADER_LIBRARIES := libhardware_headers \
+                          libsystem_headers
+
+LOCAL_STATIC_LIBRARIES := liblog
+
+LOCAL_LDLIBS := -lm
+
+LOCAL_MODULE:= sw_dsp_bench
+
+include $(BUILD_HOST_EXECUTABLE)
+
+################################################################################
+# host benchmark of the volume listener accumulate kernels, see pcm_accumulate_bench.c
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CFLAGS += -Wno-unused-parameter
+LOCAL_CFLAGS += -O2
+
+LOCAL_SRC_FILES:= \
+        pcm_accumulate.c \
+        pcm_accumulate_bench.c
+
+LOCAL_MODULE:= pcm_accumulate_bench
+
+include $(BUILD_HOST_EXECUTABLE)
+
 
 ifeq ($(strip $(AUDIO_FEATURE_ENABLED_HW_ACCELERATED_EFFECTS)),true)
 include $(CLEAR_VARS)
@@ -169,7 +253,8 @@ LOCAL_CFLAGS += -Wall
 LOCAL_CFLAGS += -Werror
 
 LOCAL_SRC_FILES:= \
-        volume_listener.c
+        volume_listener.c \
+        pcm_accumulate.c
 
 LOCAL_CFLAGS+= -O2 -fvisibility=hidden
 
@@ -31,6 +31,11 @@
 #include "effect_api.h"
 #include "bass_boost.h"
 
+/* software fallback: low shelf boosting up to 12 dB at full strength */
+#define BASSBOOST_SW_DSP_FREQ 100.0f
+#define BASSBOOST_SW_DSP_MAX_GAIN_DB 12.0f
+#define BASSBOOST_MAX_STRENGTH 1000
+
 #define BASSBOOST_MAX_LATENCY 30
 
 /* Offload bassboost UUID: 2c4a8c24-1581-487f-94f6-0002a5d5c51b */
@@ -307,6 +312,39 @@ int bass_set_mode(effect_context_t *context,  int32_t hw_acc_fd)
     return 0;
 }
 
+static void bassboost_update_sw_dsp(bassboost_context_t *context, int strength,
+                                    uint32_t rate)
+{
+    uint32_t num_stages = (strength > 0) ? 1 : 0;
+
+    if (num_stages)
+        sw_dsp_set_low_shelf(&context->sw_dsp.stages[0], rate, BASSBOOST_SW_DSP_FREQ,
+                             strength * BASSBOOST_SW_DSP_MAX_GAIN_DB /
+                             BASSBOOST_MAX_STRENGTH);
+    if (num_stages != context->sw_dsp.num_stages)
+        sw_dsp_chain_reset(&context->sw_dsp);
+    context->sw_dsp.num_stages = num_stages;
+    context->sw_dsp_strength = strength;
+    context->sw_dsp_rate = rate;
+}
+
+int bass_process(effect_context_t *context, audio_buffer_t *in, audio_buffer_t *out)
+{
+    bass_context_t *bass_ctxt = (bass_context_t *)context;
+    bassboost_context_t *bassboost_ctxt = &(bass_ctxt->bassboost_ctxt);
+    uint32_t rate = context->config.inputCfg.samplingRate;
+    int strength = 0;
+
+    /* PBE has no software implementation, the audio is passed through */
+    if (bass_ctxt->active_index == BASS_BOOST && !bassboost_ctxt->temp_disabled)
+        strength = bassboost_ctxt->strength;
+    if (strength != bassboost_ctxt->sw_dsp_strength ||
+        rate != bassboost_ctxt->sw_dsp_rate)
+        bassboost_update_sw_dsp(bassboost_ctxt, strength, rate);
+
+    return sw_dsp_process(&bassboost_ctxt->sw_dsp, &context->config, in, out);
+}
+
 #undef LOG_TAG
 #define LOG_TAG "offload_effect_bb"
 /*
@@ -381,8 +419,12 @@ int bassboost_set_device(effect_context_t *context, uint32_t device)
     return 0;
 }
 
-int bassboost_reset(effect_context_t *context __unused)
+int bassboost_reset(effect_context_t *context)
 {
+    bassboost_context_t *bass_ctxt = (bassboost_context_t *)context;
+
+    sw_dsp_chain_reset(&bass_ctxt->sw_dsp);
+    bass_ctxt->sw_dsp_rate = 0;
     return 0;
 }
 
@@ -23,6 +23,7 @@
 #define BASSBOOST_PARAM_LATENCY 0x80000000
 
 #include "bundle.h"
+#include "sw_dsp.h"
 
 enum {
     BASS_INVALID = -1,
@@ -42,6 +43,10 @@ typedef struct bassboost_context_s {
     bool temp_disabled;
     uint32_t device;
     struct bass_boost_params offload_bass;
+    // Software fallback vars, strength and rate the chain was built for
+    struct sw_dsp_chain sw_dsp;
+    int sw_dsp_strength;
+    uint32_t sw_dsp_rate;
 } bassboost_context_t;
 
 typedef struct pbe_context_s {
@@ -83,6 +88,8 @@ int bass_start(effect_context_t *context, output_context_t *output);
 
 int bass_stop(effect_context_t *context, output_context_t *output);
 
+int bass_process(effect_context_t *context, audio_buffer_t *in, audio_buffer_t *out);
+
 
 int bassboost_get_strength(bassboost_context_t *context);
 
@@ -40,6 +40,7 @@
 
 #include <stdlib.h>
 #include <cutils/list.h>
+#include <cutils/properties.h>
 #include <cutils/str_parms.h>
 #include <log/log.h>
 #include <system/thread_defs.h>
@@ -93,20 +94,91 @@ struct listnode created_effects_list;
  */
 struct listnode active_outputs_list;
 /*
- * lock must be held when modifying or accessing
- * created_effects_list or active_outputs_list
+ * lock protects created_effects_list, active_outputs_list and the handle tables. It
+ * is held for writing when they change (effect create and release, output start and
+ * stop, EFFECT_CMD_OFFLOAD) and for reading by the other commands, which then only
+ * serialize on the lock of their output and of their effect. Process calls only take
+ * the lock of their effect.
+ * Lock order: lock, output_context_t.lock, effect_context_t.lock.
  */
-pthread_mutex_t lock;
+pthread_rwlock_t lock;
 
+/*
+ * Effect handles point into handle_cells rather than to the effect context, so a
+ * handle is validated without walking created_effects_list and a stale handle never
+ * dereferences freed memory. Cells are handed out in turn, skipping the ones in use,
+ * so the handle of a released effect only becomes valid again after
+ * EFFECT_HANDLE_CELLS - MAX_EFFECT_HANDLES more effects were created. A cell keeps
+ * pointing to effect_interface once handed out.
+ * The effect owning a cell is found through its slot in handle_slots, which also holds
+ * the lock of the effect: slots are never freed, so effect_process() can take that
+ * lock before checking that the handle is still current. At most MAX_EFFECT_HANDLES
+ * effects exist at a time, creating more fails with -ENOMEM.
+ */
+#define MAX_EFFECT_HANDLES 256
+#define EFFECT_HANDLE_CELLS (MAX_EFFECT_HANDLES * 16)
+
+typedef struct effect_handle_slot_s {
+    /* effect_context_t.lock of the effect owning the slot */
+    pthread_mutex_t lock;
+    effect_context_t *context;
+    /* index in handle_cells of the handle of context */
+    uint32_t cell;
+    int32_t next_free;
+} effect_handle_slot_t;
+
+static effect_handle_slot_t handle_slots[MAX_EFFECT_HANDLES];
+static int32_t free_handle_head;
+static int32_t free_handle_tail;
+static const struct effect_interface_s *handle_cells[EFFECT_HANDLE_CELLS];
+/* slot of the effect a cell was last handed out to */
+static uint8_t handle_cell_slot[EFFECT_HANDLE_CELLS];
+static uint32_t next_handle_cell;
+
+/*
+ * Equalizer, bass boost and virtualizer process audio in software (sw_dsp.c) when
+ * they are attached to outputs that are not offloaded.
+ */
+static bool sw_fallback_enabled;
+
+/*
+ * Parameters set by a command are queued in the param_batch of the target output and
+ * flushed when the command returns, so that a command setting several values (preset,
+ * band levels...) costs one PAL round trip per DSP parameter and still reports a PAL
+ * failure to its caller.
+ */
+static int flush_output_params(output_context_t *out_ctxt)
+{
+    if (!offload_param_batch_pending(&out_ctxt->param_batch))
+        return 0;
+    return offload_param_batch_flush(&out_ctxt->param_batch);
+}
 
 /*
  *  Local functions
  */
 static void init_once() {
+    pthread_rwlockattr_t lock_attr;
+    int i;
+
     list_init(&created_effects_list);
     list_init(&active_outputs_list);
 
-    pthread_mutex_init(&lock, NULL);
+    /* commands hold lock for reading almost continuously during slider drags */
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
+    for (i = 0; i < MAX_EFFECT_HANDLES; i++) {
+        pthread_mutex_init(&handle_slots[i].lock, NULL);
+        handle_slots[i].next_free = (i + 1 < MAX_EFFECT_HANDLES) ? i + 1 : -1;
+    }
+    free_handle_head = 0;
+    free_handle_tail = MAX_EFFECT_HANDLES - 1;
+
+    sw_fallback_enabled = property_get_bool("vendor.audio.offload.effects.sw_fallback",
+                                            false);
 
     init_status = 0;
 }
@@ -117,19 +189,80 @@ int lib_init()
     return init_status;
 }
 
-bool effect_exists(effect_context_t *context)
+/* called with lock held for writing */
+static effect_handle_t alloc_effect_handle(effect_context_t *context)
 {
-    struct listnode *node;
+    effect_handle_slot_t *slot, *owner;
+    int32_t index;
+    uint32_t cell;
+
+    if (free_handle_head < 0)
+        return NULL;
+    /* at most MAX_EFFECT_HANDLES - 1 cells are in use */
+    do {
+        cell = next_handle_cell++ % EFFECT_HANDLE_CELLS;
+        owner = &handle_slots[handle_cell_slot[cell]];
+    } while (owner->context != NULL && owner->cell == cell);
+
+    index = free_handle_head;
+    slot = &handle_slots[index];
+    free_handle_head = slot->next_free;
+    if (free_handle_head < 0)
+        free_handle_tail = -1;
+    slot->next_free = -1;
+
+    handle_cells[cell] = &effect_interface;
+    __atomic_store_n(&handle_cell_slot[cell], (uint8_t)index, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&slot->lock);
+    slot->context = context;
+    slot->cell = cell;
+    pthread_mutex_unlock(&slot->lock);
+    context->lock = &slot->lock;
+    return (effect_handle_t)&handle_cells[cell];
+}
 
-    list_for_each(node, &created_effects_list) {
-        effect_context_t *fx_ctxt = node_to_item(node,
-                                                 effect_context_t,
-                                                 effects_list_node);
-        if (fx_ctxt == context) {
-            return true;
-        }
-    }
-    return false;
+/* returns the index in handle_cells of a handle or -1 if it does not point to a cell */
+static int32_t get_handle_cell(effect_handle_t handle)
+{
+    uintptr_t offset = (uintptr_t)handle - (uintptr_t)handle_cells;
+
+    if ((uintptr_t)handle < (uintptr_t)handle_cells || offset >= sizeof(handle_cells) ||
+            offset % sizeof(handle_cells[0]) != 0)
+        return -1;
+    return offset / sizeof(handle_cells[0]);
+}
+
+/*
+ * called with lock held for writing. Once it returns, process calls no longer reach
+ * the effect.
+ */
+static void free_effect_handle(effect_handle_t handle)
+{
+    int32_t index = handle_cell_slot[get_handle_cell(handle)];
+    effect_handle_slot_t *slot = &handle_slots[index];
+
+    pthread_mutex_lock(&slot->lock);
+    slot->context = NULL;
+    pthread_mutex_unlock(&slot->lock);
+    if (free_handle_tail < 0)
+        free_handle_head = index;
+    else
+        handle_slots[free_handle_tail].next_free = index;
+    free_handle_tail = index;
+}
+
+/* returns the effect of a handle or NULL if the handle is not valid, called with lock held */
+static effect_context_t *get_effect(effect_handle_t handle)
+{
+    int32_t cell = get_handle_cell(handle);
+    effect_handle_slot_t *slot;
+
+    if (cell < 0)
+        return NULL;
+    slot = &handle_slots[handle_cell_slot[cell]];
+    if (slot->cell != (uint32_t)cell)
+        return NULL;
+    return slot->context;
 }
 
 output_context_t *get_output(audio_io_handle_t output)
@@ -220,7 +353,7 @@ int offload_effects_bundle_hal_start_output(audio_io_handle_t output,  pal_strea
     if (lib_init() != 0)
         return init_status;
 
-    pthread_mutex_lock(&lock);
+    pthread_rwlock_wrlock(&lock);
     if (get_output(output) != NULL) {
         ALOGW("%s output already started", __func__);
         ret = -ENOSYS;
@@ -237,20 +370,29 @@ int offload_effects_bundle_hal_start_output(audio_io_handle_t output,  pal_strea
 
     out_ctxt->handle = output;
     out_ctxt->pal_stream_handle = pal_stream_handle;
+    pthread_mutex_init(&out_ctxt->lock, NULL);
+    offload_param_batch_init(&out_ctxt->param_batch, pal_stream_handle);
     list_init(&out_ctxt->effects_list);
+    /* all effects of the output in one batch, applied before returning to the HAL */
+    offload_param_batch_open(&out_ctxt->param_batch);
     list_for_each(node, &created_effects_list) {
         effect_context_t *fx_ctxt = node_to_item(node,
                                                  effect_context_t,
                                                  effects_list_node);
         if (fx_ctxt->out_handle == output) {
-            if (fx_ctxt->ops.start)
+            if (fx_ctxt->ops.start) {
+                pthread_mutex_lock(fx_ctxt->lock);
                 fx_ctxt->ops.start(fx_ctxt, out_ctxt);
+                pthread_mutex_unlock(fx_ctxt->lock);
+            }
             list_add_tail(&out_ctxt->effects_list, &fx_ctxt->output_node);
         }
     }
+    offload_param_batch_close();
+    flush_output_params(out_ctxt);
     list_add_tail(&active_outputs_list, &out_ctxt->outputs_list_node);
 exit:
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&lock);
     return ret;
 }
 
@@ -266,7 +408,7 @@ int offload_effects_bundle_hal_stop_output(audio_io_handle_t output,  pal_stream
     if (lib_init() != 0)
         return init_status;
 
-    pthread_mutex_lock(&lock);
+    pthread_rwlock_wrlock(&lock);
 
     out_ctxt = get_output(output);
     if (out_ctxt == NULL) {
@@ -275,20 +417,31 @@ int offload_effects_bundle_hal_stop_output(audio_io_handle_t output,  pal_stream
         goto exit;
     }
 
+    offload_param_batch_open(&out_ctxt->param_batch);
     list_for_each(fx_node, &out_ctxt->effects_list) {
         effect_context_t *fx_ctxt = node_to_item(fx_node,
                                                  effect_context_t,
                                                  output_node);
-        if (fx_ctxt->ops.stop)
+        if (fx_ctxt->ops.stop) {
+            pthread_mutex_lock(fx_ctxt->lock);
             fx_ctxt->ops.stop(fx_ctxt, out_ctxt);
+            pthread_mutex_unlock(fx_ctxt->lock);
+        }
     }
+    offload_param_batch_close();
+    flush_output_params(out_ctxt);
+    ALOGD("%s output %d: %u effect parameters sent in %u PAL round trips, %u unchanged",
+          __func__, output, out_ctxt->param_batch.queued, out_ctxt->param_batch.round_trips,
+          out_ctxt->param_batch.suppressed);
 
     list_remove(&out_ctxt->outputs_list_node);
 
+    offload_param_batch_release(&out_ctxt->param_batch);
+    pthread_mutex_destroy(&out_ctxt->lock);
     free(out_ctxt);
 
 exit:
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&lock);
     return ret;
 }
 
@@ -297,6 +450,12 @@ exit:
  */
 int set_config(effect_context_t *context, effect_config_t *config)
 {
+    /* only the software fallback has format restrictions, offloaded and hw
+     * accelerated effects never process this config */
+    if (context->ops.process != NULL && !context->offload_enabled &&
+        !context->hw_acc_enabled && !sw_dsp_config_supported(config))
+        return -EINVAL;
+
     context->config = *config;
 
     if (context->ops.reset)
@@ -355,6 +514,8 @@ int effect_lib_create(const effect_uuid_t *uuid,
         context->ops.disable = equalizer_disable;
         context->ops.start = equalizer_start;
         context->ops.stop = equalizer_stop;
+        if (sw_fallback_enabled)
+            context->ops.process = equalizer_process;
 
         context->desc = &equalizer_descriptor;
         eq_ctxt->pal_stream_handle = NULL;
@@ -376,6 +537,8 @@ int effect_lib_create(const effect_uuid_t *uuid,
         context->ops.disable = bass_disable;
         context->ops.start = bass_start;
         context->ops.stop = bass_stop;
+        if (sw_fallback_enabled)
+            context->ops.process = bass_process;
 
         context->desc = &bassboost_descriptor;
         bass_ctxt->bassboost_ctxt.pal_stream_handle = NULL;
@@ -398,6 +561,8 @@ int effect_lib_create(const effect_uuid_t *uuid,
         context->ops.disable = virtualizer_disable;
         context->ops.start = virtualizer_start;
         context->ops.stop = virtualizer_stop;
+        if (sw_fallback_enabled)
+            context->ops.process = virtualizer_process;
 
         context->desc = &virtualizer_descriptor;
         virt_ctxt-> pal_stream_handle = NULL;
@@ -461,14 +626,23 @@ int effect_lib_create(const effect_uuid_t *uuid,
 
     context->state = EFFECT_STATE_INITIALIZED;
 
-    pthread_mutex_lock(&lock);
+    pthread_rwlock_wrlock(&lock);
+    context->handle = alloc_effect_handle(context);
+    if (context->handle == NULL) {
+        pthread_rwlock_unlock(&lock);
+        ALOGE("%s: no free effect handle", __func__);
+        if (context->ops.release)
+            context->ops.release(context);
+        free(context);
+        return -ENOMEM;
+    }
     list_add_tail(&created_effects_list, &context->effects_list_node);
     output_context_t *out_ctxt = get_output(ioId);
     if (out_ctxt != NULL)
         add_effect_to_output(out_ctxt, context);
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&lock);
 
-    *pHandle = (effect_handle_t)context;
+    *pHandle = context->handle;
 
     ALOGV("%s created context %p", __func__, context);
 
@@ -478,17 +652,19 @@ int effect_lib_create(const effect_uuid_t *uuid,
 
 int effect_lib_release(effect_handle_t handle)
 {
-    effect_context_t *context = (effect_context_t *)handle;
+    effect_context_t *context;
     int status;
 
     if (lib_init() != 0)
         return init_status;
 
-    ALOGV("%s context %p", __func__, handle);
-    pthread_mutex_lock(&lock);
+    ALOGV("%s handle %p", __func__, handle);
+    pthread_rwlock_wrlock(&lock);
     status = -EINVAL;
-    if (effect_exists(context)) {
+    context = get_effect(handle);
+    if (context != NULL) {
         output_context_t *out_ctxt = get_output(context->out_handle);
+        free_effect_handle(context->handle);
         if (out_ctxt != NULL)
             remove_effect_from_output(out_ctxt, context);
         list_remove(&context->effects_list_node);
@@ -497,7 +673,7 @@ int effect_lib_release(effect_handle_t handle)
         free(context);
         status = 0;
     }
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&lock);
 
     return status;
 }
@@ -530,32 +706,34 @@ int effect_lib_get_descriptor(const effect_uuid_t *uuid,
  * Effect Control Interface Implementation
  */
 
-/* Stub function for effect interface: never called for offloaded effects */
-/* called for hw accelerated effects */
+/* never called for offloaded effects */
+/* called for hw accelerated effects and for the software fallback on other outputs */
 int effect_process(effect_handle_t self,
-                       audio_buffer_t *inBuffer __unused,
-                       audio_buffer_t *outBuffer __unused)
+                       audio_buffer_t *inBuffer,
+                       audio_buffer_t *outBuffer)
 {
-    effect_context_t * context = (effect_context_t *)self;
+    effect_context_t * context;
+    effect_handle_slot_t *slot;
+    int32_t cell;
     int status = 0;
 
     ALOGV("%s", __func__);
 
-    pthread_mutex_lock(&lock);
-    if (!effect_exists(context)) {
-        status = -ENOSYS;
-        goto exit;
-    }
+    /* only the lock of the effect: its slot outlives the effect */
+    cell = get_handle_cell(self);
+    if (cell < 0)
+        return -ENOSYS;
+    slot = &handle_slots[__atomic_load_n(&handle_cell_slot[cell], __ATOMIC_ACQUIRE)];
 
-    if (context->state != EFFECT_STATE_ACTIVE) {
+    pthread_mutex_lock(&slot->lock);
+    context = slot->context;
+    if (context == NULL || slot->cell != (uint32_t)cell)
+        status = -ENOSYS;
+    else if (context->state != EFFECT_STATE_ACTIVE)
         status = -ENODATA;
-        goto exit;
-    }
-
-    if (context->ops.process)
+    else if (context->ops.process)
         status = context->ops.process(context, inBuffer, outBuffer);
-exit:
-    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&slot->lock);
     return status;
 }
 
@@ -563,19 +741,34 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
                    void *pCmdData, uint32_t *replySize, void *pReplyData)
 {
 
-    effect_context_t * context = (effect_context_t *)self;
-    int status = 0;
+    effect_context_t * context;
+    output_context_t *batch_out_ctxt = NULL;
+    bool effect_locked = false;
+    int status = 0, flush_status;
 
-    pthread_mutex_lock(&lock);
+    /* only EFFECT_CMD_OFFLOAD moves an effect between outputs */
+    if (cmdCode == EFFECT_CMD_OFFLOAD)
+        pthread_rwlock_wrlock(&lock);
+    else
+        pthread_rwlock_rdlock(&lock);
 
-    if (!effect_exists(context)) {
+    context = get_effect(self);
+    if (context == NULL) {
         ALOGE("%s: effect doesn't exist.\n", __func__);
         status = -ENOSYS;
         goto exit;
     }
 
     ALOGV("%s: ctxt %p, cmd %d", __func__, context, cmdCode);
-    if (context == NULL || context->state == EFFECT_STATE_UNINITIALIZED) {
+    batch_out_ctxt = get_output(context->out_handle);
+    if (batch_out_ctxt != NULL) {
+        pthread_mutex_lock(&batch_out_ctxt->lock);
+        offload_param_batch_open(&batch_out_ctxt->param_batch);
+    }
+    pthread_mutex_lock(context->lock);
+    effect_locked = true;
+
+    if (context->state == EFFECT_STATE_UNINITIALIZED) {
         status = -ENOSYS;
         goto exit;
     }
@@ -605,7 +798,8 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
             status = -EINVAL;
             goto exit;
         }
-        if (!context->offload_enabled && !context->hw_acc_enabled) {
+        if (!context->offload_enabled && !context->hw_acc_enabled &&
+            context->ops.process == NULL) {
             status = -EINVAL;
             goto exit;
         }
@@ -656,7 +850,8 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
                   cmdSize, *replySize);
             goto exit;
         }
-        if (!context->offload_enabled && !context->hw_acc_enabled) {
+        if (!context->offload_enabled && !context->hw_acc_enabled &&
+            context->ops.process == NULL) {
             status = -EINVAL;
             goto exit;
         }
@@ -702,7 +897,8 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
         }
         if (pCmdData == NULL || cmdSize != 2 * sizeof(uint32_t) ||
                 replySize == NULL || *replySize < 2*sizeof(int32_t)) {
-            return -EINVAL;
+            status = -EINVAL;
+            goto exit;
         }
         memcpy(pReplyData, pCmdData, sizeof(int32_t)*2);
         } break;
@@ -746,7 +942,8 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
               cmdSize, pCmdData, *replySize, pReplyData);
         if (cmdSize != sizeof(uint32_t) || pCmdData == NULL
                 || pReplyData == NULL || *replySize != sizeof(int)) {
-            return -EINVAL;
+            status = -EINVAL;
+            goto exit;
         }
         uint32_t value = *(uint32_t *)pCmdData;
         if (context->ops.set_hw_acc_mode)
@@ -768,7 +965,16 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
     }
 
 exit:
-    pthread_mutex_unlock(&lock);
+    if (effect_locked)
+        pthread_mutex_unlock(context->lock);
+    if (batch_out_ctxt != NULL) {
+        offload_param_batch_close();
+        flush_status = flush_output_params(batch_out_ctxt);
+        pthread_mutex_unlock(&batch_out_ctxt->lock);
+        if (status == 0)
+            status = flush_status;
+    }
+    pthread_rwlock_unlock(&lock);
 
     return status;
 }
@@ -777,14 +983,21 @@ exit:
 int effect_get_descriptor(effect_handle_t   self,
                           effect_descriptor_t *descriptor)
 {
-    effect_context_t *context = (effect_context_t *)self;
+    effect_context_t *context;
+    int status = 0;
 
-    if (!effect_exists(context) || (descriptor == NULL))
+    if (descriptor == NULL)
         return -EINVAL;
 
-    *descriptor = *context->desc;
+    pthread_rwlock_rdlock(&lock);
+    context = get_effect(self);
+    if (context == NULL)
+        status = -EINVAL;
+    else
+        *descriptor = *context->desc;
+    pthread_rwlock_unlock(&lock);
 
-    return 0;
+    return status;
 }
 
 bool effect_is_active(effect_context_t * ctxt) {
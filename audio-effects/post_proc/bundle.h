@@ -50,6 +50,10 @@ struct output_context_s {
     /* pcm device id */
     int pcm_device_id;
     pal_stream_handle_t *pal_stream_handle;
+    /* effect parameters pending for pal_stream_handle */
+    struct offload_param_batch param_batch;
+    /* serializes commands of the effects attached to this output */
+    pthread_mutex_t lock;
 };
 
 /* effect specific operations.
@@ -87,6 +91,10 @@ struct effect_context_s {
     bool offload_enabled;
     bool hw_acc_enabled;
     effect_ops_t ops;
+    /* handle returned to the framework, see handle_cells */
+    effect_handle_t handle;
+    /* serializes commands and process calls on this effect, held by its handle slot */
+    pthread_mutex_t *lock;
 };
 
 int set_config(effect_context_t *context, effect_config_t *config);
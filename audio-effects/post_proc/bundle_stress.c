@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host stress benchmark of the bundle entry points with many concurrent effect
+ * sessions. It is not part of the library: the bundle_stress host target builds it
+ * with the bundle sources, and the stand-in for pal_stream_set_param() below takes
+ * the place of PAL.
+ *
+ * OUTPUTS outputs carry SESSIONS_PER_OUTPUT equalizer sessions each. While
+ * COMMAND_THREADS threads set band levels on random sessions and one audio thread per
+ * output calls process on its sessions, one thread creates and releases sessions, and
+ * uses each released handle once more, and one thread stops and restarts the outputs.
+ *
+ * Usage: bundle_stress [seconds]
+ * Any overlapping PAL call on a stream or stale handle accepted makes it exit with 1.
+ */
+
+#define LOG_TAG "bundle_stress"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/list.h>
+#include <hardware/audio_effect.h>
+#include <audio_effects/effect_equalizer.h>
+
+#include "bundle.h"
+
+#define OUTPUTS 4
+#define SESSIONS_PER_OUTPUT 16
+#define SESSIONS (OUTPUTS * SESSIONS_PER_OUTPUT)
+#define COMMAND_THREADS 16
+/* time a set_param spends in PAL and the DSP */
+#define PAL_SET_PARAM_US 20
+#define PROCESS_PERIOD_US 1000
+
+extern audio_effect_library_t AUDIO_EFFECT_LIBRARY_INFO_SYM;
+extern const effect_descriptor_t equalizer_descriptor;
+int offload_effects_bundle_hal_start_output(audio_io_handle_t output,
+                                            pal_stream_handle_t *pal_stream_handle);
+int offload_effects_bundle_hal_stop_output(audio_io_handle_t output,
+                                           pal_stream_handle_t *pal_stream_handle);
+
+static struct {
+    int busy;
+} pal_streams[OUTPUTS];
+
+static effect_handle_t sessions[SESSIONS];
+static bool stop;
+
+static struct {
+    uint64_t pal_calls;
+    uint64_t pal_overlaps;
+    uint64_t commands;
+    uint64_t processes;
+    uint64_t process_ns;
+    uint64_t process_max_ns;
+    uint64_t creates;
+    uint64_t stale_accepted;
+    uint64_t restarts;
+} stats;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int pal_stream_set_param(pal_stream_handle_t *stream_handle, uint32_t param_id __unused,
+                         pal_param_payload *param_payload __unused)
+{
+    int *busy = &pal_streams[*(int *)stream_handle].busy;
+
+    /* the bundle serializes the PAL calls of an output */
+    if (__atomic_exchange_n(busy, 1, __ATOMIC_ACQ_REL))
+        __atomic_add_fetch(&stats.pal_overlaps, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.pal_calls, 1, __ATOMIC_RELAXED);
+    usleep(PAL_SET_PARAM_US);
+    __atomic_store_n(busy, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static pal_stream_handle_t *pal_stream(int output)
+{
+    static int ids[OUTPUTS] = {0, 1, 2, 3};
+
+    return (pal_stream_handle_t *)&ids[output];
+}
+
+static int create_session(int output, effect_handle_t *handle)
+{
+    uint32_t reply_size = sizeof(int);
+    int reply;
+    int ret;
+
+    ret = AUDIO_EFFECT_LIBRARY_INFO_SYM.create_effect(&equalizer_descriptor.uuid, 0,
+                                                      output + 1, handle);
+    if (ret != 0)
+        return ret;
+    return (**handle)->command(*handle, EFFECT_CMD_ENABLE, 0, NULL, &reply_size, &reply);
+}
+
+static void *command_loop(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    uint32_t buf[sizeof(effect_param_t) / sizeof(uint32_t) + 3];
+    effect_param_t *param = (effect_param_t *)buf;
+    uint32_t reply_size;
+    int reply;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        effect_handle_t handle = sessions[rand_r(&seed) % SESSIONS];
+
+        memset(buf, 0, sizeof(buf));
+        param->psize = 2 * sizeof(int32_t);
+        param->vsize = sizeof(int16_t);
+        ((int32_t *)param->data)[0] = EQ_PARAM_BAND_LEVEL;
+        ((int32_t *)param->data)[1] = rand_r(&seed) % 5;
+        ((int16_t *)param->data)[4] = (int16_t)(rand_r(&seed) % 3000 - 1500);
+        reply_size = sizeof(int);
+        (*handle)->command(handle, EFFECT_CMD_SET_PARAM, sizeof(buf), buf,
+                           &reply_size, &reply);
+        __atomic_add_fetch(&stats.commands, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void *process_loop(void *arg)
+{
+    int output = (int)(uintptr_t)arg;
+    int16_t samples[2 * 240];
+    audio_buffer_t in = { .frameCount = 240, .s16 = samples };
+    audio_buffer_t out = { .frameCount = 240, .s16 = samples };
+    int i;
+
+    memset(samples, 0, sizeof(samples));
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        for (i = 0; i < SESSIONS_PER_OUTPUT; i++) {
+            effect_handle_t handle = sessions[output * SESSIONS_PER_OUTPUT + i];
+            uint64_t begin = now_ns(), ns;
+
+            (*handle)->process(handle, &in, &out);
+            ns = now_ns() - begin;
+            __atomic_add_fetch(&stats.processes, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stats.process_ns, ns, __ATOMIC_RELAXED);
+            if (ns > __atomic_load_n(&stats.process_max_ns, __ATOMIC_RELAXED))
+                __atomic_store_n(&stats.process_max_ns, ns, __ATOMIC_RELAXED);
+        }
+        usleep(PROCESS_PERIOD_US);
+    }
+    return NULL;
+}
+
+static void *churn_loop(void *arg __unused)
+{
+    effect_descriptor_t descriptor;
+    effect_handle_t handle;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (create_session(0, &handle) != 0) {
+            fprintf(stderr, "create failed\n");
+            break;
+        }
+        AUDIO_EFFECT_LIBRARY_INFO_SYM.release_effect(handle);
+        if ((*handle)->get_descriptor(handle, &descriptor) == 0)
+            stats.stale_accepted++;
+        stats.creates++;
+        usleep(500);
+    }
+    return NULL;
+}
+
+static void *restart_loop(void *arg __unused)
+{
+    int output;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        for (output = 0; output < OUTPUTS; output++) {
+            offload_effects_bundle_hal_stop_output(output + 1, pal_stream(output));
+            offload_effects_bundle_hal_start_output(output + 1, pal_stream(output));
+            stats.restarts++;
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[COMMAND_THREADS + OUTPUTS + 2];
+    int seconds = argc > 1 ? atoi(argv[1]) : 2;
+    int count = 0, i;
+    uint64_t begin;
+    double elapsed;
+
+    for (i = 0; i < OUTPUTS; i++)
+        offload_effects_bundle_hal_start_output(i + 1, pal_stream(i));
+    for (i = 0; i < SESSIONS; i++) {
+        if (create_session(i / SESSIONS_PER_OUTPUT, &sessions[i]) != 0) {
+            fprintf(stderr, "cannot create session %d\n", i);
+            return 1;
+        }
+    }
+
+    begin = now_ns();
+    for (i = 0; i < COMMAND_THREADS; i++)
+        pthread_create(&threads[count++], NULL, command_loop, (void *)(uintptr_t)i);
+    for (i = 0; i < OUTPUTS; i++)
+        pthread_create(&threads[count++], NULL, process_loop, (void *)(uintptr_t)i);
+    pthread_create(&threads[count++], NULL, churn_loop, NULL);
+    pthread_create(&threads[count++], NULL, restart_loop, NULL);
+    sleep(seconds > 0 ? seconds : 1);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = (now_ns() - begin) / 1e9;
+
+    for (i = 0; i < SESSIONS; i++)
+        AUDIO_EFFECT_LIBRARY_INFO_SYM.release_effect(sessions[i]);
+    for (i = 0; i < OUTPUTS; i++)
+        offload_effects_bundle_hal_stop_output(i + 1, pal_stream(i));
+
+    printf("%d sessions on %d outputs, %d command threads, %.1f s\n",
+           SESSIONS, OUTPUTS, COMMAND_THREADS, elapsed);
+    printf("commands:       %.0f/s, %.0f PAL set_param/s\n",
+           stats.commands / elapsed, stats.pal_calls / elapsed);
+    printf("process:        %.0f/s, avg %.0f ns, max %.0f us\n",
+           stats.processes / elapsed,
+           stats.processes ? (double)stats.process_ns / stats.processes : 0.0,
+           stats.process_max_ns / 1e3);
+    printf("create/release: %.0f/s, output restarts %.0f/s\n",
+           stats.creates / elapsed, stats.restarts / elapsed);
+    printf("overlapping PAL calls: %llu, stale handles accepted: %llu\n",
+           (unsigned long long)stats.pal_overlaps,
+           (unsigned long long)stats.stale_accepted);
+    return stats.pal_overlaps || stats.stale_accepted ? 1 : 0;
+}
@@ -55,6 +55,7 @@
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <errno.h>
 #include <log/log.h>
 #include <sound/audio_effects.h>
@@ -63,6 +64,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "effect_api.h"
 #include "kvh2xml.h"
@@ -137,8 +139,16 @@ void offload_bassboost_set_strength(struct bass_boost_params *bassboost,
 #endif
 }
 
-static int send_kv_payload(pal_stream_handle_t *pal_stream_handle,
-                            uint32_t tag, pal_key_vector_t *kvp)
+/*
+ * batch setters queue into instead of calling PAL, see offload_param_batch_open().
+ * Per thread: commands on different outputs run concurrently.
+ */
+static __thread struct offload_param_batch *active_batch;
+/* all initialized batches, to find the per stream state they hold */
+static struct offload_param_batch *batches;
+
+static int pal_send_kv_payload(pal_stream_handle_t *pal_stream_handle,
+                               uint32_t tag, pal_key_vector_t *kvp)
 {
    int ret = 0;
    pal_param_payload *pal_payload;
@@ -180,9 +190,9 @@ done:
     return ret;
 }
 
-static int send_custom_payload(pal_stream_handle_t *pal_stream_handle,
-                              uint32_t tag, pal_effect_custom_payload_t *data,
-                              uint32_t custom_data_sz)
+static int pal_send_custom_payload(pal_stream_handle_t *pal_stream_handle,
+                                   uint32_t tag, pal_effect_custom_payload_t *data,
+                                   uint32_t custom_data_sz)
 {
     int ret = 0;
     pal_param_payload *pal_payload;
@@ -223,6 +233,246 @@ done:
     return ret;
 }
 
+/*
+ * Parameter batching
+ *
+ * PAL_PARAM_ID_UIEFFECT carries the payload of a single module tag, so a batch
+ * queues one entry per payload in the order they were set. A payload for the same
+ * tag as the last entry is coalesced into it: key vectors merge their keys, custom
+ * payloads with the same param id replace it. Flushing sends the entries in order.
+ */
+struct offload_param_entry {
+    uint32_t tag;
+    bool is_tkv;
+    uint32_t param_id;      /* custom payloads only */
+    uint32_t size;          /* custom payloads: size of data->data */
+    union {
+        pal_key_vector_t *kv;
+        pal_effect_custom_payload_t *custom;
+    };
+};
+
+void offload_param_batch_init(struct offload_param_batch *batch,
+                              pal_stream_handle_t *pal_stream_handle)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->pal_stream_handle = pal_stream_handle;
+    batch->next = batches;
+    batches = batch;
+}
+
+static struct offload_param_batch *find_batch(pal_stream_handle_t *pal_stream_handle)
+{
+    struct offload_param_batch *batch;
+
+    for (batch = batches; batch; batch = batch->next) {
+        if (batch->pal_stream_handle == pal_stream_handle)
+            return batch;
+    }
+    return NULL;
+}
+
+static void free_batch_entries(struct offload_param_batch *batch)
+{
+    uint32_t i;
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->entries[i].is_tkv)
+            free(batch->entries[i].kv);
+        else
+            free(batch->entries[i].custom);
+    }
+    batch->count = 0;
+}
+
+void offload_param_batch_release(struct offload_param_batch *batch)
+{
+    struct offload_param_batch **prev;
+
+    for (prev = &batches; *prev; prev = &(*prev)->next) {
+        if (*prev == batch) {
+            *prev = batch->next;
+            break;
+        }
+    }
+    if (active_batch == batch)
+        active_batch = NULL;
+    free_batch_entries(batch);
+    free(batch->entries);
+    batch->entries = NULL;
+    batch->capacity = 0;
+}
+
+void offload_param_batch_open(struct offload_param_batch *batch)
+{
+    active_batch = batch;
+}
+
+void offload_param_batch_close()
+{
+    active_batch = NULL;
+}
+
+bool offload_param_batch_pending(struct offload_param_batch *batch)
+{
+    return batch->count != 0;
+}
+
+static struct offload_param_entry *batch_new_entry(struct offload_param_batch *batch)
+{
+    if (batch->count == batch->capacity) {
+        uint32_t capacity = batch->capacity ? 2 * batch->capacity : 8;
+        struct offload_param_entry *entries = (struct offload_param_entry *)
+                realloc(batch->entries, capacity * sizeof(struct offload_param_entry));
+        if (!entries) {
+            ALOGE("%s: realloc failed for %u entries", __func__, capacity);
+            return NULL;
+        }
+        batch->entries = entries;
+        batch->capacity = capacity;
+    }
+    return &batch->entries[batch->count++];
+}
+
+static int batch_add_kv(struct offload_param_batch *batch, uint32_t tag,
+                        pal_key_vector_t *kvp)
+{
+    struct offload_param_entry *entry = NULL;
+    pal_key_vector_t *kv;
+    uint32_t i, j, num_tkvs;
+
+    if (batch->count != 0 && batch->entries[batch->count - 1].is_tkv &&
+            batch->entries[batch->count - 1].tag == tag)
+        entry = &batch->entries[batch->count - 1];
+    if (!entry) {
+        kv = (pal_key_vector_t *)malloc(sizeof(pal_key_vector_t) +
+                                        kvp->num_tkvs * sizeof(pal_key_value_pair_t));
+        if (!kv)
+            return -ENOMEM;
+        entry = batch_new_entry(batch);
+        if (!entry) {
+            free(kv);
+            return -ENOMEM;
+        }
+        entry->tag = tag;
+        entry->is_tkv = true;
+        entry->param_id = 0;
+        entry->size = 0;
+        entry->kv = kv;
+        kv->num_tkvs = kvp->num_tkvs;
+        memcpy(kv->kvp, kvp->kvp, kvp->num_tkvs * sizeof(pal_key_value_pair_t));
+        return 0;
+    }
+
+    /* merge: update keys already queued for this tag, append the others */
+    num_tkvs = entry->kv->num_tkvs;
+    kv = (pal_key_vector_t *)realloc(entry->kv, sizeof(pal_key_vector_t) +
+                        (num_tkvs + kvp->num_tkvs) * sizeof(pal_key_value_pair_t));
+    if (!kv)
+        return -ENOMEM;
+    entry->kv = kv;
+    for (i = 0; i < kvp->num_tkvs; i++) {
+        for (j = 0; j < kv->num_tkvs; j++) {
+            if (kv->kvp[j].key == kvp->kvp[i].key)
+                break;
+        }
+        kv->kvp[j] = kvp->kvp[i];
+        if (j == kv->num_tkvs)
+            kv->num_tkvs++;
+    }
+    return 0;
+}
+
+static int batch_add_custom(struct offload_param_batch *batch, uint32_t tag,
+                            pal_effect_custom_payload_t *data, uint32_t custom_data_sz)
+{
+    struct offload_param_entry *entry = NULL;
+    pal_effect_custom_payload_t *custom;
+
+    custom = (pal_effect_custom_payload_t *)malloc(sizeof(pal_effect_custom_payload_t) +
+                                                   custom_data_sz);
+    if (!custom)
+        return -ENOMEM;
+    custom->paramId = data->paramId;
+    memcpy(custom->data, data->data, custom_data_sz);
+
+    if (batch->count != 0 && !batch->entries[batch->count - 1].is_tkv &&
+            batch->entries[batch->count - 1].tag == tag &&
+            batch->entries[batch->count - 1].param_id == data->paramId) {
+        entry = &batch->entries[batch->count - 1];
+        free(entry->custom);
+    }
+    if (!entry) {
+        entry = batch_new_entry(batch);
+        if (!entry) {
+            free(custom);
+            return -ENOMEM;
+        }
+        entry->tag = tag;
+        entry->is_tkv = false;
+        entry->param_id = data->paramId;
+    }
+    entry->size = custom_data_sz;
+    entry->custom = custom;
+    return 0;
+}
+
+int offload_param_batch_flush(struct offload_param_batch *batch)
+{
+    uint32_t i;
+    int ret, status = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        struct offload_param_entry *entry = &batch->entries[i];
+
+        if (entry->is_tkv)
+            ret = pal_send_kv_payload(batch->pal_stream_handle, entry->tag, entry->kv);
+        else
+            ret = pal_send_custom_payload(batch->pal_stream_handle, entry->tag,
+                                          entry->custom, entry->size);
+        batch->round_trips++;
+        if (ret) {
+            ALOGE("%s: pal_stream_set_param failed for tag 0x%x. ret = %d",
+                  __func__, entry->tag, ret);
+            /* the reverb values were cached as sent when queued */
+            if (entry->tag == TAG_STREAM_REVERB)
+                batch->reverb_sent_mask = 0;
+            if (status == 0)
+                status = ret;
+        }
+    }
+    ALOGV("%s: %u entries, %u params queued, %u PAL round trips so far", __func__,
+          batch->count, batch->queued, batch->round_trips);
+    free_batch_entries(batch);
+    return status;
+}
+
+static int send_kv_payload(pal_stream_handle_t *pal_stream_handle,
+                           uint32_t tag, pal_key_vector_t *kvp)
+{
+    if (active_batch && active_batch->pal_stream_handle == pal_stream_handle) {
+        active_batch->queued++;
+        if (batch_add_kv(active_batch, tag, kvp) == 0)
+            return 0;
+        /* out of memory: keep the order of what is already queued */
+        offload_param_batch_flush(active_batch);
+    }
+    return pal_send_kv_payload(pal_stream_handle, tag, kvp);
+}
+
+static int send_custom_payload(pal_stream_handle_t *pal_stream_handle,
+                               uint32_t tag, pal_effect_custom_payload_t *data,
+                               uint32_t custom_data_sz)
+{
+    if (active_batch && active_batch->pal_stream_handle == pal_stream_handle) {
+        active_batch->queued++;
+        if (batch_add_custom(active_batch, tag, data, custom_data_sz) == 0)
+            return 0;
+        offload_param_batch_flush(active_batch);
+    }
+    return pal_send_custom_payload(pal_stream_handle, tag, data, custom_data_sz);
+}
+
 void offload_bassboost_set_mode(struct bass_boost_params *bassboost,
                                 int mode)
 {
@@ -826,365 +1076,134 @@ void offload_reverb_set_density(struct reverb_params *reverb, int density)
 }
 
 
+/* reverb properties in OFFLOAD_SEND_REVERB_* bit order, entry 0 is the enable switch */
+#define REVERB_PAYLOAD_MAX_WORDS 8
+#define REVERB_PRESET_DEPENDENT_PROPERTIES \
+        ~(OFFLOAD_SEND_REVERB_ENABLE_FLAG | OFFLOAD_SEND_REVERB_MODE | OFFLOAD_SEND_REVERB_PRESET)
+
+static const struct {
+    uint32_t param_id;
+    uint32_t len;
+    size_t offset;      /* of the int value in struct reverb_params */
+} reverb_properties[OFFLOAD_REVERB_PROPERTY_COUNT] = {
+    {0, 0, offsetof(struct reverb_params, enable_flag)},
+    {PARAM_ID_REVERB_MODE, REVERB_MODE_PARAM_LEN,
+     offsetof(struct reverb_params, mode)},
+    {PARAM_ID_REVERB_PRESET, REVERB_PRESET_PARAM_LEN,
+     offsetof(struct reverb_params, preset)},
+    {PARAM_ID_REVERB_WET_MIX, REVERB_WET_MIX_PARAM_LEN,
+     offsetof(struct reverb_params, wet_mix)},
+    {PARAM_ID_REVERB_GAIN_ADJUST, REVERB_GAIN_ADJUST_PARAM_LEN,
+     offsetof(struct reverb_params, gain_adjust)},
+    {PARAM_ID_REVERB_ROOM_LEVEL, REVERB_ROOM_LEVEL_PARAM_LEN,
+     offsetof(struct reverb_params, room_level)},
+    {PARAM_ID_REVERB_ROOM_HF_LEVEL, REVERB_ROOM_HF_LEVEL_PARAM_LEN,
+     offsetof(struct reverb_params, room_hf_level)},
+    {PARAM_ID_REVERB_DECAY_TIME, REVERB_DECAY_TIME_PARAM_LEN,
+     offsetof(struct reverb_params, decay_time)},
+    {PARAM_ID_REVERB_DECAY_HF_RATIO, REVERB_DECAY_HF_RATIO_PARAM_LEN,
+     offsetof(struct reverb_params, decay_hf_ratio)},
+    {PARAM_ID_REVERB_REFLECTIONS_LEVEL, REVERB_REFLECTIONS_LEVEL_PARAM_LEN,
+     offsetof(struct reverb_params, reflections_level)},
+    {PARAM_ID_REVERB_REFLECTIONS_DELAY, REVERB_REFLECTIONS_DELAY_PARAM_LEN,
+     offsetof(struct reverb_params, reflections_delay)},
+    {PARAM_ID_REVERB_LEVEL, REVERB_LEVEL_PARAM_LEN,
+     offsetof(struct reverb_params, level)},
+    {PARAM_ID_REVERB_DELAY, REVERB_DELAY_PARAM_LEN,
+     offsetof(struct reverb_params, delay)},
+    {PARAM_ID_REVERB_DIFFUSION, REVERB_DIFFUSION_PARAM_LEN,
+     offsetof(struct reverb_params, diffusion)},
+    {PARAM_ID_REVERB_DENSITY, REVERB_DENSITY_PARAM_LEN,
+     offsetof(struct reverb_params, density)},
+};
+
+/* true if the DSP already has this value for reverb property idx */
+static bool reverb_property_sent(struct offload_param_batch *cache, uint32_t idx,
+                                 int32_t value)
+{
+    return cache && (cache->reverb_sent_mask & (1u << idx)) &&
+           cache->reverb_sent[idx] == value;
+}
+
+static void reverb_property_update(struct offload_param_batch *cache, uint32_t idx,
+                                   int32_t value, int ret)
+{
+    if (!cache)
+        return;
+    if (ret) {
+        cache->reverb_sent_mask &= ~(1u << idx);
+        return;
+    }
+    /* a new preset or mode reloads the other properties in the DSP */
+    if ((1u << idx) & (OFFLOAD_SEND_REVERB_MODE | OFFLOAD_SEND_REVERB_PRESET))
+        cache->reverb_sent_mask &= ~REVERB_PRESET_DEPENDENT_PROPERTIES;
+    cache->reverb_sent[idx] = value;
+    cache->reverb_sent_mask |= 1u << idx;
+}
+
+/*
+ * Only properties whose value differs from the last one sent on the stream go to the
+ * DSP: the output batch caches what was sent and coalesces updates close in time.
+ */
 static int reverb_send_params_pal(eff_mode_t mode, pal_stream_handle_t *pal_stream_handle,
                                struct reverb_params *reverb,
                               unsigned param_send_flags)
 {
+    struct offload_param_batch *cache = find_batch(pal_stream_handle);
+    union {
+        pal_key_vector_t kv;
+        uint8_t bytes[sizeof(pal_key_vector_t) + sizeof(pal_key_value_pair_t)];
+    } kv_payload;
+    union {
+        pal_effect_custom_payload_t custom;
+        uint32_t words[REVERB_PAYLOAD_MAX_WORDS];
+    } custom_payload;
+    int32_t value;
+    uint32_t i;
     int ret = 0;
-    pal_effect_custom_payload_t *custom_payload = NULL;
 
     ALOGV("%s: flags 0x%x", __func__, param_send_flags);
 
-    if (param_send_flags & OFFLOAD_SEND_REVERB_ENABLE_FLAG) {
-        uint32_t num_kvs = 1;
-        pal_key_vector_t *pal_key_vector = NULL;
-        pal_key_vector = (pal_key_vector_t *) calloc (1, sizeof(pal_key_vector_t) +
-                                         num_kvs * sizeof(pal_key_value_pair_t));
-        if (!pal_key_vector) {
-            ALOGE("%s:%d calloc failed for size %zu", __func__, __LINE__,
-                 sizeof(pal_key_vector_t) + num_kvs * sizeof(pal_key_value_pair_t));
-            ret = -ENOMEM;
-            goto done;
-        }
-        pal_key_vector->num_tkvs = num_kvs;
-        pal_key_vector->kvp[0].key= REVERB_SWITCH;
-        pal_key_vector->kvp[0].value = reverb->enable_flag;
-        ret = send_kv_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              pal_key_vector);
-        free(pal_key_vector);
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_MODE) {
-        uint32_t custom_data_sz = REVERB_MODE_PARAM_LEN * sizeof(uint32_t);
+    for (i = 0; i < OFFLOAD_REVERB_PROPERTY_COUNT; i++) {
+        uint32_t custom_data_sz = reverb_properties[i].len * sizeof(uint32_t);
 
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                           sizeof(pal_effect_custom_payload_t) +
-                                           custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_MODE;
-        custom_payload->data[0] = reverb->mode;;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_PRESET) {
-        uint32_t custom_data_sz = REVERB_PRESET_PARAM_LEN * sizeof(uint32_t);
-
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                           sizeof(pal_effect_custom_payload_t) +
-                                           custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_PRESET;
-        custom_payload->data[0] = reverb->preset;
+        if (!(param_send_flags & (1u << i)))
+            continue;
 
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
+        if (i == 0)
+            value = reverb->enable_flag;
+        else
+            value = *(const int *)((const uint8_t *)reverb + reverb_properties[i].offset);
+        if (reverb_property_sent(cache, i, value)) {
+            cache->suppressed++;
+            continue;
         }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_WET_MIX) {
-        // param_id + actual payload
-        uint32_t custom_data_sz = REVERB_WET_MIX_PARAM_LEN * sizeof(uint32_t);
 
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                            sizeof(pal_effect_custom_payload_t) +
-                                            custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
+        if (i == 0) {
+            kv_payload.kv.num_tkvs = 1;
+            kv_payload.kv.kvp[0].key = REVERB_SWITCH;
+            kv_payload.kv.kvp[0].value = value;
+            ret = send_kv_payload(pal_stream_handle, TAG_STREAM_REVERB, &kv_payload.kv);
+        } else {
+            if (sizeof(pal_effect_custom_payload_t) + custom_data_sz >
+                    sizeof(custom_payload)) {
+                ALOGE("%s: param 0x%x too large", __func__, reverb_properties[i].param_id);
+                ret = -EINVAL;
+                goto done;
+            }
+            memset(&custom_payload, 0, sizeof(custom_payload));
+            custom_payload.custom.paramId = reverb_properties[i].param_id;
+            custom_payload.custom.data[0] = value;
+            ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
+                                      &custom_payload.custom, custom_data_sz);
         }
-
-        custom_payload->paramId = PARAM_ID_REVERB_WET_MIX;
-        custom_payload->data[0] = reverb->wet_mix;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
+        reverb_property_update(cache, i, value, ret);
         if (ret) {
             ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
             goto done;
         }
     }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_GAIN_ADJUST) {
-        uint32_t custom_data_sz = REVERB_GAIN_ADJUST_PARAM_LEN * sizeof(uint32_t);
-
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                            sizeof(pal_effect_custom_payload_t) +
-                                            custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
 
-        custom_payload->paramId = PARAM_ID_REVERB_GAIN_ADJUST;
-        custom_payload->data[0] = reverb->gain_adjust;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_ROOM_LEVEL) {
-        uint32_t custom_data_sz = REVERB_ROOM_LEVEL_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                            sizeof(pal_effect_custom_payload_t) +
-                                            custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_ROOM_LEVEL;
-        custom_payload->data[0] = reverb->room_level;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_ROOM_HF_LEVEL) {
-        uint32_t custom_data_sz = REVERB_ROOM_HF_LEVEL_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                            sizeof(pal_effect_custom_payload_t) +
-                                            custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_ROOM_HF_LEVEL;
-        custom_payload->data[0] = reverb->room_hf_level;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_DECAY_TIME) {
-        uint32_t custom_data_sz = REVERB_DECAY_TIME_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                              sizeof(pal_effect_custom_payload_t) +
-                                              custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_DECAY_TIME;
-        custom_payload->data[0] = reverb->decay_time;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_DECAY_HF_RATIO) {
-        uint32_t custom_data_sz = REVERB_DECAY_HF_RATIO_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                              sizeof(pal_effect_custom_payload_t) +
-                                              custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_DECAY_HF_RATIO;
-        custom_payload->data[0] = reverb->decay_hf_ratio;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_REFLECTIONS_LEVEL) {
-        uint32_t custom_data_sz = REVERB_REFLECTIONS_LEVEL_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                            sizeof(pal_effect_custom_payload_t) +
-                                            custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-
-        custom_payload->paramId = PARAM_ID_REVERB_REFLECTIONS_LEVEL;
-        custom_payload->data[0] = reverb->reflections_level;
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_REFLECTIONS_DELAY) {
-        uint32_t custom_data_sz = REVERB_REFLECTIONS_DELAY_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                             sizeof(pal_effect_custom_payload_t) +
-                                             custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-
-        custom_payload->paramId = PARAM_ID_REVERB_REFLECTIONS_DELAY;
-        custom_payload->data[0] = reverb->reflections_delay;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_LEVEL) {
-        uint32_t custom_data_sz = REVERB_LEVEL_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                              sizeof(pal_effect_custom_payload_t) +
-                                              custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_LEVEL;
-        custom_payload->data[0] = reverb->level;
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_DELAY) {
-        uint32_t custom_data_sz = REVERB_DELAY_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                             sizeof(pal_effect_custom_payload_t) +
-                                             custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_DELAY;
-        custom_payload->data[0] = reverb->delay;
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_DIFFUSION) {
-        uint32_t custom_data_sz = REVERB_DIFFUSION_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                           sizeof(pal_effect_custom_payload_t) +
-                                           custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_DIFFUSION;
-        custom_payload->data[0] = reverb->diffusion;
-
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            goto done;
-        }
-    }
-    if (param_send_flags & OFFLOAD_SEND_REVERB_DENSITY) {
-        uint32_t custom_data_sz = REVERB_DENSITY_PARAM_LEN * sizeof(uint32_t);
-        custom_payload = (pal_effect_custom_payload_t *) calloc (1,
-                                           sizeof(pal_effect_custom_payload_t) +
-                                           custom_data_sz);
-        if (!custom_payload) {
-             ALOGE("%s:%d calloc failed for size %d", __func__, __LINE__,
-                    custom_data_sz);
-             ret = -ENOMEM;
-             goto done;
-        }
-        custom_payload->paramId = PARAM_ID_REVERB_DENSITY;
-        custom_payload->data[0] = reverb->density;
-        ret = send_custom_payload(pal_stream_handle, TAG_STREAM_REVERB,
-                              custom_payload, custom_data_sz);
-        free(custom_payload);
-        custom_payload = NULL;
-        if (ret) {
-            ALOGE("%s: pal_stream_set_param failed. ret = %d", __func__, ret);
-            return ret;
-        }
-    }
 done:
     return ret;
 }
@@ -71,6 +71,41 @@ typedef enum {
 extern "C" {
 #endif
 
+struct offload_param_entry;
+
+#define OFFLOAD_REVERB_PROPERTY_COUNT 15
+
+/*
+ * Parameters sent to one PAL stream while a batch is open on it are queued in order,
+ * consecutive ones for the same module coalesced, instead of being set one by one;
+ * offload_param_batch_flush() sends what is pending and returns the first PAL error.
+ * A batch also keeps the per stream state needed to send only changed values.
+ * Batches are not thread safe, callers serialize open/flush/close on a batch.
+ * The open batch is per thread; init and release must not race with any use.
+ */
+struct offload_param_batch {
+    pal_stream_handle_t *pal_stream_handle;
+    struct offload_param_entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+    /* reverb values last sent on the stream, indexed by OFFLOAD_SEND_REVERB_* bit */
+    uint32_t reverb_sent_mask;
+    int32_t reverb_sent[OFFLOAD_REVERB_PROPERTY_COUNT];
+    /* statistics */
+    uint32_t queued;        /* parameters sent by effects, i.e. round trips without batching */
+    uint32_t round_trips;   /* pal_stream_set_param() calls made by flushes */
+    uint32_t suppressed;    /* parameters not sent because the DSP already had the value */
+    struct offload_param_batch *next;
+};
+
+void offload_param_batch_init(struct offload_param_batch *batch,
+                              pal_stream_handle_t *pal_stream_handle);
+void offload_param_batch_release(struct offload_param_batch *batch);
+void offload_param_batch_open(struct offload_param_batch *batch);
+void offload_param_batch_close();
+bool offload_param_batch_pending(struct offload_param_batch *batch);
+int offload_param_batch_flush(struct offload_param_batch *batch);
+
 #define OFFLOAD_SEND_PBE_ENABLE_FLAG      (1 << 0)
 #define OFFLOAD_SEND_PBE_CONFIG           (OFFLOAD_SEND_PBE_ENABLE_FLAG << 1)
 void offload_pbe_set_device(struct pbe_params *pbe,
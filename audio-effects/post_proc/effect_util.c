@@ -21,6 +21,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -35,7 +41,9 @@ enum {
     BASSBOOST,
 };
 
-static const char *paramList[10] = {
+#define EFFECT_STATE_PARAM_COUNT 10
+
+static const char *paramList[EFFECT_STATE_PARAM_COUNT] = {
                               "eq_enable",
                               "virt_enable",
                               "bb_enable",
@@ -52,163 +60,350 @@ static const char *paramList[10] = {
 #define MAX_LENGTH_OF_INTEGER_IN_STRING 13
 
 #ifdef DTS_EAGLE
-void create_effect_state_node(int device_id)
+/*
+ * The state of each device is kept in memory; effect commands only update it and
+ * arm the flush timer. The timer rewrites the state files of all modified devices,
+ * so a file is never more than state_flush_ms behind the effects.
+ */
+#define MAX_EFFECT_STATE_NODES 4
+#define EFFECT_STATE_FLUSH_MS_DEFAULT 100
+
+struct effect_state_node {
+    bool in_use;
+    bool dirty;
+    int device_id;
+    int values[EFFECT_STATE_PARAM_COUNT];
+};
+
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+/* serializes file writes between the flush timer and create/remove */
+static pthread_mutex_t state_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool dts_eagle_enabled;
+static uint32_t state_flush_ms;
+static timer_t state_flush_timer;
+static bool state_flush_timer_created;
+/* protected by state_lock */
+static bool state_flush_armed;
+static struct effect_state_node state_nodes[MAX_EFFECT_STATE_NODES];
+
+static void flush_effect_state_nodes(union sigval sv __unused);
+
+static void state_init_once()
 {
     char prop[PROPERTY_VALUE_MAX];
-    int fd;
-    char buf[1024];
-    char path[PATH_MAX];
-    char value[MAX_LENGTH_OF_INTEGER_IN_STRING];
+    struct sigevent sev;
 
     property_get("vendor.audio.use.dts_eagle", prop, "0");
-    if (!strncmp("true", prop, sizeof("true")) || atoi(prop)) {
-        ALOGV("create_effect_node for - device_id: %d", device_id);
-        strlcpy(path, EFFECT_FILE, sizeof(path));
-        snprintf(value, sizeof(value), "%d", device_id);
-        strlcat(path, value, sizeof(path));
-        if ((fd=open(path, O_RDONLY)) < 0) {
-            ALOGV("No File exist");
-        } else {
-            ALOGV("A file with the same name exist. So, not creating again");
-            return;
-        }
-        if ((fd=creat(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) < 0) {
-            ALOGE("opening effect state node failed returned");
-            return;
+    dts_eagle_enabled = !strncmp("true", prop, sizeof("true")) || atoi(prop);
+    if (!dts_eagle_enabled)
+        return;
+
+    state_flush_ms = property_get_int32("vendor.audio.dts_eagle.state_flush_ms",
+                                        EFFECT_STATE_FLUSH_MS_DEFAULT);
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = flush_effect_state_nodes;
+    if (state_flush_ms != 0) {
+        state_flush_timer_created = timer_create(CLOCK_MONOTONIC, &sev,
+                                                 &state_flush_timer) == 0;
+        if (!state_flush_timer_created)
+            ALOGW("%s: timer_create failed, effect state written per change", __func__);
+    }
+}
+
+static bool effect_state_enabled()
+{
+    pthread_once(&state_once, state_init_once);
+    return dts_eagle_enabled;
+}
+
+static void get_state_path(int device_id, char *path, size_t size)
+{
+    char value[MAX_LENGTH_OF_INTEGER_IN_STRING];
+
+    strlcpy(path, EFFECT_FILE, size);
+    snprintf(value, sizeof(value), "%d", device_id);
+    strlcat(path, value, size);
+}
+
+/* called with state_lock held */
+static struct effect_state_node *get_state_node(int device_id)
+{
+    int i;
+
+    for (i = 0; i < MAX_EFFECT_STATE_NODES; i++) {
+        if (state_nodes[i].in_use && state_nodes[i].device_id == device_id)
+            return &state_nodes[i];
+    }
+    return NULL;
+}
+
+/* called with state_lock held */
+static struct effect_state_node *alloc_state_node(int device_id)
+{
+    int i;
+
+    for (i = 0; i < MAX_EFFECT_STATE_NODES; i++) {
+        if (!state_nodes[i].in_use) {
+            memset(&state_nodes[i], 0, sizeof(state_nodes[i]));
+            state_nodes[i].in_use = true;
+            state_nodes[i].device_id = device_id;
+            return &state_nodes[i];
         }
+    }
+    ALOGE("%s: no free effect state node for device_id %d", __func__, device_id);
+    return NULL;
+}
+
+/* returns false if the state file does not exist or cannot be read */
+static bool read_state_file(const char *path, int *values)
+{
+    char buf[1024];
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+    memset(buf, 0, sizeof(buf));
+    if (fgets(buf, sizeof(buf), fp) == NULL) {
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+    for (i = 0; i < EFFECT_STATE_PARAM_COUNT; i++) {
+        char *s = strstr(buf, paramList[i]);
+        if (s != NULL && s[strlen(paramList[i])] == '=')
+            values[i] = atoi(s + strlen(paramList[i]) + 1);
+    }
+    return true;
+}
+
+static int write_state_file(const char *path, const int *values, bool create)
+{
+    char buf[1024];
+    int fd, n;
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < EFFECT_STATE_PARAM_COUNT; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s=%d",
+                        i ? ";" : "", paramList[i], values[i]);
+        if (len >= sizeof(buf))
+            return -EINVAL;
+    }
+    if (create)
+        fd = creat(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    else
+        fd = open(path, O_TRUNC|O_WRONLY);
+    if (fd < 0) {
+        ALOGV("opening effect state node for writing failed");
+        return -errno;
+    }
+    if (create)
         chmod(path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH);
-        snprintf(buf, sizeof(buf), "eq_enable=%d;virt_enable=%d;bb_enable=%d;eq_param_level0=%d;eq_param_level1=%d;eq_param_level2=%d;eq_param_level3=%d;eq_param_level4=%d;virt_param_strength=%d;bassboost_param_strength=%d", 0,0,0,0,0,0,0,0,0,0);
-        int n = write(fd, buf, strlen(buf));
-        ALOGV("number of bytes written: %d", n);
-        close(fd);
+    n = write(fd, buf, len);
+    if (n < 0)
+        n = -errno;
+    close(fd);
+    ALOGV("number of bytes written: %d", n);
+    if (n < 0)
+        return n;
+    return (size_t)n == len ? 0 : -EIO;
+}
+
+static void flush_effect_state_nodes(union sigval sv __unused)
+{
+    struct effect_state_node nodes[MAX_EFFECT_STATE_NODES];
+    char path[PATH_MAX];
+    int i, count = 0;
+
+    pthread_mutex_lock(&state_file_lock);
+    pthread_mutex_lock(&state_lock);
+    state_flush_armed = false;
+    for (i = 0; i < MAX_EFFECT_STATE_NODES; i++) {
+        if (state_nodes[i].in_use && state_nodes[i].dirty) {
+            nodes[count++] = state_nodes[i];
+            state_nodes[i].dirty = false;
+        }
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    for (i = 0; i < count; i++) {
+        struct effect_state_node *node;
+        int ret;
+
+        get_state_path(nodes[i].device_id, path, sizeof(path));
+        ret = write_state_file(path, nodes[i].values, false);
+        if (ret == 0)
+            continue;
+        ALOGE("%s: writing effect state of device %d failed: %d", __func__,
+              nodes[i].device_id, ret);
+        /* written again with the next update */
+        pthread_mutex_lock(&state_lock);
+        node = get_state_node(nodes[i].device_id);
+        if (node != NULL)
+            node->dirty = true;
+        pthread_mutex_unlock(&state_lock);
     }
+    pthread_mutex_unlock(&state_file_lock);
+}
+
+/* called with state_lock held, returns true if the caller must flush now */
+static bool schedule_state_flush()
+{
+    struct itimerspec ts;
+
+    if (state_flush_armed)
+        return false;
+    if (!state_flush_timer_created)
+        return true;
+    memset(&ts, 0, sizeof(ts));
+    ts.it_value.tv_sec = state_flush_ms / 1000;
+    ts.it_value.tv_nsec = (state_flush_ms % 1000) * 1000000L;
+    if (timer_settime(state_flush_timer, 0, &ts, NULL) != 0)
+        return true;
+    state_flush_armed = true;
+    return false;
+}
+
+void create_effect_state_node(int device_id)
+{
+    struct effect_state_node *node;
+    char path[PATH_MAX];
+    int values[EFFECT_STATE_PARAM_COUNT];
+    bool exists;
+
+    if (!effect_state_enabled())
+        return;
+
+    ALOGV("create_effect_node for - device_id: %d", device_id);
+    get_state_path(device_id, path, sizeof(path));
+    memset(values, 0, sizeof(values));
+    pthread_mutex_lock(&state_file_lock);
+    exists = read_state_file(path, values);
+    if (exists)
+        ALOGV("A file with the same name exist. So, not creating again");
+    else if (write_state_file(path, values, true) != 0)
+        ALOGE("opening effect state node failed returned");
+
+    pthread_mutex_lock(&state_lock);
+    node = get_state_node(device_id);
+    if (node == NULL)
+        node = alloc_state_node(device_id);
+    if (node != NULL && !node->dirty)
+        memcpy(node->values, values, sizeof(values));
+    pthread_mutex_unlock(&state_lock);
+    pthread_mutex_unlock(&state_file_lock);
 }
 
 void update_effects_node(int device_id, int effect_type, int enable_or_set, int enable_disable, int strength, int eq_band, int eq_level)
 {
-    char prop[PROPERTY_VALUE_MAX];
-    char buf[1024];
-    int fd = 0;
+    struct effect_state_node *node;
     int paramValue = 0;
-    char path[PATH_MAX];
-    char value[MAX_LENGTH_OF_INTEGER_IN_STRING];
-    char parameterValue[MAX_LENGTH_OF_INTEGER_IN_STRING];
     int keyParamIndex = -1; //index in the paramlist array which has to be updated
-    char *s1, *s2;
-    char resultBuf[1024];
-    int index1 = -1;
-  //ALOGV("value of device_id and effect_type is %d and %d", device_id, effect_type);
-    property_get("vendor.audio.use.dts_eagle", prop, "0");
-    if (!strncmp("true", prop, sizeof("true")) || atoi(prop)) {
-        strlcpy(path, EFFECT_FILE, sizeof(path));
-        snprintf(value, sizeof(value), "%d", device_id);
-        strlcat(path, value, sizeof(path));
-        switch (effect_type)
-        {
-        case EQUALIZER:
-            if (enable_or_set) {
-                keyParamIndex = 0;
-                paramValue = enable_disable;
+    bool flush_now = false;
+
+    if (!effect_state_enabled())
+        return;
+
+    switch (effect_type) {
+    case EQUALIZER:
+        if (enable_or_set) {
+            keyParamIndex = 0;
+            paramValue = enable_disable;
         } else {
-            switch (eq_band) {
-            case 0:
-                keyParamIndex = 3;
-                break;
-            case 1:
-                keyParamIndex = 4;
-                break;
-            case 2:
-                keyParamIndex = 5;
-                break;
-            case 3:
-                keyParamIndex = 6;
-                break;
-            case 4:
-                keyParamIndex = 7;
-                break;
-            default:
-                break;
-            }
+            if (eq_band >= 0 && eq_band <= 4)
+                keyParamIndex = 3 + eq_band;
             paramValue = eq_level;
         }
         break;
-        case VIRTUALIZER:
-            if(enable_or_set) {
-                keyParamIndex = 1;
-                paramValue = enable_disable;
-            } else {
-                 keyParamIndex = 8;
-                 paramValue = strength;
-            }
-            break;
-        case BASSBOOST:
-            if (enable_or_set) {
-                keyParamIndex = 2;
-                paramValue = enable_disable;
-            } else {
-                keyParamIndex = 9;
-                paramValue = strength;
-            }
-            break;
-         default:
-            break;
+    case VIRTUALIZER:
+        if (enable_or_set) {
+            keyParamIndex = 1;
+            paramValue = enable_disable;
+        } else {
+            keyParamIndex = 8;
+            paramValue = strength;
         }
-        if(keyParamIndex !=-1) {
-            FILE *fp;
-            fp = fopen(path,"r");
-            if (fp != NULL) {
-                memset(buf, 0, 1024);
-                memset(resultBuf, 0, 1024);
-                if (fgets(buf, 1024, fp) != NULL) {
-                    s1 = strstr(buf, paramList[keyParamIndex]);
-                    s2 = strstr(s1,";");
-                    index1 = s1 - buf;
-                    strncpy(resultBuf, buf, index1);
-                    strncat(resultBuf, paramList[keyParamIndex], sizeof(resultBuf)-strlen(resultBuf)-1);
-                    strncat(resultBuf, "=", sizeof(resultBuf)-strlen(resultBuf)-1);
-                    snprintf(parameterValue, sizeof(parameterValue), "%d", paramValue);
-                    strncat(resultBuf, parameterValue, sizeof(resultBuf)-strlen(resultBuf)-1);
-                    if (s2)
-                        strncat(resultBuf, s2, sizeof(resultBuf)-strlen(resultBuf)-1);
-                    fclose(fp);
-                    if ((fd=open(path, O_TRUNC|O_WRONLY)) < 0) {
-                       ALOGV("opening file for writing failed");
-                       return;
-                    }
-                    int n = write(fd, resultBuf, strlen(resultBuf));
-                    close(fd);
-                    ALOGV("number of bytes written: %d", n);
-                } else {
-                    ALOGV("file could not be read");
-                    fclose(fp);
-                }
-            } else
-                ALOGV("file could not be opened");
+        break;
+    case BASSBOOST:
+        if (enable_or_set) {
+            keyParamIndex = 2;
+            paramValue = enable_disable;
+        } else {
+            keyParamIndex = 9;
+            paramValue = strength;
         }
+        break;
+    default:
+        break;
     }
+    if (keyParamIndex == -1)
+        return;
+
+    pthread_mutex_lock(&state_lock);
+    node = get_state_node(device_id);
+    if (node == NULL) {
+        /* state node created by a previous instance: load it once, without holding
+         * state_lock across the file access */
+        char path[PATH_MAX];
+        int values[EFFECT_STATE_PARAM_COUNT];
+        bool loaded;
+
+        pthread_mutex_unlock(&state_lock);
+        get_state_path(device_id, path, sizeof(path));
+        memset(values, 0, sizeof(values));
+        pthread_mutex_lock(&state_file_lock);
+        loaded = read_state_file(path, values);
+        pthread_mutex_unlock(&state_file_lock);
+        if (!loaded) {
+            ALOGV("file could not be opened");
+            return;
+        }
+        pthread_mutex_lock(&state_lock);
+        /* another command may have loaded it meanwhile */
+        node = get_state_node(device_id);
+        if (node == NULL) {
+            node = alloc_state_node(device_id);
+            if (node == NULL) {
+                pthread_mutex_unlock(&state_lock);
+                return;
+            }
+            memcpy(node->values, values, sizeof(values));
+        }
+    }
+    if (node->values[keyParamIndex] != paramValue) {
+        node->values[keyParamIndex] = paramValue;
+        node->dirty = true;
+        flush_now = schedule_state_flush();
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    if (flush_now)
+        flush_effect_state_nodes((union sigval){ .sival_ptr = NULL });
 }
 
 void remove_effect_state_node(int device_id)
 {
-    char prop[PROPERTY_VALUE_MAX];
-    int fd;
+    struct effect_state_node *node;
     char path[PATH_MAX];
-    char value[MAX_LENGTH_OF_INTEGER_IN_STRING];
 
-    property_get("vendor.audio.use.dts_eagle", prop, "0");
-    if (!strncmp("true", prop, sizeof("true")) || atoi(prop)) {
-        ALOGV("remove_state_notifier_node: device_id - %d", device_id);
-        strlcpy(path, EFFECT_FILE, sizeof(path));
-        snprintf(value, sizeof(value), "%d", device_id);
-        strlcat(path, value, sizeof(path));
-        if ((fd=open(path, O_RDONLY)) < 0) {
-            ALOGV("open effect state node failed");
-        } else {
-            ALOGV("open effect state node successful");
-            ALOGV("Remove the file");
-            close(fd);
-            remove(path);
-        }
-    }
+    if (!effect_state_enabled())
+        return;
+
+    ALOGV("remove_state_notifier_node: device_id - %d", device_id);
+    pthread_mutex_lock(&state_file_lock);
+    pthread_mutex_lock(&state_lock);
+    node = get_state_node(device_id);
+    if (node != NULL)
+        node->in_use = false;
+    pthread_mutex_unlock(&state_lock);
+
+    get_state_path(device_id, path, sizeof(path));
+    if (remove(path) != 0)
+        ALOGV("remove effect state node failed");
+    pthread_mutex_unlock(&state_file_lock);
 }
 #endif
@@ -29,6 +29,8 @@
 #include "equalizer.h"
 
 #define EQUALIZER_MAX_LATENCY 0
+/* bands are about two octaves apart */
+#define EQUALIZER_SW_DSP_Q 0.7f
 
 /* Offload equalizer UUID: a0dac280-401c-11e3-9379-0002a5d5c51b */
 const effect_descriptor_t equalizer_descriptor = {
@@ -484,8 +486,12 @@ int equalizer_set_device(effect_context_t *context,  uint32_t device)
     return 0;
 }
 
-int equalizer_reset(effect_context_t *context __unused)
+int equalizer_reset(effect_context_t *context)
 {
+    equalizer_context_t *eq_ctxt = (equalizer_context_t *)context;
+
+    sw_dsp_chain_reset(&eq_ctxt->sw_dsp);
+    eq_ctxt->sw_dsp_rate = 0;
     return 0;
 }
 
@@ -600,3 +606,37 @@ int equalizer_set_mode(effect_context_t *context, int32_t hw_acc_fd)
 
     return 0;
 }
+
+static void equalizer_update_sw_dsp(equalizer_context_t *context, uint32_t rate)
+{
+    uint32_t num_stages = 0;
+    int i;
+
+    for (i = 0; i < NUM_EQ_BANDS; i++) {
+        if (context->band_levels[i] != 0)
+            num_stages = NUM_EQ_BANDS;
+        sw_dsp_set_peaking(&context->sw_dsp.stages[i], rate,
+                           equalizer_band_presets_freq[i], EQUALIZER_SW_DSP_Q,
+                           context->band_levels[i]);
+        context->sw_dsp_levels[i] = context->band_levels[i];
+    }
+    /* a flat equalizer is bypassed, the state is stale when it comes back */
+    if (num_stages != context->sw_dsp.num_stages)
+        sw_dsp_chain_reset(&context->sw_dsp);
+    context->sw_dsp.num_stages = num_stages;
+    context->sw_dsp_rate = rate;
+}
+
+int equalizer_process(effect_context_t *context, audio_buffer_t *in,
+                      audio_buffer_t *out)
+{
+    equalizer_context_t *eq_ctxt = (equalizer_context_t *)context;
+    uint32_t rate = context->config.inputCfg.samplingRate;
+
+    if (rate != eq_ctxt->sw_dsp_rate ||
+        memcmp(eq_ctxt->sw_dsp_levels, eq_ctxt->band_levels,
+               sizeof(eq_ctxt->band_levels)) != 0)
+        equalizer_update_sw_dsp(eq_ctxt, rate);
+
+    return sw_dsp_process(&eq_ctxt->sw_dsp, &context->config, in, out);
+}
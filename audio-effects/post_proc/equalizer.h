@@ -21,6 +21,7 @@
 #define OFFLOAD_EQUALIZER_H_
 
 #include "bundle.h"
+#include "sw_dsp.h"
 
 #define NUM_EQ_BANDS              5
 #define INVALID_PRESET		 -2
@@ -41,6 +42,11 @@ typedef struct equalizer_context_s {
     int hw_acc_fd;
     uint32_t device;
     struct eq_params offload_eq;
+
+    // Software fallback vars, band levels and rate the chain was built for
+    struct sw_dsp_chain sw_dsp;
+    int sw_dsp_levels[NUM_EQ_BANDS];
+    uint32_t sw_dsp_rate;
 } equalizer_context_t;
 
 int equalizer_get_parameter(effect_context_t *context, effect_param_t *p,
@@ -65,4 +71,7 @@ int equalizer_start(effect_context_t *context, output_context_t *output);
 
 int equalizer_stop(effect_context_t *context, output_context_t *output);
 
+int equalizer_process(effect_context_t *context, audio_buffer_t *in,
+                      audio_buffer_t *out);
+
 #endif /*OFFLOAD_EQUALIZER_H_*/
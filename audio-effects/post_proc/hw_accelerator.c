@@ -32,6 +32,7 @@
 /*#define LOG_NDEBUG 0*/
 
 #include <cutils/list.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <fcntl.h>
 #include <sound/audio_effects.h>
@@ -173,6 +174,7 @@ int hw_accelerator_init(effect_context_t *context)
 
     hw_acc_ctxt->fd = -1;
     memset(&(hw_acc_ctxt->cfg), 0, sizeof(struct msm_hwacc_effects_config));
+    hw_acc_ctxt->ring_mode = false;
     enable_gcov();
     return 0;
 }
@@ -226,11 +228,72 @@ int hw_accelerator_set_mode(effect_context_t *context, int32_t frame_count)
     return 0;
 }
 
+/*
+ * Maps the input and output buffers of the driver once, process() then only moves
+ * ring indices. Falls back to the read/write ioctls if the driver has no ring.
+ */
+static void hw_accelerator_map_ring(hw_accelerator_context_t *hw_acc_ctxt)
+{
+    int ret;
+
+    hw_acc_ctxt->ring_mode = false;
+    if (!property_get_bool("vendor.audio.hw_acc.ring", true))
+        return;
+    ret = hw_acc_ring_map(&hw_acc_ctxt->ring, hw_acc_ctxt->fd, hw_acc_ctxt->fd,
+                          hw_acc_ctxt->cfg.output.num_buf, hw_acc_ctxt->cfg.output.buf_size,
+                          hw_acc_ctxt->cfg.input.num_buf, hw_acc_ctxt->cfg.input.buf_size);
+    if (ret != 0) {
+        ALOGV("%s: no shared ring (%d), using read/write", __func__, ret);
+        return;
+    }
+    hw_acc_ctxt->ring_mode = true;
+}
+
+static void hw_accelerator_unmap_ring(hw_accelerator_context_t *hw_acc_ctxt)
+{
+    if (!hw_acc_ctxt->ring_mode)
+        return;
+    ALOGD("%s: %u periods in, %u out, %u doorbells, %u inputs dropped", __func__,
+          hw_acc_ctxt->ring.periods_written, hw_acc_ctxt->ring.periods_read,
+          hw_acc_ctxt->ring.doorbells, hw_acc_ctxt->ring.writes_dropped);
+    hw_acc_ring_unmap(&hw_acc_ctxt->ring);
+    hw_acc_ctxt->ring_mode = false;
+#ifdef HW_ACC_RING_STUB
+    hw_acc_ring_stub_close();
+#endif
+}
+
+#ifdef HW_ACC_RING_STUB
+/* host builds: attach to the user space stand-in instead of the driver */
+int hw_accelerator_enable(effect_context_t *context)
+{
+    hw_accelerator_context_t *hw_acc_ctxt = (hw_accelerator_context_t *)context;
+    int map_fd, doorbell_fd;
+    int ret;
+
+    ret = hw_acc_ring_stub_open(hw_acc_ctxt->cfg.output.num_buf,
+                                hw_acc_ctxt->cfg.output.buf_size,
+                                hw_acc_ctxt->cfg.input.num_buf,
+                                hw_acc_ctxt->cfg.input.buf_size, &map_fd, &doorbell_fd);
+    if (ret != 0)
+        return ret;
+    ret = hw_acc_ring_map(&hw_acc_ctxt->ring, map_fd, doorbell_fd,
+                          hw_acc_ctxt->cfg.output.num_buf, hw_acc_ctxt->cfg.output.buf_size,
+                          hw_acc_ctxt->cfg.input.num_buf, hw_acc_ctxt->cfg.input.buf_size);
+    if (ret != 0) {
+        hw_acc_ring_stub_close();
+        return ret;
+    }
+    hw_acc_ctxt->ring_mode = true;
+    return 0;
+}
+#else
 int hw_accelerator_enable(effect_context_t *context)
 {
     hw_accelerator_context_t *hw_acc_ctxt = (hw_accelerator_context_t *)context;
 
     ALOGV("%s: ctxt %p", __func__, hw_acc_ctxt);
+    hw_acc_ctxt->buf_cfg_set = false;
     hw_acc_ctxt->fd = open("/dev/msm_hweffects", O_RDWR | O_NONBLOCK);
     /* open driver */
     if (hw_acc_ctxt->fd < 0) {
@@ -253,15 +316,18 @@ int hw_accelerator_enable(effect_context_t *context)
         hw_acc_ctxt->fd = -1;
         return -EFAULT;
     }
+    hw_accelerator_map_ring(hw_acc_ctxt);
     enable_gcov();
     return 0;
 }
+#endif
 
 int hw_accelerator_disable(effect_context_t *context)
 {
     hw_accelerator_context_t *hw_acc_ctxt = (hw_accelerator_context_t *)context;
 
     ALOGV("%s: ctxt %p", __func__, hw_acc_ctxt);
+    hw_accelerator_unmap_ring(hw_acc_ctxt);
     if (hw_acc_ctxt->fd > 0)
         if (close(hw_acc_ctxt->fd) < 0)
             ALOGE("releasing hardware accelerated effects driver failed");
@@ -275,6 +341,7 @@ int hw_accelerator_release(effect_context_t *context)
     hw_accelerator_context_t *hw_acc_ctxt = (hw_accelerator_context_t *)context;
 
     ALOGV("%s: ctxt %p", __func__, hw_acc_ctxt);
+    hw_accelerator_unmap_ring(hw_acc_ctxt);
     if (hw_acc_ctxt->fd > 0)
         if (close(hw_acc_ctxt->fd) < 0)
             ALOGE("releasing hardware accelerated effects driver failed");
@@ -283,12 +350,75 @@ int hw_accelerator_release(effect_context_t *context)
     return 0;
 }
 
+/* one copy in and one out, no system call unless the driver went idle */
+static int hw_accelerator_process_ring(hw_accelerator_context_t *hw_acc_ctxt,
+                                       audio_buffer_t *in_buf, audio_buffer_t *out_buf,
+                                       struct msm_hwacc_buf_cfg *buf_cfg)
+{
+    uint32_t written, read;
+
+    written = hw_acc_ring_write(&hw_acc_ctxt->ring, in_buf->raw, buf_cfg->output_len);
+    if (written == 0)
+        ALOGV("%s: ring full, input dropped (%u so far)", __func__,
+              hw_acc_ctxt->ring.writes_dropped);
+    read = hw_acc_ring_read(&hw_acc_ctxt->ring, out_buf->raw, buf_cfg->input_len);
+    if (read == 0) {
+        ALOGV("Request for more data");
+        return -ENODATA;
+    }
+    /* fewer processed periods than asked for: the rest of the output is silence */
+    if (read < buf_cfg->input_len)
+        memset((uint8_t *)out_buf->raw + read, 0, buf_cfg->input_len - read);
+    return written ? in_buf->frameCount : 0;
+}
+
+/* writes the whole input to the driver, period_size bytes per AUDIO_EFFECTS_WRITE */
+static int hw_accelerator_write_periods(hw_accelerator_context_t *hw_acc_ctxt,
+                                        audio_buffer_t *in_buf,
+                                        struct msm_hwacc_buf_cfg *buf_cfg,
+                                        uint32_t period_size, uint32_t periods)
+{
+    uint32_t total_len = buf_cfg->output_len;
+    uint32_t offset, i;
+
+    for (i = 0, offset = 0; i < periods; i++, offset += period_size) {
+        buf_cfg->output_len = total_len - offset < period_size ?
+                              total_len - offset : period_size;
+        if (hw_accelerator_set_buf_len(hw_acc_ctxt, buf_cfg) < 0)
+            return -EFAULT;
+        if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_WRITE, (char *)in_buf->raw + offset) < 0) {
+            ALOGE("AUDIO_EFFECTS_WRITE failed");
+            return -EFAULT;
+        }
+    }
+    return 0;
+}
+
+/* AUDIO_EFFECTS_SET_BUF_LEN only when the lengths change */
+static int hw_accelerator_set_buf_len(hw_accelerator_context_t *hw_acc_ctxt,
+                                      struct msm_hwacc_buf_cfg *buf_cfg)
+{
+    if (hw_acc_ctxt->buf_cfg_set &&
+        hw_acc_ctxt->buf_cfg.output_len == buf_cfg->output_len &&
+        hw_acc_ctxt->buf_cfg.input_len == buf_cfg->input_len)
+        return 0;
+    if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_SET_BUF_LEN, buf_cfg) < 0) {
+        ALOGE("AUDIO_EFFECTS_BUF_CFG failed");
+        hw_acc_ctxt->buf_cfg_set = false;
+        return -EFAULT;
+    }
+    hw_acc_ctxt->buf_cfg = *buf_cfg;
+    hw_acc_ctxt->buf_cfg_set = true;
+    return 0;
+}
+
 int hw_accelerator_process(effect_context_t *context, audio_buffer_t *in_buf,
                            audio_buffer_t *out_buf)
 {
     hw_accelerator_context_t *hw_acc_ctxt = (hw_accelerator_context_t *)context;
     struct msm_hwacc_buf_cfg buf_cfg;
     struct msm_hwacc_buf_avail buf_avail;
+    uint32_t period_size, periods;
     int ret = 0;
 
     ALOGV("%s: ctxt %p", __func__, hw_acc_ctxt);
@@ -303,33 +433,33 @@ int hw_accelerator_process(effect_context_t *context, audio_buffer_t *in_buf,
                          audio_bytes_per_sample(context->config.outputCfg.format) *
                          hw_acc_ctxt->cfg.input.num_channels;
 
+    if (hw_acc_ctxt->ring_mode)
+        return hw_accelerator_process_ring(hw_acc_ctxt, in_buf, out_buf, &buf_cfg);
+
     if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_GET_BUF_AVAIL, &buf_avail) < 0) {
         ALOGE("AUDIO_EFFECTS_GET_BUF_AVAIL failed");
         return -ENOMEM;
     }
 
+    /* an input larger than the driver buffers goes in several periods */
+    period_size = hw_acc_ctxt->cfg.output.buf_size;
+    if (period_size == 0 || period_size > buf_cfg.output_len)
+        period_size = buf_cfg.output_len;
+    periods = (buf_cfg.output_len + period_size - 1) / period_size;
+
     if (!hw_acc_ctxt->intial_buffer_done) {
-        if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_SET_BUF_LEN, &buf_cfg) < 0) {
-            ALOGE("AUDIO_EFFECTS_BUF_CFG failed");
-            return -EFAULT;
-        }
-        if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_WRITE, (char *)in_buf->raw) < 0) {
-            ALOGE("AUDIO_EFFECTS_WRITE failed");
+        if (hw_accelerator_write_periods(hw_acc_ctxt, in_buf, &buf_cfg, period_size,
+                                         periods) < 0)
             return -EFAULT;
-        }
         ALOGV("Request for more data");
         hw_acc_ctxt->intial_buffer_done = true;
         return -ENODATA;
     }
-    if (buf_avail.output_num_avail > 1) {
-        if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_SET_BUF_LEN, &buf_cfg) < 0) {
-            ALOGE("AUDIO_EFFECTS_BUF_CFG failed");
-            return -EFAULT;
-        }
-        if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_WRITE, (char *)in_buf->raw) < 0) {
-            ALOGE("AUDIO_EFFECTS_WRITE failed");
+    /* one driver buffer is kept free, as for a single period */
+    if (buf_avail.output_num_avail > periods) {
+        if (hw_accelerator_write_periods(hw_acc_ctxt, in_buf, &buf_cfg, period_size,
+                                         periods) < 0)
             return -EFAULT;
-        }
         ret = in_buf->frameCount;
     }
     if (ioctl(hw_acc_ctxt->fd, AUDIO_EFFECTS_READ, (char *)out_buf->raw) < 0) {
@@ -35,6 +35,8 @@
 
 #include <linux/msm_audio.h>
 
+#include "hw_accelerator_ring.h"
+
 #define HWACCELERATOR_OUTPUT_CHANNELS AUDIO_CHANNEL_OUT_STEREO
 
 extern const effect_descriptor_t hw_accelerator_descriptor;
@@ -46,6 +48,12 @@ typedef struct hw_accelerator_context_s {
     uint32_t device;
     bool intial_buffer_done;
     struct msm_hwacc_effects_config cfg;
+    /* buffer lengths last set with AUDIO_EFFECTS_SET_BUF_LEN */
+    struct msm_hwacc_buf_cfg buf_cfg;
+    bool buf_cfg_set;
+    /* buffers exchanged through the shared memory ring instead of read/write ioctls */
+    bool ring_mode;
+    struct hw_acc_ring ring;
 } hw_accelerator_context_t;
 
 int hw_accelerator_get_parameter(effect_context_t *context,
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "hw_accelerator_ring"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <log/log.h>
+
+#include "hw_accelerator_ring.h"
+
+#define HW_ACC_RING_PAGE_SIZE 4096
+
+static size_t ring_control_size()
+{
+    return (sizeof(struct hw_acc_ring_shared) + HW_ACC_RING_PAGE_SIZE - 1) &
+            ~(size_t)(HW_ACC_RING_PAGE_SIZE - 1);
+}
+
+size_t hw_acc_ring_map_size(uint32_t write_periods, uint32_t write_period_size,
+                            uint32_t read_periods, uint32_t read_period_size)
+{
+    return ring_control_size() + (size_t)write_periods * write_period_size +
+            (size_t)read_periods * read_period_size;
+}
+
+int hw_acc_ring_map(struct hw_acc_ring *ring, int map_fd, int doorbell_fd,
+                    uint32_t write_periods, uint32_t write_period_size,
+                    uint32_t read_periods, uint32_t read_period_size)
+{
+    struct hw_acc_ring_shared *shared;
+    size_t size;
+    void *base;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->doorbell_fd = -1;
+    if (write_periods == 0 || write_periods > HW_ACC_RING_MAX_PERIODS ||
+        read_periods == 0 || read_periods > HW_ACC_RING_MAX_PERIODS ||
+        write_period_size == 0 || read_period_size == 0)
+        return -EINVAL;
+
+    size = hw_acc_ring_map_size(write_periods, write_period_size,
+                                read_periods, read_period_size);
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+    if (base == MAP_FAILED) {
+        ALOGV("%s: mmap failed: %s", __func__, strerror(errno));
+        return -errno;
+    }
+    shared = (struct hw_acc_ring_shared *)base;
+    if (shared->magic != HW_ACC_RING_MAGIC ||
+        shared->write_periods != write_periods ||
+        shared->write_period_size != write_period_size ||
+        shared->read_periods != read_periods ||
+        shared->read_period_size != read_period_size) {
+        ALOGE("%s: ring geometry mismatch", __func__);
+        munmap(base, size);
+        return -EINVAL;
+    }
+    ring->shared = shared;
+    ring->write_base = (uint8_t *)base + ring_control_size();
+    ring->read_base = ring->write_base + (size_t)write_periods * write_period_size;
+    ring->map_size = size;
+    ring->doorbell_fd = doorbell_fd;
+    return 0;
+}
+
+void hw_acc_ring_unmap(struct hw_acc_ring *ring)
+{
+    if (ring->shared != NULL)
+        munmap(ring->shared, ring->map_size);
+    memset(ring, 0, sizeof(*ring));
+    ring->doorbell_fd = -1;
+}
+
+static void ring_doorbell(struct hw_acc_ring *ring, uint32_t periods)
+{
+    /* an eventfd is not signalled by adding 0 */
+    uint64_t count = periods ? periods : 1;
+
+    __atomic_store_n(&ring->shared->driver_idle, 0, __ATOMIC_RELAXED);
+    if (write(ring->doorbell_fd, &count, sizeof(count)) != sizeof(count))
+        ALOGW("%s: doorbell failed: %s", __func__, strerror(errno));
+    ring->doorbells++;
+}
+
+/*
+ * The driver sets driver_idle and then checks write_head again before sleeping,
+ * the effect publishes write_head and then checks driver_idle: with both accesses
+ * sequentially consistent one of them sees the other's update.
+ */
+static void ring_kick_if_idle(struct hw_acc_ring *ring, uint32_t periods)
+{
+    if (__atomic_load_n(&ring->shared->driver_idle, __ATOMIC_SEQ_CST))
+        ring_doorbell(ring, periods);
+}
+
+uint32_t hw_acc_ring_write_avail(struct hw_acc_ring *ring)
+{
+    struct hw_acc_ring_shared *shared = ring->shared;
+    uint32_t head = shared->write_head;
+    uint32_t tail = __atomic_load_n(&shared->write_tail, __ATOMIC_ACQUIRE);
+
+    return shared->write_periods - (head - tail);
+}
+
+uint32_t hw_acc_ring_write(struct hw_acc_ring *ring, const void *data, uint32_t size)
+{
+    struct hw_acc_ring_shared *shared = ring->shared;
+    uint32_t head = shared->write_head;
+    uint32_t periods = (size + shared->write_period_size - 1) / shared->write_period_size;
+    uint32_t offset = 0;
+    uint32_t i;
+
+    if (size == 0)
+        return 0;
+    if (periods > hw_acc_ring_write_avail(ring)) {
+        ring->writes_dropped++;
+        return 0;
+    }
+    for (i = 0; i < periods; i++) {
+        uint32_t slot = (head + i) % shared->write_periods;
+        uint32_t len = size - offset;
+
+        if (len > shared->write_period_size)
+            len = shared->write_period_size;
+        memcpy(ring->write_base + (size_t)slot * shared->write_period_size,
+               (const uint8_t *)data + offset, len);
+        shared->write_lengths[slot] = len;
+        offset += len;
+    }
+    __atomic_store_n(&shared->write_head, head + periods, __ATOMIC_SEQ_CST);
+    ring->periods_written += periods;
+    /* with the read ring full the driver cannot progress, hw_acc_ring_read() kicks it */
+    if (__atomic_load_n(&shared->read_head, __ATOMIC_ACQUIRE) - shared->read_tail <
+            shared->read_periods)
+        ring_kick_if_idle(ring, periods);
+    return size;
+}
+
+uint32_t hw_acc_ring_read(struct hw_acc_ring *ring, void *data, uint32_t size)
+{
+    struct hw_acc_ring_shared *shared = ring->shared;
+    uint32_t tail = shared->read_tail;
+    uint32_t head = __atomic_load_n(&shared->read_head, __ATOMIC_ACQUIRE);
+    uint32_t offset = 0;
+    uint32_t periods = 0;
+
+    while (tail + periods != head) {
+        uint32_t slot = (tail + periods) % shared->read_periods;
+        uint32_t len = shared->read_lengths[slot];
+
+        if (len > shared->read_period_size || offset + len > size)
+            break;
+        memcpy((uint8_t *)data + offset,
+               ring->read_base + (size_t)slot * shared->read_period_size, len);
+        offset += len;
+        periods++;
+    }
+    if (periods == 0)
+        return 0;
+    __atomic_store_n(&shared->read_tail, tail + periods, __ATOMIC_SEQ_CST);
+    ring->periods_read += periods;
+    /* the driver may have stopped on a full read ring with input still pending */
+    if (shared->write_head != __atomic_load_n(&shared->write_tail, __ATOMIC_ACQUIRE))
+        ring_kick_if_idle(ring, 0);
+    return offset;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HW_ACCELERATOR_RING_H_
+#define HW_ACCELERATOR_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory ring between the hw accelerated effect and the effects driver.
+ *
+ * The driver exposes one mapping: a control page holding struct hw_acc_ring_shared,
+ * followed by write_periods buffers of write_period_size bytes (effect to DSP) and
+ * read_periods buffers of read_period_size bytes (DSP to effect), each with its valid
+ * length in the control page. Indices are free running period counters, each written
+ * by one side only. Once mapped, periods are exchanged by moving indices; the doorbell
+ * (an 8 byte write of the number of new periods, eventfd style) is only rung when the
+ * driver flagged itself idle.
+ */
+#define HW_ACC_RING_MAGIC 0x52414848 /* "HHAR" */
+#define HW_ACC_RING_MAX_PERIODS 16
+
+struct hw_acc_ring_shared {
+    uint32_t magic;
+    uint32_t write_periods;
+    uint32_t write_period_size;
+    uint32_t read_periods;
+    uint32_t read_period_size;
+    /* effect to DSP: head advanced by the effect, tail by the driver */
+    uint32_t write_head;
+    uint32_t write_tail;
+    /* DSP to effect: head advanced by the driver, tail by the effect */
+    uint32_t read_head;
+    uint32_t read_tail;
+    /* set by the driver before it sleeps, the effect then rings the doorbell */
+    uint32_t driver_idle;
+    uint32_t write_lengths[HW_ACC_RING_MAX_PERIODS];
+    uint32_t read_lengths[HW_ACC_RING_MAX_PERIODS];
+};
+
+struct hw_acc_ring {
+    struct hw_acc_ring_shared *shared;
+    uint8_t *write_base;
+    uint8_t *read_base;
+    size_t map_size;
+    int doorbell_fd;
+    /* statistics */
+    uint32_t doorbells;
+    uint32_t periods_written;
+    uint32_t periods_read;
+    uint32_t writes_dropped; /* inputs that did not fit in the free periods */
+};
+
+size_t hw_acc_ring_map_size(uint32_t write_periods, uint32_t write_period_size,
+                            uint32_t read_periods, uint32_t read_period_size);
+
+/* maps the ring of map_fd and checks it matches the expected geometry */
+int hw_acc_ring_map(struct hw_acc_ring *ring, int map_fd, int doorbell_fd,
+                    uint32_t write_periods, uint32_t write_period_size,
+                    uint32_t read_periods, uint32_t read_period_size);
+
+void hw_acc_ring_unmap(struct hw_acc_ring *ring);
+
+/* number of periods that can be written without overwriting unconsumed input */
+uint32_t hw_acc_ring_write_avail(struct hw_acc_ring *ring);
+
+/*
+ * queues size bytes of input in as many periods as needed, all or nothing.
+ * Returns size, or 0 if the free periods cannot hold it, counted in writes_dropped.
+ */
+uint32_t hw_acc_ring_write(struct hw_acc_ring *ring, const void *data, uint32_t size);
+
+/* copies the processed periods that fit in size bytes to data, returns the bytes read */
+uint32_t hw_acc_ring_read(struct hw_acc_ring *ring, void *data, uint32_t size);
+
+#ifdef HW_ACC_RING_STUB
+/*
+ * User space stand-in for the driver side of the ring, see hw_accelerator_ring_stub.c.
+ * Returns the fds to pass to hw_acc_ring_map().
+ */
+int hw_acc_ring_stub_open(uint32_t write_periods, uint32_t write_period_size,
+                          uint32_t read_periods, uint32_t read_period_size,
+                          int *map_fd, int *doorbell_fd);
+void hw_acc_ring_stub_close();
+#endif
+
+#endif /* HW_ACCELERATOR_RING_H_ */
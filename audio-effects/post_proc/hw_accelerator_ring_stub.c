@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * User space stand-in for the effects driver side of the shared memory ring, so that
+ * the ring path of the hw accelerated effect can be exercised and benchmarked on a
+ * host. It is not part of the library: build it together with hw_accelerator_ring.c
+ * and -DHW_ACC_RING_STUB, hw_accelerator_enable() then attaches to it instead of
+ * /dev/msm_hweffects.
+ *
+ * The "DSP" is a thread turning each input period into one output period, with the
+ * first output period size bytes of the input.
+ */
+
+#define LOG_TAG "hw_accelerator_ring_stub"
+/*#define LOG_NDEBUG 0*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <log/log.h>
+
+#ifndef HW_ACC_RING_STUB
+#define HW_ACC_RING_STUB
+#endif
+#include "hw_accelerator_ring.h"
+
+static struct {
+    bool opened;
+    bool exit;
+    int map_fd;
+    int doorbell_fd;
+    struct hw_acc_ring ring;
+    pthread_t thread;
+} stub;
+
+static bool stub_work_pending(struct hw_acc_ring_shared *shared)
+{
+    return __atomic_load_n(&shared->write_head, __ATOMIC_SEQ_CST) != shared->write_tail &&
+            shared->read_head - __atomic_load_n(&shared->read_tail, __ATOMIC_SEQ_CST) <
+            shared->read_periods;
+}
+
+static void *stub_thread_loop(void *arg __unused)
+{
+    struct hw_acc_ring_shared *shared = stub.ring.shared;
+    uint64_t count;
+
+    while (!__atomic_load_n(&stub.exit, __ATOMIC_ACQUIRE)) {
+        while (stub_work_pending(shared)) {
+            uint32_t in_slot = shared->write_tail % shared->write_periods;
+            uint32_t out_slot = shared->read_head % shared->read_periods;
+            uint8_t *in = stub.ring.write_base + (size_t)in_slot * shared->write_period_size;
+            uint8_t *out = stub.ring.read_base + (size_t)out_slot * shared->read_period_size;
+
+            uint32_t len = shared->write_lengths[in_slot];
+
+            if (len > shared->read_period_size)
+                len = shared->read_period_size;
+            memcpy(out, in, len);
+            shared->read_lengths[out_slot] = len;
+            __atomic_store_n(&shared->write_tail, shared->write_tail + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&shared->read_head, shared->read_head + 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&shared->driver_idle, 1, __ATOMIC_SEQ_CST);
+        if (stub_work_pending(shared)) {
+            __atomic_store_n(&shared->driver_idle, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (read(stub.doorbell_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+        __atomic_store_n(&shared->driver_idle, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int hw_acc_ring_stub_open(uint32_t write_periods, uint32_t write_period_size,
+                          uint32_t read_periods, uint32_t read_period_size,
+                          int *map_fd, int *doorbell_fd)
+{
+    struct hw_acc_ring_shared *shared;
+    size_t size = hw_acc_ring_map_size(write_periods, write_period_size,
+                                       read_periods, read_period_size);
+    int ret;
+
+    if (stub.opened)
+        return -EBUSY;
+    stub.map_fd = memfd_create("hw_acc_ring", MFD_CLOEXEC);
+    if (stub.map_fd < 0)
+        return -errno;
+    stub.doorbell_fd = eventfd(0, EFD_CLOEXEC);
+    if (stub.doorbell_fd < 0) {
+        ret = -errno;
+        goto fail_map;
+    }
+    if (ftruncate(stub.map_fd, size) < 0) {
+        ret = -errno;
+        goto fail_doorbell;
+    }
+    shared = (struct hw_acc_ring_shared *)mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                                               MAP_SHARED, stub.map_fd, 0);
+    if (shared == MAP_FAILED) {
+        ret = -errno;
+        goto fail_doorbell;
+    }
+    memset(shared, 0, sizeof(*shared));
+    shared->magic = HW_ACC_RING_MAGIC;
+    shared->write_periods = write_periods;
+    shared->write_period_size = write_period_size;
+    shared->read_periods = read_periods;
+    shared->read_period_size = read_period_size;
+    munmap(shared, sizeof(*shared));
+
+    ret = hw_acc_ring_map(&stub.ring, stub.map_fd, stub.doorbell_fd, write_periods,
+                          write_period_size, read_periods, read_period_size);
+    if (ret != 0)
+        goto fail_doorbell;
+    stub.exit = false;
+    ret = -pthread_create(&stub.thread, NULL, stub_thread_loop, NULL);
+    if (ret != 0) {
+        hw_acc_ring_unmap(&stub.ring);
+        goto fail_doorbell;
+    }
+    stub.opened = true;
+    *map_fd = stub.map_fd;
+    *doorbell_fd = stub.doorbell_fd;
+    ALOGV("%s: %u x %u bytes in, %u x %u bytes out", __func__, write_periods,
+          write_period_size, read_periods, read_period_size);
+    return 0;
+
+fail_doorbell:
+    close(stub.doorbell_fd);
+fail_map:
+    close(stub.map_fd);
+    return ret;
+}
+
+void hw_acc_ring_stub_close()
+{
+    uint64_t count = 1;
+
+    if (!stub.opened)
+        return;
+    __atomic_store_n(&stub.exit, true, __ATOMIC_RELEASE);
+    if (write(stub.doorbell_fd, &count, sizeof(count)) != sizeof(count))
+        ALOGW("%s: wake up failed", __func__);
+    pthread_join(stub.thread, NULL);
+    hw_acc_ring_unmap(&stub.ring);
+    close(stub.doorbell_fd);
+    close(stub.map_fd);
+    stub.opened = false;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "pcm_accumulate.h"
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample>>15) ^ (sample>>31))
+        sample = 0x7FFF ^ (sample>>31);
+    return sample;
+}
+
+void pcm_accumulate_s16(int16_t *out, const int16_t *in, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    for (; i + 8 <= count; i += 8)
+        vst1q_s16(out + i, vqaddq_s16(vld1q_s16(out + i), vld1q_s16(in + i)));
+#elif defined(__SSE2__)
+    for (; i + 8 <= count; i += 8) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(out + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_adds_epi16(o, n));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = clamp16((int32_t)out[i] + in[i]);
+}
+
+static inline float clamp_float(float sample)
+{
+    if (sample > 1.0f)
+        return 1.0f;
+    if (sample < -1.0f)
+        return -1.0f;
+    return sample;
+}
+
+void pcm_accumulate_float(float *out, const float *in, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    const float32x4_t max = vdupq_n_f32(1.0f), min = vdupq_n_f32(-1.0f);
+
+    for (; i + 4 <= count; i += 4)
+        vst1q_f32(out + i, vmaxq_f32(vminq_f32(vaddq_f32(vld1q_f32(out + i),
+                                                         vld1q_f32(in + i)), max), min));
+#elif defined(__SSE2__)
+    const __m128 max = _mm_set1_ps(1.0f), min = _mm_set1_ps(-1.0f);
+
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(out + i, _mm_max_ps(_mm_min_ps(_mm_add_ps(_mm_loadu_ps(out + i),
+                                                                _mm_loadu_ps(in + i)), max), min));
+#endif
+    for (; i < count; i++)
+        out[i] = clamp_float(out[i] + in[i]);
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host benchmark of the accumulate kernels of the volume listener. It is not part of
+ * the library: the pcm_accumulate_bench host target builds it with pcm_accumulate.c.
+ *
+ * Accumulates BENCH_FRAMES frames of noise into an output buffer, for PCM 16 and float
+ * at 1, 2 and 8 channels, and prints the cost per frame of the SIMD kernel and of a
+ * plain per-sample loop, in ns and, on x86, in TSC cycles. Both results are compared
+ * sample by sample first.
+ *
+ * Usage: pcm_accumulate_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pcm_accumulate.h"
+
+/* 20 ms at 48 kHz */
+#define BENCH_FRAMES 960
+#define BENCH_MAX_CHANNELS 8
+#define BENCH_SAMPLES (BENCH_FRAMES * BENCH_MAX_CHANNELS)
+
+static int16_t in_s16[BENCH_SAMPLES];
+static int16_t out_s16[BENCH_SAMPLES];
+static int16_t ref_s16[BENCH_SAMPLES];
+static float in_f32[BENCH_SAMPLES];
+static float out_f32[BENCH_SAMPLES];
+static float ref_f32[BENCH_SAMPLES];
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t now_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+__attribute__((noinline))
+static void scalar_accumulate_s16(int16_t *out, const int16_t *in, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        int32_t sum = (int32_t)out[i] + in[i];
+        out[i] = sum > 32767 ? 32767 : sum < -32768 ? -32768 : sum;
+    }
+}
+
+__attribute__((noinline))
+static void scalar_accumulate_float(float *out, const float *in, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        float sum = out[i] + in[i];
+        out[i] = sum > 1.0f ? 1.0f : sum < -1.0f ? -1.0f : sum;
+    }
+}
+
+/* loud enough for a share of the sums to saturate */
+static void fill_buffers()
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        in_s16[i] = (int16_t)(rand() % 65536 - 32768);
+        out_s16[i] = (int16_t)(rand() % 65536 - 32768);
+        in_f32[i] = in_s16[i] / 32768.0f;
+        out_f32[i] = out_s16[i] / 32768.0f;
+    }
+    memcpy(ref_s16, out_s16, sizeof(ref_s16));
+    memcpy(ref_f32, out_f32, sizeof(ref_f32));
+}
+
+static int check_kernels()
+{
+    int i, bad = 0;
+
+    fill_buffers();
+    pcm_accumulate_s16(out_s16, in_s16, BENCH_SAMPLES - 3);
+    scalar_accumulate_s16(ref_s16, in_s16, BENCH_SAMPLES - 3);
+    pcm_accumulate_float(out_f32, in_f32, BENCH_SAMPLES - 3);
+    scalar_accumulate_float(ref_f32, in_f32, BENCH_SAMPLES - 3);
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        if (out_s16[i] != ref_s16[i] || out_f32[i] != ref_f32[i])
+            bad++;
+    }
+    return bad;
+}
+
+static void report(const char *format, int channels, const char *kernel, int iterations,
+                   double ns, uint64_t cycles)
+{
+    double frames = (double)iterations * BENCH_FRAMES;
+
+    printf("%-5s %d ch  %-6s %7.3f ns per frame", format, channels, kernel, ns / frames);
+    if (cycles)
+        printf(", %6.2f cycles per frame", cycles / frames);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const int channel_counts[] = { 1, 2, 8 };
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    uint64_t cycles;
+    double ns;
+    size_t count;
+    int c, i;
+
+    if (iterations <= 0)
+        iterations = 1;
+    if (check_kernels()) {
+        fprintf(stderr, "SIMD and scalar accumulate differ\n");
+        return 1;
+    }
+
+    for (c = 0; c < (int)(sizeof(channel_counts) / sizeof(channel_counts[0])); c++) {
+        count = (size_t)BENCH_FRAMES * channel_counts[c];
+
+        fill_buffers();
+        ns = now_ns();
+        cycles = now_cycles();
+        for (i = 0; i < iterations; i++)
+            pcm_accumulate_s16(out_s16, in_s16, count);
+        cycles = now_cycles() - cycles;
+        report("pcm16", channel_counts[c], "simd", iterations, now_ns() - ns, cycles);
+
+        ns = now_ns();
+        cycles = now_cycles();
+        for (i = 0; i < iterations; i++)
+            scalar_accumulate_s16(ref_s16, in_s16, count);
+        cycles = now_cycles() - cycles;
+        report("pcm16", channel_counts[c], "scalar", iterations, now_ns() - ns, cycles);
+
+        ns = now_ns();
+        cycles = now_cycles();
+        for (i = 0; i < iterations; i++)
+            pcm_accumulate_float(out_f32, in_f32, count);
+        cycles = now_cycles() - cycles;
+        report("float", channel_counts[c], "simd", iterations, now_ns() - ns, cycles);
+
+        ns = now_ns();
+        cycles = now_cycles();
+        for (i = 0; i < iterations; i++)
+            scalar_accumulate_float(ref_f32, in_f32, count);
+        cycles = now_cycles() - cycles;
+        report("float", channel_counts[c], "scalar", iterations, now_ns() - ns, cycles);
+    }
+    return 0;
+}
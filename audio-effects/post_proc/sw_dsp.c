@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "offload_effect_sw_dsp"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <log/log.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "sw_dsp.h"
+
+/* frames converted to float and run through the chain at a time, fits in L1 */
+#define SW_DSP_BLOCK_FRAMES 256
+#define SW_DSP_CHANNELS 2
+/* keeps filter frequencies clear of Nyquist on low sample rates */
+#define SW_DSP_MAX_FREQ_RATIO 0.45f
+/*
+ * filter state decaying on silence ends up in denormals, which are up to 70 times
+ * slower to process on x86. State below -300 dBFS is flushed after each block.
+ */
+#define SW_DSP_STATE_FLOOR 1e-15f
+
+static float clamp_freq(uint32_t sample_rate, float freq)
+{
+    float max_freq = sample_rate * SW_DSP_MAX_FREQ_RATIO;
+
+    return freq < max_freq ? freq : max_freq;
+}
+
+static void set_normalized(struct sw_dsp_biquad *biquad, float b0, float b1, float b2,
+                           float a0, float a1, float a2)
+{
+    biquad->b0 = b0 / a0;
+    biquad->b1 = b1 / a0;
+    biquad->b2 = b2 / a0;
+    biquad->a1 = a1 / a0;
+    biquad->a2 = a2 / a0;
+}
+
+void sw_dsp_chain_reset(struct sw_dsp_chain *chain)
+{
+    memset(chain->state, 0, sizeof(chain->state));
+    memset(chain->crossfeed_state, 0, sizeof(chain->crossfeed_state));
+}
+
+void sw_dsp_set_peaking(struct sw_dsp_biquad *biquad, uint32_t sample_rate,
+                        float freq, float q, float gain_db)
+{
+    float a = powf(10.0f, gain_db / 40.0f);
+    float w0 = 2.0f * (float)M_PI * clamp_freq(sample_rate, freq) / sample_rate;
+    float cos_w0 = cosf(w0);
+    float alpha = sinf(w0) / (2.0f * q);
+
+    set_normalized(biquad, 1.0f + alpha * a, -2.0f * cos_w0, 1.0f - alpha * a,
+                   1.0f + alpha / a, -2.0f * cos_w0, 1.0f - alpha / a);
+}
+
+void sw_dsp_set_low_shelf(struct sw_dsp_biquad *biquad, uint32_t sample_rate,
+                          float freq, float gain_db)
+{
+    float a = powf(10.0f, gain_db / 40.0f);
+    float w0 = 2.0f * (float)M_PI * clamp_freq(sample_rate, freq) / sample_rate;
+    float cos_w0 = cosf(w0);
+    /* 2 * sqrt(A) * alpha for a slope of 1 */
+    float beta = sqrtf(2.0f * a) * sinf(w0);
+
+    set_normalized(biquad,
+                   a * ((a + 1.0f) - (a - 1.0f) * cos_w0 + beta),
+                   2.0f * a * ((a - 1.0f) - (a + 1.0f) * cos_w0),
+                   a * ((a + 1.0f) - (a - 1.0f) * cos_w0 - beta),
+                   (a + 1.0f) + (a - 1.0f) * cos_w0 + beta,
+                   -2.0f * ((a - 1.0f) + (a + 1.0f) * cos_w0),
+                   (a + 1.0f) + (a - 1.0f) * cos_w0 - beta);
+}
+
+void sw_dsp_set_crossfeed(struct sw_dsp_chain *chain, uint32_t sample_rate,
+                          float cutoff, float level)
+{
+    /* the lowpass state is stale when the crossfeed comes back */
+    if (level > 0.0f && !chain->crossfeed)
+        memset(chain->crossfeed_state, 0, sizeof(chain->crossfeed_state));
+    chain->crossfeed = level > 0.0f;
+    chain->crossfeed_coef = 1.0f - expf(-2.0f * (float)M_PI *
+                                        clamp_freq(sample_rate, cutoff) / sample_rate);
+    chain->crossfeed_level = level;
+    /* a centered low frequency signal keeps its level */
+    chain->crossfeed_norm = 1.0f / (1.0f + level);
+}
+
+/* one biquad on frames stereo frames of buf, in place */
+static void process_biquad(const struct sw_dsp_biquad *biquad, float *state,
+                           float *buf, size_t frames)
+{
+    size_t i;
+#if defined(__ARM_NEON)
+    float32x2_t b0 = vdup_n_f32(biquad->b0);
+    float32x2_t b1 = vdup_n_f32(biquad->b1);
+    float32x2_t b2 = vdup_n_f32(biquad->b2);
+    float32x2_t a1 = vdup_n_f32(biquad->a1);
+    float32x2_t a2 = vdup_n_f32(biquad->a2);
+    float32x2_t z1 = vld1_f32(state);
+    float32x2_t z2 = vld1_f32(state + SW_DSP_CHANNELS);
+
+    for (i = 0; i < frames; i++) {
+        float32x2_t x = vld1_f32(buf);
+        float32x2_t y = vmla_f32(z1, b0, x);
+
+        z1 = vmls_f32(vmla_f32(z2, b1, x), a1, y);
+        z2 = vmls_f32(vmul_f32(b2, x), a2, y);
+        vst1_f32(buf, y);
+        buf += SW_DSP_CHANNELS;
+    }
+    vst1_f32(state, z1);
+    vst1_f32(state + SW_DSP_CHANNELS, z2);
+#elif defined(__SSE2__)
+    /* only the two low lanes are used */
+    __m128 b0 = _mm_set1_ps(biquad->b0);
+    __m128 b1 = _mm_set1_ps(biquad->b1);
+    __m128 b2 = _mm_set1_ps(biquad->b2);
+    __m128 a1 = _mm_set1_ps(biquad->a1);
+    __m128 a2 = _mm_set1_ps(biquad->a2);
+    __m128 z1 = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)state);
+    __m128 z2 = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(state + SW_DSP_CHANNELS));
+
+    for (i = 0; i < frames; i++) {
+        __m128 x = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)buf);
+        __m128 y = _mm_add_ps(z1, _mm_mul_ps(b0, x));
+
+        z1 = _mm_sub_ps(_mm_add_ps(z2, _mm_mul_ps(b1, x)), _mm_mul_ps(a1, y));
+        z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+        _mm_storel_pi((__m64 *)buf, y);
+        buf += SW_DSP_CHANNELS;
+    }
+    _mm_storel_pi((__m64 *)state, z1);
+    _mm_storel_pi((__m64 *)(state + SW_DSP_CHANNELS), z2);
+#else
+    float z1l = state[0], z1r = state[1], z2l = state[2], z2r = state[3];
+
+    for (i = 0; i < frames; i++) {
+        float xl = buf[0], xr = buf[1];
+        float yl = biquad->b0 * xl + z1l;
+        float yr = biquad->b0 * xr + z1r;
+
+        z1l = biquad->b1 * xl - biquad->a1 * yl + z2l;
+        z1r = biquad->b1 * xr - biquad->a1 * yr + z2r;
+        z2l = biquad->b2 * xl - biquad->a2 * yl;
+        z2r = biquad->b2 * xr - biquad->a2 * yr;
+        buf[0] = yl;
+        buf[1] = yr;
+        buf += SW_DSP_CHANNELS;
+    }
+    state[0] = z1l;
+    state[1] = z1r;
+    state[2] = z2l;
+    state[3] = z2r;
+#endif
+}
+
+/* y = (x + level * lowpass(x swapped)) * norm */
+static void process_crossfeed(struct sw_dsp_chain *chain, float *buf, size_t frames)
+{
+    size_t i;
+#if defined(__ARM_NEON)
+    float32x2_t coef = vdup_n_f32(chain->crossfeed_coef);
+    float32x2_t level = vdup_n_f32(chain->crossfeed_level);
+    float32x2_t norm = vdup_n_f32(chain->crossfeed_norm);
+    float32x2_t lp = vld1_f32(chain->crossfeed_state);
+
+    for (i = 0; i < frames; i++) {
+        float32x2_t x = vld1_f32(buf);
+
+        lp = vmla_f32(lp, coef, vsub_f32(x, lp));
+        vst1_f32(buf, vmul_f32(vmla_f32(x, level, vrev64_f32(lp)), norm));
+        buf += SW_DSP_CHANNELS;
+    }
+    vst1_f32(chain->crossfeed_state, lp);
+#elif defined(__SSE2__)
+    __m128 coef = _mm_set1_ps(chain->crossfeed_coef);
+    __m128 level = _mm_set1_ps(chain->crossfeed_level);
+    __m128 norm = _mm_set1_ps(chain->crossfeed_norm);
+    __m128 lp = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)chain->crossfeed_state);
+
+    for (i = 0; i < frames; i++) {
+        __m128 x = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)buf);
+        __m128 other;
+
+        lp = _mm_add_ps(lp, _mm_mul_ps(coef, _mm_sub_ps(x, lp)));
+        other = _mm_shuffle_ps(lp, lp, _MM_SHUFFLE(3, 2, 0, 1));
+        _mm_storel_pi((__m64 *)buf,
+                      _mm_mul_ps(_mm_add_ps(x, _mm_mul_ps(level, other)), norm));
+        buf += SW_DSP_CHANNELS;
+    }
+    _mm_storel_pi((__m64 *)chain->crossfeed_state, lp);
+#else
+    float lpl = chain->crossfeed_state[0], lpr = chain->crossfeed_state[1];
+
+    for (i = 0; i < frames; i++) {
+        lpl += chain->crossfeed_coef * (buf[0] - lpl);
+        lpr += chain->crossfeed_coef * (buf[1] - lpr);
+        buf[0] = (buf[0] + chain->crossfeed_level * lpr) * chain->crossfeed_norm;
+        buf[1] = (buf[1] + chain->crossfeed_level * lpl) * chain->crossfeed_norm;
+        buf += SW_DSP_CHANNELS;
+    }
+    chain->crossfeed_state[0] = lpl;
+    chain->crossfeed_state[1] = lpr;
+#endif
+}
+
+static void flush_denormals(float *state, uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (fabsf(state[i]) < SW_DSP_STATE_FLOOR)
+            state[i] = 0.0f;
+    }
+}
+
+static void load_block(float *dst, const audio_buffer_t *in, audio_format_t format,
+                       size_t offset, size_t samples)
+{
+    size_t i;
+
+    if (format == AUDIO_FORMAT_PCM_FLOAT) {
+        memcpy(dst, in->f32 + offset, samples * sizeof(float));
+        return;
+    }
+    for (i = 0; i < samples; i++)
+        dst[i] = in->s16[offset + i] * (1.0f / 32768.0f);
+}
+
+static int16_t clamp16(float sample)
+{
+    if (sample >= 32767.0f)
+        return 32767;
+    if (sample <= -32768.0f)
+        return -32768;
+    return (int16_t)lrintf(sample);
+}
+
+static void store_block(audio_buffer_t *out, const float *src, audio_format_t format,
+                        bool accumulate, size_t offset, size_t samples)
+{
+    size_t i;
+
+    if (format == AUDIO_FORMAT_PCM_FLOAT) {
+        if (!accumulate) {
+            memcpy(out->f32 + offset, src, samples * sizeof(float));
+            return;
+        }
+        for (i = 0; i < samples; i++)
+            out->f32[offset + i] += src[i];
+        return;
+    }
+    for (i = 0; i < samples; i++) {
+        float sample = src[i] * 32768.0f;
+
+        if (accumulate)
+            sample += out->s16[offset + i];
+        out->s16[offset + i] = clamp16(sample);
+    }
+}
+
+bool sw_dsp_config_supported(const effect_config_t *config)
+{
+    const buffer_config_t *in = &config->inputCfg;
+    const buffer_config_t *out = &config->outputCfg;
+
+    if (in->samplingRate == 0 || in->samplingRate != out->samplingRate)
+        return false;
+    if (in->channels != AUDIO_CHANNEL_OUT_STEREO || out->channels != AUDIO_CHANNEL_OUT_STEREO)
+        return false;
+    if (in->format != AUDIO_FORMAT_PCM_16_BIT && in->format != AUDIO_FORMAT_PCM_FLOAT)
+        return false;
+    return in->format == out->format;
+}
+
+int sw_dsp_process(struct sw_dsp_chain *chain, const effect_config_t *config,
+                   audio_buffer_t *in, audio_buffer_t *out)
+{
+    float block[SW_DSP_BLOCK_FRAMES * SW_DSP_CHANNELS] __attribute__((aligned(16)));
+    audio_format_t format = (audio_format_t)config->inputCfg.format;
+    bool accumulate = config->outputCfg.accessMode == EFFECT_BUFFER_ACCESS_ACCUMULATE;
+    size_t done, frames;
+    uint32_t i;
+
+    if (in == NULL || out == NULL || in->raw == NULL || out->raw == NULL ||
+        in->frameCount != out->frameCount || !sw_dsp_config_supported(config))
+        return -EINVAL;
+
+    for (done = 0; done < in->frameCount; done += frames) {
+        frames = in->frameCount - done;
+        if (frames > SW_DSP_BLOCK_FRAMES)
+            frames = SW_DSP_BLOCK_FRAMES;
+
+        load_block(block, in, format, done * SW_DSP_CHANNELS, frames * SW_DSP_CHANNELS);
+        for (i = 0; i < chain->num_stages; i++) {
+            process_biquad(&chain->stages[i], chain->state[i], block, frames);
+            flush_denormals(chain->state[i], SW_DSP_CHANNELS * 2);
+        }
+        if (chain->crossfeed) {
+            process_crossfeed(chain, block, frames);
+            flush_denormals(chain->crossfeed_state, SW_DSP_CHANNELS);
+        }
+        store_block(out, block, format, accumulate, done * SW_DSP_CHANNELS,
+                    frames * SW_DSP_CHANNELS);
+    }
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OFFLOAD_SW_DSP_H_
+#define OFFLOAD_SW_DSP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <hardware/audio_effect.h>
+
+/*
+ * Software processing for the bundle effects on outputs without DSP offload.
+ *
+ * A chain is a cascade of biquads followed by an optional crossfeed, run on
+ * stereo frames with both channels in one SIMD vector (NEON, SSE2 or scalar
+ * fallback), so it adds no latency. Parameters are owned by the effect, which
+ * recomputes the coefficients when they change and before the next process().
+ */
+#define SW_DSP_MAX_STAGES 5
+
+struct sw_dsp_biquad {
+    float b0;
+    float b1;
+    float b2;
+    float a1;
+    float a2;
+};
+
+struct sw_dsp_chain {
+    uint32_t num_stages;
+    struct sw_dsp_biquad stages[SW_DSP_MAX_STAGES];
+    /* transposed direct form II state, per stage: z1 left, z1 right, z2 left, z2 right */
+    float state[SW_DSP_MAX_STAGES][4];
+    /* crossfeed: one pole lowpass of each channel mixed into the other one */
+    bool crossfeed;
+    float crossfeed_coef;
+    float crossfeed_level;
+    float crossfeed_norm;
+    float crossfeed_state[2];
+};
+
+/* clears the filter state, e.g. on reset or when the stream restarts */
+void sw_dsp_chain_reset(struct sw_dsp_chain *chain);
+
+/* RBJ peaking filter, gain in dB */
+void sw_dsp_set_peaking(struct sw_dsp_biquad *biquad, uint32_t sample_rate,
+                        float freq, float q, float gain_db);
+
+/* RBJ low shelf with a slope of 1, gain in dB */
+void sw_dsp_set_low_shelf(struct sw_dsp_biquad *biquad, uint32_t sample_rate,
+                          float freq, float gain_db);
+
+/* crossfeed through a lowpass at cutoff Hz, level 0 (off) to 1 (mono below cutoff) */
+void sw_dsp_set_crossfeed(struct sw_dsp_chain *chain, uint32_t sample_rate,
+                          float cutoff, float level);
+
+/* true if process() can handle the config: stereo, PCM 16 bit or float, same in and out */
+bool sw_dsp_config_supported(const effect_config_t *config);
+
+/*
+ * processes in to out according to config, honoring EFFECT_BUFFER_ACCESS_ACCUMULATE
+ * on the output. Returns 0 or -EINVAL for unsupported configs or buffers.
+ */
+int sw_dsp_process(struct sw_dsp_chain *chain, const effect_config_t *config,
+                   audio_buffer_t *in, audio_buffer_t *out);
+
+#endif /* OFFLOAD_SW_DSP_H_ */
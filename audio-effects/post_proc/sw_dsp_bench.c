@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host benchmark of the software fallback DSP. It is not part of the library: the
+ * sw_dsp_bench host target builds it with sw_dsp.c.
+ *
+ * Runs each effect chain, and the three together as the bundle chains them, on
+ * BENCH_FRAMES stereo frames of noise at 48 kHz, in float and PCM 16, and prints the
+ * cost per channel-frame and the share of one core a 48 kHz channel takes. The SIMD
+ * path the compiler selects is measured; build with -U__SSE2__ (x86) or
+ * -U__ARM_NEON (arm) for the scalar path.
+ *
+ * Usage: sw_dsp_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <hardware/audio_effect.h>
+
+#include "sw_dsp.h"
+
+#define BENCH_SAMPLE_RATE 48000
+/* 20 ms at 48 kHz */
+#define BENCH_FRAMES 960
+#define BENCH_WARMUP 100
+
+#define BENCH_EQUALIZER (1 << 0)
+#define BENCH_BASS_BOOST (1 << 1)
+#define BENCH_VIRTUALIZER (1 << 2)
+
+/* one chain per effect, as in the bundle */
+struct bench_effects {
+    struct sw_dsp_chain chains[3];
+    int num_chains;
+};
+
+static const struct {
+    const char *name;
+    int effects;
+} cases[] = {
+    { "eq 5 bands", BENCH_EQUALIZER },
+    { "bass boost", BENCH_BASS_BOOST },
+    { "virtualizer", BENCH_VIRTUALIZER },
+    { "all three", BENCH_EQUALIZER | BENCH_BASS_BOOST | BENCH_VIRTUALIZER },
+};
+
+static float in_f32[BENCH_FRAMES * 2];
+static float out_f32[BENCH_FRAMES * 2];
+static int16_t in_s16[BENCH_FRAMES * 2];
+static int16_t out_s16[BENCH_FRAMES * 2];
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the offload band centers, levels of a typical "rock" preset, strength 800 */
+static void setup_effects(struct bench_effects *fx, int effects)
+{
+    static const float band_freqs[5] = { 60, 230, 910, 3600, 14000 };
+    static const float band_levels_db[5] = { 5, 3, -1, 3, 5 };
+    struct sw_dsp_chain *chain;
+    int i;
+
+    memset(fx, 0, sizeof(*fx));
+    if (effects & BENCH_EQUALIZER) {
+        chain = &fx->chains[fx->num_chains++];
+        for (i = 0; i < 5; i++)
+            sw_dsp_set_peaking(&chain->stages[i], BENCH_SAMPLE_RATE, band_freqs[i], 0.7f,
+                               band_levels_db[i]);
+        chain->num_stages = 5;
+    }
+    if (effects & BENCH_BASS_BOOST) {
+        chain = &fx->chains[fx->num_chains++];
+        sw_dsp_set_low_shelf(&chain->stages[0], BENCH_SAMPLE_RATE, 100, 9.6f);
+        chain->num_stages = 1;
+    }
+    if (effects & BENCH_VIRTUALIZER) {
+        chain = &fx->chains[fx->num_chains++];
+        sw_dsp_set_crossfeed(chain, BENCH_SAMPLE_RATE, 700, 0.8f);
+    }
+}
+
+static void run_effects(struct bench_effects *fx, const effect_config_t *config,
+                        audio_buffer_t *in, audio_buffer_t *out)
+{
+    int i;
+
+    sw_dsp_process(&fx->chains[0], config, in, out);
+    for (i = 1; i < fx->num_chains; i++)
+        sw_dsp_process(&fx->chains[i], config, out, out);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    struct bench_effects fx;
+    effect_config_t config;
+    audio_buffer_t in, out;
+    double begin, ns;
+    int format, c, i;
+
+    if (iterations <= 0)
+        iterations = 1;
+    srand(1);
+    for (i = 0; i < BENCH_FRAMES * 2; i++) {
+        in_f32[i] = ((float)rand() / RAND_MAX - 0.5f) * 0.5f;
+        in_s16[i] = (int16_t)(in_f32[i] * 32767);
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.inputCfg.samplingRate = BENCH_SAMPLE_RATE;
+    config.outputCfg.samplingRate = BENCH_SAMPLE_RATE;
+    config.inputCfg.channels = AUDIO_CHANNEL_OUT_STEREO;
+    config.outputCfg.channels = AUDIO_CHANNEL_OUT_STEREO;
+    config.outputCfg.accessMode = EFFECT_BUFFER_ACCESS_WRITE;
+
+    for (format = 0; format < 2; format++) {
+        config.inputCfg.format = format ? AUDIO_FORMAT_PCM_16_BIT : AUDIO_FORMAT_PCM_FLOAT;
+        config.outputCfg.format = config.inputCfg.format;
+        in.frameCount = out.frameCount = BENCH_FRAMES;
+        if (format) {
+            in.s16 = in_s16;
+            out.s16 = out_s16;
+        } else {
+            in.f32 = in_f32;
+            out.f32 = out_f32;
+        }
+        for (c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+            setup_effects(&fx, cases[c].effects);
+            for (i = 0; i < BENCH_WARMUP; i++)
+                run_effects(&fx, &config, &in, &out);
+            begin = now_ns();
+            for (i = 0; i < iterations; i++)
+                run_effects(&fx, &config, &in, &out);
+            ns = (now_ns() - begin) / ((double)iterations * BENCH_FRAMES * 2);
+            printf("%-6s %-12s %6.2f ns per channel-frame, %.3f%% of a core per channel\n",
+                   format ? "pcm16" : "float", cases[c].name, ns,
+                   ns * BENCH_SAMPLE_RATE / 1e7);
+        }
+    }
+    return 0;
+}
@@ -29,6 +29,11 @@
 #include "effect_api.h"
 #include "virtualizer.h"
 
+/* software fallback: lows crossfed 4.4 dB below the direct path at full strength */
+#define VIRTUALIZER_SW_DSP_CUTOFF 700.0f
+#define VIRTUALIZER_SW_DSP_MAX_LEVEL 0.6f
+#define VIRTUALIZER_MAX_STRENGTH 1000
+
 #define VIRUALIZER_MAX_LATENCY 30
 
 #ifdef AUDIO_FEATURE_ENABLED_GCOV
@@ -455,8 +460,12 @@ int virtualizer_set_device(effect_context_t *context, uint32_t device)
     return 0;
 }
 
-int virtualizer_reset(effect_context_t *context __unused)
+int virtualizer_reset(effect_context_t *context)
 {
+    virtualizer_context_t *virt_ctxt = (virtualizer_context_t *)context;
+
+    sw_dsp_chain_reset(&virt_ctxt->sw_dsp);
+    virt_ctxt->sw_dsp_rate = 0;
     return 0;
 }
 
@@ -586,3 +595,22 @@ int virtualizer_set_mode(effect_context_t *context, int32_t hw_acc_fd)
 
     return 0;
 }
+
+int virtualizer_process(effect_context_t *context, audio_buffer_t *in,
+                        audio_buffer_t *out)
+{
+    virtualizer_context_t *virt_ctxt = (virtualizer_context_t *)context;
+    uint32_t rate = context->config.inputCfg.samplingRate;
+    /* same rule as the offload enable flag: no effect when temporarily disabled */
+    int strength = virt_ctxt->temp_disabled ? 0 : virt_ctxt->strength;
+
+    if (strength != virt_ctxt->sw_dsp_strength || rate != virt_ctxt->sw_dsp_rate) {
+        sw_dsp_set_crossfeed(&virt_ctxt->sw_dsp, rate, VIRTUALIZER_SW_DSP_CUTOFF,
+                             strength * VIRTUALIZER_SW_DSP_MAX_LEVEL /
+                             VIRTUALIZER_MAX_STRENGTH);
+        virt_ctxt->sw_dsp_strength = strength;
+        virt_ctxt->sw_dsp_rate = rate;
+    }
+
+    return sw_dsp_process(&virt_ctxt->sw_dsp, &context->config, in, out);
+}
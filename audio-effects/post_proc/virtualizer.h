@@ -23,6 +23,7 @@
 #define VIRTUALIZER_PARAM_LATENCY 0x80000000
 
 #include "bundle.h"
+#include "sw_dsp.h"
 
 extern const effect_descriptor_t virtualizer_descriptor;
 
@@ -38,6 +39,10 @@ typedef struct virtualizer_context_s {
     audio_devices_t forced_device;
     audio_devices_t device;
     struct virtualizer_params offload_virt;
+    // Software fallback vars, strength and rate the chain was built for
+    struct sw_dsp_chain sw_dsp;
+    int sw_dsp_strength;
+    uint32_t sw_dsp_rate;
 } virtualizer_context_t;
 
 int virtualizer_get_parameter(effect_context_t *context, effect_param_t *p,
@@ -62,4 +67,7 @@ int virtualizer_start(effect_context_t *context, output_context_t *output);
 
 int virtualizer_stop(effect_context_t *context, output_context_t *output);
 
+int virtualizer_process(effect_context_t *context, audio_buffer_t *in,
+                        audio_buffer_t *out);
+
 #endif /* OFFLOAD_VIRTUALIZER_H_ */
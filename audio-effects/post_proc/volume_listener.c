@@ -35,12 +35,15 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <time.h>
+#include <signal.h>
 
 #include <cutils/list.h>
 #include <log/log.h>
 #include <hardware/audio_effect.h>
 #include <cutils/properties.h>
 #include "PalDefs.h"
+#include "pcm_accumulate.h"
 
 #define PRIMARY_HAL_PATH XSTR(LIB_AUDIO_HAL)
 #define XSTR(x) STR(x)
@@ -85,6 +88,21 @@ static void get_library_path(char *lib_path)
 #define AHAL_GAIN_GET_MAPPING_TABLE "audio_hw_get_gain_level_mapping"
 #define DEFAULT_CAL_STEP 0
 
+
+/* defaults for gain dep cal selection, overridable through properties */
+#define DEFAULT_CAL_HYSTERESIS_DB 1.0
+#define DEFAULT_CAL_MIN_DWELL_MS 100
+
+/* private EFFECT_CMD_GET_PARAM id returning struct gain_dep_cal_stats */
+#define VOL_LISTENER_PARAM_GAIN_DEP_CAL_STATS 0x1000
+/* private EFFECT_CMD_GET_PARAM id returning the struct vol_listener_process_stats
+ * of this effect, counted while dumping is enabled */
+#define VOL_LISTENER_PARAM_PROCESS_STATS 0x1001
+
+/* outputCfg fields used by process(), packed in process_config */
+#define PROCESS_CONFIG_CHANNELS_SHIFT 32
+#define PROCESS_CONFIG_ACCUMULATE (1ULL << 48)
+
 #ifdef AUDIO_FEATURE_ENABLED_GCOV
 extern void  __gcov_flush();
 static void enable_gcov()
@@ -112,6 +130,9 @@ static bool initialized = false;
 /* current gain dep cal level that was pushed succesfully */
 static int current_gain_dep_cal_level = -1;
 
+/* mapping table index of current_gain_dep_cal_level, -1 for default cal */
+static int current_gain_dep_cal_index = -1;
+
 enum STREAM_TYPE {
     MUSIC,
     RING,
@@ -132,6 +153,15 @@ struct vol_listener_context_s {
     uint32_t dev_id;
     float left_vol;
     float right_vol;
+    /* format, channel count and access mode of config.outputCfg, stored by
+     * EFFECT_CMD_SET_CONFIG so that process() reads them in one atomic load */
+    uint64_t process_config;
+    /* process() cost accounting while dumping is enabled, updated atomically */
+    struct vol_listener_process_stats {
+        uint64_t calls;
+        uint64_t frames;
+        uint64_t ns;
+    } process_stats;
 };
 
 /* volume listener, music UUID: 08b8b058-0590-11e5-ac71-0025b32654a0 */
@@ -248,6 +278,40 @@ pthread_mutex_t vol_listner_init_lock;
 
 static bool headset_cal_enabled;
 
+/* amplitude ratio a volume must move past a table boundary before switching */
+static float cal_hysteresis_ratio = 1.0;
+
+/* minimum time between two gain dep cal pushes to the DSP */
+static uint32_t cal_min_dwell_ms;
+
+/* time of the last successful gain dep cal push */
+static uint64_t last_cal_push_ns;
+
+/*
+ * one-shot timer re-evaluating a selection deferred by the dwell time, created on
+ * first use and deleted when the last effect is released
+ */
+static timer_t cal_defer_timer;
+static bool cal_defer_timer_created;
+static bool cal_defer_pending;
+
+struct gain_dep_cal_stats {
+    uint32_t pushes;
+    uint32_t push_failures;
+    uint32_t deferred;
+    uint32_t suppressed;
+};
+
+/* gain dep cal counters, protected by vol_listner_init_lock */
+static struct gain_dep_cal_stats cal_stats;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /*
  *  Local functions
  */
@@ -286,11 +350,149 @@ static void dump_list_l()
         context->stream_type == VC_CALL ? "VC_CALL" :
         context->stream_type == NOTIFICATION ? "NOTIFICATION" : "--INVALID--",
         context->dev_id, context->state, context->session_id, context->left_vol,context->right_vol);
+        if (__atomic_load_n(&context->process_stats.frames, __ATOMIC_RELAXED) > 0)
+            ALOGW("%s: sessionID [%d] process calls [%" PRIu64 "] frames [%" PRIu64 "] "
+                  "[%.2f ns/frame]", __func__, context->session_id,
+                  __atomic_load_n(&context->process_stats.calls, __ATOMIC_RELAXED),
+                  __atomic_load_n(&context->process_stats.frames, __ATOMIC_RELAXED),
+                  (double)__atomic_load_n(&context->process_stats.ns, __ATOMIC_RELAXED) /
+                  __atomic_load_n(&context->process_stats.frames, __ATOMIC_RELAXED));
     }
 
+    ALOGW("%s: gain dep cal level [%d] pushes [%u] failures [%u] deferred [%u] suppressed [%u]",
+          __func__, current_gain_dep_cal_level, cal_stats.pushes,
+          cal_stats.push_failures, cal_stats.deferred, cal_stats.suppressed);
+
     ALOGW("DUMP_END :: ===========");
 }
 
+/*
+ * mapping table index i with amp[i] <= vol < amp[i + 1], -1 if vol is below
+ * the first or not below the last amplitude: only a volume of 1 selects the
+ * last level
+ */
+static int find_gain_dep_cal_index(float vol)
+{
+    int lo = 0, hi = total_volume_cal_step - 1, index = -1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (volume_curve_gain_mapping_table[mid].amp <= vol) {
+            index = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return index < total_volume_cal_step - 1 ? index : -1;
+}
+
+/*
+ * Pick the mapping table index for new_vol. Once a level is applied the
+ * volume has to cross the neighbouring boundary by cal_hysteresis_ratio
+ * before another level is selected, so a slider resting on a boundary
+ * does not flip calibrations back and forth.
+ */
+static int select_gain_dep_cal_index(float new_vol)
+{
+    int index, up_index, down_index;
+
+    if (total_volume_cal_step <= 0)
+        return -1;
+    if (new_vol >= 1) // max amplitude, use highest DRC level
+        return total_volume_cal_step - 1;
+    if (new_vol == 0)
+        return 0;
+    index = find_gain_dep_cal_index(new_vol);
+    if (index < 0 || current_gain_dep_cal_index < 0)
+        return index;
+
+    up_index = find_gain_dep_cal_index(new_vol / cal_hysteresis_ratio);
+    down_index = find_gain_dep_cal_index(new_vol * cal_hysteresis_ratio);
+    if (down_index < 0) // above the table, no lower level than index
+        down_index = index;
+    if (up_index > current_gain_dep_cal_index)
+        return up_index;
+    if (down_index < current_gain_dep_cal_index)
+        return down_index;
+    if (index != current_gain_dep_cal_index)
+        cal_stats.suppressed++;
+    return current_gain_dep_cal_index;
+}
+
+static void check_and_set_gain_dep_cal();
+
+static void cal_defer_timer_expired(union sigval sv __unused)
+{
+    pthread_mutex_lock(&vol_listner_init_lock);
+    if (cal_defer_pending) {
+        cal_defer_pending = false;
+        check_and_set_gain_dep_cal();
+    }
+    pthread_mutex_unlock(&vol_listner_init_lock);
+}
+
+/* called with vol_listner_init_lock held */
+static bool create_cal_defer_timer_l()
+{
+    struct sigevent sev;
+
+    if (cal_defer_timer_created)
+        return true;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = cal_defer_timer_expired;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &cal_defer_timer) != 0) {
+        ALOGE("%s: failed to create defer timer, pushing now", __func__);
+        return false;
+    }
+    cal_defer_timer_created = true;
+    return true;
+}
+
+/* called with vol_listner_init_lock held */
+static void delete_cal_defer_timer_l()
+{
+    if (!cal_defer_timer_created)
+        return;
+    timer_delete(cal_defer_timer);
+    cal_defer_timer_created = false;
+    cal_defer_pending = false;
+}
+
+/* returns true if a push now would violate the dwell time; arms the timer */
+static bool defer_gain_dep_cal()
+{
+    struct itimerspec its;
+    uint64_t elapsed_ns, remaining_ns;
+
+    if (cal_min_dwell_ms == 0 || last_cal_push_ns == 0)
+        return false;
+
+    elapsed_ns = now_ns() - last_cal_push_ns;
+    if (elapsed_ns >= (uint64_t)cal_min_dwell_ms * 1000000ull)
+        return false;
+
+    if (cal_defer_pending) {
+        cal_stats.deferred++;
+        return true;
+    }
+    if (!create_cal_defer_timer_l())
+        return false;
+    cal_stats.deferred++;
+
+    remaining_ns = (uint64_t)cal_min_dwell_ms * 1000000ull - elapsed_ns;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = remaining_ns / 1000000000ull;
+    its.it_value.tv_nsec = remaining_ns % 1000000000ull;
+    if (timer_settime(cal_defer_timer, 0, &its, NULL) != 0) {
+        ALOGE("%s: failed to arm defer timer, pushing now", __func__);
+        return false;
+    }
+    cal_defer_pending = true;
+    return true;
+}
+
 static void check_and_set_gain_dep_cal()
 {
     // iterate through list and make decision to set new gain dep cal level for speaker device
@@ -302,7 +504,7 @@ static void check_and_set_gain_dep_cal()
     struct listnode *node = NULL;
     float new_vol = -1.0, sum_energy = 0.0, temp_vol = 0.0;
     bool sum_energy_used = false;
-    int max_level = 0;
+    int gain_dep_cal_index = -1;
     vol_listener_context_t *context = NULL;
     if (dumping_enabled) {
         dump_list_l();
@@ -333,30 +535,28 @@ static void check_and_set_gain_dep_cal()
             // send Gain dep cal level
             int gain_dep_cal_level = -1;
 
-            if (new_vol >= 1 && total_volume_cal_step > 0) { // max amplitude, use highest DRC level
-                gain_dep_cal_level = volume_curve_gain_mapping_table[total_volume_cal_step - 1].level;
-            } else if (new_vol == -1) {
+            if (new_vol == -1) {
                 gain_dep_cal_level = DEFAULT_CAL_STEP;
-            } else if (new_vol == 0) {
-                gain_dep_cal_level = volume_curve_gain_mapping_table[0].level;
             } else {
-                for (max_level = 0; max_level + 1 < total_volume_cal_step; max_level++) {
-                    if (new_vol < volume_curve_gain_mapping_table[max_level + 1].amp &&
-                        new_vol >= volume_curve_gain_mapping_table[max_level].amp) {
-                        gain_dep_cal_level = volume_curve_gain_mapping_table[max_level].level;
-                        ALOGV("%s: volume(%f), gain dep cal selcetd %d ",
-                              __func__, current_vol, gain_dep_cal_level);
-                        break;
-                    }
+                gain_dep_cal_index = select_gain_dep_cal_index(new_vol);
+                if (gain_dep_cal_index >= 0) {
+                    gain_dep_cal_level = volume_curve_gain_mapping_table[gain_dep_cal_index].level;
+                    ALOGV("%s: volume(%f), gain dep cal selcetd %d ",
+                          __func__, new_vol, gain_dep_cal_level);
                 }
             }
 
             // check here if previous gain dep cal level was not same
             if (gain_dep_cal_level != -1) {
                 if (gain_dep_cal_level != current_gain_dep_cal_level) {
-                    // decision made .. send new level now
-                    if (!send_gain_dep_cal(gain_dep_cal_level)) {
+                    // decision made .. send new level now unless the last
+                    // push is younger than the dwell time
+                    if (defer_gain_dep_cal()) {
+                        ALOGV("%s: level %d deferred, last push too recent",
+                              __func__, gain_dep_cal_level);
+                    } else if (!send_gain_dep_cal(gain_dep_cal_level)) {
                         ALOGE("%s: Failed to set gain dep cal level", __func__);
+                        cal_stats.push_failures++;
                     } else {
                         // Success in setting the gain dep cal level, store new level and Volume
                         if (dumping_enabled) {
@@ -368,10 +568,15 @@ static void check_and_set_gain_dep_cal()
                                   __func__, current_vol, new_vol, current_gain_dep_cal_level,
                                   gain_dep_cal_level);
                         }
+                        cal_stats.pushes++;
+                        last_cal_push_ns = now_ns();
                         current_gain_dep_cal_level = gain_dep_cal_level;
+                        current_gain_dep_cal_index = gain_dep_cal_index;
                         current_vol = new_vol;
                     }
                 } else {
+                    // table entries may share a level, the boundaries are the index's
+                    current_gain_dep_cal_index = gain_dep_cal_index;
                     if (dumping_enabled) {
                         ALOGW("%s: volume changed but gain dep cal level is still the same: (old/new) Volume (%f/%f) (old/new) level (%d)",
                               __func__,current_vol, new_vol, current_gain_dep_cal_level);
@@ -398,47 +603,100 @@ static void check_and_set_gain_dep_cal()
  * Effect Control Interface Implementation
  */
 
-static inline int16_t clamp16(int32_t sample)
+static uint64_t pack_process_config(const effect_config_t *config)
 {
-    if ((sample>>15) ^ (sample>>31))
-        sample = 0x7FFF ^ (sample>>31);
-    return sample;
+    uint64_t packed = (uint32_t)config->outputCfg.format;
+
+    packed |= (uint64_t)(audio_channel_count_from_out_mask(config->outputCfg.channels) &
+                         0xffff) << PROCESS_CONFIG_CHANNELS_SHIFT;
+    if (config->outputCfg.accessMode == EFFECT_BUFFER_ACCESS_ACCUMULATE)
+        packed |= PROCESS_CONFIG_ACCUMULATE;
+    return packed;
+}
+
+/* only process() writes the counters, readers may see them mid update */
+static void update_process_stats(vol_listener_context_t *context,
+                                 uint64_t start_ns, size_t frames)
+{
+    struct vol_listener_process_stats *stats = &context->process_stats;
+
+    __atomic_fetch_add(&stats->ns, now_ns() - start_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->frames, frames, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
 }
 
 static int vol_effect_process(effect_handle_t self,
                               audio_buffer_t *in_buffer,
                               audio_buffer_t *out_buffer)
 {
-    int status = 0;
-    ALOGV("%s Called ", __func__);
-
     vol_listener_context_t *context = (vol_listener_context_t *)self;
-    pthread_mutex_lock(&vol_listner_init_lock);
+    uint32_t channels, sample_size;
+    size_t frames, samples;
+    uint64_t start_ns = 0, config;
+    bool accumulate;
 
-    if (context->state != VOL_LISTENER_STATE_ACTIVE) {
+    ALOGV("%s Called ", __func__);
+
+    /*
+     * process() only touches this context, so it does not take the global
+     * list lock; state is published by vol_effect_command with release
+     * semantics and checked here.
+     */
+    if (context == NULL ||
+        __atomic_load_n(&context->state, __ATOMIC_ACQUIRE) != VOL_LISTENER_STATE_ACTIVE) {
         ALOGE("%s: state is not active .. return error", __func__);
-        status = -EINVAL;
-        goto exit;
+        return -EINVAL;
     }
 
-    // calculation based on channel count 2
-    if (in_buffer->raw != out_buffer->raw) {
-        if (context->config.outputCfg.accessMode == EFFECT_BUFFER_ACCESS_ACCUMULATE) {
-            size_t i;
-            for (i = 0; i < out_buffer->frameCount*2; i++) {
-                out_buffer->s16[i] = clamp16(out_buffer->s16[i] + in_buffer->s16[i]);
-            }
-        } else {
-            memcpy(out_buffer->raw, in_buffer->raw, out_buffer->frameCount * 2 * sizeof(int16_t));
-        }
-    } else {
-        ALOGV("%s: something wrong, didn't handle in_buffer and out_buffer same address case",
-              __func__);
+    if (in_buffer == NULL || out_buffer == NULL ||
+        in_buffer->raw == NULL || out_buffer->raw == NULL) {
+        ALOGE("%s: invalid buffer", __func__);
+        return -EINVAL;
     }
 
-exit:
-    pthread_mutex_unlock(&vol_listner_init_lock);
-    return status;
+    if (in_buffer->raw == out_buffer->raw) {
+        ALOGV("%s: in place processing, nothing to do", __func__);
+        return 0;
+    }
+
+    if (dumping_enabled)
+        start_ns = now_ns();
+
+    /* config is set under the list lock, process() only uses this copy */
+    config = __atomic_load_n(&context->process_config, __ATOMIC_ACQUIRE);
+    accumulate = (config & PROCESS_CONFIG_ACCUMULATE) != 0;
+    channels = (config >> PROCESS_CONFIG_CHANNELS_SHIFT) & 0xffff;
+    if (channels == 0)
+        channels = FCC_2;
+    frames = out_buffer->frameCount < in_buffer->frameCount ?
+             out_buffer->frameCount : in_buffer->frameCount;
+    samples = frames * channels;
+
+    switch ((audio_format_t)(uint32_t)config) {
+    case AUDIO_FORMAT_PCM_FLOAT:
+        sample_size = sizeof(float);
+        if (accumulate)
+            pcm_accumulate_float(out_buffer->f32, in_buffer->f32, samples);
+        else
+            memcpy(out_buffer->raw, in_buffer->raw, samples * sample_size);
+        break;
+    case AUDIO_FORMAT_PCM_16_BIT:
+    case AUDIO_FORMAT_DEFAULT:
+        sample_size = sizeof(int16_t);
+        if (accumulate)
+            pcm_accumulate_s16(out_buffer->s16, in_buffer->s16, samples);
+        else
+            memcpy(out_buffer->raw, in_buffer->raw, samples * sample_size);
+        break;
+    default:
+        ALOGE("%s: unsupported format 0x%x", __func__, (uint32_t)config);
+        return -EINVAL;
+    }
+
+    if (dumping_enabled)
+        update_process_stats(context, start_ns, frames);
+
+    return 0;
 }
 
 
@@ -483,6 +741,8 @@ static int vol_effect_command(effect_handle_t self,
             goto exit;
         }
         context->config = *(effect_config_t *)p_cmd_data;
+        __atomic_store_n(&context->process_config, pack_process_config(&context->config),
+                         __ATOMIC_RELEASE);
         *(int *)p_reply_data = 0;
         break;
 
@@ -527,7 +787,7 @@ static int vol_effect_command(effect_handle_t self,
             goto exit;
         }
 
-        context->state = VOL_LISTENER_STATE_ACTIVE;
+        __atomic_store_n(&context->state, VOL_LISTENER_STATE_ACTIVE, __ATOMIC_RELEASE);
         *(int *)p_reply_data = 0;
 
         // After changing the state and if device is speaker
@@ -554,7 +814,7 @@ static int vol_effect_command(effect_handle_t self,
             goto exit;
         }
 
-        context->state = VOL_LISTENER_STATE_INITIALIZED;
+        __atomic_store_n(&context->state, VOL_LISTENER_STATE_INITIALIZED, __ATOMIC_RELEASE);
         *(int *)p_reply_data = 0;
 
         // After changing the state and if device is speaker
@@ -566,7 +826,52 @@ static int vol_effect_command(effect_handle_t self,
         break;
 
     case EFFECT_CMD_GET_PARAM:
-        ALOGV("%s :: cmd called EFFECT_CMD_GET_PARAM", __func__);
+        {
+            effect_param_t *p = (effect_param_t *)p_reply_data;
+            struct vol_listener_process_stats process_stats;
+            const void *value = NULL;
+            uint32_t vsize = 0;
+
+            ALOGV("%s :: cmd called EFFECT_CMD_GET_PARAM", __func__);
+            /* malformed requests are ignored, as before parameters could be read */
+            if (p_cmd_data == NULL || p_reply_data == NULL || reply_size == NULL ||
+                cmd_size != sizeof(effect_param_t) + sizeof(int32_t) ||
+                *reply_size < sizeof(effect_param_t) + sizeof(int32_t)) {
+                ALOGW("%s: EFFECT_CMD_GET_PARAM: invalid parameter header", __func__);
+                break;
+            }
+
+            memcpy(p, p_cmd_data, sizeof(effect_param_t) + sizeof(int32_t));
+            switch (*(int32_t *)p->data) {
+            case VOL_LISTENER_PARAM_GAIN_DEP_CAL_STATS:
+                value = &cal_stats;
+                vsize = sizeof(cal_stats);
+                break;
+            case VOL_LISTENER_PARAM_PROCESS_STATS:
+                process_stats.calls = __atomic_load_n(&context->process_stats.calls,
+                                                      __ATOMIC_RELAXED);
+                process_stats.frames = __atomic_load_n(&context->process_stats.frames,
+                                                       __ATOMIC_RELAXED);
+                process_stats.ns = __atomic_load_n(&context->process_stats.ns,
+                                                   __ATOMIC_RELAXED);
+                value = &process_stats;
+                vsize = sizeof(process_stats);
+                break;
+            default:
+                break;
+            }
+            if (value == NULL ||
+                *reply_size < sizeof(effect_param_t) + sizeof(int32_t) + vsize) {
+                p->status = -EINVAL;
+                p->vsize = 0;
+                *reply_size = sizeof(effect_param_t) + sizeof(int32_t);
+                break;
+            }
+            p->status = 0;
+            p->vsize = vsize;
+            memcpy(p->data + sizeof(int32_t), value, vsize);
+            *reply_size = sizeof(effect_param_t) + sizeof(int32_t) + p->vsize;
+        }
         break;
 
     case EFFECT_CMD_SET_PARAM:
@@ -741,6 +1046,19 @@ static void init_once()
     headset_cal_enabled = property_get_bool(
                             "vendor.audio.volume.headset.gain.depcal", false);
 
+    char hysteresis_val[PROPERTY_VALUE_MAX];
+    float hysteresis_db = DEFAULT_CAL_HYSTERESIS_DB;
+    if (property_get("vendor.audio.volume.listener.cal.hysteresis_db",
+                     hysteresis_val, NULL) > 0)
+        hysteresis_db = fmax(atof(hysteresis_val), 0.0);
+    cal_hysteresis_ratio = pow(10.0, hysteresis_db / 20.0);
+
+    cal_min_dwell_ms = property_get_int32("vendor.audio.volume.listener.cal.min_dwell_ms",
+                                          DEFAULT_CAL_MIN_DWELL_MS);
+
+    ALOGD("%s: gain dep cal hysteresis %.2f dB, min dwell %u ms", __func__,
+          hysteresis_db, cal_min_dwell_ms);
+
     init_status = 0;
     list_init(&vol_effect_list);
     initialized = true;
@@ -859,6 +1177,7 @@ static int vol_prc_lib_release(effect_handle_t handle)
     // if there are no active streams, reset cal and volume level
     if (active_stream_count == 0) {
         current_gain_dep_cal_level = -1;
+        current_gain_dep_cal_index = -1;
         current_vol = 0.0;
     }
 
@@ -866,6 +1185,9 @@ static int vol_prc_lib_release(effect_handle_t handle)
         check_and_set_gain_dep_cal();
     }
 
+    if (active_stream_count == 0)
+        delete_cal_defer_timer_l();
+
     if (dumping_enabled) {
         dump_list_l();
     }
@@ -24,9 +24,18 @@
 #include <sys/prctl.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <unistd.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <cutils/list.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <system/thread_defs.h>
 #include <audio_effects/effect_visualizer.h>
@@ -58,8 +67,9 @@ enum pcm_device_param {
 typedef struct effect_context_s effect_context_t;
 typedef struct output_context_s output_context_t;
 
-/* effect specific operations. Only the init() and process() operations must be defined.
- * Others are optional.
+/* effect specific operations. Only the init() operation must be defined.
+ * Others are optional. There is no process operation: the capture thread
+ * publishes captured audio once in capture_ring for all effects.
  */
 typedef struct effect_ops_s {
     int (*init)(effect_context_t *context);
@@ -69,7 +79,6 @@ typedef struct effect_ops_s {
     int (*disable)(effect_context_t *context);
     int (*start)(effect_context_t *context, output_context_t *output);
     int (*stop)(effect_context_t *context, output_context_t *output);
-    int (*process)(effect_context_t *context, audio_buffer_t *in, audio_buffer_t *out);
     int (*set_parameter)(effect_context_t *context, effect_param_t *param, uint32_t size);
     int (*get_parameter)(effect_context_t *context, effect_param_t *param, uint32_t *size);
     int (*command)(effect_context_t *context, uint32_t cmdCode, uint32_t cmdSize,
@@ -108,30 +117,108 @@ typedef struct output_context_s {
 /* maximum number of buffers for which we keep track of the measurements */
 #define MEASUREMENT_WINDOW_MAX_SIZE_IN_BUFFERS 25 /* note: buffer index is stored in uint8_t */
 
+/* number of per buffer measurements kept in capture_ring, power of 2 and larger than
+ * MEASUREMENT_WINDOW_MAX_SIZE_IN_BUFFERS so that readers have slack before being lapped */
+#define MEASUREMENT_RING_SIZE 32
+
 typedef struct buffer_stats_s {
-    bool is_valid;
     uint16_t peak_u16; /* the positive peak of the absolute value of the samples in a buffer */
     float rms_squared; /* the average square of the samples in a buffer */
 } buffer_stats_t;
 
+/* Captured audio shared by all visualizer contexts. Single producer (the capture thread),
+ * any number of consumers: the producer fills the buffers and then publishes the free
+ * running counters with release semantics. Consumers copy without taking any lock and
+ * retry if the producer lapped the region they were copying. */
+typedef struct capture_ring_s {
+    uint8_t normalized[CAPTURE_BUF_SIZE];  /* VISUALIZER_SCALING_MODE_NORMALIZED rendering */
+    uint8_t as_played[CAPTURE_BUF_SIZE];   /* VISUALIZER_SCALING_MODE_AS_PLAYED rendering */
+    buffer_stats_t stats[MEASUREMENT_RING_SIZE];
+    uint32_t write_count;    /* frames published */
+    uint32_t stats_count;    /* buffers measured */
+    int64_t update_time_ns;  /* CLOCK_MONOTONIC time of the last publish */
+} capture_ring_t;
+
+/*
+ * HAL side spectrum (QTI extension). A context enables it by setting
+ * VISUALIZER_PARAM_SPECTRUM_SIZE to a power of 2 in [SPECTRUM_SIZE_MIN, SPECTRUM_SIZE_MAX]
+ * and reads it with VISUALIZER_CMD_SPECTRUM: SPECTRUM_SIZE / 2 + 1 int16_t bin magnitudes in
+ * millibels relative to a full scale sine. One FFT per capture period is computed for each
+ * distinct (size, window) configuration, whatever the number of contexts using it.
+ */
+#define VISUALIZER_PARAM_SPECTRUM_SIZE 0x10000
+#define VISUALIZER_PARAM_SPECTRUM_WINDOW 0x10001
+#define VISUALIZER_CMD_SPECTRUM (EFFECT_CMD_FIRST_PROPRIETARY + 0x100)
+
+enum {
+    SPECTRUM_WINDOW_RECTANGULAR,
+    SPECTRUM_WINDOW_HANN,
+    SPECTRUM_WINDOW_HAMMING,
+    SPECTRUM_WINDOW_BLACKMAN,
+    SPECTRUM_WINDOW_COUNT,
+};
+
+#define SPECTRUM_SIZE_MIN 128
+#define SPECTRUM_SIZE_MAX 1024
+#define SPECTRUM_MAX_CONFIGS 4
+#define SPECTRUM_FLOOR_MB (-9600)
+
+/* precomputed tables for one real FFT size and window */
+typedef struct fft_plan_s {
+    uint32_t size;        /* N real input samples */
+    uint16_t *bitrev;     /* N/2 entries, complex FFT input permutation */
+    float *stage_re;      /* N/2 - 1 twiddles, stage with half span h starts at h - 1 */
+    float *stage_im;
+    float *post_re;       /* W_N^k, k < N/2, to split the half size complex FFT */
+    float *post_im;
+    float *window;        /* N entries */
+    float norm_mb;        /* level of a full scale sine, in mB of power */
+} fft_plan_t;
+
+/* a spectrum configuration shared by all contexts requesting it. users is modified
+ * atomically with lock held; the capture thread only computes slots with users != 0, inside an effects
+ * snapshot read section, so plans are released only after synchronize_snapshot_readers() */
+typedef struct spectrum_slot_s {
+    uint32_t users;
+    uint32_t window;
+    fft_plan_t plan;
+    uint32_t seq;         /* odd while the capture thread updates mb[] */
+    int16_t mb[SPECTRUM_SIZE_MAX / 2 + 1];
+} spectrum_slot_t;
+
 typedef struct visualizer_context_s {
     effect_context_t common;
 
-    uint32_t capture_idx;
     uint32_t capture_size;
     uint32_t scaling_mode;
-    uint32_t last_capture_idx;
+    bool rate_configured;       /* sampling rate set by EFFECT_CMD_SET_CONFIG, not the default */
+    uint32_t last_capture_idx;  /* capture_ring.write_count at the previous capture */
     uint32_t latency;
-    struct timespec buffer_update_time;
-    uint8_t capture_buf[CAPTURE_BUF_SIZE];
-    /* for measurements */
-    uint8_t channel_count; /* to avoid recomputing it every time a buffer is processed */
+    bool capture_idle;  /* output stalled, return silence until new frames are published */
+    /* for measurements, mode and start count accessed atomically: MEASURE runs without lock */
     uint32_t meas_mode;
     uint8_t meas_wndw_size_in_buffers;
-    uint8_t meas_buffer_idx;
-    buffer_stats_t past_meas[MEASUREMENT_WINDOW_MAX_SIZE_IN_BUFFERS];
+    uint32_t meas_start_count;  /* capture_ring.stats_count when measurements (re)started */
+    /* spectrum */
+    uint32_t spectrum_size;     /* 0 when disabled */
+    uint32_t spectrum_window;
+    int32_t spectrum_slot;      /* index in spectrum_slots, -1 when disabled */
+    /* client demand, read by the capture thread */
+    uint64_t last_poll_ns;      /* last capture, measure or spectrum command */
+    uint32_t poll_interval_ms;  /* smoothed interval between polls, 0 until known */
 } visualizer_context_t;
 
+/* Read-mostly copy of created_effects_list, rebuilt under lock on every change and
+ * published with an atomic pointer swap so that the capture thread and the capture and
+ * measure commands can validate handles without taking lock. */
+typedef struct effects_snapshot_s {
+    uint32_t count;
+    struct {
+        effect_context_t *context;
+        bool attached;  /* attached to an active output */
+    } entries[];
+} effects_snapshot_t;
+
 
 extern const struct effect_interface_s effect_interface;
 
@@ -163,8 +250,8 @@ struct listnode created_effects_list;
  * and visualizer_hal_stop_output() */
 struct listnode active_outputs_list;
 
-/* thread capturing PCM from Proxy port and calling the process function on each enabled effect
- * attached to an active output stream */
+/* thread capturing PCM from Proxy port into capture_ring while an enabled effect
+ * is attached to an active output stream */
 pthread_t capture_thread;
 /* lock must be held when modifying or accessing created_effects_list or active_outputs_list */
 pthread_mutex_t lock;
@@ -179,6 +266,23 @@ bool exit_thread;
 /* 0 if the capture thread was created successfully */
 int thread_status;
 
+capture_ring_t capture_ring;
+
+/* current effects snapshot and the two reader counters used to retire old snapshots:
+ * readers register in snapshot_readers[snapshot_reader_idx], the writer flips the index
+ * twice and waits for both counters to drain before freeing the snapshot it replaced */
+static effects_snapshot_t empty_effects_snapshot;
+effects_snapshot_t *effects_snapshot = &empty_effects_snapshot;
+static uint32_t snapshot_readers[2];
+static uint32_t snapshot_reader_idx;
+
+static spectrum_slot_t spectrum_slots[SPECTRUM_MAX_CONFIGS];
+
+/* capture thread only: latest mono samples and FFT scratch */
+static int16_t spectrum_history[SPECTRUM_SIZE_MAX];
+static float fft_re[SPECTRUM_SIZE_MAX / 2];
+static float fft_im[SPECTRUM_SIZE_MAX / 2];
+
 
 #define DSP_OUTPUT_LATENCY_MS 0 /* Fudge factor for latency after capture point in audio DSP */
 
@@ -200,6 +304,75 @@ int thread_status;
 #define AUDIO_CAPTURE_PERIOD_COUNT (32)
 
 #define AUDIO_CAPTURE_BIT_WIDTH (16)
+#define AUDIO_CAPTURE_MAX_CHANNEL_COUNT 8
+
+/* Adaptive capture: the period is half the fastest client polling interval, and no longer
+ * than the shortest client capture, within these bounds; the rate is the lowest proxy rate
+ * covering the highest configured client rate. */
+#define AUDIO_CAPTURE_PERIOD_MIN_MS 16
+#define AUDIO_CAPTURE_PERIOD_MAX_MS 64
+#define AUDIO_CAPTURE_MAX_PERIOD_SIZE (AUDIO_CAPTURE_SMP_RATE * AUDIO_CAPTURE_PERIOD_MAX_MS / 1000)
+/* reads pause when no client polled for max(pause_ms, CAPTURE_PAUSE_POLL_INTERVALS * its
+ * polling interval) */
+#define CAPTURE_PAUSE_MS_DEFAULT 500
+#define CAPTURE_PAUSE_POLL_INTERVALS 3
+#define CAPTURE_PAUSE_RECHECK_MS 200
+/* minimum time between two stream reconfigurations */
+#define CAPTURE_RECONFIG_MIN_MS 1000
+
+/* frames converted to 16 bit at a time when the proxy delivers wider samples */
+#define ANALYSIS_BLOCK_FRAMES 256
+
+/* PCM layout delivered by the proxy capture, see init_once() */
+typedef struct capture_config_s {
+    uint32_t sample_rate;
+    uint32_t channel_count;
+    uint32_t bit_width;
+    audio_format_t format; /* AUDIO_FORMAT_PCM_16_BIT or AUDIO_FORMAT_PCM_32_BIT */
+    uint32_t period_size;  /* in frames */
+} capture_config_t;
+
+/* result of the single analysis pass run by the capture thread on each captured period */
+typedef struct capture_analysis_s {
+    uint32_t frame_count;
+    uint32_t sample_count;
+    uint16_t peak_u16;      /* positive peak of the absolute sample values */
+    uint16_t max_magnitude; /* max of (smp < 0 ? -smp - 1 : smp), used for normalized scaling */
+    uint64_t sum_squares;
+    int16_t *mono;          /* period downmixed to mono, frame_count samples */
+} capture_analysis_t;
+
+capture_config_t capture_config;
+
+/* capture rate and period requested by the active clients */
+typedef struct capture_demand_s {
+    uint32_t sample_rate;
+    uint32_t period_size;   /* in frames */
+    bool idle;              /* no client polled within its latency window */
+} capture_demand_t;
+
+/* integer divisions of the 48 kHz DSP output rate, so the proxy never resamples to 44.1 kHz */
+static const uint32_t capture_rates[] = {16000, 24000, AUDIO_CAPTURE_SMP_RATE};
+
+static bool capture_adaptive;
+static uint32_t capture_pause_ms;
+/* set by the capture thread while its reads are paused, cleared by whoever posts
+ * capture_resume to wake it up */
+static bool capture_paused;
+static sem_t capture_resume;
+/* set when the proxy rejected a rate other than AUDIO_CAPTURE_SMP_RATE */
+static bool capture_rate_fixed;
+
+static const uint16_t capture_ch_map[AUDIO_CAPTURE_MAX_CHANNEL_COUNT] = {
+    PAL_CHMAP_CHANNEL_FL,
+    PAL_CHMAP_CHANNEL_FR,
+    PAL_CHMAP_CHANNEL_C,
+    PAL_CHMAP_CHANNEL_LFE,
+    PAL_CHMAP_CHANNEL_LB,
+    PAL_CHMAP_CHANNEL_RB,
+    PAL_CHMAP_CHANNEL_LS,
+    PAL_CHMAP_CHANNEL_RS,
+};
 
 /*
  *  Local functions
@@ -215,6 +388,32 @@ static void init_once() {
     exit_thread = false;
     thread_status = -1;
 
+    memset(capture_ring.normalized, 0x80, CAPTURE_BUF_SIZE);
+    memset(capture_ring.as_played, 0x80, CAPTURE_BUF_SIZE);
+
+    capture_config.sample_rate = AUDIO_CAPTURE_SMP_RATE;
+    capture_config.period_size = AUDIO_CAPTURE_PERIOD_SIZE;
+    capture_config.channel_count = property_get_int32("vendor.audio.visualizer.capture.channels",
+                                                      AUDIO_CAPTURE_CHANNEL_COUNT);
+    if (capture_config.channel_count < 1 ||
+            capture_config.channel_count > AUDIO_CAPTURE_MAX_CHANNEL_COUNT)
+        capture_config.channel_count = AUDIO_CAPTURE_CHANNEL_COUNT;
+    capture_config.bit_width = property_get_int32("vendor.audio.visualizer.capture.bit_width",
+                                                  AUDIO_CAPTURE_BIT_WIDTH);
+    if (capture_config.bit_width == 32) {
+        capture_config.format = AUDIO_FORMAT_PCM_32_BIT;
+    } else {
+        capture_config.bit_width = AUDIO_CAPTURE_BIT_WIDTH;
+        capture_config.format = AUDIO_FORMAT_PCM_16_BIT;
+    }
+    capture_adaptive = property_get_bool("vendor.audio.visualizer.capture.adaptive", true);
+    capture_pause_ms = property_get_int32("vendor.audio.visualizer.capture.pause_ms",
+                                          CAPTURE_PAUSE_MS_DEFAULT);
+    sem_init(&capture_resume, 0, 0);
+    ALOGD("%s: proxy capture %u ch %u bit adaptive %d pause %u ms", __func__,
+          capture_config.channel_count, capture_config.bit_width, capture_adaptive,
+          capture_pause_ms);
+
     init_status = 0;
 }
 
@@ -224,20 +423,116 @@ int lib_init() {
     return init_status;
 }
 
-bool effect_exists(effect_context_t *context) {
-    struct listnode *node;
+static inline int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    list_for_each(node, &created_effects_list) {
-        effect_context_t *fx_ctxt = node_to_item(node,
-                                                     effect_context_t,
+static inline uint32_t effects_read_lock()
+{
+    uint32_t idx = __atomic_load_n(&snapshot_reader_idx, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&snapshot_readers[idx], 1, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+static inline void effects_read_unlock(uint32_t idx)
+{
+    __atomic_sub_fetch(&snapshot_readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+static void wait_for_snapshot_readers(uint32_t idx)
+{
+    while (__atomic_load_n(&snapshot_readers[idx], __ATOMIC_ACQUIRE) != 0)
+        sched_yield();
+}
+
+/* wait until every reader that may have seen data retired before this call is done.
+ * Called with lock held. */
+static void synchronize_snapshot_readers()
+{
+    uint32_t idx = snapshot_reader_idx;
+
+    __atomic_store_n(&snapshot_reader_idx, idx ^ 1, __ATOMIC_SEQ_CST);
+    wait_for_snapshot_readers(idx);
+    __atomic_store_n(&snapshot_reader_idx, idx, __ATOMIC_SEQ_CST);
+    wait_for_snapshot_readers(idx ^ 1);
+}
+
+/* resume capture thread reads if paused. Can be called without lock. */
+static void resume_capture()
+{
+    if (__atomic_exchange_n(&capture_paused, false, __ATOMIC_SEQ_CST))
+        sem_post(&capture_resume);
+}
+
+/* wake the capture thread whether it waits for a state change or has paused its reads */
+static void wake_capture_thread()
+{
+    pthread_cond_signal(&cond);
+    resume_capture();
+}
+
+output_context_t *get_output(audio_io_handle_t output);
+
+/* Rebuild and publish the effects snapshot. Called with lock held after any change to
+ * created_effects_list, active_outputs_list or an effect output attachment, and before
+ * freeing a context that was removed. */
+static void publish_effects_snapshot()
+{
+    struct listnode *node;
+    effects_snapshot_t *snapshot, *old;
+    uint32_t count = 0;
+
+    list_for_each(node, &created_effects_list)
+        count++;
+
+    snapshot = (effects_snapshot_t *)malloc(sizeof(effects_snapshot_t) +
+                                            count * sizeof(snapshot->entries[0]));
+    if (snapshot == NULL) {
+        /* never leave a stale snapshot referencing released contexts */
+        ALOGE("%s: fail to allocate memory, capture paused", __func__);
+        snapshot = &empty_effects_snapshot;
+    } else {
+        snapshot->count = 0;
+        list_for_each(node, &created_effects_list) {
+            effect_context_t *fx_ctxt = node_to_item(node, effect_context_t,
                                                      effects_list_node);
-        if (fx_ctxt == context) {
-            return true;
+            snapshot->entries[snapshot->count].context = fx_ctxt;
+            snapshot->entries[snapshot->count].attached = get_output(fx_ctxt->out_handle) != NULL;
+            snapshot->count++;
         }
     }
+
+    old = __atomic_exchange_n(&effects_snapshot, snapshot, __ATOMIC_SEQ_CST);
+    synchronize_snapshot_readers();
+
+    if (old != &empty_effects_snapshot)
+        free(old);
+}
+
+/* called in a read section, which keeps a context found from being freed until it ends */
+static bool effect_in_snapshot(effect_context_t *context)
+{
+    effects_snapshot_t *snapshot = __atomic_load_n(&effects_snapshot, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    for (i = 0; i < snapshot->count; i++) {
+        if (snapshot->entries[i].context == context)
+            return true;
+    }
     return false;
 }
 
+bool effect_exists(effect_context_t *context) {
+    uint32_t idx = effects_read_lock();
+    bool found = effect_in_snapshot(context);
+
+    effects_read_unlock(idx);
+    return found;
+}
+
 output_context_t *get_output(audio_io_handle_t output) {
     struct listnode *node;
 
@@ -296,55 +591,646 @@ bool effects_enabled() {
             effect_context_t *fx_ctxt = node_to_item(fx_node,
                                                          effect_context_t,
                                                          output_node);
-            if (fx_ctxt->state == EFFECT_STATE_ACTIVE && fx_ctxt->ops.process != NULL)
+            if (fx_ctxt->state == EFFECT_STATE_ACTIVE)
                 return true;
         }
     }
     return false;
 }
 
+static void analyze_s16_scalar(const int16_t *in, size_t count,
+                               uint16_t *peak, uint16_t *max_mag, uint64_t *sum_squares)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        int32_t smp = in[i];
+        uint32_t mag = smp < 0 ? -smp - 1 : smp;
+        uint32_t abs = smp < 0 ? (mag == 32767 ? 32767 : mag + 1) : mag;
+
+        if (abs > *peak)
+            *peak = abs;
+        if (mag > *max_mag)
+            *max_mag = mag;
+        *sum_squares += abs * abs;
+    }
+}
+
+/*
+ * Single pass over interleaved 16 bit PCM producing peak, sum of squares and max magnitude
+ * for the whole block and, for mono and stereo, the mono downmix in the same loop. The
+ * downmix of other channel counts is done by a second scalar loop over the block.
+ */
+static void analyze_s16(const int16_t *in, size_t frames, uint32_t channels,
+                        int16_t *mono, capture_analysis_t *result)
+{
+    size_t samples = frames * channels;
+    size_t i = 0;
+    uint16_t peak = result->peak_u16;
+    uint16_t max_mag = result->max_magnitude;
+    uint64_t sum_squares = result->sum_squares;
+
+#if defined(__ARM_NEON)
+    int16x8_t vpeak = vdupq_n_s16(0);
+    int16x8_t vmag = vdupq_n_s16(0);
+    uint64x2_t vsq = vdupq_n_u64(0);
+    int16_t lanes[8];
+    int l;
+
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t x = vld1q_s16(in + i);
+        int16x8_t a = vqabsq_s16(x);
+        int16x4_t a_lo = vget_low_s16(a);
+        int16x4_t a_hi = vget_high_s16(a);
+
+        vpeak = vmaxq_s16(vpeak, a);
+        vmag = vmaxq_s16(vmag, veorq_s16(x, vshrq_n_s16(x, 15)));
+        vsq = vpadalq_u32(vsq, vreinterpretq_u32_s32(vmull_s16(a_lo, a_lo)));
+        vsq = vpadalq_u32(vsq, vreinterpretq_u32_s32(vmull_s16(a_hi, a_hi)));
+        if (channels == 2)
+            vst1_s16(mono + i / 2, vshrn_n_s32(vpaddlq_s16(x), 1));
+        else if (channels == 1)
+            vst1q_s16(mono + i, x);
+    }
+    vst1q_s16(lanes, vpeak);
+    for (l = 0; l < 8; l++)
+        if ((uint16_t)lanes[l] > peak)
+            peak = lanes[l];
+    vst1q_s16(lanes, vmag);
+    for (l = 0; l < 8; l++)
+        if ((uint16_t)lanes[l] > max_mag)
+            max_mag = lanes[l];
+    sum_squares += vgetq_lane_u64(vsq, 0) + vgetq_lane_u64(vsq, 1);
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i vpeak = zero;
+    __m128i vmag = zero;
+    __m128i vsq = zero;
+    int16_t lanes[8];
+    uint64_t sq[2];
+    int l;
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i sign = _mm_srai_epi16(x, 15);
+        __m128i m = _mm_xor_si128(x, sign);   /* -x - 1 for negative samples */
+        __m128i a = _mm_subs_epi16(m, sign);  /* saturated |x| */
+        __m128i squares = _mm_madd_epi16(a, a);
+
+        vpeak = _mm_max_epi16(vpeak, a);
+        vmag = _mm_max_epi16(vmag, m);
+        vsq = _mm_add_epi64(vsq, _mm_unpacklo_epi32(squares, zero));
+        vsq = _mm_add_epi64(vsq, _mm_unpackhi_epi32(squares, zero));
+        if (channels == 2) {
+            __m128i sum = _mm_srai_epi32(_mm_madd_epi16(x, ones), 1);
+            _mm_storel_epi64((__m128i *)(mono + i / 2), _mm_packs_epi32(sum, sum));
+        } else if (channels == 1) {
+            _mm_storeu_si128((__m128i *)(mono + i), x);
+        }
+    }
+    _mm_storeu_si128((__m128i *)lanes, vpeak);
+    for (l = 0; l < 8; l++)
+        if ((uint16_t)lanes[l] > peak)
+            peak = lanes[l];
+    _mm_storeu_si128((__m128i *)lanes, vmag);
+    for (l = 0; l < 8; l++)
+        if ((uint16_t)lanes[l] > max_mag)
+            max_mag = lanes[l];
+    _mm_storeu_si128((__m128i *)sq, vsq);
+    sum_squares += sq[0] + sq[1];
+#endif
+    analyze_s16_scalar(in + i, samples - i, &peak, &max_mag, &sum_squares);
+
+    if (channels == 1) {
+        for (; i < samples; i++)
+            mono[i] = in[i];
+    } else if (channels == 2) {
+        for (i /= 2; i < frames; i++)
+            mono[i] = ((int32_t)in[2 * i] + in[2 * i + 1]) >> 1;
+    } else {
+        for (i = 0; i < frames; i++) {
+            int32_t sum = 0;
+            uint32_t ch;
+            for (ch = 0; ch < channels; ch++)
+                sum += in[i * channels + ch];
+            mono[i] = sum / (int32_t)channels;
+        }
+    }
+
+    result->peak_u16 = peak;
+    result->max_magnitude = max_mag;
+    result->sum_squares = sum_squares;
+}
+
+/* Analyze one captured period. 32 bit captures are narrowed to 16 bit in small blocks so
+ * that the same kernel serves both proxy configurations. */
+static void analyze_capture(const void *data, size_t frames, const capture_config_t *config,
+                            capture_analysis_t *result)
+{
+    int16_t block[ANALYSIS_BLOCK_FRAMES * AUDIO_CAPTURE_MAX_CHANNEL_COUNT];
+    const int32_t *src;
+    uint32_t channels = config->channel_count;
+    size_t done, n, i;
+
+    result->frame_count = frames;
+    result->sample_count = frames * channels;
+    result->peak_u16 = 0;
+    result->max_magnitude = 0;
+    result->sum_squares = 0;
+
+    if (config->format == AUDIO_FORMAT_PCM_16_BIT) {
+        analyze_s16((const int16_t *)data, frames, channels, result->mono, result);
+        return;
+    }
+
+    for (done = 0; done < frames; done += n) {
+        n = frames - done;
+        if (n > ANALYSIS_BLOCK_FRAMES)
+            n = ANALYSIS_BLOCK_FRAMES;
+        src = (const int32_t *)data + done * channels;
+        for (i = 0; i < n * channels; i++)
+            block[i] = src[i] >> 16;
+        analyze_s16(block, n, channels, result->mono + done, result);
+    }
+}
+
+/* dst[i] = (uint8_t)(mono[i] >> shift) ^ 0x80 */
+static void pack_capture_u8(const int16_t *mono, size_t count, int32_t shift, uint8_t *dst)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    const int16x8_t vshift = vdupq_n_s16(-shift);
+    const uint8x8_t bias = vdup_n_u8(0x80);
+
+    for (; i + 8 <= count; i += 8) {
+        int8x8_t b = vmovn_s16(vshlq_s16(vld1q_s16(mono + i), vshift));
+        vst1_u8(dst + i, veor_u8(vreinterpret_u8_s8(b), bias));
+    }
+#elif defined(__SSE2__)
+    const __m128i vshift = _mm_cvtsi32_si128(shift);
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = _mm_sra_epi16(_mm_loadu_si128((const __m128i *)(mono + i)), vshift);
+        __m128i hi = _mm_sra_epi16(_mm_loadu_si128((const __m128i *)(mono + i + 8)), vshift);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_packs_epi16(lo, hi), bias));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = ((uint8_t)(mono[i] >> shift)) ^ 0x80;
+}
+
+/* Render an analyzed period into capture_ring and publish it. Capture thread only. */
+static void publish_capture(const capture_analysis_t *analysis)
+{
+    uint32_t write_count = capture_ring.write_count;
+    uint32_t stats_count = capture_ring.stats_count;
+    buffer_stats_t *stats = &capture_ring.stats[stats_count % MEASUREMENT_RING_SIZE];
+    uint32_t done = 0;
+    int32_t shift;
+
+    /* derive capture scaling factor from peak value in current buffer
+     * this gives more interesting captures for display.
+     * The shift applies to the mono downmix, i.e. after the division by the channel count */
+    shift = analysis->max_magnitude ? __builtin_clz(analysis->max_magnitude) : 32;
+    /* A maximum amplitude signal will have 17 leading zeros, which we want to
+     * translate to a shift of 8 (for converting 16 bit to 8 bit) */
+    shift = 25 - shift;
+    /* Never scale by less than 8 to avoid returning unaltered PCM signal. */
+    if (shift < 3) {
+        shift = 3;
+    }
+
+    while (done < analysis->frame_count) {
+        uint32_t idx = (write_count + done) % CAPTURE_BUF_SIZE;
+        uint32_t count = analysis->frame_count - done;
+        if (count > CAPTURE_BUF_SIZE - idx)
+            count = CAPTURE_BUF_SIZE - idx;
+        pack_capture_u8(analysis->mono + done, count, shift, capture_ring.normalized + idx);
+        pack_capture_u8(analysis->mono + done, count, 8, capture_ring.as_played + idx);
+        done += count;
+    }
+
+    stats->peak_u16 = analysis->peak_u16;
+    stats->rms_squared = analysis->sample_count ?
+            (float)analysis->sum_squares / analysis->sample_count : 0;
+
+    __atomic_store_n(&capture_ring.update_time_ns, now_ns(), __ATOMIC_RELEASE);
+    __atomic_store_n(&capture_ring.stats_count, stats_count + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&capture_ring.write_count, write_count + analysis->frame_count,
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * Spectrum engine
+ */
+
+static void fft_plan_release(fft_plan_t *plan)
+{
+    free(plan->bitrev);
+    free(plan->stage_re);
+    memset(plan, 0, sizeof(*plan));
+}
+
+static int fft_plan_init(fft_plan_t *plan, uint32_t size, uint32_t window)
+{
+    const uint32_t half = size / 2;
+    uint32_t bits = 0, i, h;
+    float sum = 0;
+
+    while ((1u << bits) < half)
+        bits++;
+
+    plan->size = size;
+    plan->bitrev = (uint16_t *)malloc(half * sizeof(uint16_t));
+    /* one block for all float tables */
+    plan->stage_re = (float *)malloc((2 * (half - 1) + 2 * half + size) * sizeof(float));
+    if (plan->bitrev == NULL || plan->stage_re == NULL) {
+        fft_plan_release(plan);
+        return -ENOMEM;
+    }
+    plan->stage_im = plan->stage_re + (half - 1);
+    plan->post_re = plan->stage_im + (half - 1);
+    plan->post_im = plan->post_re + half;
+    plan->window = plan->post_im + half;
+
+    for (i = 0; i < half; i++) {
+        uint32_t r = 0, b;
+        for (b = 0; b < bits; b++)
+            if (i & (1u << b))
+                r |= 1u << (bits - 1 - b);
+        plan->bitrev[i] = r;
+    }
+    for (h = 1; h < half; h <<= 1) {
+        for (i = 0; i < h; i++) {
+            plan->stage_re[h - 1 + i] = cos(M_PI * i / h);
+            plan->stage_im[h - 1 + i] = -sin(M_PI * i / h);
+        }
+    }
+    for (i = 0; i < half; i++) {
+        plan->post_re[i] = cos(2 * M_PI * i / size);
+        plan->post_im[i] = -sin(2 * M_PI * i / size);
+    }
+    for (i = 0; i < size; i++) {
+        double phase = 2 * M_PI * i / (size - 1);
+        switch (window) {
+        case SPECTRUM_WINDOW_HANN:
+            plan->window[i] = 0.5 - 0.5 * cos(phase);
+            break;
+        case SPECTRUM_WINDOW_HAMMING:
+            plan->window[i] = 0.54 - 0.46 * cos(phase);
+            break;
+        case SPECTRUM_WINDOW_BLACKMAN:
+            plan->window[i] = 0.42 - 0.5 * cos(phase) + 0.08 * cos(2 * phase);
+            break;
+        default:
+            plan->window[i] = 1.0f;
+            break;
+        }
+        sum += plan->window[i];
+    }
+    /* a full scale sine on a bin peaks at sum(window) / 2 */
+    plan->norm_mb = 2000 * log10f(sum / 2);
+    return 0;
+}
+
+/* radix 2 butterflies of one stage, h >= 4 so that four butterflies share a vector */
+static void fft_stage_vector(float *re, float *im, uint32_t half,
+                             const float *tw_re, const float *tw_im, uint32_t h)
+{
+    uint32_t start, j;
+
+    for (start = 0; start < half; start += 2 * h) {
+        float *ar = re + start, *ai = im + start;
+        float *br = ar + h, *bi = ai + h;
+        for (j = 0; j < h; j += 4) {
+#if defined(__ARM_NEON)
+            float32x4_t wr = vld1q_f32(tw_re + j), wi = vld1q_f32(tw_im + j);
+            float32x4_t xr = vld1q_f32(br + j), xi = vld1q_f32(bi + j);
+            float32x4_t tr = vmlsq_f32(vmulq_f32(xr, wr), xi, wi);
+            float32x4_t ti = vmlaq_f32(vmulq_f32(xr, wi), xi, wr);
+            float32x4_t yr = vld1q_f32(ar + j), yi = vld1q_f32(ai + j);
+            vst1q_f32(br + j, vsubq_f32(yr, tr));
+            vst1q_f32(bi + j, vsubq_f32(yi, ti));
+            vst1q_f32(ar + j, vaddq_f32(yr, tr));
+            vst1q_f32(ai + j, vaddq_f32(yi, ti));
+#elif defined(__SSE2__)
+            __m128 wr = _mm_loadu_ps(tw_re + j), wi = _mm_loadu_ps(tw_im + j);
+            __m128 xr = _mm_loadu_ps(br + j), xi = _mm_loadu_ps(bi + j);
+            __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, wr), _mm_mul_ps(xi, wi));
+            __m128 ti = _mm_add_ps(_mm_mul_ps(xr, wi), _mm_mul_ps(xi, wr));
+            __m128 yr = _mm_loadu_ps(ar + j), yi = _mm_loadu_ps(ai + j);
+            _mm_storeu_ps(br + j, _mm_sub_ps(yr, tr));
+            _mm_storeu_ps(bi + j, _mm_sub_ps(yi, ti));
+            _mm_storeu_ps(ar + j, _mm_add_ps(yr, tr));
+            _mm_storeu_ps(ai + j, _mm_add_ps(yi, ti));
+#else
+            uint32_t k;
+            for (k = j; k < j + 4; k++) {
+                float tr = br[k] * tw_re[k] - bi[k] * tw_im[k];
+                float ti = br[k] * tw_im[k] + bi[k] * tw_re[k];
+                br[k] = ar[k] - tr;
+                bi[k] = ai[k] - ti;
+                ar[k] += tr;
+                ai[k] += ti;
+            }
+#endif
+        }
+    }
+}
+
+/* power spectrum of the last plan->size samples of spectrum_history into slot->mb */
+static void compute_spectrum(spectrum_slot_t *slot)
+{
+    const fft_plan_t *plan = &slot->plan;
+    const uint32_t size = plan->size, half = size / 2;
+    const int16_t *x = spectrum_history + SPECTRUM_SIZE_MAX - size;
+    const float scale = 1.0f / 32768;
+    uint32_t i, h, start, j, k;
+    int16_t *mb = slot->mb;
+
+    /* pack even/odd real samples as one half size complex sequence, bit reversed */
+    for (i = 0; i < half; i++) {
+        uint32_t r = plan->bitrev[i];
+        fft_re[r] = x[2 * i] * plan->window[2 * i] * scale;
+        fft_im[r] = x[2 * i + 1] * plan->window[2 * i + 1] * scale;
+    }
+
+    for (h = 1; h < half && h < 4; h <<= 1) {
+        const float *tw_re = plan->stage_re + h - 1, *tw_im = plan->stage_im + h - 1;
+        for (start = 0; start < half; start += 2 * h) {
+            for (j = 0; j < h; j++) {
+                uint32_t a = start + j, b = a + h;
+                float tr = fft_re[b] * tw_re[j] - fft_im[b] * tw_im[j];
+                float ti = fft_re[b] * tw_im[j] + fft_im[b] * tw_re[j];
+                fft_re[b] = fft_re[a] - tr;
+                fft_im[b] = fft_im[a] - ti;
+                fft_re[a] += tr;
+                fft_im[a] += ti;
+            }
+        }
+    }
+    for (; h < half; h <<= 1)
+        fft_stage_vector(fft_re, fft_im, half, plan->stage_re + h - 1, plan->stage_im + h - 1, h);
+
+    /* split into the spectrum of the real input: X[k] = E[k] + W^k O[k] */
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (k = 0; k <= half; k++) {
+        float xr, xi, power;
+        if (k == 0 || k == half) {
+            xr = k == 0 ? fft_re[0] + fft_im[0] : fft_re[0] - fft_im[0];
+            xi = 0;
+        } else {
+            float zr = fft_re[k], zi = fft_im[k];
+            float cr = fft_re[half - k], ci = -fft_im[half - k];
+            float er = 0.5f * (zr + cr), ei = 0.5f * (zi + ci);
+            float odr = 0.5f * (zi - ci), odi = -0.5f * (zr - cr);
+            xr = er + plan->post_re[k] * odr - plan->post_im[k] * odi;
+            xi = ei + plan->post_re[k] * odi + plan->post_im[k] * odr;
+        }
+        power = xr * xr + xi * xi;
+        if (power <= 0) {
+            mb[k] = SPECTRUM_FLOOR_MB;
+        } else {
+            float level = 1000 * log10f(power) - plan->norm_mb;
+            mb[k] = level < SPECTRUM_FLOOR_MB ? SPECTRUM_FLOOR_MB :
+                    (level > INT16_MAX ? INT16_MAX : (int16_t)level);
+        }
+    }
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* called by the capture thread after each published period */
+static void update_spectrums(const capture_analysis_t *analysis)
+{
+    uint32_t frames = analysis->frame_count, idx, i;
+    bool any = false;
+
+    if (frames >= SPECTRUM_SIZE_MAX) {
+        memcpy(spectrum_history, analysis->mono + frames - SPECTRUM_SIZE_MAX,
+               sizeof(spectrum_history));
+    } else {
+        memmove(spectrum_history, spectrum_history + frames,
+                (SPECTRUM_SIZE_MAX - frames) * sizeof(int16_t));
+        memcpy(spectrum_history + SPECTRUM_SIZE_MAX - frames, analysis->mono,
+               frames * sizeof(int16_t));
+    }
+
+    idx = effects_read_lock();
+    for (i = 0; i < SPECTRUM_MAX_CONFIGS; i++) {
+        if (__atomic_load_n(&spectrum_slots[i].users, __ATOMIC_ACQUIRE) != 0)
+            compute_spectrum(&spectrum_slots[i]);
+    }
+    effects_read_unlock(idx);
+}
+
+/*
+ * Adaptive capture
+ */
+
+/* Union of the demand of active clients: the lowest proxy rate covering every configured
+ * client rate, a period of half the fastest polling interval so that each poll sees fresh
+ * data but no longer than the shortest capture, so that a capture never ends more than its
+ * own length behind the output, and idle when no client polled within its latency window.
+ * Clients that did not configure a rate are assumed at the DSP rate. Lock free, capture
+ * thread only. */
+static void get_capture_demand(uint64_t now, capture_demand_t *demand, bool *active)
+{
+    effects_snapshot_t *snapshot;
+    uint32_t rate = 0, min_interval_ms = 0, min_capture_ms = 0, period_ms, idx, i;
+    bool idle = true;
+
+    *active = false;
+    idx = effects_read_lock();
+    snapshot = __atomic_load_n(&effects_snapshot, __ATOMIC_ACQUIRE);
+    for (i = 0; i < snapshot->count; i++) {
+        effect_context_t *context = snapshot->entries[i].context;
+        visualizer_context_t *visu_ctxt = (visualizer_context_t *)context;
+        uint32_t client_rate, capture_ms, interval_ms, window_ms;
+        uint64_t last_poll_ns;
+
+        if (!snapshot->entries[i].attached ||
+            __atomic_load_n(&context->state, __ATOMIC_ACQUIRE) != EFFECT_STATE_ACTIVE)
+            continue;
+        *active = true;
+
+        client_rate = AUDIO_CAPTURE_SMP_RATE;
+        if (__atomic_load_n(&visu_ctxt->rate_configured, __ATOMIC_RELAXED))
+            client_rate = __atomic_load_n(&context->config.inputCfg.samplingRate,
+                                          __ATOMIC_RELAXED);
+        if (client_rate > rate)
+            rate = client_rate;
+        capture_ms = client_rate == 0 ? 0 :
+                (uint32_t)((uint64_t)__atomic_load_n(&visu_ctxt->capture_size,
+                                                     __ATOMIC_RELAXED) * 1000 / client_rate);
+        if (capture_ms != 0 && (min_capture_ms == 0 || capture_ms < min_capture_ms))
+            min_capture_ms = capture_ms;
+        interval_ms = __atomic_load_n(&visu_ctxt->poll_interval_ms, __ATOMIC_RELAXED);
+        if (interval_ms != 0 && (min_interval_ms == 0 || interval_ms < min_interval_ms))
+            min_interval_ms = interval_ms;
+
+        window_ms = CAPTURE_PAUSE_POLL_INTERVALS * interval_ms;
+        if (window_ms < capture_pause_ms)
+            window_ms = capture_pause_ms;
+        last_poll_ns = __atomic_load_n(&visu_ctxt->last_poll_ns, __ATOMIC_SEQ_CST);
+        if (capture_pause_ms == 0 || now < last_poll_ns ||
+                now - last_poll_ns <= (uint64_t)window_ms * 1000000)
+            idle = false;
+    }
+    effects_read_unlock(idx);
+
+    if (!capture_adaptive) {
+        demand->sample_rate = AUDIO_CAPTURE_SMP_RATE;
+        demand->period_size = AUDIO_CAPTURE_PERIOD_SIZE;
+        demand->idle = false;
+        return;
+    }
+
+    demand->sample_rate = AUDIO_CAPTURE_SMP_RATE;
+    if (!capture_rate_fixed) {
+        for (i = 0; i < sizeof(capture_rates) / sizeof(capture_rates[0]); i++) {
+            if (capture_rates[i] >= rate) {
+                demand->sample_rate = capture_rates[i];
+                break;
+            }
+        }
+    }
+    period_ms = min_interval_ms / 2;
+    if (period_ms == 0 || (min_capture_ms != 0 && min_capture_ms < period_ms))
+        period_ms = min_capture_ms;
+    if (period_ms < AUDIO_CAPTURE_PERIOD_MIN_MS)
+        period_ms = AUDIO_CAPTURE_PERIOD_MIN_MS;
+    else if (period_ms > AUDIO_CAPTURE_PERIOD_MAX_MS)
+        period_ms = AUDIO_CAPTURE_PERIOD_MAX_MS;
+    demand->period_size = demand->sample_rate * period_ms / 1000;
+    demand->idle = idle;
+}
+
+/* true if the stream must be reopened to follow demand: other rate or period off by 25% */
+static bool capture_demand_changed(const capture_demand_t *demand)
+{
+    uint32_t period_size = capture_config.period_size;
+    uint32_t diff = demand->period_size > period_size ? demand->period_size - period_size :
+                                                         period_size - demand->period_size;
+
+    return demand->sample_rate != capture_config.sample_rate || diff * 4 > period_size;
+}
+
+/* Stop proxy reads until a client polls again or the capture conditions change, then restart
+ * them. Any of those wakes the thread through resume_capture(), which it then takes no more
+ * than one period to serve. CAPTURE_PAUSE_RECHECK_MS bounds a missed wake up. */
+static void pause_capture(pal_stream_handle_t *stream)
+{
+    capture_demand_t demand;
+    struct timespec ts;
+    bool active;
+    int ret;
+
+    ret = pal_stream_stop(stream);
+    if (ret != 0)
+        ALOGW("%s: pal_stream_stop failed with err=%d", __func__, ret);
+    ALOGD("%s: capture PAUSED", __func__);
+
+    for (;;) {
+        __atomic_store_n(&capture_paused, true, __ATOMIC_SEQ_CST);
+        /* a poll stamped before the store above is seen here, one after it posts */
+        get_capture_demand(now_ns(), &demand, &active);
+        if (!demand.idle || !active || __atomic_load_n(&exit_thread, __ATOMIC_ACQUIRE))
+            break;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CAPTURE_PAUSE_RECHECK_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&capture_resume, &ts);
+    }
+    __atomic_store_n(&capture_paused, false, __ATOMIC_SEQ_CST);
+    /* drop a wake up posted while we were already leaving */
+    while (sem_trywait(&capture_resume) == 0)
+        ;
+
+    ret = pal_stream_start(stream);
+    if (ret != 0)
+        ALOGW("%s: pal_stream_start failed with err=%d", __func__, ret);
+    ALOGD("%s: capture RESUMED", __func__);
+}
+
+/* apply demand to the stream attributes before opening the proxy stream */
+static void set_capture_demand(const capture_demand_t *demand,
+                               struct pal_stream_attributes *stream_attr,
+                               struct pal_device *device)
+{
+    stream_attr->in_media_config.sample_rate = demand->sample_rate;
+    device->config.sample_rate = demand->sample_rate;
+    /* read lock free by VISUALIZER_CMD_CAPTURE for latency compensation */
+    __atomic_store_n(&capture_config.sample_rate, demand->sample_rate, __ATOMIC_RELAXED);
+    capture_config.period_size = demand->period_size;
+    ALOGD("%s: proxy capture %u Hz period %u frames", __func__,
+          demand->sample_rate, demand->period_size);
+}
+
 void *capture_thread_loop(void *arg)
 {
-    int16_t data[AUDIO_CAPTURE_PERIOD_SIZE * AUDIO_CAPTURE_CHANNEL_COUNT * sizeof(int16_t)];
-    audio_buffer_t buf;
-    buf.frameCount = AUDIO_CAPTURE_PERIOD_SIZE;
-    buf.s16 = data;
+    const uint32_t frame_size = capture_config.channel_count * capture_config.bit_width / 8;
+    void *data = NULL;
+    int16_t *mono = NULL;
+    capture_analysis_t analysis;
     bool capture_enabled = false;
+    bool reconfigure, active;
+    capture_demand_t demand;
+    uint64_t config_time_ns = 0, now;
     int ret;
     pal_stream_handle_t *in_stream_handle = NULL;
     uint32_t no_of_devices = 1;
     struct pal_stream_attributes stream_attr;
     struct pal_device devices;
     struct pal_channel_info ch_info;
-    uint32_t in_buff_size = AUDIO_CAPTURE_PERIOD_SIZE * AUDIO_CAPTURE_CHANNEL_COUNT * sizeof(int16_t);
+    uint32_t in_buff_size;
     struct pal_buffer_config in_buffer_cfg = {0, 0, 0};
     uint32_t in_buff_count = 1;
     struct pal_buffer in_buffer;
     ssize_t read_status = 0;
-
+    uint32_t i;
 
     memset(&stream_attr, 0x0, sizeof(struct pal_stream_attributes));
     memset(&devices, 0x0, sizeof(struct pal_device));
-    ch_info.channels = AUDIO_CAPTURE_CHANNEL_COUNT;
-    ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
-    ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
+    ch_info.channels = capture_config.channel_count;
+    for (i = 0; i < capture_config.channel_count; i++)
+        ch_info.ch_map[i] = capture_ch_map[i];
 
     stream_attr.type = PAL_STREAM_PROXY;
     stream_attr.flags = 0;
     stream_attr.direction = PAL_AUDIO_INPUT;
-    stream_attr.in_media_config.sample_rate = AUDIO_CAPTURE_SMP_RATE;
-    stream_attr.in_media_config.bit_width = AUDIO_CAPTURE_BIT_WIDTH;
+    stream_attr.in_media_config.sample_rate = capture_config.sample_rate;
+    stream_attr.in_media_config.bit_width = capture_config.bit_width;
     stream_attr.in_media_config.ch_info = ch_info;
-    stream_attr.in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S16_LE;
+    stream_attr.in_media_config.aud_fmt_id = capture_config.bit_width == 32 ?
+                                             PAL_AUDIO_FMT_PCM_S32_LE : PAL_AUDIO_FMT_PCM_S16_LE;
 
     devices.id = PAL_DEVICE_IN_PROXY;
-    devices.config.sample_rate = AUDIO_CAPTURE_SMP_RATE;
-    devices.config.bit_width = AUDIO_CAPTURE_BIT_WIDTH;
+    devices.config.sample_rate = capture_config.sample_rate;
+    devices.config.bit_width = capture_config.bit_width;
     devices.config.ch_info = ch_info;
-    devices.config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S16_LE;
+    devices.config.aud_fmt_id = stream_attr.in_media_config.aud_fmt_id;
 
     ALOGD("thread enter");
 
+    /* sized for the longest period so that following demand never reallocates */
+    data = malloc(AUDIO_CAPTURE_MAX_PERIOD_SIZE * frame_size);
+    mono = (int16_t *)malloc(AUDIO_CAPTURE_MAX_PERIOD_SIZE * sizeof(int16_t));
+    if (data == NULL || mono == NULL) {
+        ALOGE("%s: failed to allocate capture buffers", __func__);
+        free(data);
+        free(mono);
+        return NULL;
+    }
+    memset(&analysis, 0, sizeof(analysis));
+    analysis.mono = mono;
+
     prctl(PR_SET_NAME, (unsigned long)"visualizer capture", 0, 0, 0);
 
     pthread_mutex_lock(&lock);
@@ -355,6 +1241,10 @@ void *capture_thread_loop(void *arg)
         }
         if (effects_enabled()) {
             if (!capture_enabled) {
+                get_capture_demand(now_ns(), &demand, &active);
+                set_capture_demand(&demand, &stream_attr, &devices);
+                in_buff_size = capture_config.period_size * frame_size;
+                config_time_ns = now_ns();
 
                 ret = pal_stream_open(&stream_attr,
                     no_of_devices, &devices,
@@ -363,13 +1253,32 @@ void *capture_thread_loop(void *arg)
                     NULL,
                     0,
                     &in_stream_handle);
+                if (ret != 0 && demand.sample_rate != AUDIO_CAPTURE_SMP_RATE) {
+                    ALOGW("%s: proxy rejected %u Hz, capturing at %u Hz from now on",
+                          __func__, demand.sample_rate, AUDIO_CAPTURE_SMP_RATE);
+                    capture_rate_fixed = true;
+                    demand.period_size = demand.period_size * AUDIO_CAPTURE_SMP_RATE /
+                                         demand.sample_rate;
+                    demand.sample_rate = AUDIO_CAPTURE_SMP_RATE;
+                    set_capture_demand(&demand, &stream_attr, &devices);
+                    in_buff_size = capture_config.period_size * frame_size;
+                    ret = pal_stream_open(&stream_attr,
+                        no_of_devices, &devices,
+                        0,
+                        NULL,
+                        NULL,
+                        0,
+                        &in_stream_handle);
+                }
                 if (ret == 0 && in_stream_handle) {
                     in_buffer_cfg.buf_size = in_buff_size;
                     in_buffer_cfg.buf_count = in_buff_count;
                     ret = pal_stream_set_buffer_size(in_stream_handle,
                         &in_buffer_cfg,
                         NULL);
-                    in_buff_size = in_buffer_cfg.buf_size;
+                    /* never read more than what was allocated */
+                    if (in_buffer_cfg.buf_size < in_buff_size)
+                        in_buff_size = in_buffer_cfg.buf_size;
                     if(ret != 0)
                     {
                         ALOGW("%s: pal_stream_set_buffer_size failed with err=%d", __func__, ret);
@@ -414,38 +1323,53 @@ void *capture_thread_loop(void *arg)
             continue;
 
         pthread_mutex_unlock(&lock);
-        if(in_stream_handle)
-        {
+        /* steady state: read and publish without lock for as long as an enabled effect
+         * is attached, so capture never waits behind command traffic. State changes are
+         * handled above with lock held, and so is reopening the stream when the demand
+         * moved away from the current rate and period. */
+        reconfigure = false;
+        while (!__atomic_load_n(&exit_thread, __ATOMIC_ACQUIRE)) {
+            now = now_ns();
+            get_capture_demand(now, &demand, &active);
+            if (!active)
+                break;
+            if (demand.idle) {
+                pause_capture(in_stream_handle);
+                continue;
+            }
+            if (capture_demand_changed(&demand) &&
+                    now - config_time_ns >= CAPTURE_RECONFIG_MIN_MS * 1000000ULL) {
+                reconfigure = true;
+                break;
+            }
             memset(&in_buffer, 0, sizeof(struct pal_buffer));
-            in_buffer.buffer = (void*)&data[0];
+            in_buffer.buffer = data;
             in_buffer.size = in_buff_size;
             read_status = pal_stream_read(in_stream_handle, &in_buffer);
+            if (read_status > 0) {
+                ALOGV("%s: pal_stream_read success no_of_bytes_read = %zd",
+                        __func__, read_status );
+                analyze_capture(data, read_status / frame_size, &capture_config, &analysis);
+                publish_capture(&analysis);
+                update_spectrums(&analysis);
+            } else {
+                ALOGW("%s: pal_stream_read failed with read status %zd",
+                    __func__, read_status);
+            }
         }
         pthread_mutex_lock(&lock);
 
-        if (read_status > 0) {
-            ALOGD("%s: pal_stream_read success no_of_bytes_read = %zd",
-                    __func__, read_status );
-
-            struct listnode *out_node;
-
-            list_for_each(out_node, &active_outputs_list) {
-                output_context_t *out_ctxt = node_to_item(out_node,
-                                                          output_context_t,
-                                                          outputs_list_node);
-                struct listnode *fx_node;
-
-                list_for_each(fx_node, &out_ctxt->effects_list) {
-                    effect_context_t *fx_ctxt = node_to_item(fx_node,
-                                                                effect_context_t,
-                                                                output_node);
-                    if (fx_ctxt->ops.process != NULL)
-                        fx_ctxt->ops.process(fx_ctxt, &buf, &buf);
-                }
+        if (reconfigure) {
+            ret = pal_stream_stop(in_stream_handle);
+            if(ret != 0) {
+                ALOGW("%s: pal_stream_stop failed with err=%d", __func__, ret);
             }
-        } else {
-            ALOGW("%s: pal_stream_read failed with read status %zd",
-                __func__, read_status);
+            ret = pal_stream_close(in_stream_handle);
+            if(ret != 0) {
+                ALOGW("%s: pal_stream_close failed with err=%d", __func__, ret);
+            }
+            in_stream_handle = NULL;
+            capture_enabled = false;
         }
     }
 
@@ -464,6 +1388,9 @@ void *capture_thread_loop(void *arg)
     }
     pthread_mutex_unlock(&lock);
 
+    free(data);
+    free(mono);
+
     ALOGD("thread exit");
 
     return NULL;
@@ -512,12 +1439,13 @@ int visualizer_hal_start_output(audio_io_handle_t output,
         }
     }
     if (list_empty(&active_outputs_list)) {
-        exit_thread = false;
+        __atomic_store_n(&exit_thread, false, __ATOMIC_RELEASE);
         thread_status = pthread_create(&capture_thread, (const pthread_attr_t *) NULL,
                         capture_thread_loop, NULL);
     }
     list_add_tail(&active_outputs_list, &out_ctxt->outputs_list_node);
-    pthread_cond_signal(&cond);
+    publish_effects_snapshot();
+    wake_capture_thread();
 
 exit:
     pthread_mutex_unlock(&lock);
@@ -555,12 +1483,13 @@ int visualizer_hal_stop_output(audio_io_handle_t output,
             fx_ctxt->ops.stop(fx_ctxt, out_ctxt);
     }
     list_remove(&out_ctxt->outputs_list_node);
-    pthread_cond_signal(&cond);
+    publish_effects_snapshot();
+    wake_capture_thread();
 
     if (list_empty(&active_outputs_list)) {
         if (thread_status == 0) {
-            exit_thread = true;
-            pthread_cond_signal(&cond);
+            __atomic_store_n(&exit_thread, true, __ATOMIC_RELEASE);
+            wake_capture_thread();
             pthread_mutex_unlock(&lock);
             pthread_join(capture_thread, (void **) NULL);
             pthread_mutex_lock(&lock);
@@ -588,7 +1517,9 @@ int set_config(effect_context_t *context, effect_config_t *config)
     if (config->inputCfg.format != config->outputCfg.format) return -EINVAL;
     if (config->outputCfg.accessMode != EFFECT_BUFFER_ACCESS_WRITE &&
             config->outputCfg.accessMode != EFFECT_BUFFER_ACCESS_ACCUMULATE) return -EINVAL;
-    if (config->inputCfg.format != AUDIO_FORMAT_PCM_16_BIT) return -EINVAL;
+    /* the client format does not matter, samples come from the proxy capture */
+    if (config->inputCfg.format != AUDIO_FORMAT_PCM_16_BIT &&
+            config->inputCfg.format != AUDIO_FORMAT_PCM_FLOAT) return -EINVAL;
 
     context->config = *config;
 
@@ -608,39 +1539,143 @@ void get_config(effect_context_t *context, effect_config_t *config)
  * Visualizer operations
  */
 
-uint32_t visualizer_get_delta_time_ms_from_updated_time(visualizer_context_t* visu_ctxt) {
-    uint32_t delta_ms = 0;
-    if (visu_ctxt->buffer_update_time.tv_sec != 0) {
-        struct timespec ts;
-        if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
-            time_t secs = ts.tv_sec - visu_ctxt->buffer_update_time.tv_sec;
-            long nsec = ts.tv_nsec - visu_ctxt->buffer_update_time.tv_nsec;
-            if (nsec < 0) {
-                --secs;
-                nsec += 1000000000;
-            }
-            delta_ms = secs * 1000 + nsec / 1000000;
+/* time since capture_ring was last updated, 0 if nothing was ever captured */
+uint32_t visualizer_get_delta_time_ms_from_updated_time() {
+    int64_t update_time_ns = __atomic_load_n(&capture_ring.update_time_ns, __ATOMIC_ACQUIRE);
+
+    if (update_time_ns == 0)
+        return 0;
+    return (uint32_t)((now_ns() - update_time_ns) / 1000000);
+}
+
+/* Attach context to the spectrum slot matching its size and window, creating the slot
+ * if needed. Called with lock held. */
+static int spectrum_attach(visualizer_context_t *visu_ctxt)
+{
+    spectrum_slot_t *slot;
+    int i, free_idx = -1, status;
+
+    for (i = 0; i < SPECTRUM_MAX_CONFIGS; i++) {
+        slot = &spectrum_slots[i];
+        if (__atomic_load_n(&slot->users, __ATOMIC_RELAXED) == 0) {
+            if (free_idx < 0)
+                free_idx = i;
+        } else if (slot->plan.size == visu_ctxt->spectrum_size &&
+                   slot->window == visu_ctxt->spectrum_window) {
+            __atomic_add_fetch(&slot->users, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&visu_ctxt->spectrum_slot, i, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    if (free_idx < 0) {
+        ALOGW("%s all %d spectrum configurations in use", __func__, SPECTRUM_MAX_CONFIGS);
+        return -EBUSY;
+    }
+
+    slot = &spectrum_slots[free_idx];
+    status = fft_plan_init(&slot->plan, visu_ctxt->spectrum_size, visu_ctxt->spectrum_window);
+    if (status != 0)
+        return status;
+    slot->window = visu_ctxt->spectrum_window;
+    for (i = 0; i <= SPECTRUM_SIZE_MAX / 2; i++)
+        slot->mb[i] = SPECTRUM_FLOOR_MB;
+    /* plan is complete before the capture thread can see the slot in use */
+    __atomic_store_n(&slot->users, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&visu_ctxt->spectrum_slot, free_idx, __ATOMIC_RELEASE);
+    ALOGV("%s slot %d size %u window %u", __func__, free_idx, slot->plan.size, slot->window);
+    return 0;
+}
+
+/* Called with lock held. */
+static void spectrum_detach(visualizer_context_t *visu_ctxt)
+{
+    int idx = visu_ctxt->spectrum_slot;
+    spectrum_slot_t *slot;
+
+    if (idx < 0)
+        return;
+    __atomic_store_n(&visu_ctxt->spectrum_slot, -1, __ATOMIC_RELEASE);
+    slot = &spectrum_slots[idx];
+    if (__atomic_sub_fetch(&slot->users, 1, __ATOMIC_RELEASE) != 0)
+        return;
+    /* neither the capture thread nor a VISUALIZER_CMD_SPECTRUM reader may still use the plan */
+    synchronize_snapshot_readers();
+    fft_plan_release(&slot->plan);
+}
+
+/* Called with lock held. */
+static int spectrum_update(visualizer_context_t *visu_ctxt, uint32_t size, uint32_t window)
+{
+    uint32_t old_size = visu_ctxt->spectrum_size, old_window = visu_ctxt->spectrum_window;
+    int status = 0;
+
+    if (size != 0 &&
+        (size < SPECTRUM_SIZE_MIN || size > SPECTRUM_SIZE_MAX || (size & (size - 1)) != 0))
+        return -EINVAL;
+    if (window >= SPECTRUM_WINDOW_COUNT)
+        return -EINVAL;
+    if (size == old_size && window == old_window)
+        return 0;
+
+    spectrum_detach(visu_ctxt);
+    visu_ctxt->spectrum_size = size;
+    visu_ctxt->spectrum_window = window;
+    if (size != 0) {
+        status = spectrum_attach(visu_ctxt);
+        if (status != 0)
+            visu_ctxt->spectrum_size = 0;
+    }
+    return status;
+}
+
+/* record a client poll, the demand driving the capture period and pausing */
+static void note_client_poll(visualizer_context_t *visu_ctxt)
+{
+    uint64_t now = now_ns();
+    uint64_t last = __atomic_load_n(&visu_ctxt->last_poll_ns, __ATOMIC_RELAXED);
+
+    if (last != 0 && now > last) {
+        uint32_t interval_ms = (uint32_t)((now - last) / 1000000);
+        uint32_t smoothed = visu_ctxt->poll_interval_ms;
+        /* a client coming back after a long silence is not polling slowly */
+        if (interval_ms <= MAX_STALL_TIME_MS) {
+            smoothed = smoothed == 0 ? interval_ms : (3 * smoothed + interval_ms) / 4;
+            __atomic_store_n(&visu_ctxt->poll_interval_ms, smoothed, __ATOMIC_RELAXED);
         }
     }
-    return delta_ms;
+    __atomic_store_n(&visu_ctxt->last_poll_ns, now, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&capture_paused, __ATOMIC_SEQ_CST))
+        resume_capture();
+}
+
+int visualizer_enable(effect_context_t *context)
+{
+    visualizer_context_t *visu_ctxt = (visualizer_context_t *)context;
+
+    /* give a new client a full latency window to start polling */
+    __atomic_store_n(&visu_ctxt->poll_interval_ms, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&visu_ctxt->last_poll_ns, now_ns(), __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+int visualizer_release(effect_context_t *context)
+{
+    spectrum_detach((visualizer_context_t *)context);
+    return 0;
 }
 
 int visualizer_reset(effect_context_t *context)
 {
     visualizer_context_t * visu_ctxt = (visualizer_context_t *)context;
 
-    visu_ctxt->capture_idx = 0;
-    visu_ctxt->last_capture_idx = 0;
-    visu_ctxt->buffer_update_time.tv_sec = 0;
+    visu_ctxt->last_capture_idx = __atomic_load_n(&capture_ring.write_count, __ATOMIC_ACQUIRE);
+    visu_ctxt->capture_idle = false;
     visu_ctxt->latency = DSP_OUTPUT_LATENCY_MS;
-    memset(visu_ctxt->capture_buf, 0x80, CAPTURE_BUF_SIZE);
     return 0;
 }
 
 int visualizer_init(effect_context_t *context)
 {
-    int32_t i;
-
     visualizer_context_t * visu_ctxt = (visualizer_context_t *)context;
 
     context->config.inputCfg.accessMode = EFFECT_BUFFER_ACCESS_READ;
@@ -661,18 +1696,17 @@ int visualizer_init(effect_context_t *context)
     context->config.outputCfg.mask = EFFECT_CONFIG_ALL;
 
     visu_ctxt->capture_size = VISUALIZER_CAPTURE_SIZE_MAX;
+    __atomic_store_n(&visu_ctxt->rate_configured, false, __ATOMIC_RELAXED);
     visu_ctxt->scaling_mode = VISUALIZER_SCALING_MODE_NORMALIZED;
 
     // measurement initialization
-    visu_ctxt->channel_count = popcount(context->config.inputCfg.channels);
     visu_ctxt->meas_mode = MEASUREMENT_MODE_NONE;
     visu_ctxt->meas_wndw_size_in_buffers = MEASUREMENT_WINDOW_MAX_SIZE_IN_BUFFERS;
-    visu_ctxt->meas_buffer_idx = 0;
-    for (i=0 ; i<visu_ctxt->meas_wndw_size_in_buffers ; i++) {
-        visu_ctxt->past_meas[i].is_valid = false;
-        visu_ctxt->past_meas[i].peak_u16 = 0;
-        visu_ctxt->past_meas[i].rms_squared = 0;
-    }
+    visu_ctxt->meas_start_count = __atomic_load_n(&capture_ring.stats_count, __ATOMIC_ACQUIRE);
+
+    visu_ctxt->spectrum_size = 0;
+    visu_ctxt->spectrum_window = SPECTRUM_WINDOW_HANN;
+    visu_ctxt->spectrum_slot = -1;
 
     set_config(context, &context->config);
 
@@ -708,6 +1742,16 @@ int visualizer_get_parameter(effect_context_t *context, effect_param_t *p, uint3
         p->vsize = sizeof(uint32_t);
         *size += sizeof(uint32_t);
         break;
+    case VISUALIZER_PARAM_SPECTRUM_SIZE:
+        *((uint32_t *)p->data + 1) = visu_ctxt->spectrum_size;
+        p->vsize = sizeof(uint32_t);
+        *size += sizeof(uint32_t);
+        break;
+    case VISUALIZER_PARAM_SPECTRUM_WINDOW:
+        *((uint32_t *)p->data + 1) = visu_ctxt->spectrum_window;
+        p->vsize = sizeof(uint32_t);
+        *size += sizeof(uint32_t);
+        break;
     default:
         p->status = -EINVAL;
     }
@@ -723,7 +1767,8 @@ int visualizer_set_parameter(effect_context_t *context, effect_param_t *p, uint3
 
     switch (*(uint32_t *)p->data) {
     case VISUALIZER_PARAM_CAPTURE_SIZE:
-        visu_ctxt->capture_size = *((uint32_t *)p->data + 1);
+        __atomic_store_n(&visu_ctxt->capture_size, *((uint32_t *)p->data + 1),
+                         __ATOMIC_RELAXED);
         ALOGV("%s set capture_size = %d", __func__, visu_ctxt->capture_size);
         break;
     case VISUALIZER_PARAM_SCALING_MODE:
@@ -736,122 +1781,38 @@ int visualizer_set_parameter(effect_context_t *context, effect_param_t *p, uint3
         ALOGV("%s set latency = %d", __func__, visu_ctxt->latency);
         break;
     case VISUALIZER_PARAM_MEASUREMENT_MODE:
-        visu_ctxt->meas_mode = *((uint32_t *)p->data + 1);
+        /* only buffers captured from now on count in the measurements */
+        if (!(__atomic_load_n(&visu_ctxt->meas_mode, __ATOMIC_RELAXED) &
+              MEASUREMENT_MODE_PEAK_RMS))
+            __atomic_store_n(&visu_ctxt->meas_start_count,
+                             __atomic_load_n(&capture_ring.stats_count, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELAXED);
+        __atomic_store_n(&visu_ctxt->meas_mode, *((uint32_t *)p->data + 1), __ATOMIC_RELAXED);
         ALOGV("%s set meas_mode = %d", __func__, visu_ctxt->meas_mode);
         break;
+    case VISUALIZER_PARAM_SPECTRUM_SIZE:
+        ALOGV("%s set spectrum_size = %u", __func__, *((uint32_t *)p->data + 1));
+        return spectrum_update(visu_ctxt, *((uint32_t *)p->data + 1),
+                               visu_ctxt->spectrum_window);
+    case VISUALIZER_PARAM_SPECTRUM_WINDOW:
+        ALOGV("%s set spectrum_window = %u", __func__, *((uint32_t *)p->data + 1));
+        return spectrum_update(visu_ctxt, visu_ctxt->spectrum_size,
+                               *((uint32_t *)p->data + 1));
     default:
         return -EINVAL;
     }
     return 0;
 }
 
-/* Real process function called from capture thread. Called with lock held */
-int visualizer_process(effect_context_t *context,
-                       audio_buffer_t *inBuffer,
-                       audio_buffer_t *outBuffer)
-{
-    visualizer_context_t *visu_ctxt = (visualizer_context_t *)context;
-
-    if (!effect_exists(context))
-        return -EINVAL;
-
-    if (inBuffer == NULL || inBuffer->raw == NULL ||
-        outBuffer == NULL || outBuffer->raw == NULL ||
-        inBuffer->frameCount != outBuffer->frameCount ||
-        inBuffer->frameCount == 0) {
-        return -EINVAL;
-    }
-
-    // perform measurements if needed
-    if (visu_ctxt->meas_mode & MEASUREMENT_MODE_PEAK_RMS) {
-        // find the peak and RMS squared for the new buffer
-        uint32_t inIdx;
-        int16_t max_sample = 0;
-        float rms_squared_acc = 0;
-        for (inIdx = 0 ; inIdx < inBuffer->frameCount * visu_ctxt->channel_count ; inIdx++) {
-            if (inBuffer->s16[inIdx] > max_sample) {
-                max_sample = inBuffer->s16[inIdx];
-            } else if (-inBuffer->s16[inIdx] > max_sample) {
-                max_sample = -inBuffer->s16[inIdx];
-            }
-            rms_squared_acc += (inBuffer->s16[inIdx] * inBuffer->s16[inIdx]);
-        }
-        // store the measurement
-        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].peak_u16 = (uint16_t)max_sample;
-        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].rms_squared =
-                rms_squared_acc / (inBuffer->frameCount * visu_ctxt->channel_count);
-        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].is_valid = true;
-        if (++visu_ctxt->meas_buffer_idx >= visu_ctxt->meas_wndw_size_in_buffers) {
-            visu_ctxt->meas_buffer_idx = 0;
-        }
-    }
-
-    /* all code below assumes stereo 16 bit PCM output and input */
-    int32_t shift;
-
-    if (visu_ctxt->scaling_mode == VISUALIZER_SCALING_MODE_NORMALIZED) {
-        /* derive capture scaling factor from peak value in current buffer
-         * this gives more interesting captures for display. */
-        shift = 32;
-        int len = inBuffer->frameCount * 2;
-        int i;
-        for (i = 0; i < len; i++) {
-            int32_t smp = inBuffer->s16[i];
-            if (smp < 0) smp = -smp - 1; /* take care to keep the max negative in range */
-            int32_t clz = __builtin_clz(smp);
-            if (shift > clz) shift = clz;
-        }
-        /* A maximum amplitude signal will have 17 leading zeros, which we want to
-         * translate to a shift of 8 (for converting 16 bit to 8 bit) */
-        shift = 25 - shift;
-        /* Never scale by less than 8 to avoid returning unaltered PCM signal. */
-        if (shift < 3) {
-            shift = 3;
-        }
-        /* add one to combine the division by 2 needed after summing
-         * left and right channels below */
-        shift++;
-    } else {
-        assert(visu_ctxt->scaling_mode == VISUALIZER_SCALING_MODE_AS_PLAYED);
-        shift = 9;
-    }
-
-    uint32_t capt_idx;
-    uint32_t in_idx;
-    uint8_t *buf = visu_ctxt->capture_buf;
-    for (in_idx = 0, capt_idx = visu_ctxt->capture_idx;
-         in_idx < inBuffer->frameCount;
-         in_idx++, capt_idx++) {
-        if (capt_idx >= CAPTURE_BUF_SIZE) {
-            /* wrap around */
-            capt_idx = 0;
-        }
-        int32_t smp = inBuffer->s16[2 * in_idx] + inBuffer->s16[2 * in_idx + 1];
-        smp = smp >> shift;
-        buf[capt_idx] = ((uint8_t)smp)^0x80;
-    }
-
-    /* XXX the following two should really be atomic, though it probably doesn't
-     * matter much for visualization purposes */
-    visu_ctxt->capture_idx = capt_idx;
-    /* update last buffer update time stamp */
-    if (clock_gettime(CLOCK_MONOTONIC, &visu_ctxt->buffer_update_time) < 0) {
-        visu_ctxt->buffer_update_time.tv_sec = 0;
-    }
-
-    if (context->state != EFFECT_STATE_ACTIVE) {
-        ALOGV("%s DONE inactive", __func__);
-        return -ENODATA;
-    }
-
-    return 0;
-}
-
 int visualizer_command(effect_context_t * context, uint32_t cmdCode, uint32_t cmdSize,
         void *pCmdData, uint32_t *replySize, void *pReplyData)
 {
     visualizer_context_t * visu_ctxt = (visualizer_context_t *)context;
 
+    if (cmdCode == VISUALIZER_CMD_CAPTURE || cmdCode == VISUALIZER_CMD_MEASURE ||
+            cmdCode == VISUALIZER_CMD_SPECTRUM)
+        note_client_poll(visu_ctxt);
+
     switch (cmdCode) {
     case VISUALIZER_CMD_CAPTURE:
         if (pReplyData == NULL || *replySize != visu_ctxt->capture_size) {
@@ -864,46 +1825,47 @@ int visualizer_command(effect_context_t * context, uint32_t cmdCode, uint32_t cm
             break;
 
         if (context->state == EFFECT_STATE_ACTIVE) {
-            int32_t latency_ms = visu_ctxt->latency;
-            const int32_t delta_ms = visualizer_get_delta_time_ms_from_updated_time(visu_ctxt);
-            latency_ms -= delta_ms;
-            if (latency_ms < 0) {
-                latency_ms = 0;
-            }
-            const uint32_t delta_smp = context->config.inputCfg.samplingRate * latency_ms / 1000;
-
-            int64_t capture_point = visu_ctxt->capture_idx;
-            capture_point -= visu_ctxt->capture_size;
-            capture_point -= delta_smp;
-            int64_t capture_size = visu_ctxt->capture_size;
-            if (capture_point < 0) {
-                int64_t size = -capture_point;
-                if (size > capture_size)
-                    size = capture_size;
-
-                memcpy(pReplyData,
-                       visu_ctxt->capture_buf + CAPTURE_BUF_SIZE + capture_point,
-                       size);
-                pReplyData = (void *)((size_t)pReplyData + size);
-                capture_size -= size;
-                capture_point = 0;
-            }
-            memcpy(pReplyData,
-                   visu_ctxt->capture_buf + capture_point,
-                   capture_size);
-
+            const uint8_t *ring = visu_ctxt->scaling_mode == VISUALIZER_SCALING_MODE_AS_PLAYED ?
+                                  capture_ring.as_played : capture_ring.normalized;
+            uint32_t write_count, capture_point, after;
+            int32_t delta_ms;
+
+            do {
+                int32_t latency_ms = visu_ctxt->latency;
+                write_count = __atomic_load_n(&capture_ring.write_count, __ATOMIC_ACQUIRE);
+                delta_ms = visualizer_get_delta_time_ms_from_updated_time();
+                latency_ms -= delta_ms;
+                if (latency_ms < 0) {
+                    latency_ms = 0;
+                }
+                const uint32_t delta_smp =
+                        __atomic_load_n(&capture_config.sample_rate, __ATOMIC_RELAXED) *
+                        latency_ms / 1000;
+
+                capture_point = write_count - visu_ctxt->capture_size - delta_smp;
+                uint32_t idx = capture_point % CAPTURE_BUF_SIZE;
+                uint32_t size = visu_ctxt->capture_size;
+                if (size > CAPTURE_BUF_SIZE - idx)
+                    size = CAPTURE_BUF_SIZE - idx;
+                memcpy(pReplyData, ring + idx, size);
+                memcpy((uint8_t *)pReplyData + size, ring, visu_ctxt->capture_size - size);
+
+                /* the producer never publishes more than a period at once, if it moved by
+                 * more than half the ring the copied region may have been overwritten */
+                after = __atomic_load_n(&capture_ring.write_count, __ATOMIC_ACQUIRE);
+            } while (after - capture_point > CAPTURE_BUF_SIZE / 2);
 
             /* if audio framework has stopped playing audio although the effect is still
-             * active we must clear the capture buffer to return silence */
-            if ((visu_ctxt->last_capture_idx == visu_ctxt->capture_idx) &&
-                    (visu_ctxt->buffer_update_time.tv_sec != 0)) {
-                if (delta_ms > MAX_STALL_TIME_MS) {
-                    ALOGV("%s capture going to idle", __func__);
-                    visu_ctxt->buffer_update_time.tv_sec = 0;
-                    memset(pReplyData, 0x80, visu_ctxt->capture_size);
-                }
+             * active we must return silence */
+            if (visu_ctxt->last_capture_idx != write_count) {
+                visu_ctxt->capture_idle = false;
+            } else if (!visu_ctxt->capture_idle && delta_ms > MAX_STALL_TIME_MS) {
+                ALOGV("%s capture going to idle", __func__);
+                visu_ctxt->capture_idle = true;
             }
-            visu_ctxt->last_capture_idx = visu_ctxt->capture_idx;
+            if (visu_ctxt->capture_idle)
+                memset(pReplyData, 0x80, visu_ctxt->capture_size);
+            visu_ctxt->last_capture_idx = write_count;
         } else {
             memset(pReplyData, 0x80, visu_ctxt->capture_size);
         }
@@ -927,30 +1889,41 @@ int visualizer_command(effect_context_t * context, uint32_t cmdCode, uint32_t cm
         uint8_t nb_valid_meas = 0;
         /* reset measurements if last measurement was too long ago (which implies stored
          * measurements aren't relevant anymore and shouldn't bias the new one) */
-        const int32_t delay_ms = visualizer_get_delta_time_ms_from_updated_time(visu_ctxt);
-        if (delay_ms > DISCARD_MEASUREMENTS_TIME_MS) {
-            uint32_t i;
+        const int32_t delay_ms = visualizer_get_delta_time_ms_from_updated_time();
+        uint32_t stats_count = __atomic_load_n(&capture_ring.stats_count, __ATOMIC_ACQUIRE);
+        if (!(__atomic_load_n(&visu_ctxt->meas_mode, __ATOMIC_RELAXED) &
+              MEASUREMENT_MODE_PEAK_RMS)) {
+            ALOGV("%s VISUALIZER_CMD_MEASURE measurements not enabled", __func__);
+        } else if (delay_ms > DISCARD_MEASUREMENTS_TIME_MS) {
             ALOGV("Discarding measurements, last measurement is %dms old", delay_ms);
-            for (i=0 ; i<visu_ctxt->meas_wndw_size_in_buffers ; i++) {
-                visu_ctxt->past_meas[i].is_valid = false;
-                visu_ctxt->past_meas[i].peak_u16 = 0;
-                visu_ctxt->past_meas[i].rms_squared = 0;
-            }
-            visu_ctxt->meas_buffer_idx = 0;
+            __atomic_store_n(&visu_ctxt->meas_start_count, stats_count, __ATOMIC_RELAXED);
         } else {
             /* only use actual measurements, otherwise the first RMS measure happening before
              * MEASUREMENT_WINDOW_MAX_SIZE_IN_BUFFERS have been played will always be artificially
              * low */
-            uint32_t i;
-            for (i=0 ; i < visu_ctxt->meas_wndw_size_in_buffers ; i++) {
-                if (visu_ctxt->past_meas[i].is_valid) {
-                    if (visu_ctxt->past_meas[i].peak_u16 > peak_u16) {
-                        peak_u16 = visu_ctxt->past_meas[i].peak_u16;
+            uint32_t start = __atomic_load_n(&visu_ctxt->meas_start_count, __ATOMIC_RELAXED);
+            uint32_t available, after, i;
+            do {
+                peak_u16 = 0;
+                sum_rms_squared = 0.0f;
+                available = stats_count - start;
+                if (available > visu_ctxt->meas_wndw_size_in_buffers)
+                    available = visu_ctxt->meas_wndw_size_in_buffers;
+                for (i = 1; i <= available; i++) {
+                    const buffer_stats_t *stats =
+                            &capture_ring.stats[(stats_count - i) % MEASUREMENT_RING_SIZE];
+                    if (stats->peak_u16 > peak_u16) {
+                        peak_u16 = stats->peak_u16;
                     }
-                    sum_rms_squared += visu_ctxt->past_meas[i].rms_squared;
-                    nb_valid_meas++;
+                    sum_rms_squared += stats->rms_squared;
                 }
-            }
+                nb_valid_meas = available;
+                /* retry if the producer reused a slot we read */
+                after = __atomic_load_n(&capture_ring.stats_count, __ATOMIC_ACQUIRE);
+                if (after - stats_count < MEASUREMENT_RING_SIZE - available)
+                    break;
+                stats_count = after;
+            } while (true);
         }
         float rms = nb_valid_meas == 0 ? 0.0f : sqrtf(sum_rms_squared / nb_valid_meas);
         int32_t* p_int_reply_data = (int32_t*)pReplyData;
@@ -971,6 +1944,40 @@ int visualizer_command(effect_context_t * context, uint32_t cmdCode, uint32_t cm
         }
         break;
 
+    case VISUALIZER_CMD_SPECTRUM: {
+        int32_t slot_idx;
+        spectrum_slot_t *slot;
+        uint32_t bins, seq, idx;
+
+        /* the read section keeps spectrum_detach() from releasing the slot under us,
+         * so the slot is looked up inside it */
+        idx = effects_read_lock();
+        slot_idx = __atomic_load_n(&visu_ctxt->spectrum_slot, __ATOMIC_ACQUIRE);
+        if (slot_idx < 0) {
+            effects_read_unlock(idx);
+            ALOGV("%s VISUALIZER_CMD_SPECTRUM spectrum not enabled", __func__);
+            return -EINVAL;
+        }
+        slot = &spectrum_slots[slot_idx];
+        bins = slot->plan.size / 2 + 1;
+        if (slot->plan.size == 0 || pReplyData == NULL || replySize == NULL ||
+                *replySize < bins * sizeof(int16_t)) {
+            effects_read_unlock(idx);
+            ALOGV("%s VISUALIZER_CMD_SPECTRUM error replySize %u < %zu", __func__,
+                  replySize == NULL ? 0 : *replySize, bins * sizeof(int16_t));
+            return -EINVAL;
+        }
+        do {
+            do {
+                seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            } while (seq & 1);
+            memcpy(pReplyData, slot->mb, bins * sizeof(int16_t));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+        effects_read_unlock(idx);
+        *replySize = bins * sizeof(int16_t);
+        } break;
+
     default:
         ALOGW("%s invalid command %d", __func__, cmdCode);
         return -EINVAL;
@@ -1015,10 +2022,11 @@ int effect_lib_create(const effect_uuid_t *uuid,
         context = (effect_context_t *)visu_ctxt;
         context->ops.init = visualizer_init;
         context->ops.reset = visualizer_reset;
-        context->ops.process = visualizer_process;
         context->ops.set_parameter = visualizer_set_parameter;
         context->ops.get_parameter = visualizer_get_parameter;
         context->ops.command = visualizer_command;
+        context->ops.release = visualizer_release;
+        context->ops.enable = visualizer_enable;
         context->desc = &visualizer_descriptor;
     } else {
         return -EINVAL;
@@ -1042,6 +2050,7 @@ int effect_lib_create(const effect_uuid_t *uuid,
     output_context_t *out_ctxt = get_output(ioId);
     if (out_ctxt != NULL)
         add_effect_to_output(out_ctxt, context);
+    publish_effects_snapshot();
     pthread_mutex_unlock(&lock);
 
     *pHandle = (effect_handle_t)context;
@@ -1067,6 +2076,8 @@ int effect_lib_release(effect_handle_t handle) {
         if (out_ctxt != NULL)
             remove_effect_from_output(out_ctxt, context);
         list_remove(&context->effects_list_node);
+        /* lock free readers must be done with the context before it is freed */
+        publish_effects_snapshot();
         if (context->ops.release)
             context->ops.release(context);
         free(context);
@@ -1137,6 +2148,24 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
     int retsize;
     int status = 0;
 
+    /* capture, measure and spectrum only read capture_ring, spectrum_slots and the context:
+     * serve them without lock so that polling clients never contend with the capture thread.
+     * The read section lasts until the command returns, so a release waits for it. */
+    if (cmdCode == VISUALIZER_CMD_CAPTURE || cmdCode == VISUALIZER_CMD_MEASURE ||
+            cmdCode == VISUALIZER_CMD_SPECTRUM) {
+        uint32_t idx = effects_read_lock();
+
+        if (!effect_in_snapshot(context) ||
+            __atomic_load_n(&context->state, __ATOMIC_ACQUIRE) == EFFECT_STATE_UNINITIALIZED ||
+            context->ops.command == NULL)
+            status = -EINVAL;
+        else
+            status = context->ops.command(context, cmdCode, cmdSize, pCmdData, replySize,
+                                          pReplyData);
+        effects_read_unlock(idx);
+        return status;
+    }
+
     pthread_mutex_lock(&lock);
 
     if (!effect_exists(context)) {
@@ -1170,6 +2199,9 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
             goto exit;
         }
         *(int *) pReplyData = set_config(context, (effect_config_t *) pCmdData);
+        if (*(int *) pReplyData == 0)
+            __atomic_store_n(&((visualizer_context_t *)context)->rate_configured, true,
+                             __ATOMIC_RELAXED);
         break;
     case EFFECT_CMD_GET_CONFIG:
         if (pReplyData == NULL ||
@@ -1197,10 +2229,10 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
             status = -ENOSYS;
             goto exit;
         }
-        context->state = EFFECT_STATE_ACTIVE;
+        __atomic_store_n(&context->state, EFFECT_STATE_ACTIVE, __ATOMIC_RELEASE);
         if (context->ops.enable)
             context->ops.enable(context);
-        pthread_cond_signal(&cond);
+        wake_capture_thread();
         ALOGV("%s EFFECT_CMD_ENABLE", __func__);
         *(int *)pReplyData = 0;
         break;
@@ -1213,10 +2245,10 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
             status = -ENOSYS;
             goto exit;
         }
-        context->state = EFFECT_STATE_INITIALIZED;
+        __atomic_store_n(&context->state, EFFECT_STATE_INITIALIZED, __ATOMIC_RELEASE);
         if (context->ops.disable)
             context->ops.disable(context);
-        pthread_cond_signal(&cond);
+        wake_capture_thread();
         ALOGV("%s EFFECT_CMD_DISABLE", __func__);
         *(int *)pReplyData = 0;
         break;
@@ -1284,6 +2316,7 @@ int effect_command(effect_handle_t self, uint32_t cmdCode, uint32_t cmdSize,
         out_ctxt = get_output(offload_param->ioHandle);
         if (out_ctxt != NULL)
             add_effect_to_output(out_ctxt, context);
+        publish_effects_snapshot();
 
         } break;
 
@@ -65,6 +65,16 @@ LOCAL_SRC_FILES := \
     AudioDevice.cpp \
     AudioVoice.cpp \
     audio_extn/soundtrigger.cpp \
+    audio_extn/LabReader.cpp \
+    audio_extn/CaptureFanout.cpp \
+    audio_extn/StreamRecovery.cpp \
+    audio_extn/CompressOffloadEngine.cpp \
+    audio_extn/PalCallbackDispatcher.cpp \
+    audio_extn/MmapClock.cpp \
+    audio_extn/LatencyTest.cpp \
+    audio_extn/CadenceMonitor.cpp \
+    audio_extn/EventTrace.cpp \
+    audio_extn/PcmTap.cpp \
     audio_extn/Gain.cpp \
     audio_extn/AudioExtn.cpp
 
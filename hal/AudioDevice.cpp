@@ -380,6 +380,7 @@ std::shared_ptr<StreamOutPrimary> AudioDevice::CreateStreamOut(
         AHAL_ERR("Failed to create StreamOutPrimary");
         return nullptr;
     }
+    astream->callback_token_ = PalCallbackDispatcher::Register(astream);
     astream->GetStreamHandle(stream_out);
     out_list_mutex.lock();
     stream_out_list_.push_back(astream);
@@ -787,6 +788,7 @@ std::shared_ptr<StreamInPrimary> AudioDevice::CreateStreamIn(
     std::shared_ptr<StreamInPrimary> astream (new StreamInPrimary(handle,
                                               devices, flags, config,
                                               address, source));
+    astream->callback_token_ = PalCallbackDispatcher::Register(astream);
     astream->GetStreamHandle(stream_in);
     in_list_mutex.lock();
     stream_in_list_.push_back(astream);
@@ -1220,6 +1222,11 @@ static int adev_dump(const audio_hw_device_t *device, int fd)
 #else
     dprintf(fd, "PAL HIDL disabled");
 #endif
+    dprintf(fd, "\n");
+    PalCallbackDispatcher::Dump(fd);
+    LatencyTest::Dump(fd);
+    EventTrace::Dump(fd);
+    PcmTap::Dump(fd);
 
     return 0;
 }
@@ -1398,18 +1405,17 @@ std::shared_ptr<StreamOutPrimary> AudioDevice::OutGetStream(audio_io_handle_t ha
 std::shared_ptr<StreamOutPrimary> AudioDevice::OutGetStream(audio_stream_t* stream_out) {
 
     std::shared_ptr<StreamOutPrimary> astream_out;
-    AHAL_VERBOSE("stream_out(%p)", stream_out);
     out_list_mutex.lock();
     for (int i = 0; i < stream_out_list_.size(); i++) {
         if (stream_out_list_[i]->stream_.get() ==
                                         (audio_stream_out*) stream_out) {
-            AHAL_VERBOSE("Found stream associated with stream_out");
             astream_out = stream_out_list_[i];
             break;
         }
     }
     out_list_mutex.unlock();
-    AHAL_VERBOSE("astream_out(%p)", astream_out->stream_.get());
+    EventTrace::Record(EVENT_TRACE_OUT_GET_STREAM, (intptr_t)stream_out,
+                       (intptr_t)astream_out.get());
 
     return astream_out;
 }
@@ -1432,17 +1438,16 @@ std::shared_ptr<StreamInPrimary> AudioDevice::InGetStream (audio_io_handle_t han
 std::shared_ptr<StreamInPrimary> AudioDevice::InGetStream (audio_stream_t* stream_in) {
     std::shared_ptr<StreamInPrimary> astream_in;
 
-    AHAL_VERBOSE("stream_in(%p)", stream_in);
     in_list_mutex.lock();
     for (int i = 0; i < stream_in_list_.size(); i++) {
         if (stream_in_list_[i]->stream_.get() == (audio_stream_in*) stream_in) {
-            AHAL_VERBOSE("Found existing stream associated with astream_in");
             astream_in = stream_in_list_[i];
             break;
         }
     }
     in_list_mutex.unlock();
-    AHAL_VERBOSE("astream_in(%p)", astream_in->stream_.get());
+    EventTrace::Record(EVENT_TRACE_IN_GET_STREAM, (intptr_t)stream_in,
+                       (intptr_t)astream_in.get());
     return astream_in;
 }
 
@@ -1584,6 +1589,22 @@ int AudioDevice::SetParameters(const char *kvpairs) {
     }
 #endif
 
+    ret = str_parms_get_str(parms, "latency_test", value, sizeof(value));
+    if (ret >= 0) {
+        char usecase[128];
+
+        ret = str_parms_get_str(parms, "latency_test_usecase", usecase, sizeof(usecase));
+        LatencyTest::SetParameters(value, ret >= 0 ? usecase : NULL);
+    }
+
+    ret = str_parms_get_str(parms, "event_trace", value, sizeof(value));
+    if (ret >= 0)
+        EventTrace::SetParameters(value);
+
+    ret = str_parms_get_str(parms, "pcm_tap", value, sizeof(value));
+    if (ret >= 0)
+        PcmTap::SetParameters(value);
+
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
         pal_param_screen_state_t param_screen_st;
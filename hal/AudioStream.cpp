@@ -40,6 +40,7 @@
 #include <cutils/properties.h>
 #include <inttypes.h>
 
+#include <algorithm>
 #include <chrono>
 #include <thread>
 
@@ -52,7 +53,6 @@
 #define COMPRESS_OFFLOAD_FRAGMENT_SIZE (32 * 1024)
 #define FLAC_COMPRESS_OFFLOAD_FRAGMENT_SIZE (256 * 1024)
 
-#define MAX_READ_RETRY_COUNT 25
 #define MAX_ACTIVE_MICROPHONES_TO_SUPPORT 10
 #define AFE_PROXY_RECORD_PERIOD_SIZE  768
 
@@ -244,46 +244,49 @@ static pal_stream_type_t GetPalStreamType(audio_output_flags_t flags) {
 std::shared_ptr<AudioDevice> AudioDevice::adev_ = nullptr;
 std::shared_ptr<audio_hw_device_t> AudioDevice::device_ = nullptr;
 
-static int32_t pal_callback(pal_stream_handle_t *stream_handle,
-                            uint32_t event_id, uint32_t *event_data,
-                            uint32_t event_size, uint64_t cookie)
+void StreamOutPrimary::OnPalEvent(pal_stream_handle_t *stream_handle,
+                                  uint32_t event_id, const uint32_t *event_data,
+                                  uint32_t event_size)
 {
     stream_callback_event_t event;
-    StreamOutPrimary *astream_out = reinterpret_cast<StreamOutPrimary *> (cookie);
 
-    AHAL_VERBOSE("stream_handle (%p), event_id (%x), event_data (%p), cookie %" PRIu64
-          "event_size (%d)", stream_handle, event_id, event_data,
-           cookie, event_size);
+    EventTrace::Record(EVENT_TRACE_OUT_PAL_EVENT, handle_, event_id, event_size);
+
+    // compress streams handle events on their own dispatcher thread
+    if (compress_engine_) {
+        // delivering it here would overtake the events already queued
+        compress_engine_->PostEvent(event_id);
+        return;
+    }
 
     switch (event_id)
     {
         case PAL_STREAM_CBK_EVENT_WRITE_READY:
         {
-            std::lock_guard<std::mutex> write_guard (astream_out->write_wait_mutex_);
-            astream_out->write_ready_ = true;
-            AHAL_VERBOSE("received WRITE_READY event");
-            (astream_out->write_condition_).notify_all();
+            std::lock_guard<std::mutex> write_guard (write_wait_mutex_);
+            write_ready_ = true;
+            write_condition_.notify_all();
             event = STREAM_CBK_EVENT_WRITE_READY;
         }
         break;
 
     case PAL_STREAM_CBK_EVENT_DRAIN_READY:
         {
-            std::lock_guard<std::mutex> drain_guard (astream_out->drain_wait_mutex_);
-            astream_out->drain_ready_ = true;
-            astream_out->sendGaplessMetadata = false;
+            std::lock_guard<std::mutex> drain_guard (drain_wait_mutex_);
+            drain_ready_ = true;
+            sendGaplessMetadata = false;
             AHAL_DBG("received DRAIN_READY event");
-            (astream_out->drain_condition_).notify_all();
+            drain_condition_.notify_all();
             event = STREAM_CBK_EVENT_DRAIN_READY;
         }
         break;
     case PAL_STREAM_CBK_EVENT_PARTIAL_DRAIN_READY:
         {
-            std::lock_guard<std::mutex> drain_guard (astream_out->drain_wait_mutex_);
-            astream_out->drain_ready_ = true;
-            astream_out->sendGaplessMetadata = true;
+            std::lock_guard<std::mutex> drain_guard (drain_wait_mutex_);
+            drain_ready_ = true;
+            sendGaplessMetadata = true;
             AHAL_DBG("received PARTIAL DRAIN_READY event");
-            (astream_out->drain_condition_).notify_all();
+            drain_condition_.notify_all();
             event = STREAM_CBK_EVENT_DRAIN_READY;
         }
         break;
@@ -293,15 +296,13 @@ static int32_t pal_callback(pal_stream_handle_t *stream_handle,
         break;
     default:
         AHAL_ERR("Invalid event id:%d", event_id);
-        return -EINVAL;
+        return;
     }
 
-    if (astream_out && astream_out->client_callback) {
+    if (client_callback) {
         AHAL_VERBOSE("Callback to Framework");
-        astream_out->client_callback(event, NULL, astream_out->client_cookie);
+        client_callback(event, NULL, client_cookie);
     }
-
-    return 0;
 }
 
 
@@ -614,9 +615,25 @@ static int astream_out_standby(struct audio_stream *stream) {
 }
 
 static int astream_dump(const struct audio_stream *stream, int fd) {
-    std::ignore = stream;
-    std::ignore = fd;
-    AHAL_DBG("dump function not implemented");
+    std::shared_ptr<AudioDevice> adevice = AudioDevice::GetInstance();
+    std::shared_ptr<StreamOutPrimary> astream_out;
+    std::shared_ptr<StreamInPrimary> astream_in;
+
+    if (!adevice) {
+        AHAL_ERR("unable to get audio device");
+        return 0;
+    }
+
+    astream_out = adevice->OutGetStream((audio_stream_t*)stream);
+    if (astream_out) {
+        astream_out->Dump(fd);
+        return 0;
+    }
+
+    astream_in = adevice->InGetStream((audio_stream_t*)stream);
+    if (astream_in)
+        astream_in->Dump(fd);
+
     return 0;
 }
 
@@ -1697,8 +1714,13 @@ int StreamOutPrimary::FillHalFnPtrs() {
 int StreamOutPrimary::GetMmapPosition(struct audio_mmap_position *position)
 {
     struct pal_mmap_position pal_mmap_pos;
+    struct timespec start, end;
     int32_t ret = 0;
 
+    if (mmap_clock_.Extrapolate(position))
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
     stream_mutex_.lock();
     if (pal_stream_handle_ == nullptr) {
         AHAL_ERR("error pal handle is null\n");
@@ -1714,6 +1736,9 @@ int StreamOutPrimary::GetMmapPosition(struct audio_mmap_position *position)
     }
     position->position_frames = pal_mmap_pos.position_frames;
     position->time_nanoseconds = pal_mmap_pos.time_nanoseconds;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    mmap_clock_.Update(position, (end.tv_sec - start.tv_sec) * 1000000000LL +
+                                 end.tv_nsec - start.tv_nsec);
 
 #if 0
     /** Check if persist vendor property is available */
@@ -1787,6 +1812,7 @@ int StreamOutPrimary::Stop() {
     if (usecase_ == USECASE_AUDIO_PLAYBACK_MMAP &&
             pal_stream_handle_ && stream_started_) {
 
+        mmap_clock_.Stop();
         ret = pal_stream_stop(pal_stream_handle_);
         if (ret == 0) {
             stream_started_ = false;
@@ -1806,8 +1832,10 @@ int StreamOutPrimary::Start() {
             pal_stream_handle_ && !stream_started_) {
 
         ret = pal_stream_start(pal_stream_handle_);
-        if (ret == 0)
+        if (ret == 0) {
             stream_started_ = true;
+            mmap_clock_.Start(streamAttributes_.out_media_config.sample_rate);
+        }
     }
     if (karaoke)
         AudExtn.karaoke_start();
@@ -1839,6 +1867,8 @@ int StreamOutPrimary::Pause() {
     if (pal_stream_handle_) {
         ret = pal_stream_pause(pal_stream_handle_);
     }
+    /* the writes stop until resume */
+    cadence_.Stop();
     if (ret)
         ret = -EINVAL;
     else {
@@ -1896,6 +1926,10 @@ int StreamOutPrimary::Flush() {
             AHAL_INFO("called in invalid state (stream not paused)" );
         }
         mBytesWritten = 0;
+        if (compress_engine_) {
+            compress_engine_->OnBufferEmpty();
+            compress_engine_->CancelTransition();
+        }
     }
     sendGaplessMetadata = true;
     stream_mutex_.unlock();
@@ -1924,8 +1958,15 @@ int StreamOutPrimary::Drain(audio_drain_type_t type) {
     }
 
     stream_mutex_.lock();
-    if (pal_stream_handle_)
+    if (pal_stream_handle_) {
+        if (compress_engine_) {
+            if (palDrainType == PAL_DRAIN_PARTIAL)
+                compress_engine_->OnPartialDrain();
+            else
+                compress_engine_->CancelTransition();
+        }
         ret = pal_stream_drain(pal_stream_handle_, palDrainType);
+    }
     stream_mutex_.unlock();
 
     if (ret) {
@@ -1939,6 +1980,11 @@ int StreamOutPrimary::Standby() {
     int ret = 0;
 
     AHAL_DBG("Enter");
+    EventTrace::Record(EVENT_TRACE_OUT_STANDBY, handle_);
+    /* no-op when called by the recovery itself */
+    recovery_.Stop();
+    mmap_clock_.Stop();
+    cadence_.Stop();
     stream_mutex_.lock();
     if (pal_stream_handle_) {
         ret = pal_stream_stop(pal_stream_handle_);
@@ -1959,6 +2005,13 @@ int StreamOutPrimary::Standby() {
     stream_started_ = false;
     stream_paused_ = false;
     sendGaplessMetadata = true;
+    /* finishes the files, the next write opens new ones */
+    pcm_tap_.Reset();
+    haptics_tap_.Reset();
+    if (compress_engine_) {
+        compress_engine_->OnBufferEmpty();
+        compress_engine_->CancelTransition();
+    }
     if (CheckOffloadEffectsType(streamAttributes_.type)) {
         ret = StopOffloadEffects(handle_, pal_stream_handle_);
         ret = StopOffloadVisualizer(handle_, pal_stream_handle_);
@@ -2186,28 +2239,55 @@ int StreamOutPrimary::SetParameters(struct str_parms *parms) {
 
     //Parse below metadata only if it is compress offload usecase.
     if (usecase_ == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
-        ret = AudioExtn::audio_extn_parse_compress_metadata(&config_, &palSndDec, parms,
-                                         &msample_rate, &mchannels, &isCompressMetadataAvail);
+        bool codecAvail = false;
+        uint32_t sampleRate = 0;
+        uint16_t channels = 0;
+
+        // the dispatcher may push the metadata at partial drain ready
+        stream_mutex_.lock();
+        // parse on top of what is already staged for the next track
+        if (!nextTrack.codecAvail)
+            nextTrack.palSndDec = palSndDec;
+        ret = AudioExtn::audio_extn_parse_compress_metadata(&config_, &nextTrack.palSndDec, parms,
+                                         &sampleRate, &channels, &codecAvail);
         if (ret) {
+            stream_mutex_.unlock();
             AHAL_ERR("parse_compress_metadata Error (%x)", ret);
             goto error;
         }
-
-        ret1 = str_parms_get_str(parms, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES, value, sizeof(value));
-        if (ret1 >= 0 ) {
-            gaplessMeta.encoderDelay = atoi(value);
-            AHAL_DBG("new encoder delay %u", gaplessMeta.encoderDelay);
-        } else {
-            gaplessMeta.encoderDelay = 0;
+        if (codecAvail) {
+            nextTrack.sample_rate = sampleRate;
+            nextTrack.channels = channels;
+            nextTrack.codecAvail = true;
         }
 
-        ret1 = str_parms_get_str(parms, AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES, value, sizeof(value));
-        if (ret1 >= 0) {
-            gaplessMeta.encoderPadding = atoi(value);
-            AHAL_DBG("padding %u", gaplessMeta.encoderPadding);
-        } else {
-            gaplessMeta.encoderPadding = 0;
+        if (str_parms_has_key(parms, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES) ||
+            str_parms_has_key(parms, AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES)) {
+            ret1 = str_parms_get_str(parms, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES, value, sizeof(value));
+            if (ret1 >= 0 ) {
+                nextTrack.gaplessMeta.encoderDelay = atoi(value);
+                AHAL_DBG("new encoder delay %u", nextTrack.gaplessMeta.encoderDelay);
+            } else {
+                nextTrack.gaplessMeta.encoderDelay = 0;
+            }
+
+            ret1 = str_parms_get_str(parms, AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES, value, sizeof(value));
+            if (ret1 >= 0) {
+                nextTrack.gaplessMeta.encoderPadding = atoi(value);
+                AHAL_DBG("padding %u", nextTrack.gaplessMeta.encoderPadding);
+            } else {
+                nextTrack.gaplessMeta.encoderPadding = 0;
+            }
+            nextTrack.gaplessAvail = true;
         }
+
+        ApplyTrackBoundary();
+        // mid track, keep it for the next partial drain ready
+        if (trackBoundary)
+            CommitNextTrackMetadata();
+        else if (nextTrack.codecAvail || nextTrack.gaplessAvail)
+            AHAL_DBG("next track metadata staged");
+        stream_mutex_.unlock();
     }
 
     ret1 = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_HAC, value, sizeof(value));
@@ -2356,9 +2436,7 @@ uint64_t StreamOutPrimary::GetFramesWritten(struct timespec *timestamp)
        *timestamp = writeAt;
     }
 
-    AHAL_VERBOSE("signed frames %lld written frames %lld kernel frames %lld dsp frames %lld, bt extra frames %lld",
-                 (long long)signed_frames, (long long)written_frames, (long long)kernel_frames,
-                 (long long)dsp_frames, (long long)bt_extra_frames);
+    EventTrace::Record(EVENT_TRACE_FRAMES_WRITTEN, handle_, signed_frames, written_frames);
 
     return signed_frames;
 }
@@ -2652,8 +2730,8 @@ int StreamOutPrimary::Open() {
                           mPalOutDevice,
                           0,
                           NULL,
-                          &pal_callback,
-                          (uint64_t)this,
+                          &PalCallbackDispatcher::Post,
+                          callback_token_,
                           &pal_stream_handle_);
 
     AHAL_DBG("(%x:ret)",ret);
@@ -2692,8 +2770,8 @@ int StreamOutPrimary::Open() {
                                    hapticsDevice,
                                    0,
                                    NULL,
-                                   &pal_callback,
-                                   (uint64_t)this,
+                                   &PalCallbackDispatcher::Post,
+                                   callback_token_,
                                    &pal_haptics_stream_handle);
             if (ret)
                 AHAL_ERR("Pal Haptics Stream Open Error (%x)", ret);
@@ -2702,7 +2780,8 @@ int StreamOutPrimary::Open() {
         }
     }
     if (karaoke) {
-        ret = AudExtn.karaoke_open(mPalOutDevice[mAndroidOutDevices.size()-1].id, &pal_callback, ch_info);
+        ret = AudExtn.karaoke_open(mPalOutDevice[mAndroidOutDevices.size()-1].id,
+                                   &PalCallbackDispatcher::Post, ch_info);
         if (ret) {
             AHAL_ERR("Karaoke Open Error (%x)", ret);
             karaoke = false;
@@ -2711,25 +2790,15 @@ int StreamOutPrimary::Open() {
 
     //TODO: Remove below code, once pal_stream_open is moved to
     //adev_open_output_stream
-    if (streamAttributes_.type == PAL_STREAM_COMPRESSED) {
-        pal_param_payload *param_payload = nullptr;
-        param_payload = (pal_param_payload *) calloc (1,
-                                              sizeof(pal_param_payload) +
-                                              sizeof(pal_snd_dec_t));
-
-        if (!param_payload) {
-            AHAL_ERR("calloc failed for size %zu",
-                   sizeof(pal_param_payload) + sizeof(pal_snd_dec_t));
-        } else {
-            param_payload->payload_size = sizeof(pal_snd_dec_t);
-            memcpy(param_payload->payload, &palSndDec, param_payload->payload_size);
+    if (streamAttributes_.type == PAL_STREAM_COMPRESSED && compress_engine_) {
+        pal_param_payload *param_payload = compress_engine_->CodecPayload(&palSndDec);
 
+        if (param_payload) {
             ret = pal_stream_set_param(pal_stream_handle_,
                                        PAL_PARAM_ID_CODEC_CONFIGURATION,
                                        param_payload);
             if (ret)
                 AHAL_ERR("Pal Set Param Error (%x)", ret);
-            free(param_payload);
         }
         isCompressMetadataAvail = false;
     }
@@ -2773,6 +2842,13 @@ int StreamOutPrimary::Open() {
 
     fragment_size_ = outBufSize;
     fragments_ = outBufCount;
+    if (compress_engine_)
+        compress_engine_->SetFragments(fragments_, fragment_size_);
+    else
+        cadence_.Start(use_case_table[usecase_], handle_, true, config_.sample_rate,
+                audio_bytes_per_frame(audio_channel_count_from_out_mask(config_.channel_mask),
+                                      config_.format),
+                fragment_size_, fragments_);
 
     AHAL_DBG("fragment_size_ %d fragments_ %d", fragment_size_, fragments_);
     outBufCfg.buf_size = fragment_size_;
@@ -2886,6 +2962,26 @@ int StreamOutPrimary::GetOutputUseCase(audio_output_flags_t halStreamFlags)
     return usecase;
 }
 
+void StreamOutPrimary::UpdatePcmTaps()
+{
+    audio_format_t format = config_.format;
+    audio_channel_mask_t mask = config_.channel_mask;
+    uint32_t haptics_channels = 0;
+
+    /* what PAL is given: converted, and without the haptics channels */
+    if (halInputFormat != halOutputFormat && convertBuffer != NULL)
+        format = halOutputFormat;
+    if (usecase_ == USECASE_AUDIO_PLAYBACK_WITH_HAPTICS && pal_haptics_stream_handle) {
+        haptics_channels = audio_channel_count_from_out_mask(mask & AUDIO_CHANNEL_HAPTIC_ALL);
+        mask = (audio_channel_mask_t)(mask & ~AUDIO_CHANNEL_HAPTIC_ALL);
+    }
+    /* no haptics tap without haptics channels */
+    haptics_tap_.Update(use_case_table[usecase_], handle_, format, haptics_channels,
+                        config_.sample_rate);
+    pcm_tap_.Update(use_case_table[usecase_], handle_, format,
+                    audio_channel_count_from_out_mask(mask), config_.sample_rate);
+}
+
 ssize_t StreamOutPrimary::splitAndWriteAudioHapticsStream(const void *buffer, size_t bytes)
 {
      ssize_t ret = 0;
@@ -2941,18 +3037,25 @@ ssize_t StreamOutPrimary::splitAndWriteAudioHapticsStream(const void *buffer, si
          srcIndex += hapticsFrameSize;
      }
 
+     pcm_tap_.Write(audioBuf.buffer, audioBuf.size);
+     haptics_tap_.Write(hapticBuf.buffer, hapticBuf.size);
+
      // write audio data
+     EventTrace::Record(EVENT_TRACE_PAL_WRITE, (intptr_t)pal_stream_handle_, audioBuf.size);
      ret = pal_stream_write(pal_stream_handle_, &audioBuf);
+     EventTrace::Record(EVENT_TRACE_PAL_WRITE_DONE, (intptr_t)pal_stream_handle_, ret);
      // write haptics data
+     EventTrace::Record(EVENT_TRACE_PAL_WRITE, (intptr_t)pal_haptics_stream_handle,
+                        hapticBuf.size);
      ret = pal_stream_write(pal_haptics_stream_handle, &hapticBuf);
+     EventTrace::Record(EVENT_TRACE_PAL_WRITE_DONE, (intptr_t)pal_haptics_stream_handle, ret);
 
      return (ret < 0 ? ret : bytes);
 }
 
 ssize_t StreamOutPrimary::onWriteError(size_t bytes, ssize_t ret) {
-    // standby streams upon write failures and sleep for buffer duration.
+    // reopen streams in the background upon write failures, dropping data at real time rate meanwhile.
     AHAL_ERR("write error %d usecase(%d: %s)", ret, GetUseCase(), use_case_table[GetUseCase()]);
-    Standby();
 
     if (streamAttributes_.type != PAL_STREAM_COMPRESSED) {
         uint32_t byteWidth = streamAttributes_.out_media_config.bit_width / 8;
@@ -2962,16 +3065,30 @@ ssize_t StreamOutPrimary::onWriteError(size_t bytes, ssize_t ret) {
 
         if (frameSize == 0 || sampleRate == 0) {
             AHAL_ERR("invalid frameSize=%d, sampleRate=%d", frameSize, sampleRate);
+            Standby();
             return -EINVAL;
-        } else {
-            usleep((uint64_t)bytes * 1000000 / frameSize / sampleRate);
-            return bytes;
         }
+        if (recovery_.Start(frameSize, sampleRate, [this] { Standby(); },
+                            [this] { return ReopenAfterError(); }) == 0)
+            return recovery_.Consume(bytes);
+        Standby();
+        usleep((uint64_t)bytes * 1000000 / frameSize / sampleRate);
+        return bytes;
     }
+    Standby();
     // Return error in case of compress offload.
     return ret;
 }
 
+int StreamOutPrimary::ReopenAfterError() {
+    ssize_t ret = 0;
+
+    stream_mutex_.lock();
+    ret = configurePalOutputStream();
+    stream_mutex_.unlock();
+    return ret < 0 ? (int)ret : 0;
+}
+
 ssize_t StreamOutPrimary::configurePalOutputStream() {
     ssize_t ret = 0;
     if (!pal_stream_handle_) {
@@ -3043,57 +3160,170 @@ ssize_t StreamOutPrimary::configurePalOutputStream() {
         }
         ATRACE_END();
     }
-    if ((streamAttributes_.type == PAL_STREAM_COMPRESSED) && isCompressMetadataAvail) {
-        // Send codec params first.
-        pal_param_payload *param_payload = nullptr;
-        param_payload = (pal_param_payload *) calloc (1,
-                                              sizeof(pal_param_payload) +
-                                              sizeof(pal_snd_dec_t));
+    if (streamAttributes_.type == PAL_STREAM_COMPRESSED)
+        SendCompressMetadata();
+    return 0;
+}
 
-        if (param_payload) {
-            param_payload->payload_size = sizeof(pal_snd_dec_t);
-            memcpy(param_payload->payload, &palSndDec, param_payload->payload_size);
+void StreamOutPrimary::SendCompressMetadata()
+{
+    pal_param_payload *param_payload = nullptr;
+    bool sent = isCompressMetadataAvail || sendGaplessMetadata;
+    int ret = 0;
+
+    if (!compress_engine_ || !pal_stream_handle_)
+        return;
 
+    if (isCompressMetadataAvail) {
+        // Send codec params first.
+        param_payload = compress_engine_->CodecPayload(&palSndDec);
+        if (param_payload) {
             ret = pal_stream_set_param(pal_stream_handle_,
                                        PAL_PARAM_ID_CODEC_CONFIGURATION,
                                        param_payload);
-            if (ret) {
+            if (ret)
                 AHAL_INFO("Pal Set Param for codec configuration failed (%x)", ret);
-                ret = 0;
-            }
-            free(param_payload);
-
-        } else {
-            AHAL_ERR("calloc failed for size %zu",
-                   sizeof(pal_param_payload) + sizeof(pal_snd_dec_t));
         }
         isCompressMetadataAvail = false;
     }
 
-    if ((streamAttributes_.type == PAL_STREAM_COMPRESSED) && sendGaplessMetadata) {
-        //Send gapless metadata
-        pal_param_payload *param_payload = nullptr;
-        param_payload = (pal_param_payload *) calloc (1,
-                                          sizeof(pal_param_payload) +
-                                          sizeof(struct pal_compr_gapless_mdata));
+    if (sendGaplessMetadata) {
+        param_payload = compress_engine_->GaplessPayload(&gaplessMeta);
         if (param_payload) {
             AHAL_DBG("sending gapless metadata");
-            param_payload->payload_size = sizeof(struct pal_compr_gapless_mdata);
-            memcpy(param_payload->payload, &gaplessMeta, param_payload->payload_size);
-
             ret = pal_stream_set_param(pal_stream_handle_,
                                        PAL_PARAM_ID_GAPLESS_MDATA,
                                        param_payload);
-            if (ret) {
+            if (ret)
                 AHAL_INFO("PAL set param for gapless failed, error (%x)", ret);
-                ret = 0;
-            }
-            free(param_payload);
-        } else {
-            AHAL_ERR("Failed to allocate gapless payload");
         }
         sendGaplessMetadata = false;
     }
+    if (sent)
+        compress_engine_->OnMetadataSent();
+}
+
+bool StreamOutPrimary::CommitNextTrackMetadata()
+{
+    bool committed = false;
+
+    if (nextTrack.codecAvail) {
+        palSndDec = nextTrack.palSndDec;
+        msample_rate = nextTrack.sample_rate;
+        mchannels = nextTrack.channels;
+        isCompressMetadataAvail = true;
+        nextTrack.codecAvail = false;
+        committed = true;
+    }
+    if (nextTrack.gaplessAvail) {
+        gaplessMeta = nextTrack.gaplessMeta;
+        sendGaplessMetadata = true;
+        nextTrack.gaplessAvail = false;
+        committed = true;
+    }
+    return committed;
+}
+
+int64_t StreamOutPrimary::GetSessionTimeUs()
+{
+    pal_session_time tstamp;
+
+    if (!pal_stream_handle_ || !stream_started_)
+        return -1;
+    if (pal_get_timestamp(pal_stream_handle_, &tstamp))
+        return -1;
+    return (int64_t)((uint64_t)tstamp.session_time.value_msw << 32 |
+                     tstamp.session_time.value_lsw);
+}
+
+/*
+ * Drain() holds stream_mutex_ across pal_stream_drain, which may wait for
+ * these events, so the dispatcher never blocks on it: the track boundary is
+ * queued and applied right away only if the lock is free, otherwise by the
+ * next write or SetParameters.
+ */
+void StreamOutPrimary::OnCompressEvent(uint32_t event_id)
+{
+    switch (event_id) {
+    case PAL_STREAM_CBK_EVENT_WRITE_READY:
+        {
+            std::lock_guard<std::mutex> write_guard (write_wait_mutex_);
+            write_ready_ = true;
+            write_condition_.notify_all();
+        }
+        // the next track started rendering, close its transition
+        if (compress_engine_->WantsRenderSample() && stream_mutex_.try_lock()) {
+            compress_engine_->OnRenderSample(GetSessionTimeUs());
+            stream_mutex_.unlock();
+        }
+        break;
+    case PAL_STREAM_CBK_EVENT_DRAIN_READY:
+        {
+            std::lock_guard<std::mutex> drain_guard (drain_wait_mutex_);
+            drain_ready_ = true;
+            sendGaplessMetadata = false;
+            AHAL_DBG("received DRAIN_READY event");
+            drain_condition_.notify_all();
+        }
+        compress_engine_->OnBufferEmpty();
+        compress_engine_->CancelTransition();
+        pendingTrackBoundary.store(TRACK_BOUNDARY_DRAIN);
+        if (stream_mutex_.try_lock()) {
+            ApplyTrackBoundary();
+            stream_mutex_.unlock();
+        }
+        break;
+    case PAL_STREAM_CBK_EVENT_PARTIAL_DRAIN_READY:
+        {
+            std::lock_guard<std::mutex> drain_guard (drain_wait_mutex_);
+            drain_ready_ = true;
+            AHAL_DBG("received PARTIAL DRAIN_READY event");
+            drain_condition_.notify_all();
+        }
+        pendingTrackBoundary.store(TRACK_BOUNDARY_PARTIAL_DRAIN);
+        if (stream_mutex_.try_lock()) {
+            compress_engine_->OnPartialDrainReady(GetSessionTimeUs());
+            ApplyTrackBoundary();
+            stream_mutex_.unlock();
+        } else {
+            compress_engine_->OnPartialDrainReady(-1);
+        }
+        break;
+    case PAL_STREAM_CBK_EVENT_ERROR:
+        AHAL_DBG("received PAL_STREAM_CBK_EVENT_ERROR event");
+        break;
+    default:
+        break;
+    }
+}
+
+void StreamOutPrimary::ApplyTrackBoundary()
+{
+    int boundary = pendingTrackBoundary.exchange(TRACK_BOUNDARY_NONE);
+
+    if (boundary == TRACK_BOUNDARY_NONE)
+        return;
+    trackBoundary = true;
+    if (boundary != TRACK_BOUNDARY_PARTIAL_DRAIN)
+        return;
+    /*
+     * If SetParameters already staged the next track's metadata push it
+     * now, otherwise it goes with the first write of the next track.
+     */
+    sendGaplessMetadata = true;
+    if (CommitNextTrackMetadata())
+        SendCompressMetadata();
+}
+
+int StreamOutPrimary::Dump(int fd)
+{
+    dprintf(fd, "Output stream handle %d usecase %d: %llu bytes written\n",
+            handle_, usecase_, (unsigned long long)mBytesWritten);
+    if (compress_engine_)
+        compress_engine_->Dump(fd);
+    if (usecase_ == USECASE_AUDIO_PLAYBACK_MMAP)
+        mmap_clock_.Dump(fd);
+    cadence_.Dump(fd);
     return 0;
 }
 
@@ -3102,17 +3332,50 @@ ssize_t StreamOutPrimary::write(const void *buffer, size_t bytes)
     ssize_t ret = 0;
     struct pal_buffer palBuffer;
     uint32_t frames;
+    int64_t start_ns;
 
     palBuffer.buffer = (uint8_t*)buffer;
     palBuffer.size = bytes;
     palBuffer.offset = 0;
 
-    AHAL_VERBOSE("handle_ %x bytes:(%zu)", handle_, bytes);
+    EventTrace::Record(EVENT_TRACE_OUT_WRITE, handle_, bytes);
+
+    start_ns = CadenceMonitor::Now();
+    if (recovery_.IsActive()) {
+        /* PAL is being reopened, without holding up the client meanwhile */
+        ret = recovery_.Consume(bytes);
+        recovery_bytes_ += bytes;
+        if (stream_mutex_.try_lock()) {
+            mBytesWritten += recovery_bytes_;
+            recovery_bytes_ = 0;
+            stream_mutex_.unlock();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &writeAt);
+        return ret;
+    }
+
+    if (LatencyTest::OutputPending() && !compress_engine_ &&
+        usecase_ != USECASE_AUDIO_PLAYBACK_WITH_HAPTICS) {
+        /* the reported latency is what the measurement is checked against */
+        buffer = LatencyTest::OnWrite(this, buffer, bytes, &latency_test_buffer_,
+                config_.format,
+                audio_channel_count_from_out_mask(config_.channel_mask),
+                config_.sample_rate, use_case_table[usecase_],
+                AudioExtn::get_device_types(mAndroidOutDevices),
+                stream_->get_latency(stream_.get()));
+        palBuffer.buffer = (uint8_t *)buffer;
+    }
 
     stream_mutex_.lock();
+    mBytesWritten += recovery_bytes_;
+    recovery_bytes_ = 0;
     ret = configurePalOutputStream();
     if (ret < 0)
         goto exit;
+    if (compress_engine_ && pendingTrackBoundary.load() != TRACK_BOUNDARY_NONE)
+        ApplyTrackBoundary();
+    if (pcm_tap_.NeedsUpdate() || haptics_tap_.NeedsUpdate())
+        UpdatePcmTaps();
     ATRACE_BEGIN("hal: pal_stream_write");
     if (halInputFormat != halOutputFormat && convertBuffer != NULL) {
         if (bytes > fragment_size_) {
@@ -3136,14 +3399,25 @@ ssize_t StreamOutPrimary::write(const void *buffer, size_t bytes)
         memcpy_by_audio_format(convertBuffer, halOutputFormat, buffer, halInputFormat, frames);
         palBuffer.buffer = (uint8_t *)convertBuffer;
         palBuffer.size = frames * (outputBitWidth / 8);
+        pcm_tap_.Write(palBuffer.buffer, palBuffer.size);
+        EventTrace::Record(EVENT_TRACE_PAL_WRITE, (intptr_t)pal_stream_handle_, palBuffer.size);
         ret = pal_stream_write(pal_stream_handle_, &palBuffer);
+        EventTrace::Record(EVENT_TRACE_PAL_WRITE_DONE, (intptr_t)pal_stream_handle_, ret);
         if (ret >= 0) {
             ret = (ret * inputBitWidth) / outputBitWidth;
         }
     } else if (usecase_ == USECASE_AUDIO_PLAYBACK_WITH_HAPTICS && pal_haptics_stream_handle) {
         ret = splitAndWriteAudioHapticsStream(buffer, bytes);
     } else {
+        pcm_tap_.Write(palBuffer.buffer, palBuffer.size);
+        EventTrace::Record(EVENT_TRACE_PAL_WRITE, (intptr_t)pal_stream_handle_, palBuffer.size);
         ret = pal_stream_write(pal_stream_handle_, &palBuffer);
+        EventTrace::Record(EVENT_TRACE_PAL_WRITE_DONE, (intptr_t)pal_stream_handle_, ret);
+        if (compress_engine_) {
+            compress_engine_->OnWrite(palBuffer.size, ret);
+            if (ret > 0)
+                trackBoundary = false;
+        }
     }
     ATRACE_END();
 
@@ -3155,6 +3429,9 @@ exit:
     }
     stream_mutex_.unlock();
     clock_gettime(CLOCK_MONOTONIC, &writeAt);
+    cadence_.OnTransfer(start_ns, writeAt.tv_sec * 1000000000LL + writeAt.tv_nsec, bytes,
+                        ret < 0);
+    EventTrace::Record(EVENT_TRACE_OUT_WRITE_DONE, handle_, ret);
 
     return (ret < 0 ? onWriteError(bytes, ret) : ret);
 }
@@ -3269,6 +3546,7 @@ StreamOutPrimary::StreamOutPrimary(
     int ret = 0;
     /*Initialize the gaplessMeta value with 0*/
     memset(&gaplessMeta,0,sizeof(struct pal_compr_gapless_mdata));
+    memset(&nextTrack, 0, sizeof(nextTrack));
 
     if (!stream_) {
         AHAL_ERR("No memory allocated for stream_");
@@ -3334,6 +3612,15 @@ StreamOutPrimary::StreamOutPrimary(
     }
 
     usecase_ = GetOutputUseCase(flags);
+    if (GetPalStreamType(flags) == PAL_STREAM_COMPRESSED) {
+        compress_engine_.reset(new CompressOffloadEngine());
+        compress_engine_->Start(
+            [this](uint32_t event_id) { OnCompressEvent(event_id); },
+            [this](stream_callback_event_t event) {
+                if (client_callback)
+                    client_callback(event, NULL, client_cookie);
+            });
+    }
     if (address) {
         strlcpy((char *)&address_, address, AUDIO_DEVICE_MAX_ADDRESS_LEN);
     } else {
@@ -3428,6 +3715,9 @@ StreamOutPrimary::~StreamOutPrimary() {
     AHAL_DBG("close stream, handle(%x), pal_stream_handle (%p)",
           handle_, pal_stream_handle_);
 
+    recovery_.Stop();
+    if (compress_engine_)
+        compress_engine_->Stop();
     stream_mutex_.lock();
     if (pal_stream_handle_) {
         if (CheckOffloadEffectsType(streamAttributes_.type)) {
@@ -3503,6 +3793,7 @@ int StreamInPrimary::Stop() {
     if (usecase_ == USECASE_AUDIO_RECORD_MMAP &&
             pal_stream_handle_ && stream_started_) {
 
+        mmap_clock_.Stop();
         ret = pal_stream_stop(pal_stream_handle_);
         if (ret == 0)
             stream_started_ = false;
@@ -3520,8 +3811,10 @@ int StreamInPrimary::Start() {
             pal_stream_handle_ && !stream_started_) {
 
         ret = pal_stream_start(pal_stream_handle_);
-        if (ret == 0)
+        if (ret == 0) {
             stream_started_ = true;
+            mmap_clock_.Start(streamAttributes_.in_media_config.sample_rate);
+        }
     }
     stream_mutex_.unlock();
     AHAL_DBG("Exit ret: %d", ret);
@@ -3570,8 +3863,13 @@ int StreamInPrimary::CreateMmapBuffer(int32_t min_size_frames,
 int StreamInPrimary::GetMmapPosition(struct audio_mmap_position *position)
 {
     struct pal_mmap_position pal_mmap_pos;
+    struct timespec start, end;
     int32_t ret = 0;
 
+    if (mmap_clock_.Extrapolate(position))
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
     stream_mutex_.lock();
     if (pal_stream_handle_ == nullptr) {
         AHAL_ERR("error pal handle is null\n");
@@ -3587,30 +3885,53 @@ int StreamInPrimary::GetMmapPosition(struct audio_mmap_position *position)
     }
     position->position_frames = pal_mmap_pos.position_frames;
     position->time_nanoseconds = pal_mmap_pos.time_nanoseconds;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    mmap_clock_.Update(position, (end.tv_sec - start.tv_sec) * 1000000000LL +
+                                 end.tv_nsec - start.tv_nsec);
 
     stream_mutex_.unlock();
     return 0;
 }
 
+int StreamInPrimary::Dump(int fd)
+{
+    dprintf(fd, "Input stream handle %d usecase %d source %d\n", handle_, usecase_, source_);
+    if (usecase_ == USECASE_AUDIO_RECORD_MMAP)
+        mmap_clock_.Dump(fd);
+    cadence_.Dump(fd);
+    return 0;
+}
+
 int StreamInPrimary::Standby() {
     int ret = 0;
     std::shared_ptr<AudioDevice> adevice = AudioDevice::GetInstance();
 
     AHAL_DBG("Enter");
+    EventTrace::Record(EVENT_TRACE_IN_STANDBY, handle_);
+    /* no-op when called by the recovery itself */
+    recovery_.Stop();
+    mmap_clock_.Stop();
+    cadence_.Stop();
     stream_mutex_.lock();
-    if (pal_stream_handle_) {
-        if (!is_st_session) {
-            ret = pal_stream_stop(pal_stream_handle_);
-        } else if (audio_extn_sound_trigger_check_session_activity(this)) {
-            ret = pal_stream_set_param(pal_stream_handle_,
-                PAL_PARAM_ID_STOP_BUFFERING, nullptr);
-            if (adevice->num_va_sessions_ > 0) {
-                adevice->num_va_sessions_--;
-            }
+    if (pal_stream_handle_ && !is_st_session) {
+        ret = pal_stream_stop(pal_stream_handle_);
+    } else if (pal_stream_handle_ && audio_extn_sound_trigger_check_session_activity(this)) {
+        /* stopping buffering unblocks the PAL read of the LAB reader */
+        lab_reader_.RequestStop();
+        ret = pal_stream_set_param(pal_stream_handle_,
+            PAL_PARAM_ID_STOP_BUFFERING, nullptr);
+        if (adevice->num_va_sessions_ > 0) {
+            adevice->num_va_sessions_--;
         }
+        lab_reader_.Stop();
+    } else {
+        /* also before the first read, while pal_stream_handle_ is not set yet */
+        StopLabReader();
     }
+    capture_client_.reset();
     effects_applied_ = true;
     stream_started_ = false;
+    pcm_tap_.Reset();
 
     if (pal_stream_handle_ && !is_st_session) {
         ret = pal_stream_close(pal_stream_handle_);
@@ -3939,6 +4260,11 @@ int StreamInPrimary::RouteStream(const std::set<audio_devices_t>& new_devices, b
 
         if (pal_stream_handle_)
             ret = pal_stream_set_device(pal_stream_handle_, noPalDevices, mPalInDevice);
+        /* the other clients stay on the shared capture, attach again on next read */
+        if (capture_client_) {
+            capture_client_.reset();
+            stream_started_ = false;
+        }
 // vector+++ add for camera recording   
     }else{
 	for (int i = 0; i < mAndroidInDevices.size(); i++) {
@@ -4134,6 +4460,13 @@ int StreamInPrimary::Open() {
          }
     }
 
+    if (CaptureFanoutEligible()) {
+        ret = AttachCaptureFanout();
+        if (ret == 0)
+            goto set_buff_size;
+        AHAL_DBG("capture fan-out not available (%d), opening own session", ret);
+    }
+
     AHAL_DBG("(%x:ret)", ret);
 
     ret = pal_stream_open(&streamAttributes_,
@@ -4141,8 +4474,8 @@ int StreamInPrimary::Open() {
                          mPalInDevice,
                          0,
                          NULL,
-                         &pal_callback,
-                         (uint64_t)this,
+                         &PalCallbackDispatcher::Post,
+                         callback_token_,
                          &pal_stream_handle_);
 
     AHAL_DBG("(%x:ret)", ret);
@@ -4170,7 +4503,7 @@ set_buff_size:
     if (usecase_ == USECASE_AUDIO_RECORD_VOIP)
         inBufCount = VOIP_PERIOD_COUNT_DEFAULT;
 
-    if (!handle) {
+    if (!handle && !capture_client_) {
         inBufCfg.buf_size = inBufSize;
         inBufCfg.buf_count = inBufCount;
         ret = pal_stream_set_buffer_size(pal_stream_handle_, &inBufCfg, NULL);
@@ -4182,6 +4515,10 @@ set_buff_size:
 
     fragments_ = inBufCount;
     fragment_size_ = inBufSize;
+    cadence_.Start(use_case_table[usecase_], handle_, false, config_.sample_rate,
+            audio_bytes_per_frame(audio_channel_count_from_in_mask(config_.channel_mask),
+                                  config_.format),
+            fragment_size_, fragments_);
 
 exit:
     if (device_cap_query) {
@@ -4280,16 +4617,19 @@ int StreamInPrimary::SetMicMute(bool mute) {
         ret = pal_stream_set_mute(pal_stream_handle_, mute);
         if (ret)
             AHAL_ERR("Error applying mute %d for input session", mute);
+    } else if (capture_client_) {
+        ret = capture_client_->SetMute(mute);
+        if (ret)
+            AHAL_ERR("Error applying mute %d for shared input session", mute);
     }
     stream_mutex_.unlock();
     AHAL_DBG("Exit");
     return ret;
 }
 
-ssize_t StreamInPrimary::onReadError(size_t bytes, size_t ret) {
-    // standby streams upon read failures and sleep for buffer duration.
+ssize_t StreamInPrimary::onReadError(const void *buffer, size_t bytes, size_t ret) {
+    // reopen streams in the background upon read failures, returning silence at real time rate meanwhile.
     AHAL_ERR("read failed %d usecase(%d: %s)", ret, GetUseCase(), use_case_table[GetUseCase()]);
-    Standby();
     uint32_t byteWidth = streamAttributes_.in_media_config.bit_width / 8;
     uint32_t sampleRate = streamAttributes_.in_media_config.sample_rate;
     uint32_t channelCount = streamAttributes_.in_media_config.ch_info.channels;
@@ -4297,28 +4637,137 @@ ssize_t StreamInPrimary::onReadError(size_t bytes, size_t ret) {
 
     if (frameSize == 0 || sampleRate == 0) {
         AHAL_ERR("invalid frameSize=%d, sampleRate=%d", frameSize, sampleRate);
+        Standby();
         return -EINVAL;
-    } else {
-        usleep((uint64_t)bytes * 1000000 / frameSize / sampleRate);
     }
+    memset((void *)buffer, 0, bytes);
+    if (recovery_.Start(frameSize, sampleRate, [this] { Standby(); },
+                        [this] { return ReopenAfterError(); }) == 0)
+        return recovery_.Consume(bytes);
+    Standby();
+    usleep((uint64_t)bytes * 1000000 / frameSize / sampleRate);
     return bytes;
 }
 
+int StreamInPrimary::ReopenAfterError() {
+    int ret = 0;
+
+    stream_mutex_.lock();
+    if (!pal_stream_handle_ && !capture_client_)
+        ret = Open();
+    stream_mutex_.unlock();
+    return ret;
+}
+
+int StreamInPrimary::StartLabReader(pal_stream_handle_t *st_handle) {
+    uint32_t byteWidth = streamAttributes_.in_media_config.bit_width / 8;
+    uint32_t sampleRate = streamAttributes_.in_media_config.sample_rate;
+    uint32_t channelCount = streamAttributes_.in_media_config.ch_info.channels;
+    size_t bytesPerMs = (size_t)byteWidth * channelCount * sampleRate / 1000;
+
+    if (bytesPerMs == 0) {
+        AHAL_ERR("invalid stream attributes, byteWidth=%d, sampleRate=%d, channels=%d",
+                 byteWidth, sampleRate, channelCount);
+        return -EINVAL;
+    }
+    return lab_reader_.Start(st_handle, bytesPerMs * LAB_RING_DURATION_MSEC,
+                             bytesPerMs * AUDIO_CAPTURE_PERIOD_DURATION_MSEC);
+}
+
+void StreamInPrimary::StopLabReader() {
+    /*
+     * the reader may be blocked in pal_stream_read whether or not the session
+     * is still active, stopping buffering is what makes that read return. It
+     * is stopped on the handle the reader was started with: the reader starts
+     * at open, before pal_stream_handle_ is set by the first read.
+     */
+    if (lab_reader_.StopBuffering())
+        AHAL_ERR("failed to stop buffering for the LAB reader");
+    lab_reader_.Stop();
+}
+
+bool StreamInPrimary::CaptureFanoutEligible() {
+    return usecase_ == USECASE_AUDIO_RECORD && !is_st_session &&
+           is_pcm_format(config_.format) &&
+           (streamAttributes_.type == PAL_STREAM_DEEP_BUFFER ||
+            streamAttributes_.type == PAL_STREAM_VOICE_RECOGNITION) &&
+           property_get_bool("vendor.audio.capture.fanout.enable", false);
+}
+
+int StreamInPrimary::AttachCaptureFanout() {
+    int ret = 0;
+    CaptureFanoutKey key;
+    std::shared_ptr<AudioDevice> adevice = AudioDevice::GetInstance();
+
+    key.devices.assign(mPalInDeviceIds, mPalInDeviceIds + mAndroidInDevices.size());
+    std::sort(key.devices.begin(), key.devices.end());
+    key.custom_key = mPalInDevice[0].custom_config.custom_key;
+    key.source = source_;
+    key.type = streamAttributes_.type;
+    key.sample_rate = streamAttributes_.in_media_config.sample_rate;
+    key.channels = streamAttributes_.in_media_config.ch_info.channels;
+    key.effect_enabled = true;
+    if (isECEnabled && isNSEnabled) {
+        key.effect = PAL_AUDIO_EFFECT_ECNS;
+    } else if (isECEnabled) {
+        key.effect = PAL_AUDIO_EFFECT_EC;
+    } else if (isNSEnabled) {
+        key.effect = PAL_AUDIO_EFFECT_NS;
+    } else {
+        key.effect = PAL_AUDIO_EFFECT_ECNS;
+        key.effect_enabled = false;
+    }
+
+    /* the session captures in the format of the stream opening it */
+    ret = CaptureFanout::Attach(key, &streamAttributes_, mPalInDevice,
+                                mAndroidInDevices.size(), config_.format,
+                                config_.format, GetBufferSize(), NO_OF_BUF,
+                                adevice && adevice->mute_, &capture_client_);
+    if (ret)
+        return ret;
+
+    stream_started_ = true;
+    effects_applied_ = true;
+    return 0;
+}
+
+void StreamInPrimary::UpdatePcmTaps()
+{
+    pcm_tap_.Update(use_case_table[usecase_], handle_, config_.format,
+                    audio_channel_count_from_in_mask(config_.channel_mask), config_.sample_rate);
+}
+
 ssize_t StreamInPrimary::read(const void *buffer, size_t bytes) {
     ssize_t ret = 0;
-    int retry_count = MAX_READ_RETRY_COUNT;
     ssize_t size = 0;
     struct pal_buffer palBuffer;
+    int64_t start_ns = CadenceMonitor::Now();
 
     palBuffer.buffer = (uint8_t *)buffer;
     palBuffer.size = bytes;
     palBuffer.offset = 0;
     std::shared_ptr<AudioDevice> adevice = AudioDevice::GetInstance();
 
-    AHAL_VERBOSE("Bytes:(%zu)", bytes);
+    EventTrace::Record(EVENT_TRACE_IN_READ, handle_, bytes);
+
+    if (recovery_.IsActive()) {
+        /* PAL is being reopened, without holding up the client meanwhile */
+        memset(palBuffer.buffer, 0, palBuffer.size);
+        recovery_.Consume(bytes);
+        recovery_bytes_ += bytes;
+        if (stream_mutex_.try_lock()) {
+            mBytesRead += recovery_bytes_;
+            recovery_bytes_ = 0;
+            stream_mutex_.unlock();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &readAt);
+        return bytes;
+    }
 
     stream_mutex_.lock();
-    if (!pal_stream_handle_) {
+    mBytesRead += recovery_bytes_;
+    recovery_bytes_ = 0;
+    if (!pal_stream_handle_ && !capture_client_) {
         AutoPerfLock perfLock;
         ret = Open();
         if (ret < 0)
@@ -4327,8 +4776,8 @@ ssize_t StreamInPrimary::read(const void *buffer, size_t bytes) {
 
     if (is_st_session) {
         ATRACE_BEGIN("hal: lab read");
-        memset(palBuffer.buffer, 0, palBuffer.size);
         if (!audio_extn_sound_trigger_check_session_activity(this)) {
+            memset(palBuffer.buffer, 0, palBuffer.size);
             AHAL_DBG("sound trigger session not available");
             ATRACE_END();
             goto exit;
@@ -4337,27 +4786,42 @@ ssize_t StreamInPrimary::read(const void *buffer, size_t bytes) {
             adevice->num_va_sessions_++;
             stream_started_ = true;
         }
-        while (retry_count--) {
-            ret = pal_stream_read(pal_stream_handle_, &palBuffer);
-            if (ret < 0) {
+        /* normally started when the stream was opened, restarted after standby */
+        if (!lab_reader_.IsRunning()) {
+            ret = StartLabReader(pal_stream_handle_);
+            if (ret) {
                 memset(palBuffer.buffer, 0, palBuffer.size);
-                AHAL_ERR("error, failed to read data from PAL");
                 ATRACE_END();
                 goto exit;
-            } else {
-                size += ret;
-                if (ret < palBuffer.size) {
-                    palBuffer.buffer += ret;
-                    palBuffer.size -= ret;
-                } else {
-                    break;
-                }
             }
         }
+        ret = lab_reader_.Read(palBuffer.buffer, palBuffer.size);
+        if (ret < 0) {
+            memset(palBuffer.buffer, 0, palBuffer.size);
+            AHAL_ERR("error, failed to read data from PAL");
+        } else {
+            size = ret;
+            if (size < palBuffer.size)
+                memset(palBuffer.buffer + size, 0, palBuffer.size - size);
+        }
         ATRACE_END();
         goto exit;
     }
 
+    if (capture_client_ && !effects_applied_) {
+        /* pre-processing changed, move to a capture applying it */
+        capture_client_.reset();
+        stream_started_ = false;
+        ret = Open();
+        if (ret < 0)
+            goto exit;
+    }
+
+    if (capture_client_) {
+        ret = capture_client_->Read(palBuffer.buffer, palBuffer.size);
+        goto read_done;
+    }
+
     if (!stream_started_) {
         AutoPerfLock perfLock;
         ret = pal_stream_start(pal_stream_handle_);
@@ -4394,8 +4858,11 @@ ssize_t StreamInPrimary::read(const void *buffer, size_t bytes) {
        effects_applied_ = true;
     }
 
+    EventTrace::Record(EVENT_TRACE_PAL_READ, (intptr_t)pal_stream_handle_, palBuffer.size);
     ret = pal_stream_read(pal_stream_handle_, &palBuffer);
+    EventTrace::Record(EVENT_TRACE_PAL_READ_DONE, (intptr_t)pal_stream_handle_, ret);
 
+read_done:
 //Jessy +++
 #ifdef ASUS_AI2201_PROJECT
     if (AudioExtn::audio_devices_cmp(mAndroidInDevices, AUDIO_DEVICE_IN_BUILTIN_MIC) &&
@@ -4437,6 +4904,17 @@ ssize_t StreamInPrimary::read(const void *buffer, size_t bytes) {
         memset(palBuffer.buffer, 0, palBuffer.size);
     }
 
+    if (ret >= 0 && LatencyTest::InputPending())
+        LatencyTest::OnRead(this, palBuffer.buffer, size > 0 ? size : bytes, config_.format,
+                audio_channel_count_from_in_mask(config_.channel_mask),
+                config_.sample_rate, use_case_table[usecase_],
+                AudioExtn::get_device_types(mAndroidInDevices));
+
+    if (pcm_tap_.NeedsUpdate())
+        UpdatePcmTaps();
+    if (ret >= 0)
+        pcm_tap_.Write(palBuffer.buffer, size > 0 ? size : bytes);
+
 exit:
     if (mBytesRead <= UINT64_MAX - bytes) {
         mBytesRead += bytes;
@@ -4445,8 +4923,12 @@ exit:
     }
     stream_mutex_.unlock();
     clock_gettime(CLOCK_MONOTONIC, &readAt);
+    cadence_.OnTransfer(start_ns, readAt.tv_sec * 1000000000LL + readAt.tv_nsec, bytes,
+                        ret < 0);
+    EventTrace::Record(EVENT_TRACE_IN_READ_DONE, handle_,
+                       ret < 0 ? ret : (size > 0 ? size : bytes));
 
-    return (ret < 0 ? onReadError(bytes, ret) : (size > 0 ? size : bytes));
+    return (ret < 0 ? onReadError(buffer, bytes, ret) : (size > 0 ? size : bytes));
 }
 
 int StreamInPrimary::FillHalFnPtrs() {
@@ -4572,6 +5054,13 @@ StreamInPrimary::StreamInPrimary(audio_io_handle_t handle,
         config_.format = AUDIO_FORMAT_PCM_16_BIT;
         config_.sample_rate = streamAttributes_.in_media_config.sample_rate;
 
+        /*
+         * the capture handle is opened after a detection, start draining the
+         * keyword and look-ahead data now rather than on the first read
+         */
+        if (StartLabReader(pal_stream_handle_))
+            AHAL_ERR("failed to start LAB reader, retrying on first read");
+
         /*
          * reset pal_stream_handle in case standby come before
          * read as anyway it will be updated in StreamInPrimary::Open
@@ -4678,7 +5167,10 @@ error:
 }
 
 StreamInPrimary::~StreamInPrimary() {
+    recovery_.Stop();
     stream_mutex_.lock();
+    StopLabReader();
+    capture_client_.reset();
     if (pal_stream_handle_ && !is_st_session) {
         AHAL_DBG("close stream, pal_stream_handle (%p)",
              pal_stream_handle_);
@@ -4711,9 +5203,17 @@ StreamPrimary::StreamPrimary(audio_io_handle_t handle,
 
 StreamPrimary::~StreamPrimary(void)
 {
+    PalCallbackDispatcher::Unregister(callback_token_);
     if (volume_) {
         free(volume_);
         volume_ = NULL;
     }
 }
 
+void StreamPrimary::OnPalEvent(pal_stream_handle_t *handle, uint32_t event_id,
+                               const uint32_t *event_data __unused,
+                               uint32_t event_size __unused)
+{
+    AHAL_DBG("unhandled event %x, stream handle %p, usecase %d", event_id, handle, usecase_);
+}
+
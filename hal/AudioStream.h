@@ -42,6 +42,16 @@
 
 #include "PalDefs.h"
 #include <audio_extn/AudioExtn.h>
+#include <audio_extn/LabReader.h>
+#include <audio_extn/CaptureFanout.h>
+#include <audio_extn/StreamRecovery.h>
+#include <audio_extn/CompressOffloadEngine.h>
+#include <audio_extn/PalCallbackDispatcher.h>
+#include <audio_extn/MmapClock.h>
+#include <audio_extn/LatencyTest.h>
+#include <audio_extn/CadenceMonitor.h>
+#include <audio_extn/EventTrace.h>
+#include <audio_extn/PcmTap.h>
 #include <mutex>
 #include <map>
 
@@ -86,6 +96,8 @@
 #define MMAP_PERIOD_COUNT_DEFAULT (MMAP_PERIOD_COUNT_MAX)
 #define CODEC_BACKEND_DEFAULT_BIT_WIDTH 16
 #define AUDIO_CAPTURE_PERIOD_DURATION_MSEC 20
+/* sound trigger LAB data buffered by the HAL, on top of the DSP buffer */
+#define LAB_RING_DURATION_MSEC 2000
 
 #define LL_PERIOD_SIZE_FRAMES_160 160
 #define LL_PERIOD_SIZE_FRAMES_192 192
@@ -421,12 +433,16 @@ int adev_open(audio_hw_device_t **device);
 
 class AudioDevice;
 
-class StreamPrimary {
+class StreamPrimary : public PalCallbackTarget {
 public:
     StreamPrimary(audio_io_handle_t handle,
         const std::set<audio_devices_t> &devices,
         struct audio_config *config);
     virtual ~StreamPrimary();
+    void OnPalEvent(pal_stream_handle_t *handle, uint32_t event_id,
+                    const uint32_t *event_data, uint32_t event_size) override;
+    /* PAL callback cookie, see PalCallbackDispatcher */
+    uint64_t callback_token_ = 0;
     uint32_t        GetSampleRate();
     uint32_t        GetBufferSize();
     audio_format_t  GetFormat();
@@ -463,6 +479,14 @@ protected:
     struct pal_volume_data *volume_; /* used to cache volume */
     std::map <audio_devices_t, pal_device_id_t> mAndroidDeviceMap;
     int mmap_shared_memory_fd;
+    /* reopens PAL after a read or write error, see onWriteError/onReadError */
+    StreamRecovery recovery_;
+    /* bytes consumed during the recovery, not yet added to the stream position */
+    uint64_t recovery_bytes_ = 0;
+    /* answers most MMAP position queries without reading PAL */
+    MmapClock mmap_clock_;
+    /* flags late, slow and starved PCM writes or reads */
+    CadenceMonitor cadence_;
 
 // ASUS BSP : OZO porting +++
     void *ozo_effect = nullptr;
@@ -473,8 +497,20 @@ class StreamOutPrimary : public StreamPrimary {
 private:
     // Helper function for write to open pal stream & configure.
     ssize_t configurePalOutputStream();
-    //Helper method to standby streams upon write failures and sleep for buffer duration.
+    //Helper method to recover streams upon write failures, dropping data at real time rate meanwhile.
     ssize_t onWriteError(size_t bytes, ssize_t ret);
+    //Reopens and starts the stream from the recovery worker.
+    int ReopenAfterError();
+    //Sends pending codec config and gapless metadata, stream_mutex_ held.
+    void SendCompressMetadata();
+    //Makes the staged next track metadata current, stream_mutex_ held.
+    bool CommitNextTrackMetadata();
+    //Applies a drain ready queued by the event dispatcher, stream_mutex_ held.
+    void ApplyTrackBoundary();
+    //PAL session time in us, -1 if unavailable, stream_mutex_ held.
+    int64_t GetSessionTimeUs();
+    //Follows pcm_tap changes for the PCM taps, stream_mutex_ held.
+    void UpdatePcmTaps();
     struct pal_device* mPalOutDevice;
     pal_device_id_t* mPalOutDeviceIds;
     std::set<audio_devices_t> mAndroidOutDevices;
@@ -494,6 +530,11 @@ public:
     ~StreamOutPrimary();
     bool sendGaplessMetadata = true;
     bool isCompressMetadataAvail = false;
+    std::unique_ptr<CompressOffloadEngine> compress_engine_;
+    void OnPalEvent(pal_stream_handle_t *handle, uint32_t event_id,
+                    const uint32_t *event_data, uint32_t event_size) override;
+    void OnCompressEvent(uint32_t event_id);
+    int Dump(int fd);
     int Standby();
     int SetVolume(float left, float right);
     uint64_t GetFramesWritten(struct timespec *timestamp);
@@ -536,6 +577,24 @@ protected:
     uint32_t fragment_size_ = 0;
     pal_snd_dec_t palSndDec;
     struct pal_compr_gapless_mdata gaplessMeta;
+    //Next track metadata received while the current track plays.
+    struct {
+        pal_snd_dec_t palSndDec;
+        struct pal_compr_gapless_mdata gaplessMeta;
+        uint32_t sample_rate;
+        uint16_t channels;
+        bool codecAvail;
+        bool gaplessAvail;
+    } nextTrack;
+    //No data of the current track written yet, metadata applies right away.
+    bool trackBoundary = true;
+    //Drain ready seen by the event dispatcher, applied under stream_mutex_.
+    enum {
+        TRACK_BOUNDARY_NONE,
+        TRACK_BOUNDARY_DRAIN,
+        TRACK_BOUNDARY_PARTIAL_DRAIN,
+    };
+    std::atomic<int> pendingTrackBoundary{TRACK_BOUNDARY_NONE};
     uint32_t msample_rate;
     uint16_t mchannels;
     std::shared_ptr<audio_stream_out>   stream_;
@@ -545,6 +604,8 @@ protected:
     visualizer_hal_start_output fnp_visualizer_start_output_ = nullptr;
     visualizer_hal_stop_output fnp_visualizer_stop_output_ = nullptr;
     void *convertBuffer;
+    //Carries the latency test burst to PAL, only touched by write.
+    std::vector<uint8_t> latency_test_buffer_;
     //Haptics Usecase
     struct pal_stream_attributes hapticsStreamAttributes;
     pal_stream_handle_t* pal_haptics_stream_handle;
@@ -552,6 +613,9 @@ protected:
     struct pal_device* hapticsDevice;
     uint8_t* hapticBuffer;
     size_t hapticsBufSize;
+    //Copies of the PCM written to PAL, see PcmTap; stream_mutex_ held.
+    PcmTapSlot pcm_tap_{PcmTap::POINT_OUT};
+    PcmTapSlot haptics_tap_{PcmTap::POINT_HAPTICS};
 
     int FillHalFnPtrs();
     friend class AudioDevice;
@@ -564,8 +628,19 @@ private:
      pal_device_id_t* mPalInDeviceIds;
      std::set<audio_devices_t> mAndroidInDevices;
      bool mInitialized;
-    //Helper method to standby streams upon read failures and sleep for buffer duration.
-    ssize_t onReadError(size_t bytes, size_t ret);
+    //Helper method to recover streams upon read failures, returning silence at real time rate meanwhile.
+    ssize_t onReadError(const void *buffer, size_t bytes, size_t ret);
+    //Reopens the stream from the recovery worker.
+    int ReopenAfterError();
+    //Starts draining the LAB data of the sound trigger session.
+    int StartLabReader(pal_stream_handle_t *st_handle);
+    //Stops buffering to unblock the LAB reader and joins it, stream_mutex_ held.
+    void StopLabReader();
+    //Shares the capture of other streams recording the same devices and source.
+    bool CaptureFanoutEligible();
+    int AttachCaptureFanout();
+    //Follows pcm_tap changes for the PCM tap, stream_mutex_ held.
+    void UpdatePcmTaps();
 public:
     StreamInPrimary(audio_io_handle_t handle,
                     const std::set<audio_devices_t> &devices,
@@ -591,9 +666,13 @@ public:
     int addRemoveAudioEffect(const struct audio_stream *stream, effect_handle_t effect,bool enable);
     int SetParameters(const char *kvpairs);
     bool is_st_session;
+    /* sound trigger session registry generation st_session_active_ is valid for */
+    uint32_t st_session_generation_ = 0;
+    bool st_session_active_ = false;
     audio_input_flags_t                 flags_;
     int CreateMmapBuffer(int32_t min_size_frames, struct audio_mmap_buffer_info *info);
     int GetMmapPosition(struct audio_mmap_position *position);
+    int Dump(int fd);
     bool isDeviceAvailable(pal_device_id_t deviceId);
     int RouteStream(const std::set<audio_devices_t>& new_devices, bool force_device_switch = false);
     int64_t GetSourceLatency(audio_input_flags_t halStreamFlags);
@@ -611,6 +690,10 @@ protected:
     bool isECEnabled = false;
     bool isNSEnabled = false;
     bool effects_applied_ = true;
+    LabReader lab_reader_;
+    std::unique_ptr<CaptureFanoutClient> capture_client_;
+    //Copy of the PCM returned to the client, see PcmTap; stream_mutex_ held.
+    PcmTapSlot pcm_tap_{PcmTap::POINT_IN};
 #ifdef ASUS_AI2201_PROJECT
     int totalMuteBytes;//Jessy +++
 #endif
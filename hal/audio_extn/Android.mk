@@ -110,3 +110,43 @@ LOCAL_SHARED_LIBRARIES := \
 LOCAL_STATIC_LIBRARIES := libhealthhalutils
 
 include $(BUILD_SHARED_LIBRARY)
+
+#-------------------------------------------
+#            Build HAL_TRACE_DECODE
+#-------------------------------------------
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hal_trace_decode
+
+LOCAL_SRC_FILES:= EventTraceDecode.cpp
+
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror
+
+include $(BUILD_HOST_EXECUTABLE)
+
+#-------------------------------------------
+#            Build HAL_TRACE_STRESS
+#-------------------------------------------
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hal_trace_stress
+
+LOCAL_SRC_FILES:= \
+    EventTrace.cpp \
+    EventTraceStress.cpp
+
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror
+
+LOCAL_C_INCLUDES := \
+    vendor/qcom/opensource/audio-hal/primary-hal/hal \
+    vendor/qcom/opensource/audio-hal/primary-hal/hal/audio_extn
+
+LOCAL_STATIC_LIBRARIES := \
+    libcutils \
+    liblog
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: CadenceMonitor"
+#define ATRACE_TAG (ATRACE_TAG_AUDIO | ATRACE_TAG_HAL)
+/* #define LOG_NDEBUG 0 */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <cutils/properties.h>
+#include <utils/Trace.h>
+
+#include "AudioCommon.h"
+#include "CadenceMonitor.h"
+
+#define CADENCE_TOLERANCE_PCT_DEFAULT 50
+
+static const char * const incident_names[] = {
+    "late", "slow", "underrun", "overrun", "error",
+};
+
+int64_t CadenceMonitor::Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void CadenceMonitor::Start(const char *usecase, int handle, bool playback,
+                           uint32_t sample_rate, uint32_t frame_size,
+                           uint32_t period_bytes, uint32_t periods)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    int32_t tolerance_pct = property_get_int32("vendor.audio.cadence.tolerance_pct",
+                                               CADENCE_TOLERANCE_PCT_DEFAULT);
+    uint32_t period_frames = frame_size ? period_bytes / frame_size : 0;
+
+    running_ = false;
+    if (!sample_rate || !period_frames || !periods) {
+        started_ = false;
+        return;
+    }
+    trace_name_ = std::string("AHAL cadence ") + usecase + " " + std::to_string(handle);
+    playback_ = playback;
+    frame_size_ = frame_size;
+    frames_per_ns_ = (double)sample_rate / 1000000000;
+    period_ns_ = (int64_t)period_frames * 1000000000 / sample_rate;
+    tolerance_ns_ = period_ns_ * std::max(tolerance_pct, 0) / 100;
+    capacity_frames_ = (double)period_frames * periods;
+    started_ = true;
+    AHAL_DBG("%s: period %u frames x %u at %u Hz, tolerance %d%%", trace_name_.c_str(),
+             period_frames, periods, sample_rate, tolerance_pct);
+}
+
+void CadenceMonitor::Stop()
+{
+    std::lock_guard<std::mutex> lock(lock_);
+
+    running_ = false;
+}
+
+void CadenceMonitor::Report(Incident incident, int64_t time_ns, int64_t value_ns)
+{
+    auto &entry = history_[incidents_ % CADENCE_MONITOR_INCIDENTS];
+
+    entry.incident = incident;
+    entry.time_ns = time_ns;
+    entry.value_ns = value_ns;
+    incidents_++;
+    counts_[incident]++;
+    ATRACE_INT(trace_name_.c_str(), incident + 1);
+}
+
+void CadenceMonitor::OnTransfer(int64_t start_ns, int64_t end_ns, size_t bytes,
+                                bool failed)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    uint64_t incidents = incidents_;
+    int64_t duration_ns = end_ns - start_ns, xrun_ns;
+    double level, frames;
+
+    if (!started_)
+        return;
+    frames = bytes / frame_size_;
+
+    transfers_++;
+    if (failed) {
+        /* PAL is reopened, the model restarts with it */
+        Report(INCIDENT_ERROR, end_ns, duration_ns);
+        running_ = false;
+        return;
+    }
+
+    level = running_ ? level_frames_ : 0;
+    if (running_) {
+        int64_t gap_ns = start_ns - last_start_ns_;
+        double idle_frames = (start_ns - last_end_ns_) * frames_per_ns_;
+
+        gap_max_ns_ = std::max(gap_max_ns_, gap_ns);
+        if (gap_ns > last_duration_ns_ + tolerance_ns_)
+            Report(INCIDENT_LATE, start_ns, gap_ns - last_duration_ns_);
+
+        if (playback_) {
+            level -= idle_frames;
+            if (level < 0) {
+                xrun_ns = (int64_t)(-level / frames_per_ns_);
+                Report(INCIDENT_UNDERRUN,
+                       last_end_ns_ + (int64_t)(level_frames_ / frames_per_ns_), xrun_ns);
+                xrun_total_ns_ += xrun_ns;
+                level = 0;
+            }
+        } else {
+            level += idle_frames;
+            if (level > capacity_frames_) {
+                xrun_ns = (int64_t)((level - capacity_frames_) / frames_per_ns_);
+                Report(INCIDENT_OVERRUN, last_end_ns_ +
+                       (int64_t)((capacity_frames_ - level_frames_) / frames_per_ns_), xrun_ns);
+                xrun_total_ns_ += xrun_ns;
+                level = capacity_frames_;
+            }
+        }
+    }
+
+    duration_max_ns_ = std::max(duration_max_ns_, duration_ns);
+    if (duration_ns > period_ns_ + tolerance_ns_)
+        Report(INCIDENT_SLOW, start_ns, duration_ns);
+
+    /* a blocking transfer leaves the buffer full (playback) or empty (capture) */
+    if (playback_)
+        level = std::max(level - duration_ns * frames_per_ns_, 0.0) + frames;
+    else
+        level = std::max(level + duration_ns * frames_per_ns_ - frames, 0.0);
+    level_frames_ = std::min(level, capacity_frames_);
+
+    /* the counter goes back to 0 on the first clean transfer */
+    if (incidents == incidents_ && traced_) {
+        ATRACE_INT(trace_name_.c_str(), 0);
+        traced_ = false;
+    } else if (incidents != incidents_) {
+        traced_ = true;
+    }
+
+    last_start_ns_ = start_ns;
+    last_end_ns_ = end_ns;
+    last_duration_ns_ = (int64_t)(frames / frames_per_ns_);
+    running_ = true;
+}
+
+void CadenceMonitor::Dump(int fd)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    uint64_t first;
+
+    if (!started_)
+        return;
+
+    dprintf(fd, "  cadence: %s, period %.2f ms, tolerance %.2f ms\n",
+            running_ ? "running" : "stopped", period_ns_ / 1000000.0,
+            tolerance_ns_ / 1000000.0);
+    dprintf(fd, "    transfers %llu, late %llu, slow %llu, %s %llu, errors %llu\n",
+            (unsigned long long)transfers_, (unsigned long long)counts_[INCIDENT_LATE],
+            (unsigned long long)counts_[INCIDENT_SLOW],
+            playback_ ? "estimated underruns" : "estimated overruns",
+            (unsigned long long)counts_[playback_ ? INCIDENT_UNDERRUN : INCIDENT_OVERRUN],
+            (unsigned long long)counts_[INCIDENT_ERROR]);
+    dprintf(fd, "    max gap %.2f ms, max duration %.2f ms, estimated %s time %.2f ms\n",
+            gap_max_ns_ / 1000000.0, duration_max_ns_ / 1000000.0,
+            playback_ ? "underrun" : "overrun", xrun_total_ns_ / 1000000.0);
+
+    first = incidents_ > CADENCE_MONITOR_INCIDENTS ?
+            incidents_ - CADENCE_MONITOR_INCIDENTS : 0;
+    for (uint64_t i = first; i < incidents_; i++) {
+        auto &entry = history_[i % CADENCE_MONITOR_INCIDENTS];
+
+        dprintf(fd, "    %lld.%06lld %s %.2f ms\n",
+                (long long)(entry.time_ns / 1000000000),
+                (long long)(entry.time_ns % 1000000000 / 1000),
+                incident_names[entry.incident], entry.value_ns / 1000000.0);
+    }
+}
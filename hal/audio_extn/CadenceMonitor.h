@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_CADENCE_MONITOR_H
+#define AUDIO_EXTN_CADENCE_MONITOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <mutex>
+#include <string>
+
+#define CADENCE_MONITOR_INCIDENTS 16
+
+/*
+ * Write or read cadence of a PCM stream.
+ *
+ * Knowing the period and period count the stream opened PAL with, the
+ * monitor follows how full the PAL buffer should be: it drains (playback) or
+ * fills (capture) at the nominal rate between transfers. A playback buffer
+ * found empty at a write is an estimated underrun, a capture buffer found
+ * over full at a read an estimated overrun. Transfers starting later than
+ * the data of the previous one lasts, plus a tolerance, and transfers
+ * blocking longer than a period plus that tolerance are flagged too. The
+ * last incidents are kept for the dump and each one bumps an atrace counter.
+ */
+class CadenceMonitor {
+public:
+    enum Incident {
+        INCIDENT_LATE,     /* transfer started late */
+        INCIDENT_SLOW,     /* transfer blocked too long */
+        INCIDENT_UNDERRUN, /* playback buffer ran dry */
+        INCIDENT_OVERRUN,  /* capture buffer overflowed */
+        INCIDENT_ERROR,    /* transfer failed */
+    };
+
+    /*
+     * arms the monitor for a PCM stream opened with periods of period_bytes,
+     * reads vendor.audio.cadence.tolerance_pct
+     */
+    void Start(const char *usecase, int handle, bool playback, uint32_t sample_rate,
+               uint32_t frame_size, uint32_t period_bytes, uint32_t periods);
+    /* the stream paused or went to standby, the next transfer restarts the model */
+    void Stop();
+    /* accounts a write or read of bytes that ran from start_ns to end_ns */
+    void OnTransfer(int64_t start_ns, int64_t end_ns, size_t bytes, bool failed);
+    void Dump(int fd);
+
+    static int64_t Now();
+
+private:
+    void Report(Incident incident, int64_t time_ns, int64_t value_ns);
+
+    std::mutex lock_;
+    bool started_ = false;
+    bool running_ = false;
+    bool playback_ = true;
+    /* the atrace counter shows an incident */
+    bool traced_ = false;
+    std::string trace_name_;
+    uint32_t frame_size_ = 0;
+    double frames_per_ns_ = 0;
+    int64_t period_ns_ = 0;
+    int64_t tolerance_ns_ = 0;
+    double capacity_frames_ = 0;
+    /* model: frames in the PAL buffer at last_end_ns_ */
+    double level_frames_ = 0;
+    int64_t last_start_ns_ = 0;
+    int64_t last_end_ns_ = 0;
+    int64_t last_duration_ns_ = 0; /* data duration of the last transfer */
+
+    /* statistics */
+    uint64_t transfers_ = 0;
+    uint64_t counts_[INCIDENT_ERROR + 1] = {};
+    uint64_t incidents_ = 0;
+    int64_t gap_max_ns_ = 0;
+    int64_t duration_max_ns_ = 0;
+    int64_t xrun_total_ns_ = 0;
+    struct {
+        Incident incident;
+        int64_t time_ns;
+        int64_t value_ns;
+    } history_[CADENCE_MONITOR_INCIDENTS];
+};
+
+#endif /* AUDIO_EXTN_CADENCE_MONITOR_H */
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: CaptureFanout"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <system/thread_defs.h>
+#include <audio_utils/format.h>
+
+#include <algorithm>
+
+#include "AudioCommon.h"
+#include "CaptureFanout.h"
+
+/* periods buffered for the clients, the slowest one may lag behind by all but one */
+#define CAPTURE_FANOUT_RING_PERIODS 8
+
+class CaptureFanoutSession {
+public:
+    CaptureFanoutSession(const CaptureFanoutKey &key, audio_format_t format)
+        : key_(key), format_(format) {}
+    ~CaptureFanoutSession();
+    int Open(struct pal_stream_attributes *attributes, struct pal_device *devices,
+             uint32_t num_devices, size_t period_bytes, uint32_t periods, bool mute);
+    void Close();
+    void ReaderLoop();
+    void WaitForData(uint64_t position);
+
+    CaptureFanoutKey key_;
+    audio_format_t format_;
+    size_t frame_size_ = 0;
+    pal_stream_handle_t *handle_ = nullptr;
+    uint8_t *ring_ = nullptr;
+    size_t ring_size_ = 0;
+    size_t period_size_ = 0;
+    /* bytes captured so far, the ring holds the last ring_size_ - period_size_ of them */
+    std::atomic<uint64_t> head_{0};
+    std::atomic<bool> exit_{false};
+    std::atomic<bool> done_{false};
+    std::atomic<int> error_{0};
+    std::mutex wait_mutex_;
+    std::condition_variable data_cond_;
+    std::atomic<int> waiters_{0};
+    std::thread thread_;
+    /* attached clients, guarded by fanout_lock */
+    int clients_ = 0;
+    int max_clients_ = 0;
+    uint64_t pal_reads_ = 0;
+};
+
+static std::mutex fanout_lock;
+static std::vector<std::shared_ptr<CaptureFanoutSession>> fanout_sessions;
+
+bool CaptureFanoutKey::operator==(const CaptureFanoutKey &other) const
+{
+    return devices == other.devices && custom_key == other.custom_key &&
+           source == other.source && type == other.type &&
+           sample_rate == other.sample_rate && channels == other.channels &&
+           effect == other.effect && effect_enabled == other.effect_enabled;
+}
+
+CaptureFanoutSession::~CaptureFanoutSession()
+{
+    Close();
+    free(ring_);
+}
+
+int CaptureFanoutSession::Open(struct pal_stream_attributes *attributes,
+                               struct pal_device *devices, uint32_t num_devices,
+                               size_t period_bytes, uint32_t periods, bool mute)
+{
+    struct pal_buffer_config bufCfg = {0, 0, 0};
+    int ret;
+
+    frame_size_ = audio_bytes_per_frame(key_.channels, format_);
+    if (frame_size_ == 0 || period_bytes < frame_size_)
+        return -EINVAL;
+
+    ret = pal_stream_open(attributes, num_devices, devices, 0, NULL, NULL, 0, &handle_);
+    if (ret) {
+        AHAL_ERR("Pal Stream Open Error (%x)", ret);
+        handle_ = nullptr;
+        return -EINVAL;
+    }
+
+    bufCfg.buf_size = period_bytes;
+    bufCfg.buf_count = periods;
+    ret = pal_stream_set_buffer_size(handle_, &bufCfg, NULL);
+    if (ret) {
+        AHAL_ERR("Pal Stream set buffer size Error (%x)", ret);
+    } else {
+        period_bytes = bufCfg.buf_size;
+    }
+    period_size_ = period_bytes - period_bytes % frame_size_;
+
+    ring_size_ = period_size_ * CAPTURE_FANOUT_RING_PERIODS;
+    ring_ = (uint8_t *)malloc(ring_size_);
+    if (!ring_) {
+        AHAL_ERR("failed to allocate %zu bytes capture ring", ring_size_);
+        ret = -ENOMEM;
+        goto close;
+    }
+
+    ret = pal_stream_start(handle_);
+    if (ret) {
+        AHAL_ERR("failed to start stream. ret=%d", ret);
+        ret = -EINVAL;
+        goto close;
+    }
+    if (mute)
+        pal_stream_set_mute(handle_, mute);
+    ret = pal_add_remove_effect(handle_, key_.effect, key_.effect_enabled);
+    if (ret)
+        AHAL_ERR("Pal effect %d enable %d Error (%x)", key_.effect, key_.effect_enabled, ret);
+
+    thread_ = std::thread(&CaptureFanoutSession::ReaderLoop, this);
+    AHAL_DBG("opened source %d rate %u channels %u, ring %zu bytes, period %zu bytes",
+             key_.source, key_.sample_rate, key_.channels, ring_size_, period_size_);
+    return 0;
+
+close:
+    pal_stream_close(handle_);
+    handle_ = nullptr;
+    return ret;
+}
+
+void CaptureFanoutSession::Close()
+{
+    if (!handle_)
+        return;
+
+    exit_.store(true);
+    if (thread_.joinable())
+        thread_.join();
+    pal_stream_stop(handle_);
+    pal_stream_close(handle_);
+    handle_ = nullptr;
+    AHAL_DBG("closed source %d: %llu PAL reads, %llu bytes, up to %d clients",
+             key_.source, (unsigned long long)pal_reads_,
+             (unsigned long long)head_.load(), max_clients_);
+}
+
+void CaptureFanoutSession::ReaderLoop()
+{
+    struct pal_buffer palBuffer;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+
+    while (!exit_.load()) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        size_t offset = head % ring_size_;
+
+        /*
+         * PAL writes the period ahead of head_, which clients only read once it
+         * has been published, and which overwrites the oldest period they may
+         * still be copying: they check for that after their copy.
+         */
+        memset(&palBuffer, 0, sizeof(palBuffer));
+        palBuffer.buffer = ring_ + offset;
+        palBuffer.size = std::min(period_size_, ring_size_ - offset);
+        ssize_t ret = pal_stream_read(handle_, &palBuffer);
+        if (ret < 0) {
+            AHAL_ERR("failed to read from PAL, ret %zd", ret);
+            error_.store((int)ret);
+            break;
+        }
+        if (ret == 0)
+            continue;
+        pal_reads_++;
+        head_.store(head + ret, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load() > 0) {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            data_cond_.notify_all();
+        }
+    }
+
+    done_.store(true);
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    data_cond_.notify_all();
+}
+
+void CaptureFanoutSession::WaitForData(uint64_t position)
+{
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+
+    waiters_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    data_cond_.wait(lock, [&] {
+        return head_.load() != position || done_.load();
+    });
+    waiters_--;
+}
+
+CaptureFanoutClient::CaptureFanoutClient(std::shared_ptr<CaptureFanoutSession> session,
+                                         audio_format_t format)
+    : session_(session), format_(format),
+      position_(session->head_.load(std::memory_order_acquire))
+{
+}
+
+CaptureFanoutClient::~CaptureFanoutClient()
+{
+    bool last;
+
+    AHAL_DBG("detached from source %d: %llu bytes read, %llu overruns, %llu bytes lost",
+             session_->key_.source, (unsigned long long)bytes_read_,
+             (unsigned long long)overruns_, (unsigned long long)bytes_lost_);
+
+    {
+        std::lock_guard<std::mutex> lock(fanout_lock);
+        last = --session_->clients_ == 0;
+        if (last)
+            fanout_sessions.erase(std::find(fanout_sessions.begin(),
+                                            fanout_sessions.end(), session_));
+    }
+    if (last)
+        session_->Close();
+}
+
+ssize_t CaptureFanoutClient::Read(void *buffer, size_t bytes)
+{
+    CaptureFanoutSession *ses = session_.get();
+    size_t frames, wanted, copied = 0;
+    uint64_t window = ses->ring_size_ - ses->period_size_;
+    uint64_t head, oldest;
+    uint8_t *dst;
+
+    frames = bytes / audio_bytes_per_frame(ses->key_.channels, format_);
+    wanted = frames * ses->frame_size_;
+    if (format_ == ses->format_) {
+        dst = (uint8_t *)buffer;
+    } else {
+        if (convert_buf_.size() < wanted)
+            convert_buf_.resize(wanted);
+        dst = convert_buf_.data();
+    }
+
+    while (copied < wanted) {
+        head = ses->head_.load(std::memory_order_acquire);
+        if (head == position_) {
+            if (ses->done_.load())
+                return ses->error_.load() < 0 ? ses->error_.load() : -EIO;
+            ses->WaitForData(position_);
+            continue;
+        }
+
+        oldest = head > window ? head - window : 0;
+        if (position_ < oldest) {
+            overruns_++;
+            bytes_lost_ += oldest - position_;
+            position_ = oldest;
+        }
+
+        size_t n = std::min((size_t)(head - position_), wanted - copied);
+        size_t offset = position_ % ses->ring_size_;
+        size_t first = std::min(n, ses->ring_size_ - offset);
+        memcpy(dst + copied, ses->ring_ + offset, first);
+        memcpy(dst + copied + first, ses->ring_, n - first);
+
+        /* drop the copy if PAL overwrote part of it meanwhile */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        head = ses->head_.load(std::memory_order_relaxed);
+        if (head > window && position_ < head - window) {
+            overruns_++;
+            bytes_lost_ += head - window - position_;
+            position_ = head - window;
+            continue;
+        }
+        position_ += n;
+        copied += n;
+    }
+
+    if (dst != buffer)
+        memcpy_by_audio_format(buffer, format_, dst, ses->format_,
+                               frames * ses->key_.channels);
+    bytes_read_ += bytes;
+    return bytes;
+}
+
+int CaptureFanoutClient::SetMute(bool mute)
+{
+    return pal_stream_set_mute(session_->handle_, mute);
+}
+
+int CaptureFanout::Attach(const CaptureFanoutKey &key,
+                          struct pal_stream_attributes *attributes,
+                          struct pal_device *devices, uint32_t num_devices,
+                          audio_format_t session_format, audio_format_t client_format,
+                          size_t period_bytes, uint32_t periods, bool mute,
+                          std::unique_ptr<CaptureFanoutClient> *client)
+{
+    std::shared_ptr<CaptureFanoutSession> session;
+    int ret;
+
+    if (!audio_is_linear_pcm(session_format) || !audio_is_linear_pcm(client_format))
+        return -EINVAL;
+
+    std::lock_guard<std::mutex> lock(fanout_lock);
+    for (auto &ses : fanout_sessions) {
+        if (ses->key_ == key && !ses->done_.load()) {
+            session = ses;
+            break;
+        }
+    }
+
+    if (!session) {
+        session = std::make_shared<CaptureFanoutSession>(key, session_format);
+        ret = session->Open(attributes, devices, num_devices, period_bytes, periods, mute);
+        if (ret)
+            return ret;
+        fanout_sessions.push_back(session);
+    }
+
+    session->clients_++;
+    session->max_clients_ = std::max(session->max_clients_, session->clients_);
+    client->reset(new CaptureFanoutClient(session, client_format));
+    AHAL_DBG("attached to source %d, %d clients", key.source, session->clients_);
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_CAPTURE_FANOUT_H
+#define AUDIO_EXTN_CAPTURE_FANOUT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <system/audio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PalApi.h"
+
+/*
+ * Serves several input streams from one PAL capture session.
+ *
+ * Input streams recording the same devices and source at the same rate and
+ * channel count attach to a shared session instead of opening their own. The
+ * session thread reads PAL into a ring buffer written by that thread only;
+ * each client keeps its own read position, never blocks the writer and counts
+ * the data it lost when it fell more than a ring behind. Clients may ask for a
+ * different PCM format than the session captures, the conversion is done on
+ * their side of the ring.
+ */
+struct CaptureFanoutKey {
+    std::vector<pal_device_id_t> devices;
+    std::string custom_key;
+    audio_source_t source;
+    pal_stream_type_t type;
+    uint32_t sample_rate;
+    uint32_t channels;
+    /* pre-processing applied on the capture, enabled or removed as a whole */
+    pal_audio_effect_t effect;
+    bool effect_enabled;
+
+    bool operator==(const CaptureFanoutKey &other) const;
+};
+
+class CaptureFanoutSession;
+
+class CaptureFanoutClient {
+public:
+    ~CaptureFanoutClient();
+    /*
+     * copies bytes of capture in the client format, waiting for them to be
+     * captured. Returns bytes, or the PAL error once the session failed.
+     */
+    ssize_t Read(void *buffer, size_t bytes);
+    /* mic mute is device wide, it is applied to the whole session */
+    int SetMute(bool mute);
+
+private:
+    friend class CaptureFanout;
+    CaptureFanoutClient(std::shared_ptr<CaptureFanoutSession> session,
+                        audio_format_t format);
+
+    std::shared_ptr<CaptureFanoutSession> session_;
+    audio_format_t format_;
+    /* session data read when format_ differs from the session format */
+    std::vector<uint8_t> convert_buf_;
+    uint64_t position_;
+    /* statistics, logged on detach */
+    uint64_t bytes_read_ = 0;
+    uint64_t overruns_ = 0;
+    uint64_t bytes_lost_ = 0;
+};
+
+class CaptureFanout {
+public:
+    /*
+     * attaches to the session matching key, or opens one with the given stream
+     * attributes, devices and buffer configuration when there is none yet.
+     * Dropping the client detaches it, the last one closes the session.
+     */
+    static int Attach(const CaptureFanoutKey &key,
+                      struct pal_stream_attributes *attributes,
+                      struct pal_device *devices, uint32_t num_devices,
+                      audio_format_t session_format, audio_format_t client_format,
+                      size_t period_bytes, uint32_t periods, bool mute,
+                      std::unique_ptr<CaptureFanoutClient> *client);
+};
+
+#endif /* AUDIO_EXTN_CAPTURE_FANOUT_H */
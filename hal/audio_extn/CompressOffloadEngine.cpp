@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: CompressOffloadEngine"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <system/thread_defs.h>
+
+#include <algorithm>
+
+#include "AudioCommon.h"
+#include "CompressOffloadEngine.h"
+
+/* events kept as flags on a full queue, in the order they are delivered */
+static const uint32_t compress_pending_events[] = {
+    PAL_STREAM_CBK_EVENT_WRITE_READY,
+    PAL_STREAM_CBK_EVENT_PARTIAL_DRAIN_READY,
+    PAL_STREAM_CBK_EVENT_DRAIN_READY,
+    PAL_STREAM_CBK_EVENT_ERROR,
+};
+
+static uint32_t compress_pending_bit(uint32_t pal_event_id)
+{
+    for (uint32_t i = 0; i < sizeof(compress_pending_events) / sizeof(uint32_t); i++) {
+        if (compress_pending_events[i] == pal_event_id)
+            return 1 << i;
+    }
+    return 0;
+}
+
+static uint64_t compress_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+CompressOffloadEngine::CompressOffloadEngine()
+{
+    for (uint32_t i = 0; i < COMPRESS_EVENT_QUEUE_SIZE; i++)
+        queue_[i].seq.store(i, std::memory_order_relaxed);
+
+    codec_payload_ = (pal_param_payload *)calloc(1,
+            sizeof(pal_param_payload) + sizeof(pal_snd_dec_t));
+    gapless_payload_ = (pal_param_payload *)calloc(1,
+            sizeof(pal_param_payload) + sizeof(struct pal_compr_gapless_mdata));
+    if (!codec_payload_ || !gapless_payload_)
+        AHAL_ERR("failed to allocate compress param payloads");
+}
+
+CompressOffloadEngine::~CompressOffloadEngine()
+{
+    Stop();
+    free(codec_payload_);
+    free(gapless_payload_);
+}
+
+int CompressOffloadEngine::Start(std::function<void(uint32_t)> handle,
+                                 std::function<void(stream_callback_event_t)> deliver)
+{
+    if (thread_.joinable())
+        return 0;
+
+    handle_ = handle;
+    deliver_ = deliver;
+    exit_.store(false);
+    thread_ = std::thread(&CompressOffloadEngine::Dispatcher, this);
+    return 0;
+}
+
+void CompressOffloadEngine::Stop()
+{
+    if (!thread_.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        exit_.store(true);
+    }
+    event_cond_.notify_all();
+    thread_.join();
+}
+
+/* the stream's later events are kept too, so they stay in order */
+void CompressOffloadEngine::KeepPending(uint32_t bit)
+{
+    if (!pending_.load()) {
+        pending_pos_.store(enqueue_pos_.load());
+        pending_ns_.store(compress_now_ns());
+    }
+    pending_.fetch_or(bit);
+    events_kept_++;
+}
+
+bool CompressOffloadEngine::PendingDue()
+{
+    return pending_.load() && (int32_t)(dequeue_pos_ - pending_pos_.load()) >= 0;
+}
+
+/* bounded multi producer queue, each cell's seq tells which lap may use it */
+void CompressOffloadEngine::PostEvent(uint32_t pal_event_id)
+{
+    uint32_t bit = compress_pending_bit(pal_event_id);
+    uint32_t pos;
+    Event *ev;
+
+    if (!bit) {
+        AHAL_ERR("unknown PAL event %u", pal_event_id);
+        return;
+    }
+    if (pal_event_id == PAL_STREAM_CBK_EVENT_WRITE_READY &&
+        write_ready_queued_.exchange(true)) {
+        write_ready_coalesced_++;
+        return;
+    }
+    if (pending_.load()) {
+        KeepPending(bit);
+        goto wake;
+    }
+
+    pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+        ev = &queue_[pos & (COMPRESS_EVENT_QUEUE_SIZE - 1)];
+        int32_t dif = (int32_t)(ev->seq.load(std::memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                                   std::memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            KeepPending(bit);
+            goto wake;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    ev->pal_event_id = pal_event_id;
+    ev->posted_ns = compress_now_ns();
+    ev->seq.store(pos + 1, std::memory_order_release);
+
+wake:
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (dispatcher_waiting_.load()) {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        event_cond_.notify_one();
+    }
+}
+
+bool CompressOffloadEngine::PopEvent(uint32_t *pal_event_id, uint64_t *posted_ns)
+{
+    Event *ev = &queue_[dequeue_pos_ & (COMPRESS_EVENT_QUEUE_SIZE - 1)];
+
+    if (ev->seq.load(std::memory_order_acquire) != dequeue_pos_ + 1)
+        return false;
+    *pal_event_id = ev->pal_event_id;
+    *posted_ns = ev->posted_ns;
+    ev->seq.store(dequeue_pos_ + COMPRESS_EVENT_QUEUE_SIZE, std::memory_order_release);
+    dequeue_pos_++;
+    return true;
+}
+
+bool CompressOffloadEngine::QueueEmpty()
+{
+    Event *ev = &queue_[dequeue_pos_ & (COMPRESS_EVENT_QUEUE_SIZE - 1)];
+
+    return ev->seq.load(std::memory_order_acquire) != dequeue_pos_ + 1;
+}
+
+void CompressOffloadEngine::DispatchEvent(uint32_t pal_event_id, uint64_t posted_ns)
+{
+    stream_callback_event_t event;
+    uint64_t latency_ns;
+
+    events_++;
+    if (pal_event_id == PAL_STREAM_CBK_EVENT_WRITE_READY)
+        write_ready_queued_.store(false);
+    handle_(pal_event_id);
+    switch (pal_event_id) {
+    case PAL_STREAM_CBK_EVENT_WRITE_READY:
+        OnWriteReady();
+        event = STREAM_CBK_EVENT_WRITE_READY;
+        break;
+    case PAL_STREAM_CBK_EVENT_DRAIN_READY:
+    case PAL_STREAM_CBK_EVENT_PARTIAL_DRAIN_READY:
+        event = STREAM_CBK_EVENT_DRAIN_READY;
+        break;
+    default:
+        event = STREAM_CBK_EVENT_ERROR;
+        break;
+    }
+    deliver_(event);
+    delivered_++;
+    latency_ns = compress_now_ns() - posted_ns;
+    latency_total_ns_ += latency_ns;
+    if (latency_ns > latency_max_ns_.load())
+        latency_max_ns_.store(latency_ns);
+}
+
+void CompressOffloadEngine::Dispatcher()
+{
+    uint32_t pal_event_id, pending;
+    uint64_t posted_ns;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+
+    while (!exit_.load()) {
+        if (QueueEmpty() && !pending_.load()) {
+            std::unique_lock<std::mutex> lock(wait_mutex_);
+
+            dispatcher_waiting_.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            event_cond_.wait(lock, [&] {
+                return exit_.load() || !QueueEmpty() || pending_.load();
+            });
+            dispatcher_waiting_.store(false);
+            wakeups_++;
+            continue;
+        }
+
+        if (PendingDue()) {
+            posted_ns = pending_ns_.load();
+            pending = pending_.exchange(0);
+            for (uint32_t i = 0; i < sizeof(compress_pending_events) / sizeof(uint32_t); i++) {
+                if (pending & (1 << i))
+                    DispatchEvent(compress_pending_events[i], posted_ns);
+            }
+        } else if (PopEvent(&pal_event_id, &posted_ns)) {
+            DispatchEvent(pal_event_id, posted_ns);
+        }
+    }
+}
+
+pal_param_payload *CompressOffloadEngine::CodecPayload(const pal_snd_dec_t *dec)
+{
+    if (!codec_payload_)
+        return nullptr;
+    codec_payload_->payload_size = sizeof(pal_snd_dec_t);
+    memcpy(codec_payload_->payload, dec, sizeof(pal_snd_dec_t));
+    return codec_payload_;
+}
+
+pal_param_payload *CompressOffloadEngine::GaplessPayload(
+        const struct pal_compr_gapless_mdata *meta)
+{
+    if (!gapless_payload_)
+        return nullptr;
+    gapless_payload_->payload_size = sizeof(struct pal_compr_gapless_mdata);
+    memcpy(gapless_payload_->payload, meta, sizeof(struct pal_compr_gapless_mdata));
+    return gapless_payload_;
+}
+
+void CompressOffloadEngine::SetFragments(uint32_t count, uint32_t size)
+{
+    fragments_ = count;
+    fragment_size_ = size;
+    OnBufferEmpty();
+}
+
+void CompressOffloadEngine::OnWrite(size_t requested, ssize_t accepted)
+{
+    uint32_t fragment_size = fragment_size_.load();
+    uint64_t capacity = (uint64_t)fragments_.load() * fragment_size;
+    uint32_t used, free_fragments;
+
+    if (accepted < 0)
+        return;
+    writes_++;
+    bytes_written_ += accepted;
+    if (accepted > 0 && transition_state_.load() == TRANSITION_READY) {
+        std::lock_guard<std::mutex> lock(transition_mutex_);
+        if (transition_state_.load() == TRANSITION_READY) {
+            transition_.first_write_ns = compress_now_ns();
+            transition_state_.store(TRANSITION_WRITTEN);
+        }
+    }
+    if ((size_t)accepted < requested) {
+        /* the DSP buffer is full, the client now waits for write ready */
+        short_writes_++;
+        fragments_free_.store(0);
+        bytes_in_flight_.store(capacity);
+        return;
+    }
+    if (fragment_size == 0)
+        return;
+    used = (accepted + fragment_size - 1) / fragment_size;
+    free_fragments = fragments_free_.load();
+    fragments_free_.store(free_fragments > used ? free_fragments - used : 0);
+    bytes_in_flight_.store(std::min(bytes_in_flight_.load() + accepted, capacity));
+}
+
+/* at least one fragment was consumed */
+void CompressOffloadEngine::OnWriteReady()
+{
+    uint32_t fragments = fragments_.load(), fragment_size = fragment_size_.load();
+    uint64_t limit = fragments > 0 ? (uint64_t)(fragments - 1) * fragment_size : 0;
+
+    fragments_free_.store(std::max(fragments_free_.load(), 1u));
+    if (bytes_in_flight_.load() > limit)
+        bytes_in_flight_.store(limit);
+}
+
+void CompressOffloadEngine::OnBufferEmpty()
+{
+    fragments_free_.store(fragments_.load());
+    bytes_in_flight_.store(0);
+}
+
+void CompressOffloadEngine::OnPartialDrain()
+{
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+
+    if (transition_state_.load() != TRANSITION_IDLE)
+        transitions_cancelled_++;
+    memset(&transition_, 0, sizeof(transition_));
+    transition_.drain_ns = compress_now_ns();
+    transition_.ready_session_us = -1;
+    transition_.render_gap_us = -1;
+    transition_state_.store(TRANSITION_DRAINING);
+}
+
+void CompressOffloadEngine::OnPartialDrainReady(int64_t session_us)
+{
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+
+    if (transition_state_.load() != TRANSITION_DRAINING)
+        return;
+    transition_.ready_ns = compress_now_ns();
+    transition_.ready_session_us = session_us;
+    transition_state_.store(TRANSITION_READY);
+}
+
+void CompressOffloadEngine::OnMetadataSent()
+{
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+    int state = transition_state_.load();
+
+    if ((state == TRANSITION_READY || state == TRANSITION_WRITTEN) && !transition_.metadata_ns)
+        transition_.metadata_ns = compress_now_ns();
+}
+
+bool CompressOffloadEngine::WantsRenderSample()
+{
+    return transition_state_.load() == TRANSITION_WRITTEN;
+}
+
+void CompressOffloadEngine::OnRenderSample(int64_t session_us)
+{
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+    GaplessTransition *t = &transition_;
+    int64_t wall_us, session_delta_us;
+
+    if (transition_state_.load() != TRANSITION_WRITTEN)
+        return;
+    t->rendering_ns = compress_now_ns();
+    if (session_us >= 0 && t->ready_session_us >= 0 && session_us >= t->ready_session_us) {
+        wall_us = (int64_t)(t->rendering_ns - t->ready_ns) / 1000;
+        session_delta_us = session_us - t->ready_session_us;
+        t->render_gap_us = std::max<int64_t>(wall_us - session_delta_us, 0);
+        render_gap_max_us_ = std::max(render_gap_max_us_, t->render_gap_us);
+        if (t->render_gap_us > COMPRESS_RENDER_GAP_THRESHOLD_US)
+            transitions_with_gap_++;
+    }
+    transitions_[transitions_done_ % COMPRESS_TRANSITION_HISTORY] = *t;
+    transitions_done_++;
+    transition_state_.store(TRANSITION_IDLE);
+}
+
+void CompressOffloadEngine::CancelTransition()
+{
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+
+    if (transition_state_.load() == TRANSITION_IDLE)
+        return;
+    transitions_cancelled_++;
+    transition_state_.store(TRANSITION_IDLE);
+}
+
+static double compress_ms(uint64_t from_ns, uint64_t to_ns)
+{
+    if (!from_ns || !to_ns)
+        return -1;
+    return ((int64_t)to_ns - (int64_t)from_ns) / 1000000.0;
+}
+
+void CompressOffloadEngine::Dump(int fd)
+{
+    uint64_t delivered = delivered_.load();
+
+    dprintf(fd, "  compress offload: %u x %u bytes fragments, ~%u free, ~%llu bytes in flight\n",
+            fragments_.load(), fragment_size_.load(), fragments_free_.load(),
+            (unsigned long long)bytes_in_flight_.load());
+    dprintf(fd, "    writes %llu (%llu short), %llu bytes\n",
+            (unsigned long long)writes_.load(), (unsigned long long)short_writes_.load(),
+            (unsigned long long)bytes_written_.load());
+    dprintf(fd, "    PAL events %llu (%llu kept on a full queue, %llu write ready coalesced), "
+            "%llu delivered, %llu dispatcher wakeups, delivery latency avg %llu us max %llu us\n",
+            (unsigned long long)events_.load(), (unsigned long long)events_kept_.load(),
+            (unsigned long long)write_ready_coalesced_.load(), (unsigned long long)delivered,
+            (unsigned long long)wakeups_.load(),
+            (unsigned long long)(delivered ? latency_total_ns_.load() / delivered / 1000 : 0),
+            (unsigned long long)latency_max_ns_.load() / 1000);
+
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+    dprintf(fd, "    gapless transitions %u (%u cancelled), %u with a render gap over %d us, "
+            "worst %lld us\n", transitions_done_, transitions_cancelled_, transitions_with_gap_,
+            COMPRESS_RENDER_GAP_THRESHOLD_US, (long long)render_gap_max_us_);
+    for (uint32_t i = transitions_done_ > COMPRESS_TRANSITION_HISTORY ?
+                      transitions_done_ - COMPRESS_TRANSITION_HISTORY : 0;
+         i < transitions_done_; i++) {
+        GaplessTransition *t = &transitions_[i % COMPRESS_TRANSITION_HISTORY];
+
+        dprintf(fd, "      #%u: drain->ready %.1f ms, ready->metadata %.1f ms, "
+                "ready->first write %.1f ms, render gap %lld us\n", i,
+                compress_ms(t->drain_ns, t->ready_ns), compress_ms(t->ready_ns, t->metadata_ns),
+                compress_ms(t->ready_ns, t->first_write_ns), (long long)t->render_gap_us);
+    }
+}
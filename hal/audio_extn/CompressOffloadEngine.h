@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_COMPRESS_OFFLOAD_ENGINE_H
+#define AUDIO_EXTN_COMPRESS_OFFLOAD_ENGINE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <hardware/audio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "PalApi.h"
+
+/* power of two, PAL has at most a write ready and a drain event pending per stream */
+#define COMPRESS_EVENT_QUEUE_SIZE 32
+#define COMPRESS_TRANSITION_HISTORY 8
+/* below the PAL session time granularity */
+#define COMPRESS_RENDER_GAP_THRESHOLD_US 2000
+
+/*
+ * Timing of one gapless track transition, in ns of CLOCK_MONOTONIC.
+ * render_gap_us is how much longer the transition took in wall time than
+ * in PAL session (rendered) time, i.e. for how long the DSP had nothing to
+ * render; -1 when the session time was not available.
+ */
+struct GaplessTransition {
+    uint64_t drain_ns;        /* partial drain issued, last byte of track N written */
+    uint64_t ready_ns;        /* partial drain ready */
+    uint64_t metadata_ns;     /* track N+1 metadata sent, 0 if none */
+    uint64_t first_write_ns;  /* first byte of track N+1 accepted */
+    uint64_t rendering_ns;    /* track N+1 being rendered, first write ready after it */
+    int64_t ready_session_us;
+    int64_t render_gap_us;
+};
+
+/*
+ * Event dispatch and write accounting of a compress offload output stream.
+ *
+ * PAL callbacks only queue the event in a bounded lock-free queue, a
+ * dispatcher thread per stream runs the stream handler and delivers the
+ * framework callback. No event is dropped: a write ready event is merged into
+ * the one still queued, and events that find the queue full are kept as
+ * flags, turned back into events once the events queued before them are
+ * delivered.
+ * The codec configuration and gapless metadata payloads are allocated with
+ * the engine, so no param payload is allocated on the write path; they are
+ * shared between threads and used under the stream lock.
+ */
+class CompressOffloadEngine {
+public:
+    CompressOffloadEngine();
+    ~CompressOffloadEngine();
+    /*
+     * starts the dispatcher. handle runs first for every PAL event, then the
+     * framework event it maps to is passed to deliver.
+     */
+    int Start(std::function<void(uint32_t)> handle,
+              std::function<void(stream_callback_event_t)> deliver);
+    void Stop();
+    /* from PAL callback threads */
+    void PostEvent(uint32_t pal_event_id);
+
+    pal_param_payload *CodecPayload(const pal_snd_dec_t *dec);
+    pal_param_payload *GaplessPayload(const struct pal_compr_gapless_mdata *meta);
+
+    /* write accounting, from the write path */
+    void SetFragments(uint32_t count, uint32_t size);
+    void OnWrite(size_t requested, ssize_t accepted);
+    /* the DSP buffer was emptied by a drain, flush or standby */
+    void OnBufferEmpty();
+
+    /*
+     * gapless transitions: a partial drain starts one, the first write ready
+     * after the next track's first write ends it, with the PAL session time
+     * sampled by the stream at both ends. Flush, standby and full drains
+     * cancel it.
+     */
+    void OnPartialDrain();
+    void OnPartialDrainReady(int64_t session_us);
+    void OnMetadataSent();
+    bool WantsRenderSample();
+    void OnRenderSample(int64_t session_us);
+    void CancelTransition();
+    void Dump(int fd);
+
+private:
+    struct Event {
+        std::atomic<uint32_t> seq;
+        uint32_t pal_event_id;
+        uint64_t posted_ns;
+    };
+
+    bool PopEvent(uint32_t *pal_event_id, uint64_t *posted_ns);
+    bool QueueEmpty();
+    void KeepPending(uint32_t bit);
+    bool PendingDue();
+    void DispatchEvent(uint32_t pal_event_id, uint64_t posted_ns);
+    void OnWriteReady();
+    void Dispatcher();
+
+    Event queue_[COMPRESS_EVENT_QUEUE_SIZE];
+    std::atomic<uint32_t> enqueue_pos_{0};
+    uint32_t dequeue_pos_ = 0;
+    std::atomic<bool> write_ready_queued_{false};
+    /* events kept on a full queue, due once dequeue_pos_ passes pending_pos_ */
+    std::atomic<uint32_t> pending_{0};
+    std::atomic<uint32_t> pending_pos_{0};
+    std::atomic<uint64_t> pending_ns_{0};
+    std::function<void(uint32_t)> handle_;
+    std::function<void(stream_callback_event_t)> deliver_;
+    std::atomic<bool> exit_{false};
+    std::atomic<bool> dispatcher_waiting_{false};
+    std::mutex wait_mutex_;
+    std::condition_variable event_cond_;
+    std::thread thread_;
+
+    pal_param_payload *codec_payload_ = nullptr;
+    pal_param_payload *gapless_payload_ = nullptr;
+
+    /* DSP buffer occupancy, estimated from write sizes and write ready events */
+    std::atomic<uint32_t> fragments_{0};
+    std::atomic<uint32_t> fragment_size_{0};
+    std::atomic<uint32_t> fragments_free_{0};
+    std::atomic<uint64_t> bytes_in_flight_{0};
+
+    /* statistics */
+    std::atomic<uint64_t> writes_{0};
+    std::atomic<uint64_t> bytes_written_{0};
+    std::atomic<uint64_t> short_writes_{0};
+    std::atomic<uint64_t> events_{0};
+    std::atomic<uint64_t> events_kept_{0};
+    std::atomic<uint64_t> write_ready_coalesced_{0};
+    std::atomic<uint64_t> delivered_{0};
+    std::atomic<uint64_t> wakeups_{0};
+    std::atomic<uint64_t> latency_total_ns_{0};
+    std::atomic<uint64_t> latency_max_ns_{0};
+
+    enum TransitionState {
+        TRANSITION_IDLE,
+        TRANSITION_DRAINING,
+        TRANSITION_READY,
+        TRANSITION_WRITTEN,
+    };
+    std::atomic<int> transition_state_{TRANSITION_IDLE};
+    std::mutex transition_mutex_;
+    GaplessTransition transition_;
+    GaplessTransition transitions_[COMPRESS_TRANSITION_HISTORY];
+    uint32_t transitions_done_ = 0;
+    uint32_t transitions_cancelled_ = 0;
+    uint32_t transitions_with_gap_ = 0;
+    int64_t render_gap_max_us_ = 0;
+};
+
+#endif /* AUDIO_EXTN_COMPRESS_OFFLOAD_ENGINE_H */
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: EventTrace"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <cutils/properties.h>
+
+#include "AudioCommon.h"
+#include "EventTrace.h"
+
+/* rings are never freed, past this many threads recording is dropped */
+#define EVENT_TRACE_MAX_RINGS 64
+#define EVENT_TRACE_MAX_THREADS 256
+#define EVENT_TRACE_DUMP_EVENTS 64
+#define EVENT_TRACE_DIR_DEFAULT "/data/vendor/audio"
+
+std::atomic<bool> EventTrace::enabled_{
+        property_get_bool("vendor.audio.event_trace.enable", true)};
+thread_local EventTraceRing *EventTrace::ring_;
+
+static std::mutex et_lock;
+static EventTraceRing *et_rings[EVENT_TRACE_MAX_RINGS];
+static std::atomic<uint32_t> et_ring_count{0};
+static EventTraceThread et_threads[EVENT_TRACE_MAX_THREADS];
+static uint32_t et_thread_count;
+static uint64_t et_dropped_threads;
+static pthread_key_t et_key;
+static std::once_flag et_once;
+
+/*
+ * the thread exits, its ring goes to the next thread asking for one. A later
+ * event of the thread, from another exit handler, acquires a ring again.
+ */
+void EventTrace::ReleaseRing(void *ring)
+{
+    ring_ = nullptr;
+    static_cast<EventTraceRing *>(ring)->in_use.store(false, std::memory_order_release);
+}
+
+EventTraceRing *EventTrace::AcquireRing()
+{
+    std::lock_guard<std::mutex> lock(et_lock);
+    EventTraceRing *ring = nullptr;
+    uint32_t count = et_ring_count.load();
+    uint32_t tid = (uint32_t)syscall(SYS_gettid);
+    char name[16] = {0};
+
+    std::call_once(et_once, [] { pthread_key_create(&et_key, ReleaseRing); });
+    for (uint32_t i = 0; i < count; i++) {
+        if (!et_rings[i]->in_use.load(std::memory_order_acquire)) {
+            ring = et_rings[i];
+            break;
+        }
+    }
+    if (!ring && count < EVENT_TRACE_MAX_RINGS) {
+        ring = new (std::nothrow) EventTraceRing();
+        if (ring) {
+            et_rings[count] = ring;
+            et_ring_count.store(count + 1, std::memory_order_release);
+        }
+    }
+    if (!ring) {
+        /* asked again on the next event, rings may have been released */
+        et_dropped_threads++;
+        return nullptr;
+    }
+
+    ring->tid = tid;
+    ring->in_use.store(true, std::memory_order_relaxed);
+    ring_ = ring;
+    pthread_setspecific(et_key, ring);
+
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    auto &thread = et_threads[et_thread_count % EVENT_TRACE_MAX_THREADS];
+    thread.tid = tid;
+    memcpy(thread.name, name, sizeof(thread.name));
+    et_thread_count++;
+
+    return ring;
+}
+
+/*
+ * copies the entries of ring still valid once copied, oldest first; the
+ * owner keeps recording meanwhile and may have overwritten the oldest ones
+ */
+static void et_snapshot(EventTraceRing *ring, std::vector<EventTraceEntry> *entries,
+                        uint64_t *overwritten)
+{
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t first = head > EVENT_TRACE_ENTRIES ? head - EVENT_TRACE_ENTRIES : 0;
+    std::vector<EventTraceEntry> copy;
+    uint64_t valid_from;
+
+    copy.reserve(head - first);
+    for (uint64_t i = first; i < head; i++) {
+        auto &entry = ring->entries[i & (EVENT_TRACE_ENTRIES - 1)];
+        uint64_t tid_id = entry.tid_id.load(std::memory_order_acquire);
+
+        copy.push_back({entry.time_ns.load(std::memory_order_acquire),
+                        (uint32_t)(tid_id >> 32), (uint32_t)(tid_id & 0xffff),
+                        {entry.args[0].load(std::memory_order_acquire),
+                         entry.args[1].load(std::memory_order_acquire),
+                         entry.args[2].load(std::memory_order_acquire)}});
+    }
+
+    /* the entry being written when head was read again may be torn */
+    head = ring->head.load(std::memory_order_acquire);
+    valid_from = head >= EVENT_TRACE_ENTRIES ? head - EVENT_TRACE_ENTRIES + 1 : 0;
+    if (valid_from > first)
+        copy.erase(copy.begin(), copy.begin() + std::min<uint64_t>(valid_from - first,
+                                                                    copy.size()));
+    *overwritten = std::max(first, valid_from);
+    entries->insert(entries->end(), copy.begin(), copy.end());
+}
+
+void EventTrace::SetParameters(const char *value)
+{
+    if (!strcmp(value, "on")) {
+        enabled_ = true;
+    } else if (!strcmp(value, "off")) {
+        enabled_ = false;
+    } else if (!strcmp(value, "flush")) {
+        Flush();
+    } else {
+        AHAL_ERR("unknown value %s", value);
+    }
+}
+
+int EventTrace::Flush()
+{
+    char dir[PROPERTY_VALUE_MAX];
+    char path[PROPERTY_VALUE_MAX + 64];
+    struct timespec mono, real;
+    EventTraceFileHeader header;
+    std::vector<EventTraceThread> threads;
+    std::vector<EventTraceEntry> entries;
+    uint32_t count = et_ring_count.load(std::memory_order_acquire);
+    int fd, ret = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    property_get("vendor.audio.event_trace.dir", dir, EVENT_TRACE_DIR_DEFAULT);
+    snprintf(path, sizeof(path), "%s/hal_trace_%lld.bin", dir, (long long)real.tv_sec);
+
+    {
+        std::lock_guard<std::mutex> lock(et_lock);
+        uint32_t n = std::min<uint32_t>(et_thread_count, EVENT_TRACE_MAX_THREADS);
+
+        threads.assign(et_threads, et_threads + n);
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        AHAL_ERR("cannot create %s: %s", path, strerror(errno));
+        return -errno;
+    }
+
+    header.magic = EVENT_TRACE_MAGIC;
+    header.version = EVENT_TRACE_VERSION;
+    header.rings = count;
+    header.threads = threads.size();
+    header.monotonic_ns = (int64_t)mono.tv_sec * 1000000000 + mono.tv_nsec;
+    header.realtime_ns = (int64_t)real.tv_sec * 1000000000 + real.tv_nsec;
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, threads.data(), threads.size() * sizeof(EventTraceThread)) !=
+                (ssize_t)(threads.size() * sizeof(EventTraceThread))) {
+        ret = -EIO;
+        goto exit;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        EventTraceRingHeader ring_header = {0, 0, 0};
+
+        entries.clear();
+        et_snapshot(et_rings[i], &entries, &ring_header.overwritten);
+        ring_header.entries = entries.size();
+        if (write(fd, &ring_header, sizeof(ring_header)) != sizeof(ring_header) ||
+            write(fd, entries.data(), entries.size() * sizeof(EventTraceEntry)) !=
+                    (ssize_t)(entries.size() * sizeof(EventTraceEntry))) {
+            ret = -EIO;
+            goto exit;
+        }
+    }
+    AHAL_INFO("%u rings flushed to %s", count, path);
+
+exit:
+    if (ret)
+        AHAL_ERR("write to %s failed", path);
+    close(fd);
+    return ret;
+}
+
+/* cost of one record, measured on a private ring */
+static double et_record_cost_ns()
+{
+    static const int iterations = 20000;
+    EventTraceRing *ring = new (std::nothrow) EventTraceRing();
+    struct timespec start, end;
+    double cost;
+
+    if (!ring)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++)
+        event_trace_write(ring, EVENT_TRACE_NONE, i, i, i);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    cost = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+    delete ring;
+
+    return cost;
+}
+
+static const char *et_thread_name(const std::vector<EventTraceThread> &threads,
+                                  uint32_t tid)
+{
+    for (auto it = threads.rbegin(); it != threads.rend(); it++) {
+        if (it->tid == tid)
+            return it->name;
+    }
+    return "?";
+}
+
+void EventTrace::Dump(int fd)
+{
+    std::vector<EventTraceThread> threads;
+    std::vector<EventTraceEntry> entries;
+    uint32_t count = et_ring_count.load(std::memory_order_acquire);
+    uint64_t recorded = 0, overwritten, overwritten_total = 0, dropped;
+    double cost = et_record_cost_ns();
+
+    {
+        std::lock_guard<std::mutex> lock(et_lock);
+        uint32_t n = std::min<uint32_t>(et_thread_count, EVENT_TRACE_MAX_THREADS);
+
+        threads.assign(et_threads, et_threads + n);
+        dropped = et_dropped_threads;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        recorded += et_rings[i]->head.load(std::memory_order_acquire);
+        et_snapshot(et_rings[i], &entries, &overwritten);
+        overwritten_total += overwritten;
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const EventTraceEntry &a, const EventTraceEntry &b) {
+                  return a.time_ns < b.time_ns; });
+
+    dprintf(fd, " Event trace: %s, %u rings of %d entries, %" PRIu64 " events, "
+            "%" PRIu64 " overwritten, %" PRIu64 " dropped for lack of a ring\n",
+            enabled_.load() ? "on" : "off", count, EVENT_TRACE_ENTRIES, recorded,
+            overwritten_total, dropped);
+    dprintf(fd, "  record cost %.1f ns, budget %d ns%s\n", cost, EVENT_TRACE_BUDGET_NS,
+            cost > EVENT_TRACE_BUDGET_NS ? " EXCEEDED" : "");
+
+    for (size_t i = entries.size() > EVENT_TRACE_DUMP_EVENTS ?
+                    entries.size() - EVENT_TRACE_DUMP_EVENTS : 0;
+         i < entries.size(); i++) {
+        auto &e = entries[i];
+
+        dprintf(fd, "  %" PRIu64 ".%09" PRIu64 " %5u %-15s %-17s %" PRId64 " %" PRId64
+                " %" PRId64 "\n", e.time_ns / 1000000000, e.time_ns % 1000000000, e.tid,
+                et_thread_name(threads, e.tid),
+                e.id < EVENT_TRACE_MAX ? event_trace_names[e.id] : "?",
+                e.args[0], e.args[1], e.args[2]);
+    }
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_EVENT_TRACE_H
+#define AUDIO_EXTN_EVENT_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+/*
+ * Binary event trace for the hot paths.
+ *
+ * Each thread records into its own ring of fixed size entries: an event id,
+ * three integer arguments and a CLOCK_MONOTONIC timestamp, published by a
+ * store of the ring head, so recording never locks, formats or allocates
+ * once the thread has its ring.
+ * Rings of exited threads are handed to new ones. The rings are merged into
+ * a timeline in the device dump, or flushed as they are to a file for
+ * hal_trace_decode.
+ *
+ * Budget: recording must stay within EVENT_TRACE_BUDGET_NS, the dump shows
+ * the cost measured on the device.
+ */
+#define EVENT_TRACE_ENTRIES 2048 /* per thread, power of 2 */
+#define EVENT_TRACE_BUDGET_NS 100
+#define EVENT_TRACE_MAGIC 0x52544841 /* "AHTR" */
+#define EVENT_TRACE_VERSION 1
+
+enum EventTraceId : uint16_t {
+    EVENT_TRACE_NONE,
+    EVENT_TRACE_OUT_WRITE,        /* handle, bytes */
+    EVENT_TRACE_OUT_WRITE_DONE,   /* handle, result */
+    EVENT_TRACE_IN_READ,          /* handle, bytes */
+    EVENT_TRACE_IN_READ_DONE,     /* handle, result */
+    EVENT_TRACE_PAL_WRITE,        /* PAL handle, bytes */
+    EVENT_TRACE_PAL_WRITE_DONE,   /* PAL handle, result */
+    EVENT_TRACE_PAL_READ,         /* PAL handle, bytes */
+    EVENT_TRACE_PAL_READ_DONE,    /* PAL handle, result */
+    EVENT_TRACE_FRAMES_WRITTEN,   /* handle, presented frames, written frames */
+    EVENT_TRACE_OUT_GET_STREAM,   /* stream, found */
+    EVENT_TRACE_IN_GET_STREAM,    /* stream, found */
+    EVENT_TRACE_PAL_CALLBACK,     /* token, event id, size */
+    EVENT_TRACE_PAL_CALLBACK_DONE,/* token, event id, handler ns */
+    EVENT_TRACE_OUT_STANDBY,      /* handle */
+    EVENT_TRACE_IN_STANDBY,       /* handle */
+    EVENT_TRACE_OUT_PAL_EVENT,    /* handle, PAL event id, size */
+    EVENT_TRACE_MAX,
+};
+
+/* names used by the dump and hal_trace_decode, indexed by EventTraceId */
+static const char * const event_trace_names[EVENT_TRACE_MAX] = {
+    "none",
+    "out_write", "out_write_done",
+    "in_read", "in_read_done",
+    "pal_write", "pal_write_done",
+    "pal_read", "pal_read_done",
+    "frames_written",
+    "out_get_stream", "in_get_stream",
+    "pal_callback", "pal_callback_done",
+    "out_standby", "in_standby",
+    "out_pal_event",
+};
+
+/*
+ * flushed file: a header, thread names, then for each ring its header and
+ * its entries oldest first
+ */
+struct EventTraceEntry {
+    uint64_t time_ns;
+    uint32_t tid;
+    uint32_t id;
+    int64_t args[3];
+};
+
+struct EventTraceFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rings;
+    uint32_t threads;
+    /* the same instant on both clocks, to line the trace up with logs */
+    int64_t monotonic_ns;
+    int64_t realtime_ns;
+};
+
+struct EventTraceThread {
+    uint32_t tid;
+    char name[16];
+};
+
+struct EventTraceRingHeader {
+    uint32_t entries;
+    uint32_t reserved;
+    uint64_t overwritten;
+};
+
+/* one thread's ring, written by that thread only */
+struct EventTraceRing {
+    std::atomic<uint64_t> head;
+    std::atomic<bool> in_use;
+    uint32_t tid;
+    struct {
+        std::atomic<uint64_t> time_ns;
+        std::atomic<uint64_t> tid_id;
+        std::atomic<int64_t> args[3];
+    } entries[EVENT_TRACE_ENTRIES];
+};
+
+/*
+ * The words of an entry are stored with release semantics: a reader seeing
+ * any of them also sees the head that makes the entry it overwrites stale.
+ */
+static inline void event_trace_write(EventTraceRing *ring, EventTraceId id,
+                                     int64_t arg0, int64_t arg1, int64_t arg2)
+{
+    struct timespec ts;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    auto &entry = ring->entries[head & (EVENT_TRACE_ENTRIES - 1)];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    entry.time_ns.store((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+                        std::memory_order_release);
+    entry.tid_id.store((uint64_t)ring->tid << 32 | id, std::memory_order_release);
+    entry.args[0].store(arg0, std::memory_order_release);
+    entry.args[1].store(arg1, std::memory_order_release);
+    entry.args[2].store(arg2, std::memory_order_release);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+class EventTrace {
+public:
+    static void Record(EventTraceId id, int64_t arg0 = 0, int64_t arg1 = 0,
+                       int64_t arg2 = 0)
+    {
+        EventTraceRing *ring;
+
+        if (!enabled_.load(std::memory_order_relaxed))
+            return;
+        ring = ring_ ? ring_ : AcquireRing();
+        if (ring)
+            event_trace_write(ring, id, arg0, arg1, arg2);
+    }
+    /* "event_trace=on|off|flush", vendor.audio.event_trace.enable sets the default */
+    static void SetParameters(const char *value);
+    /*
+     * writes the rings to <vendor.audio.event_trace.dir>/hal_trace_<time>.bin,
+     * the directory defaulting to /data/vendor/audio
+     */
+    static int Flush();
+    static void Dump(int fd);
+
+private:
+    static EventTraceRing *AcquireRing();
+    static void ReleaseRing(void *ring);
+
+    static std::atomic<bool> enabled_;
+    static thread_local EventTraceRing *ring_;
+};
+
+#endif /* AUDIO_EXTN_EVENT_TRACE_H */
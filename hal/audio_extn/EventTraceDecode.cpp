@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decodes a trace flushed with "event_trace=flush" into one timeline across
+ * threads: time since the first event, wall clock time, thread and event.
+ * Events ending a call (write, read, PAL write/read and callback delivery)
+ * also show how long the call took, and a summary per event follows.
+ *
+ * usage: hal_trace_decode <hal_trace_*.bin> [tid]
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "EventTrace.h"
+
+struct EventStats {
+    uint64_t count = 0;
+    uint64_t paired = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+};
+
+static bool read_all(FILE *file, void *data, size_t size)
+{
+    return !size || fread(data, size, 1, file) == 1;
+}
+
+/* the event starting the call id ends, EVENT_TRACE_NONE if it ends none */
+static EventTraceId begin_of(uint32_t id)
+{
+    switch (id) {
+    case EVENT_TRACE_OUT_WRITE_DONE:
+    case EVENT_TRACE_IN_READ_DONE:
+    case EVENT_TRACE_PAL_WRITE_DONE:
+    case EVENT_TRACE_PAL_READ_DONE:
+    case EVENT_TRACE_PAL_CALLBACK_DONE:
+        return (EventTraceId)(id - 1);
+    default:
+        return EVENT_TRACE_NONE;
+    }
+}
+
+/* calls are matched on their thread, callbacks (posted elsewhere) on token and event */
+static std::pair<uint64_t, uint64_t> pair_key(const EventTraceEntry &e, EventTraceId begin)
+{
+    if (begin == EVENT_TRACE_PAL_CALLBACK)
+        return {(uint64_t)e.args[0], (uint64_t)e.args[1] << 16 | begin};
+    return {e.tid, begin};
+}
+
+int main(int argc, char **argv)
+{
+    EventTraceFileHeader header;
+    std::vector<EventTraceThread> threads;
+    std::vector<EventTraceEntry> entries;
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> open_calls;
+    EventStats stats[EVENT_TRACE_MAX];
+    uint32_t tid_filter = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+    uint64_t overwritten = 0;
+    FILE *file;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <hal_trace_*.bin> [tid]\n", argv[0]);
+        return 1;
+    }
+    file = fopen(argv[1], "rb");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (!read_all(file, &header, sizeof(header)) || header.magic != EVENT_TRACE_MAGIC ||
+        header.version != EVENT_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d HAL trace\n", argv[1], EVENT_TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+    threads.resize(header.threads);
+    if (!read_all(file, threads.data(), threads.size() * sizeof(EventTraceThread)))
+        goto truncated;
+    for (uint32_t i = 0; i < header.rings; i++) {
+        EventTraceRingHeader ring;
+        size_t first = entries.size();
+
+        if (!read_all(file, &ring, sizeof(ring)))
+            goto truncated;
+        entries.resize(first + ring.entries);
+        if (!read_all(file, &entries[first], ring.entries * sizeof(EventTraceEntry)))
+            goto truncated;
+        overwritten += ring.overwritten;
+    }
+    fclose(file);
+
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const EventTraceEntry &a, const EventTraceEntry &b) {
+                         return a.time_ns < b.time_ns; });
+    printf("%zu events, %" PRIu64 " overwritten before the flush\n", entries.size(),
+           overwritten);
+
+    for (auto &e : entries) {
+        int64_t wall_ns = header.realtime_ns + ((int64_t)e.time_ns - header.monotonic_ns);
+        time_t wall_s = wall_ns / 1000000000;
+        const char *name = "?";
+        EventTraceId begin = begin_of(e.id);
+        struct tm tm;
+        char wall[32];
+        char took[32] = "";
+
+        if (tid_filter && e.tid != tid_filter)
+            continue;
+        for (auto it = threads.rbegin(); it != threads.rend(); it++) {
+            if (it->tid == e.tid) {
+                name = it->name;
+                break;
+            }
+        }
+        if (e.id < EVENT_TRACE_MAX) {
+            stats[e.id].count++;
+            if (begin_of(e.id + 1) == e.id) {
+                open_calls[pair_key(e, (EventTraceId)e.id)] = e.time_ns;
+            } else if (begin != EVENT_TRACE_NONE) {
+                auto it = open_calls.find(pair_key(e, begin));
+
+                if (it != open_calls.end()) {
+                    int64_t ns = e.time_ns - it->second;
+
+                    stats[e.id].paired++;
+                    stats[e.id].total_ns += ns;
+                    stats[e.id].max_ns = std::max(stats[e.id].max_ns, ns);
+                    snprintf(took, sizeof(took), " (%.3f ms)", ns / 1000000.0);
+                    open_calls.erase(it);
+                }
+            }
+        }
+
+        localtime_r(&wall_s, &tm);
+        strftime(wall, sizeof(wall), "%m-%d %H:%M:%S", &tm);
+        printf("%12.6f %s.%06" PRId64 " %5u %-15s %-17s %" PRId64 " %" PRId64 " %" PRId64 "%s\n",
+               (double)(e.time_ns - entries[0].time_ns) / 1000000000, wall,
+               wall_ns % 1000000000 / 1000, e.tid, name,
+               e.id < EVENT_TRACE_MAX ? event_trace_names[e.id] : "?",
+               e.args[0], e.args[1], e.args[2], took);
+    }
+
+    printf("\n%-17s %10s %12s %12s\n", "event", "count", "avg ms", "max ms");
+    for (int id = 1; id < EVENT_TRACE_MAX; id++) {
+        if (!stats[id].count)
+            continue;
+        printf("%-17s %10" PRIu64, event_trace_names[id], stats[id].count);
+        if (stats[id].paired)
+            printf(" %12.3f %12.3f", stats[id].total_ns / 1000000.0 / stats[id].paired,
+                   stats[id].max_ns / 1000000.0);
+        printf("\n");
+    }
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated\n", argv[1]);
+    fclose(file);
+    return 1;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host stress test of EventTrace, meant to be run under ThreadSanitizer. It is not
+ * part of the HAL: the hal_trace_stress host target builds it with EventTrace.cpp.
+ *
+ * TRACE_WRITERS threads record write events continuously while short lived threads
+ * record a callback each, so that the rings of exited threads are handed to new
+ * ones, and the main thread dumps and flushes the rings meanwhile. It then prints
+ * the cost of a record on one thread against EVENT_TRACE_BUDGET_NS.
+ *
+ * Usage: hal_trace_stress [short lived threads]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "EventTrace.h"
+
+#define TRACE_WRITERS 6
+#define TRACE_WRITE_PERIOD_US 200
+#define TRACE_COST_RECORDS 1000000
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void writer(int index, std::atomic<bool> *stop)
+{
+    char name[16];
+    int64_t bytes = 0;
+
+    snprintf(name, sizeof(name), "writer%d", index);
+    pthread_setname_np(pthread_self(), name);
+    while (!stop->load()) {
+        EventTrace::Record(EVENT_TRACE_OUT_WRITE, index, bytes);
+        EventTrace::Record(EVENT_TRACE_PAL_WRITE, index, bytes);
+        usleep(TRACE_WRITE_PERIOD_US);
+        EventTrace::Record(EVENT_TRACE_PAL_WRITE_DONE, index, bytes);
+        EventTrace::Record(EVENT_TRACE_OUT_WRITE_DONE, index, bytes);
+        bytes += 3840;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int short_lived = argc > 1 ? atoi(argv[1]) : 200;
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> writers;
+    FILE *null_file;
+    uint64_t begin, ns;
+
+    EventTrace::SetParameters("on");
+    null_file = fopen("/dev/null", "w");
+    if (!null_file)
+        return 1;
+
+    for (int i = 0; i < TRACE_WRITERS; i++)
+        writers.emplace_back(writer, i, &stop);
+    for (int i = 0; i < short_lived; i++) {
+        std::thread([i] {
+            EventTrace::Record(EVENT_TRACE_PAL_CALLBACK, i, 1, 0);
+            EventTrace::Record(EVENT_TRACE_PAL_CALLBACK_DONE, i, 1, 5);
+        }).join();
+        if (i % 50 == 0)
+            EventTrace::Dump(fileno(null_file));
+    }
+    EventTrace::Dump(fileno(null_file));
+    EventTrace::Flush();
+    stop.store(true);
+    for (auto &t : writers)
+        t.join();
+    fclose(null_file);
+
+    begin = now_ns();
+    for (int i = 0; i < TRACE_COST_RECORDS; i++)
+        EventTrace::Record(EVENT_TRACE_FRAMES_WRITTEN, 1, i, i);
+    ns = now_ns() - begin;
+    printf("%d writers, %d short lived threads: done\n", TRACE_WRITERS, short_lived);
+    printf("record cost %.1f ns, budget %d ns\n", (double)ns / TRACE_COST_RECORDS,
+           EVENT_TRACE_BUDGET_NS);
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: LabReader"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <system/thread_defs.h>
+
+#include <algorithm>
+
+#include "AudioCommon.h"
+#include "LabReader.h"
+
+/* consecutive empty PAL reads after which buffering is considered stopped */
+#define LAB_MAX_EMPTY_READS 25
+
+static uint64_t lab_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+LabReader::LabReader()
+{
+}
+
+LabReader::~LabReader()
+{
+    Stop();
+    free(ring_);
+}
+
+int LabReader::Start(pal_stream_handle_t *handle, size_t ring_bytes, size_t chunk_bytes)
+{
+    size_t size = 1;
+
+    if (IsRunning())
+        return 0;
+    if (!handle || ring_bytes == 0 || chunk_bytes == 0)
+        return -EINVAL;
+    /* the thread gave up on its own, what it buffered is still to be read */
+    if (thread_.joinable())
+        Join();
+
+    while (size < ring_bytes)
+        size <<= 1;
+    if (size != ring_size_) {
+        head_.store(0);
+        tail_.store(0);
+        free(ring_);
+        ring_ = (uint8_t *)malloc(size);
+        if (!ring_) {
+            ring_size_ = 0;
+            AHAL_ERR("failed to allocate %zu bytes LAB ring", size);
+            return -ENOMEM;
+        }
+        ring_size_ = size;
+    }
+    chunk_size_ = std::min(chunk_bytes, ring_size_);
+    handle_ = handle;
+    exit_.store(false);
+    done_.store(false);
+    error_.store(0);
+    pal_reads_ = 0;
+    full_waits_ = 0;
+    empty_waits_ = 0;
+    first_data_ns_ = 0;
+    start_ns_ = lab_now_ns();
+
+    running_.store(true);
+    thread_ = std::thread(&LabReader::ReaderLoop, this);
+    AHAL_DBG("started, ring %zu bytes, chunk %zu bytes", ring_size_, chunk_size_);
+    return 0;
+}
+
+void LabReader::RequestStop()
+{
+    exit_.store(true);
+    Wake(writer_waiting_, space_cond_);
+}
+
+int LabReader::StopBuffering()
+{
+    if (!IsRunning())
+        return 0;
+
+    RequestStop();
+    return pal_stream_set_param(handle_, PAL_PARAM_ID_STOP_BUFFERING, nullptr);
+}
+
+void LabReader::Stop()
+{
+    if (!thread_.joinable())
+        return;
+
+    RequestStop();
+    Join();
+    head_.store(0);
+    tail_.store(0);
+    handle_ = nullptr;
+}
+
+void LabReader::Join()
+{
+    thread_.join();
+    AHAL_DBG("stopped: %llu PAL reads, first data after %llu us, %llu full waits, "
+             "%llu empty waits, %llu bytes not consumed",
+             (unsigned long long)pal_reads_, (unsigned long long)first_data_ns_ / 1000,
+             (unsigned long long)full_waits_, (unsigned long long)empty_waits_,
+             (unsigned long long)(head_.load() - tail_.load()));
+}
+
+/* wakes the other side if it is waiting, after an index update */
+void LabReader::Wake(std::atomic<bool> &waiting, std::condition_variable &cond)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load()) {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        cond.notify_all();
+    }
+}
+
+void LabReader::ReaderLoop()
+{
+    struct pal_buffer palBuffer;
+    int empty_reads = 0;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+
+    while (!exit_.load()) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        size_t space = ring_size_ - (size_t)(head - tail_.load(std::memory_order_acquire));
+
+        if (space == 0) {
+            std::unique_lock<std::mutex> lock(wait_mutex_);
+
+            full_waits_++;
+            writer_waiting_.store(true);
+            space_cond_.wait(lock, [&] {
+                return exit_.load() || head - tail_.load() < ring_size_;
+            });
+            writer_waiting_.store(false);
+            continue;
+        }
+
+        size_t offset = head & (ring_size_ - 1);
+        memset(&palBuffer, 0, sizeof(palBuffer));
+        palBuffer.buffer = ring_ + offset;
+        palBuffer.size = std::min(std::min(space, chunk_size_), ring_size_ - offset);
+        ssize_t ret = pal_stream_read(handle_, &palBuffer);
+        if (ret < 0) {
+            AHAL_ERR("failed to read LAB data from PAL, ret %zd", ret);
+            error_.store((int)ret);
+            break;
+        }
+        if (ret == 0) {
+            if (++empty_reads >= LAB_MAX_EMPTY_READS) {
+                AHAL_DBG("no more LAB data");
+                break;
+            }
+            continue;
+        }
+        empty_reads = 0;
+        if (pal_reads_++ == 0)
+            first_data_ns_ = lab_now_ns() - start_ns_;
+        head_.store(head + ret, std::memory_order_release);
+        Wake(reader_waiting_, data_cond_);
+    }
+
+    done_.store(true);
+    running_.store(false);
+    Wake(reader_waiting_, data_cond_);
+}
+
+ssize_t LabReader::Read(void *buffer, size_t bytes)
+{
+    uint8_t *dst = (uint8_t *)buffer;
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    size_t wanted = std::min(bytes, ring_size_);
+    size_t copied, offset, first;
+
+    if (!thread_.joinable())
+        return -EINVAL;
+
+    if (head - tail < wanted && !done_.load()) {
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+
+        empty_waits_++;
+        reader_waiting_.store(true);
+        data_cond_.wait(lock, [&] {
+            return head_.load() - tail >= wanted || done_.load();
+        });
+        reader_waiting_.store(false);
+        head = head_.load(std::memory_order_acquire);
+    }
+
+    copied = std::min((size_t)(head - tail), bytes);
+    offset = tail & (ring_size_ - 1);
+    first = std::min(copied, ring_size_ - offset);
+    memcpy(dst, ring_ + offset, first);
+    memcpy(dst + first, ring_, copied - first);
+    tail_.store(tail + copied, std::memory_order_release);
+    Wake(writer_waiting_, space_cond_);
+
+    if (copied == 0 && error_.load() < 0)
+        return error_.load();
+    return copied;
+}
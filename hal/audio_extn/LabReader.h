@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_LAB_READER_H
+#define AUDIO_EXTN_LAB_READER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "PalApi.h"
+
+/*
+ * Drains the keyword and look-ahead buffer (LAB) of a sound trigger session.
+ *
+ * Once started, a dedicated thread reads the PAL sound trigger stream into a
+ * preallocated single producer / single consumer ring, so the DSP buffer is
+ * emptied at the rate it fills instead of at the client read cadence. Client
+ * reads copy out of the ring. Both sides only sleep when the ring is empty or
+ * full; the indices are atomics and the mutex only guards the wakeups.
+ */
+class LabReader {
+public:
+    LabReader();
+    ~LabReader();
+    /* ring_bytes is rounded up to a power of two, chunk_bytes is the PAL read size */
+    int Start(pal_stream_handle_t *handle, size_t ring_bytes, size_t chunk_bytes);
+    /* makes the thread exit after its current PAL read, call before stopping buffering */
+    void RequestStop();
+    /*
+     * if running, requests a stop and stops buffering on the handle the thread
+     * reads, which makes its blocked PAL read return. Returns the PAL error.
+     */
+    int StopBuffering();
+    /* requests a stop if needed and joins the thread, buffered data is dropped */
+    void Stop();
+    /*
+     * false once the thread exited, also on its own after an error or when
+     * buffering stopped; Start() then restarts it keeping what was buffered
+     */
+    bool IsRunning() { return running_.load(); }
+    /*
+     * copies up to bytes of LAB data, waiting until bytes are buffered unless the
+     * thread stopped. Returns the bytes copied, or the PAL error if none were.
+     */
+    ssize_t Read(void *buffer, size_t bytes);
+
+private:
+    void ReaderLoop();
+    void Join();
+    void Wake(std::atomic<bool> &waiting, std::condition_variable &cond);
+
+    pal_stream_handle_t *handle_ = nullptr;
+    uint8_t *ring_ = nullptr;
+    size_t ring_size_ = 0;
+    size_t chunk_size_ = 0;
+    /* free running byte counters, head_ written by the thread, tail_ by Read() */
+    std::atomic<uint64_t> head_{0};
+    std::atomic<uint64_t> tail_{0};
+    std::atomic<bool> exit_{false};
+    std::atomic<bool> done_{false};
+    std::atomic<bool> running_{false};
+    std::atomic<int> error_{0};
+    std::mutex wait_mutex_;
+    std::condition_variable data_cond_;
+    std::condition_variable space_cond_;
+    std::atomic<bool> reader_waiting_{false};
+    std::atomic<bool> writer_waiting_{false};
+    std::thread thread_;
+    /* statistics, logged on stop */
+    uint64_t pal_reads_ = 0;
+    uint64_t full_waits_ = 0;
+    uint64_t empty_waits_ = 0;
+    uint64_t first_data_ns_ = 0;
+    uint64_t start_ns_ = 0;
+};
+
+#endif /* AUDIO_EXTN_LAB_READER_H */
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: LatencyTest"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <audio_utils/format.h>
+
+#include "AudioCommon.h"
+#include "LatencyTest.h"
+
+/* -6 dBFS */
+#define LATENCY_TEST_LEVEL 0.5f
+#define LATENCY_TEST_CHIRP_MS 20
+#define LATENCY_TEST_CHIRP_START_HZ 500.0
+#define LATENCY_TEST_CHIRP_END_HZ 8000.0
+/* capture kept after the burst was written, bounds the measurable latency */
+#define LATENCY_TEST_CAPTURE_MS 1000
+#define LATENCY_TEST_TIMEOUT_MS 5000
+/* correlation peak over its RMS needed for a result to be trusted */
+#define LATENCY_TEST_MIN_CONFIDENCE 8.0
+#define LATENCY_TEST_MAX_RESULTS 16
+
+enum LatencyTestState {
+    LATENCY_TEST_IDLE,
+    LATENCY_TEST_ARMED,     /* waiting for an output stream to write */
+    LATENCY_TEST_INJECTING, /* burst being written, capture running */
+    LATENCY_TEST_CAPTURING, /* burst written, capture running */
+    LATENCY_TEST_ANALYZING,
+};
+
+/* one read of the capture: frames recorded up to its end and when it returned */
+struct LatencyTestRead {
+    uint64_t end_frame;
+    int64_t time_ns;
+};
+
+struct LatencyTestResult {
+    std::string path;
+    uint32_t reported_ms;
+    uint32_t count;
+    uint32_t invalid;
+    double last_ms;
+    double min_ms;
+    double max_ms;
+    double total_ms;
+    double confidence;
+};
+
+static std::atomic<int> lt_state{LATENCY_TEST_IDLE};
+
+/* the worker threads are detached, their wait objects never destroyed */
+static std::mutex *lt_lock = new std::mutex();
+static std::condition_variable *lt_cond = new std::condition_variable();
+/* bumped on each arm and stop, an older worker leaves without reporting */
+static uint32_t lt_generation;
+
+/* measurement in progress, under lt_lock */
+static LatencyTest::Signal lt_signal;
+static std::string lt_usecase_filter;
+static const void *lt_out_stream;
+static std::string lt_out_path;
+static uint32_t lt_out_rate;
+static uint32_t lt_out_reported_ms;
+static uint32_t lt_out_frames;   /* burst frames written so far */
+static int64_t lt_write_ns;
+static std::vector<float> lt_out_burst;
+static std::vector<float> lt_out_float;
+static const void *lt_in_stream;
+static std::string lt_in_path;
+static uint32_t lt_in_rate;
+static std::vector<float> lt_capture;
+static size_t lt_capture_frames;
+static std::vector<float> lt_in_float;
+static std::vector<LatencyTestRead> lt_reads;
+
+/* results, under lt_lock */
+static std::deque<LatencyTestResult> lt_results;
+static std::string lt_last_error = "none";
+static uint32_t lt_runs;
+
+static int64_t lt_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void lt_make_burst(LatencyTest::Signal signal, uint32_t sample_rate,
+                          std::vector<float> *burst)
+{
+    uint32_t frames;
+    double duration, sweep;
+
+    if (signal == LatencyTest::SIGNAL_IMPULSE) {
+        burst->assign(1, LATENCY_TEST_LEVEL);
+        return;
+    }
+
+    frames = sample_rate * LATENCY_TEST_CHIRP_MS / 1000;
+    duration = (double)frames / sample_rate;
+    sweep = (LATENCY_TEST_CHIRP_END_HZ - LATENCY_TEST_CHIRP_START_HZ) / duration;
+    burst->resize(frames);
+    for (uint32_t i = 0; i < frames; i++) {
+        double t = (double)i / sample_rate;
+        double phase = 2 * M_PI * (LATENCY_TEST_CHIRP_START_HZ * t + sweep * t * t / 2);
+        double window = 0.5 - 0.5 * cos(2 * M_PI * i / (frames - 1));
+
+        (*burst)[i] = (float)(LATENCY_TEST_LEVEL * window * sin(phase));
+    }
+}
+
+static std::string lt_path(const char *usecase, audio_devices_t devices)
+{
+    char path[128];
+
+    snprintf(path, sizeof(path), "%s 0x%x", usecase, devices);
+    return path;
+}
+
+/* called with lt_lock held */
+static void lt_record(bool valid, double latency_ms, double confidence)
+{
+    std::string path = lt_out_path + " -> " + lt_in_path;
+    LatencyTestResult *result = nullptr;
+
+    for (auto &r : lt_results) {
+        if (r.path == path) {
+            result = &r;
+            break;
+        }
+    }
+    if (!result) {
+        if (lt_results.size() == LATENCY_TEST_MAX_RESULTS)
+            lt_results.pop_front();
+        lt_results.push_back({path, 0, 0, 0, 0, 0, 0, 0, 0});
+        result = &lt_results.back();
+    }
+
+    result->reported_ms = lt_out_reported_ms;
+    result->confidence = confidence;
+    if (!valid) {
+        result->invalid++;
+        return;
+    }
+    result->last_ms = latency_ms;
+    if (!result->count || latency_ms < result->min_ms)
+        result->min_ms = latency_ms;
+    if (!result->count || latency_ms > result->max_ms)
+        result->max_ms = latency_ms;
+    result->total_ms += latency_ms;
+    result->count++;
+}
+
+/*
+ * finds the burst in capture, returns the frame it starts at and the ratio of
+ * the correlation peak to its RMS
+ */
+static size_t lt_correlate(const std::vector<float> &capture,
+                           const std::vector<float> &reference, double *confidence)
+{
+    size_t lags = capture.size() - reference.size() + 1, peak_lag = 0;
+    double peak = 0, energy = 0, rms;
+
+    for (size_t lag = 0; lag < lags; lag++) {
+        const float *x = &capture[lag];
+        double c = 0;
+
+        for (size_t n = 0; n < reference.size(); n++)
+            c += reference[n] * x[n];
+        energy += c * c;
+        if (fabs(c) > peak) {
+            peak = fabs(c);
+            peak_lag = lag;
+        }
+    }
+    rms = sqrt(energy / lags);
+    *confidence = rms > 0 ? peak / rms : 0;
+
+    return peak_lag;
+}
+
+/*
+ * called with lt_lock held in the analyzing state, in which the streams leave
+ * the capture alone; the lock is dropped while correlating
+ */
+static void lt_analyze(std::unique_lock<std::mutex> &lock, uint32_t generation)
+{
+    std::vector<float> capture, reference;
+    std::vector<LatencyTestRead> reads;
+    size_t onset;
+    double confidence, onset_ns = 0, latency_ms;
+    bool valid;
+
+    capture.swap(lt_capture);
+    reads.swap(lt_reads);
+    lt_make_burst(lt_signal, lt_in_rate, &reference);
+    if (capture.size() < reference.size()) {
+        lt_last_error = "capture too short";
+        return;
+    }
+
+    lock.unlock();
+    onset = lt_correlate(capture, reference, &confidence);
+    lock.lock();
+    if (lt_generation != generation)
+        return;
+
+    valid = confidence >= LATENCY_TEST_MIN_CONFIDENCE;
+    /* the burst started in the read that returned frame onset */
+    for (auto &read : reads) {
+        if (read.end_frame > onset) {
+            onset_ns = read.time_ns -
+                       (double)(read.end_frame - onset) * 1000000000 / lt_in_rate;
+            break;
+        }
+    }
+    latency_ms = (onset_ns - lt_write_ns) / 1000000;
+    if (latency_ms < 0)
+        valid = false;
+
+    AHAL_INFO("%s -> %s: %s %.2f ms (reported output %u ms), confidence %.1f",
+              lt_out_path.c_str(), lt_in_path.c_str(), valid ? "round trip" : "rejected",
+              latency_ms, lt_out_reported_ms, confidence);
+    lt_record(valid, latency_ms, confidence);
+    lt_last_error = valid ? "none" : "burst not found in capture";
+}
+
+static void lt_worker(uint32_t generation)
+{
+    std::unique_lock<std::mutex> lock(*lt_lock);
+    bool done;
+
+    done = lt_cond->wait_for(lock, std::chrono::milliseconds(LATENCY_TEST_TIMEOUT_MS),
+            [generation] { return lt_generation != generation ||
+                                  lt_state.load() == LATENCY_TEST_ANALYZING; });
+    if (lt_generation != generation)
+        return;
+
+    if (done) {
+        lt_analyze(lock, generation);
+        if (lt_generation != generation)
+            return;
+    } else if (lt_state.load() == LATENCY_TEST_ARMED) {
+        lt_last_error = "no output stream wrote";
+    } else {
+        lt_last_error = lt_in_stream ? "capture stalled" : "no input stream read";
+    }
+    if (!done)
+        AHAL_ERR("timed out: %s", lt_last_error.c_str());
+    lt_runs++;
+    lt_state = LATENCY_TEST_IDLE;
+}
+
+int LatencyTest::SetParameters(const char *signal, const char *usecase)
+{
+    std::lock_guard<std::mutex> lock(*lt_lock);
+
+    lt_generation++;
+    lt_cond->notify_all();
+    if (!strcmp(signal, "stop")) {
+        AHAL_DBG("stopped");
+        lt_state = LATENCY_TEST_IDLE;
+        return 0;
+    }
+
+    if (!strcmp(signal, "chirp")) {
+        lt_signal = SIGNAL_CHIRP;
+    } else if (!strcmp(signal, "impulse")) {
+        lt_signal = SIGNAL_IMPULSE;
+    } else {
+        AHAL_ERR("unknown signal %s", signal);
+        lt_state = LATENCY_TEST_IDLE;
+        return -EINVAL;
+    }
+
+    lt_usecase_filter = usecase ? usecase : "";
+    lt_out_stream = nullptr;
+    lt_in_stream = nullptr;
+    lt_out_frames = 0;
+    lt_capture.clear();
+    lt_reads.clear();
+    lt_state = LATENCY_TEST_ARMED;
+    std::thread(lt_worker, lt_generation).detach();
+    AHAL_DBG("armed, %s on %s", signal,
+             lt_usecase_filter.empty() ? "any output" : lt_usecase_filter.c_str());
+
+    return 0;
+}
+
+bool LatencyTest::OutputPending()
+{
+    int state = lt_state.load(std::memory_order_relaxed);
+
+    return state == LATENCY_TEST_ARMED || state == LATENCY_TEST_INJECTING;
+}
+
+bool LatencyTest::InputPending()
+{
+    int state = lt_state.load(std::memory_order_relaxed);
+
+    return state == LATENCY_TEST_INJECTING || state == LATENCY_TEST_CAPTURING;
+}
+
+const void *LatencyTest::OnWrite(const void *stream, const void *buffer, size_t bytes,
+                                 std::vector<uint8_t> *out,
+                                 audio_format_t format, uint32_t channels,
+                                 uint32_t sample_rate, const char *usecase,
+                                 audio_devices_t devices, uint32_t reported_ms)
+{
+    std::lock_guard<std::mutex> lock(*lt_lock);
+    size_t frame_size = audio_bytes_per_sample(format) * channels;
+    uint32_t frames, burst_frames;
+
+    if (!frame_size || !sample_rate)
+        return buffer;
+    if (lt_state.load() == LATENCY_TEST_ARMED) {
+        if (!lt_usecase_filter.empty() && lt_usecase_filter != usecase)
+            return buffer;
+        lt_out_stream = stream;
+        lt_out_path = lt_path(usecase, devices);
+        lt_out_rate = sample_rate;
+        lt_out_reported_ms = reported_ms;
+        lt_write_ns = lt_now_ns();
+        lt_make_burst(lt_signal, sample_rate, &lt_out_burst);
+        lt_state = LATENCY_TEST_INJECTING;
+        AHAL_DBG("injecting on %s, reported latency %u ms", lt_out_path.c_str(),
+                 reported_ms);
+    } else if (lt_state.load() != LATENCY_TEST_INJECTING || lt_out_stream != stream) {
+        return buffer;
+    }
+
+    /* the burst then silence, so the stream content does not mask it */
+    frames = bytes / frame_size;
+    burst_frames = std::min<uint32_t>(frames, lt_out_burst.size() - lt_out_frames);
+    lt_out_float.assign((size_t)frames * channels, 0);
+    for (uint32_t i = 0; i < burst_frames; i++) {
+        for (uint32_t ch = 0; ch < channels; ch++)
+            lt_out_float[i * channels + ch] = lt_out_burst[lt_out_frames + i];
+    }
+    out->resize(bytes);
+    memcpy_by_audio_format(out->data(), format, lt_out_float.data(),
+                           AUDIO_FORMAT_PCM_FLOAT, (size_t)frames * channels);
+
+    lt_out_frames += burst_frames;
+    if (lt_out_frames == lt_out_burst.size())
+        lt_state = lt_in_stream && lt_capture.size() == lt_capture_frames ?
+                   LATENCY_TEST_ANALYZING : LATENCY_TEST_CAPTURING;
+    if (lt_state.load() == LATENCY_TEST_ANALYZING)
+        lt_cond->notify_all();
+
+    return out->data();
+}
+
+void LatencyTest::OnRead(const void *stream, const void *buffer, size_t bytes,
+                         audio_format_t format, uint32_t channels,
+                         uint32_t sample_rate, const char *usecase,
+                         audio_devices_t devices)
+{
+    std::lock_guard<std::mutex> lock(*lt_lock);
+    int64_t now_ns = lt_now_ns();
+    size_t frame_size = audio_bytes_per_sample(format) * channels;
+    size_t frames, copy;
+
+    if (!InputPending() || !frame_size || !sample_rate || !audio_is_linear_pcm(format))
+        return;
+    if (!lt_in_stream) {
+        lt_in_stream = stream;
+        lt_in_path = lt_path(usecase, devices);
+        lt_in_rate = sample_rate;
+        lt_capture_frames = (size_t)sample_rate * LATENCY_TEST_CAPTURE_MS / 1000;
+        lt_capture.reserve(lt_capture_frames);
+        lt_reads.reserve(lt_capture_frames / 16 + 1);
+        AHAL_DBG("capturing on %s", lt_in_path.c_str());
+    } else if (lt_in_stream != stream) {
+        return;
+    }
+
+    frames = bytes / frame_size;
+    lt_in_float.resize(frames * channels);
+    memcpy_by_audio_format(lt_in_float.data(), AUDIO_FORMAT_PCM_FLOAT, buffer, format,
+                           frames * channels);
+    copy = std::min(frames, lt_capture_frames - lt_capture.size());
+    /* the loop may come back on any channel */
+    for (size_t i = 0; i < copy; i++) {
+        float sum = 0;
+
+        for (uint32_t ch = 0; ch < channels; ch++)
+            sum += lt_in_float[i * channels + ch];
+        lt_capture.push_back(sum / channels);
+    }
+    if (lt_reads.size() < lt_reads.capacity())
+        lt_reads.push_back({lt_capture.size() + frames - copy, now_ns});
+
+    if (lt_capture.size() == lt_capture_frames &&
+        lt_state.load() == LATENCY_TEST_CAPTURING) {
+        lt_state = LATENCY_TEST_ANALYZING;
+        lt_cond->notify_all();
+    }
+}
+
+void LatencyTest::Dump(int fd)
+{
+    std::lock_guard<std::mutex> lock(*lt_lock);
+    static const char * const states[] = {
+        "idle", "armed", "injecting", "capturing", "analyzing",
+    };
+
+    dprintf(fd, " Latency test: %s, %u runs, last error: %s\n", states[lt_state.load()],
+            lt_runs, lt_last_error.c_str());
+    for (auto &r : lt_results) {
+        dprintf(fd, "  %s: ", r.path.c_str());
+        if (r.count)
+            dprintf(fd, "round trip last %.2f min %.2f avg %.2f max %.2f ms over %u, ",
+                    r.last_ms, r.min_ms, r.total_ms / r.count, r.max_ms, r.count);
+        dprintf(fd, "%u rejected, output reports %u ms, last confidence %.1f\n",
+                r.invalid, r.reported_ms, r.confidence);
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_LATENCY_TEST_H
+#define AUDIO_EXTN_LATENCY_TEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <system/audio.h>
+
+#include <vector>
+
+/*
+ * Round-trip latency measurement.
+ *
+ * Once armed, the next PCM output stream to write (optionally only the given
+ * use case) plays a burst in place of its data, and the next input stream to
+ * read records what follows. A worker thread cross-correlates the capture
+ * with the burst regenerated at the input rate; the round trip is the time
+ * from the burst being handed to write() to its first sample being captured,
+ * and is kept per output and input path next to the latency the output
+ * stream reports. The acoustic or electrical loop between the two devices is
+ * up to the tester.
+ */
+class LatencyTest {
+public:
+    enum Signal {
+        SIGNAL_CHIRP,   /* 20 ms 500-8000 Hz sweep, robust against noise */
+        SIGNAL_IMPULSE, /* single sample, for electrical loops */
+    };
+
+    /*
+     * arms a measurement on "latency_test=chirp|impulse|stop", the output use
+     * case is restricted by "latency_test_usecase=<use case name>"
+     */
+    static int SetParameters(const char *signal, const char *usecase);
+    /* cheap checks for the write and read paths */
+    static bool OutputPending();
+    static bool InputPending();
+    /*
+     * returns the buffer to write: out, filled with the burst while it is
+     * injected, buffer itself otherwise. out belongs to the stream so it
+     * stays valid until its write is done.
+     */
+    static const void *OnWrite(const void *stream, const void *buffer, size_t bytes,
+                               std::vector<uint8_t> *out,
+                               audio_format_t format, uint32_t channels,
+                               uint32_t sample_rate, const char *usecase,
+                               audio_devices_t devices, uint32_t reported_ms);
+    /*
+     * records capture returned to the client, after all HAL processing,
+     * mixed down to mono
+     */
+    static void OnRead(const void *stream, const void *buffer, size_t bytes,
+                       audio_format_t format, uint32_t channels,
+                       uint32_t sample_rate, const char *usecase,
+                       audio_devices_t devices);
+    static void Dump(int fd);
+};
+
+#endif /* AUDIO_EXTN_LATENCY_TEST_H */
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: MmapClock"
+/* #define LOG_NDEBUG 0 */
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <cutils/properties.h>
+
+#include "AudioCommon.h"
+#include "MmapClock.h"
+
+#define MMAP_CLOCK_REANCHOR_MS_DEFAULT 20
+#define MMAP_CLOCK_ANOMALY_US_DEFAULT 2000
+/* PLL gains, per reading: phase and frequency correction */
+#define MMAP_CLOCK_KP 0.5
+#define MMAP_CLOCK_KI 0.05
+/* the audio clock is trusted to be within this of nominal */
+#define MMAP_CLOCK_MAX_PPM 1000
+
+static int64_t mmap_clock_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void MmapClock::Start(uint32_t sample_rate)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    int32_t reanchor_ms = property_get_int32("vendor.audio.mmap.clock.reanchor_ms",
+                                             MMAP_CLOCK_REANCHOR_MS_DEFAULT);
+    int32_t anomaly_us = property_get_int32("vendor.audio.mmap.clock.anomaly_us",
+                                            MMAP_CLOCK_ANOMALY_US_DEFAULT);
+
+    sample_rate_ = sample_rate;
+    reanchor_ns_ = reanchor_ms > 0 ? (uint64_t)reanchor_ms * 1000000 : 0;
+    anomaly_frames_ = (double)anomaly_us * sample_rate / 1000000;
+    nominal_rate_ = (double)sample_rate / 1000000000;
+    rate_ = nominal_rate_;
+    anchored_ = false;
+    last_reported_ = 0;
+    /* 0 disables the model, every query reads the hardware */
+    started_ = sample_rate > 0 && reanchor_ns_ > 0;
+    AHAL_DBG("rate %u, re-anchor %d ms, anomaly %d us, %s", sample_rate, reanchor_ms,
+             anomaly_us, started_ ? "enabled" : "disabled");
+}
+
+void MmapClock::Stop()
+{
+    std::lock_guard<std::mutex> lock(lock_);
+
+    started_ = false;
+    anchored_ = false;
+}
+
+bool MmapClock::Extrapolate(struct audio_mmap_position *position)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    int64_t now_ns, frames;
+    uint64_t cost_ns;
+
+    if (!started_ || !anchored_)
+        return false;
+    now_ns = mmap_clock_now_ns();
+    if ((uint64_t)(now_ns - anchor_ns_) >= reanchor_ns_)
+        return false;
+
+    frames = (int64_t)floor(anchor_frames_ + rate_ * (now_ns - anchor_ns_));
+    frames = std::max(frames, last_reported_);
+    last_reported_ = frames;
+    position->position_frames = (int32_t)frames;
+    position->time_nanoseconds = now_ns;
+
+    cost_ns = mmap_clock_now_ns() - now_ns;
+    extrapolated_++;
+    extrapolate_ns_ += cost_ns;
+    extrapolate_max_ns_ = std::max(extrapolate_max_ns_, cost_ns);
+    return true;
+}
+
+/* the hardware position is 32 bit and wraps, the model is not */
+int64_t MmapClock::Unwrap(int32_t position_frames)
+{
+    hw_frames_ += (int32_t)((uint32_t)position_frames - (uint32_t)last_raw_);
+    last_raw_ = position_frames;
+    return hw_frames_;
+}
+
+void MmapClock::Update(struct audio_mmap_position *position, uint64_t query_ns)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    int64_t frames, dt_ns;
+    double predicted, error, max_rate;
+
+    hw_queries_++;
+    hw_query_ns_ += query_ns;
+    hw_query_max_ns_ = std::max(hw_query_max_ns_, query_ns);
+    if (!started_)
+        return;
+
+    if (!anchored_) {
+        last_raw_ = position->position_frames;
+        hw_frames_ = position->position_frames;
+        anchor_frames_ = hw_frames_;
+        anchor_ns_ = position->time_nanoseconds;
+        rate_ = nominal_rate_;
+        anchored_ = true;
+        goto report;
+    }
+
+    frames = Unwrap(position->position_frames);
+    dt_ns = position->time_nanoseconds - anchor_ns_;
+    if (dt_ns <= 0)
+        goto report;
+
+    /* what the model would have answered at the time of the reading */
+    predicted = anchor_frames_ + rate_ * dt_ns;
+    error = frames - predicted;
+    error_samples_++;
+    error_abs_total_ += fabs(error);
+    error_abs_max_ = std::max(error_abs_max_, fabs(error));
+
+    if (fabs(error) > anomaly_frames_) {
+        AHAL_DBG("position off by %.0f frames, restarting model", error);
+        anomalies_++;
+        anchor_frames_ = frames;
+        rate_ = nominal_rate_;
+    } else {
+        anchor_frames_ = predicted + MMAP_CLOCK_KP * error;
+        rate_ += MMAP_CLOCK_KI * error / dt_ns;
+        max_rate = nominal_rate_ * MMAP_CLOCK_MAX_PPM / 1000000;
+        rate_ = std::min(std::max(rate_, nominal_rate_ - max_rate), nominal_rate_ + max_rate);
+    }
+    anchor_ns_ = position->time_nanoseconds;
+
+report:
+    /* an extrapolation slightly ahead of the hardware must not be undone */
+    frames = hw_frames_;
+    if (frames < last_reported_ && last_reported_ - frames <= anomaly_frames_) {
+        held_back_++;
+        frames = last_reported_;
+    }
+    last_reported_ = frames;
+    position->position_frames = (int32_t)frames;
+}
+
+void MmapClock::Dump(int fd)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    double ppm = nominal_rate_ > 0 ? (rate_ / nominal_rate_ - 1) * 1000000 : 0;
+
+    dprintf(fd, "  mmap clock: %s, re-anchor %llu ms, drift %.1f ppm\n",
+            started_ ? "running" : "stopped", (unsigned long long)reanchor_ns_ / 1000000, ppm);
+    dprintf(fd, "    hardware queries %llu, avg %llu ns max %llu ns\n",
+            (unsigned long long)hw_queries_,
+            (unsigned long long)(hw_queries_ ? hw_query_ns_ / hw_queries_ : 0),
+            (unsigned long long)hw_query_max_ns_);
+    dprintf(fd, "    extrapolated %llu, avg %llu ns max %llu ns\n",
+            (unsigned long long)extrapolated_,
+            (unsigned long long)(extrapolated_ ? extrapolate_ns_ / extrapolated_ : 0),
+            (unsigned long long)extrapolate_max_ns_);
+    dprintf(fd, "    model error at re-anchor avg %.1f max %.1f frames, %llu anomalies, "
+            "%llu readings held back\n",
+            error_samples_ ? error_abs_total_ / error_samples_ : 0, error_abs_max_,
+            (unsigned long long)anomalies_, (unsigned long long)held_back_);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_MMAP_CLOCK_H
+#define AUDIO_EXTN_MMAP_CLOCK_H
+
+#include <stdint.h>
+#include <hardware/audio.h>
+
+#include <mutex>
+
+/*
+ * Position model of a MMAP stream.
+ *
+ * Hardware readings (position, timestamp) anchor a linear model whose rate
+ * is tracked by a second order PLL, so the drift of the audio clock against
+ * CLOCK_MONOTONIC is followed. Queries within the re-anchor interval of the
+ * last reading are answered from the model; a reading further than the
+ * anomaly threshold from the model (xrun, stop, clock jump) restarts it at
+ * the nominal rate. Reported positions never go backwards.
+ */
+class MmapClock {
+public:
+    /* arms the model for a started stream, reads vendor.audio.mmap.clock.* */
+    void Start(uint32_t sample_rate);
+    void Stop();
+    /* fills position from the model, false when the hardware has to be read */
+    bool Extrapolate(struct audio_mmap_position *position);
+    /* feeds a hardware reading, possibly adjusting it to stay monotonic */
+    void Update(struct audio_mmap_position *position, uint64_t query_ns);
+    void Dump(int fd);
+
+private:
+    int64_t Unwrap(int32_t position_frames);
+
+    std::mutex lock_;
+    bool started_ = false;
+    bool anchored_ = false;
+    uint32_t sample_rate_ = 0;
+    uint64_t reanchor_ns_ = 0;
+    double anomaly_frames_ = 0;
+    /* model: frames = anchor_frames_ + rate_ * (t - anchor_ns_) */
+    double anchor_frames_ = 0;
+    int64_t anchor_ns_ = 0;
+    double rate_ = 0;          /* frames per ns */
+    double nominal_rate_ = 0;
+    int32_t last_raw_ = 0;
+    int64_t hw_frames_ = 0;    /* unwrapped hardware position */
+    int64_t last_reported_ = 0;
+
+    /* statistics */
+    uint64_t hw_queries_ = 0;
+    uint64_t hw_query_ns_ = 0;
+    uint64_t hw_query_max_ns_ = 0;
+    uint64_t extrapolated_ = 0;
+    uint64_t extrapolate_ns_ = 0;
+    uint64_t extrapolate_max_ns_ = 0;
+    uint64_t error_samples_ = 0;
+    double error_abs_total_ = 0;
+    double error_abs_max_ = 0;
+    uint64_t anomalies_ = 0;
+    uint64_t held_back_ = 0;
+};
+
+#endif /* AUDIO_EXTN_MMAP_CLOCK_H */
@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: PalCallbackDispatcher"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <system/thread_defs.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "AudioCommon.h"
+#include "EventTrace.h"
+#include "PalCallbackDispatcher.h"
+
+/* below the fast mixer and fast capture threads */
+#define PAL_CALLBACK_RT_PRIORITY 1
+/* retry period of a PAL callback waiting for room in the queue */
+#define PAL_CALLBACK_FULL_WAIT_US 100
+
+/*
+ * events kept as stream flags on a full queue, in the order they are delivered.
+ * PAL has at most one drain pending per stream, so a flag loses no event.
+ */
+#define PAL_CALLBACK_PENDING_WRITE_READY (1 << 0)
+#define PAL_CALLBACK_PENDING_PARTIAL_DRAIN_READY (1 << 1)
+#define PAL_CALLBACK_PENDING_DRAIN_READY (1 << 2)
+#define PAL_CALLBACK_PENDING_ERROR (1 << 3)
+
+struct PalCallbackEvent {
+    std::atomic<uint32_t> seq;
+    uint64_t token;
+    pal_stream_handle_t *handle;
+    uint32_t event_id;
+    uint32_t event_size;
+    uint64_t posted_ns;
+    uint32_t data[PAL_CALLBACK_EVENT_DATA_MAX / sizeof(uint32_t)];
+};
+
+/*
+ * Per registered stream, indexed by the low bits of its token. pending_pos is
+ * the enqueue position when the first pending flag was set: the flags are
+ * delivered once the dispatcher has passed it.
+ */
+struct PalCallbackStream {
+    std::atomic<uint64_t> token;
+    std::atomic<pal_stream_handle_t *> handle;
+    std::atomic<uint32_t> pending;
+    std::atomic<uint32_t> pending_pos;
+    std::atomic<uint64_t> pending_ns;
+    std::atomic<bool> write_ready_queued;
+};
+
+static PalCallbackEvent cb_queue[PAL_CALLBACK_QUEUE_SIZE];
+static std::atomic<uint32_t> cb_enqueue_pos{0};
+static uint32_t cb_dequeue_pos;
+
+static PalCallbackStream cb_streams[PAL_CALLBACK_MAX_STREAMS];
+/* some stream has pending flags */
+static std::atomic<bool> cb_pending{false};
+
+/* the dispatcher is never stopped, nor are its wait objects destroyed */
+static std::once_flag cb_once;
+static std::atomic<bool> cb_waiting{false};
+static std::mutex *cb_wait_lock;
+static std::condition_variable *cb_cond;
+
+static std::mutex cb_targets_lock;
+static std::map<uint64_t, std::weak_ptr<PalCallbackTarget>> cb_targets;
+static uint64_t cb_next_token = 1;
+
+/* statistics */
+static std::atomic<uint64_t> cb_posted{0};
+static std::atomic<uint64_t> cb_merged{0};
+static std::atomic<uint64_t> cb_kept{0};
+static std::atomic<uint64_t> cb_waited_full{0};
+static std::atomic<uint64_t> cb_truncated{0};
+static std::atomic<uint64_t> cb_dropped_stale{0};
+static std::atomic<uint64_t> cb_delivered{0};
+static std::atomic<uint64_t> cb_latency_total_ns{0};
+static std::atomic<uint64_t> cb_latency_max_ns{0};
+static std::atomic<uint64_t> cb_handler_max_ns{0};
+static std::atomic<bool> cb_realtime{false};
+
+static uint64_t cb_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void cb_update_max(std::atomic<uint64_t> &max, uint64_t value)
+{
+    if (value > max.load())
+        max.store(value);
+}
+
+static bool cb_queue_empty()
+{
+    PalCallbackEvent *ev = &cb_queue[cb_dequeue_pos & (PAL_CALLBACK_QUEUE_SIZE - 1)];
+
+    return ev->seq.load(std::memory_order_acquire) != cb_dequeue_pos + 1;
+}
+
+static PalCallbackStream *cb_stream(uint64_t token)
+{
+    PalCallbackStream *stream = &cb_streams[token & (PAL_CALLBACK_MAX_STREAMS - 1)];
+
+    return stream->token.load() == token ? stream : nullptr;
+}
+
+static uint32_t cb_pending_bit(uint32_t event_id)
+{
+    switch (event_id) {
+    case PAL_STREAM_CBK_EVENT_WRITE_READY:
+        return PAL_CALLBACK_PENDING_WRITE_READY;
+    case PAL_STREAM_CBK_EVENT_PARTIAL_DRAIN_READY:
+        return PAL_CALLBACK_PENDING_PARTIAL_DRAIN_READY;
+    case PAL_STREAM_CBK_EVENT_DRAIN_READY:
+        return PAL_CALLBACK_PENDING_DRAIN_READY;
+    case PAL_STREAM_CBK_EVENT_ERROR:
+        return PAL_CALLBACK_PENDING_ERROR;
+    default:
+        return 0;
+    }
+}
+
+static void cb_wake()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (cb_waiting.load()) {
+        std::lock_guard<std::mutex> lock(*cb_wait_lock);
+        cb_cond->notify_one();
+    }
+}
+
+static void cb_deliver(uint64_t token, pal_stream_handle_t *handle, uint32_t event_id,
+                       const uint32_t *event_data, uint32_t event_size, uint64_t posted_ns)
+{
+    std::shared_ptr<PalCallbackTarget> target;
+    uint64_t start_ns, end_ns;
+
+    {
+        std::lock_guard<std::mutex> lock(cb_targets_lock);
+        auto it = cb_targets.find(token);
+        if (it != cb_targets.end())
+            target = it->second.lock();
+    }
+    if (!target) {
+        AHAL_DBG("event %x for closed stream, token %" PRIu64, event_id, token);
+        cb_dropped_stale++;
+        return;
+    }
+
+    start_ns = cb_now_ns();
+    target->OnPalEvent(handle, event_id, event_size ? event_data : nullptr, event_size);
+    end_ns = cb_now_ns();
+    EventTrace::Record(EVENT_TRACE_PAL_CALLBACK_DONE, token, event_id, end_ns - start_ns);
+    cb_delivered++;
+    cb_latency_total_ns += end_ns - posted_ns;
+    cb_update_max(cb_latency_max_ns, end_ns - posted_ns);
+    cb_update_max(cb_handler_max_ns, end_ns - start_ns);
+}
+
+/* the events of the stream's pending flags, once no earlier event is queued */
+static void cb_deliver_pending()
+{
+    static const uint32_t events[] = {
+        PAL_STREAM_CBK_EVENT_WRITE_READY,
+        PAL_STREAM_CBK_EVENT_PARTIAL_DRAIN_READY,
+        PAL_STREAM_CBK_EVENT_DRAIN_READY,
+        PAL_STREAM_CBK_EVENT_ERROR,
+    };
+    PalCallbackStream *stream;
+    uint32_t pending;
+
+    cb_pending.store(false);
+    for (uint32_t i = 0; i < PAL_CALLBACK_MAX_STREAMS; i++) {
+        stream = &cb_streams[i];
+        if (!stream->pending.load())
+            continue;
+        if ((int32_t)(cb_dequeue_pos - stream->pending_pos.load()) < 0) {
+            cb_pending.store(true);
+            continue;
+        }
+        pending = stream->pending.exchange(0);
+        for (uint32_t event_id : events) {
+            if (!(pending & cb_pending_bit(event_id)))
+                continue;
+            if (event_id == PAL_STREAM_CBK_EVENT_WRITE_READY)
+                stream->write_ready_queued.store(false);
+            cb_deliver(stream->token.load(), stream->handle.load(), event_id, nullptr, 0,
+                       stream->pending_ns.load());
+        }
+    }
+}
+
+static void cb_dispatcher()
+{
+    struct sched_param param;
+    PalCallbackEvent *ev;
+    PalCallbackStream *stream;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = PAL_CALLBACK_RT_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+        cb_realtime = true;
+    } else {
+        AHAL_INFO("SCHED_FIFO not permitted, using audio priority");
+        setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+    }
+
+    for (;;) {
+        if (cb_queue_empty() && !cb_pending.load()) {
+            std::unique_lock<std::mutex> lock(*cb_wait_lock);
+
+            cb_waiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            cb_cond->wait(lock, [] { return !cb_queue_empty() || cb_pending.load(); });
+            cb_waiting.store(false);
+        }
+        if (cb_pending.load())
+            cb_deliver_pending();
+        if (cb_queue_empty())
+            continue;
+
+        ev = &cb_queue[cb_dequeue_pos & (PAL_CALLBACK_QUEUE_SIZE - 1)];
+        if (ev->event_id == PAL_STREAM_CBK_EVENT_WRITE_READY) {
+            stream = cb_stream(ev->token);
+            if (stream)
+                stream->write_ready_queued.store(false);
+        }
+        cb_deliver(ev->token, ev->handle, ev->event_id, ev->data, ev->event_size,
+                   ev->posted_ns);
+        ev->seq.store(cb_dequeue_pos + PAL_CALLBACK_QUEUE_SIZE, std::memory_order_release);
+        cb_dequeue_pos++;
+    }
+}
+
+static void cb_start()
+{
+    for (uint32_t i = 0; i < PAL_CALLBACK_QUEUE_SIZE; i++)
+        cb_queue[i].seq.store(i, std::memory_order_relaxed);
+    cb_wait_lock = new std::mutex();
+    cb_cond = new std::condition_variable();
+    std::thread(cb_dispatcher).detach();
+}
+
+uint64_t PalCallbackDispatcher::Register(std::weak_ptr<PalCallbackTarget> target)
+{
+    std::lock_guard<std::mutex> lock(cb_targets_lock);
+    PalCallbackStream *stream = nullptr;
+    uint32_t slot;
+    uint64_t token;
+
+    std::call_once(cb_once, cb_start);
+    for (slot = 0; slot < PAL_CALLBACK_MAX_STREAMS; slot++) {
+        if (!cb_streams[slot].token.load()) {
+            stream = &cb_streams[slot];
+            break;
+        }
+    }
+    /* the low bits of the token index its stream flags */
+    token = cb_next_token++ * PAL_CALLBACK_MAX_STREAMS + (slot & (PAL_CALLBACK_MAX_STREAMS - 1));
+    if (stream) {
+        stream->handle.store(nullptr);
+        stream->pending.store(0);
+        stream->write_ready_queued.store(false);
+        stream->token.store(token);
+    } else {
+        AHAL_ERR("%d streams registered, events of token %" PRIu64 " wait for room",
+                 PAL_CALLBACK_MAX_STREAMS, token);
+    }
+    cb_targets[token] = target;
+    return token;
+}
+
+void PalCallbackDispatcher::Unregister(uint64_t token)
+{
+    std::lock_guard<std::mutex> lock(cb_targets_lock);
+    PalCallbackStream *stream = cb_stream(token);
+
+    if (stream)
+        stream->token.store(0);
+    cb_targets.erase(token);
+}
+
+/* events of the stream are delivered in order once one of them is kept as a flag */
+static void cb_keep_pending(PalCallbackStream *stream, pal_stream_handle_t *handle,
+                            uint32_t bit)
+{
+    stream->handle.store(handle);
+    if (!stream->pending.load()) {
+        stream->pending_pos.store(cb_enqueue_pos.load());
+        stream->pending_ns.store(cb_now_ns());
+    }
+    stream->pending.fetch_or(bit);
+    cb_kept++;
+    cb_pending.store(true);
+    cb_wake();
+}
+
+/* bounded multi producer queue, each cell's seq tells which lap may use it */
+int32_t PalCallbackDispatcher::Post(pal_stream_handle_t *handle, uint32_t event_id,
+                                    uint32_t *event_data, uint32_t event_size,
+                                    uint64_t cookie)
+{
+    PalCallbackStream *stream;
+    uint32_t pos, bit;
+    bool waited = false;
+    PalCallbackEvent *ev;
+
+    std::call_once(cb_once, cb_start);
+    EventTrace::Record(EVENT_TRACE_PAL_CALLBACK, cookie, event_id, event_size);
+    cb_posted++;
+    stream = cb_stream(cookie);
+    bit = stream ? cb_pending_bit(event_id) : 0;
+    if (bit == PAL_CALLBACK_PENDING_WRITE_READY && stream->write_ready_queued.exchange(true)) {
+        cb_merged++;
+        return 0;
+    }
+    if (bit && stream->pending.load()) {
+        cb_keep_pending(stream, handle, bit);
+        return 0;
+    }
+
+    pos = cb_enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        ev = &cb_queue[pos & (PAL_CALLBACK_QUEUE_SIZE - 1)];
+        int32_t dif = (int32_t)(ev->seq.load(std::memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (cb_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                     std::memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            if (bit) {
+                cb_keep_pending(stream, handle, bit);
+                return 0;
+            }
+            if (!waited) {
+                AHAL_ERR("queue full, event %x waits for room", event_id);
+                cb_waited_full++;
+                waited = true;
+            }
+            usleep(PAL_CALLBACK_FULL_WAIT_US);
+            pos = cb_enqueue_pos.load(std::memory_order_relaxed);
+        } else {
+            pos = cb_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    ev->token = cookie;
+    ev->handle = handle;
+    ev->event_id = event_id;
+    ev->event_size = 0;
+    if (event_data && event_size) {
+        if (event_size > PAL_CALLBACK_EVENT_DATA_MAX) {
+            cb_truncated++;
+            event_size = PAL_CALLBACK_EVENT_DATA_MAX;
+        }
+        memcpy(ev->data, event_data, event_size);
+        ev->event_size = event_size;
+    }
+    ev->posted_ns = cb_now_ns();
+    ev->seq.store(pos + 1, std::memory_order_release);
+    cb_wake();
+    return 0;
+}
+
+void PalCallbackDispatcher::Dump(int fd)
+{
+    uint64_t delivered = cb_delivered.load();
+    size_t streams;
+
+    {
+        std::lock_guard<std::mutex> lock(cb_targets_lock);
+        streams = cb_targets.size();
+    }
+    dprintf(fd, "PAL callback dispatcher: %zu streams, %s\n", streams,
+            cb_realtime.load() ? "SCHED_FIFO" : "SCHED_OTHER");
+    dprintf(fd, "  events %llu: %llu delivered, %llu dropped closed stream, "
+            "%llu truncated\n",
+            (unsigned long long)cb_posted.load(), (unsigned long long)delivered,
+            (unsigned long long)cb_dropped_stale.load(),
+            (unsigned long long)cb_truncated.load());
+    dprintf(fd, "  %llu write ready merged, queue full: %llu kept as stream flags, "
+            "%llu waited for room\n",
+            (unsigned long long)cb_merged.load(), (unsigned long long)cb_kept.load(),
+            (unsigned long long)cb_waited_full.load());
+    dprintf(fd, "  delivery latency avg %llu us max %llu us, slowest handler %llu us\n",
+            (unsigned long long)(delivered ? cb_latency_total_ns.load() / delivered / 1000 : 0),
+            (unsigned long long)cb_latency_max_ns.load() / 1000,
+            (unsigned long long)cb_handler_max_ns.load() / 1000);
+}
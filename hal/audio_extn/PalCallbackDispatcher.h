@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_PAL_CALLBACK_DISPATCHER_H
+#define AUDIO_EXTN_PAL_CALLBACK_DISPATCHER_H
+
+#include <stdint.h>
+
+#include <memory>
+
+#include "PalApi.h"
+
+/* power of two, shared by all streams */
+#define PAL_CALLBACK_QUEUE_SIZE 256
+/* event payload copied with the event, longer payloads are truncated */
+#define PAL_CALLBACK_EVENT_DATA_MAX 32
+/* power of two, registered streams whose events can be kept as flags */
+#define PAL_CALLBACK_MAX_STREAMS 128
+
+class PalCallbackTarget {
+public:
+    virtual ~PalCallbackTarget() {}
+    /* runs on the dispatcher thread, must not wait for other streams */
+    virtual void OnPalEvent(pal_stream_handle_t *handle, uint32_t event_id,
+                            const uint32_t *event_data, uint32_t event_size) = 0;
+};
+
+/*
+ * Delivers PAL stream callbacks on one dispatcher thread.
+ *
+ * Streams register once and pass the returned token as their PAL callback
+ * cookie. The PAL callback only copies the event into a bounded lock-free
+ * queue; the dispatcher resolves the token through a weak reference, so
+ * events of a stream closed meanwhile are dropped instead of reaching a
+ * destroyed object, and the stream stays alive until its event returns.
+ *
+ * No event is dropped on a full queue. A write ready event is merged into
+ * the one of its stream still queued; write ready, drain and error events
+ * that find no room are kept as flags of their stream, which the dispatcher
+ * turns back into events once the events queued before them are delivered.
+ * Any other event makes the PAL callback wait for room.
+ */
+class PalCallbackDispatcher {
+public:
+    static uint64_t Register(std::weak_ptr<PalCallbackTarget> target);
+    static void Unregister(uint64_t token);
+    /* the pal_stream_callback, cookie is a registration token */
+    static int32_t Post(pal_stream_handle_t *handle, uint32_t event_id,
+                        uint32_t *event_data, uint32_t event_size, uint64_t cookie);
+    static void Dump(int fd);
+};
+
+#endif /* AUDIO_EXTN_PAL_CALLBACK_DISPATCHER_H */
@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: PcmTap"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <system/thread_defs.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <audio_utils/format.h>
+#include <cutils/properties.h>
+
+#include "AudioCommon.h"
+#include "PcmTap.h"
+
+#define PCM_TAP_DRAIN_MS 20
+#define PCM_TAP_RING_MS_DEFAULT 500
+#define PCM_TAP_DIR_DEFAULT "/data/vendor/audio"
+#define PCM_TAP_MAX_FINISHED 8
+
+#define WAV_HEADER_SIZE 44
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3
+
+static std::atomic<uint32_t> tap_points{0};
+static std::atomic<uint32_t> tap_generation{1};
+
+/* the writer thread is never stopped, nor are its wait objects destroyed */
+static std::once_flag tap_once;
+static std::mutex *tap_lock = new std::mutex();
+static std::condition_variable *tap_cond = new std::condition_variable();
+/* owned by the writer thread, which alone adds and removes taps */
+static std::list<std::unique_ptr<PcmTap>> *tap_list = new std::list<std::unique_ptr<PcmTap>>();
+/* slots of the open streams, for the writer thread to find requests */
+static std::list<PcmTapSlot *> *tap_slots = new std::list<PcmTapSlot *>();
+/* summaries of the last finished taps, for the dump */
+static std::list<std::string> *tap_finished = new std::list<std::string>();
+/* taps are only built by the writer thread */
+static uint32_t tap_sequence;
+
+static const char *tap_point_name(uint32_t point)
+{
+    switch (point) {
+    case PcmTap::POINT_OUT:
+        return "out";
+    case PcmTap::POINT_HAPTICS:
+        return "haptics";
+    case PcmTap::POINT_IN:
+        return "in";
+    default:
+        return "?";
+    }
+}
+
+/* bits per sample in the file, 8_24 is saved as 32 bit */
+static uint32_t tap_file_bits(audio_format_t format)
+{
+    return format == AUDIO_FORMAT_PCM_24_BIT_PACKED ? 24 :
+           audio_bytes_per_sample(format) * 8;
+}
+
+PcmTap::PcmTap(Point point, const char *usecase, int handle, audio_format_t format,
+               uint32_t channels, uint32_t sample_rate, size_t ring_bytes)
+    : point_(point),
+      usecase_(usecase),
+      handle_(handle),
+      format_(format),
+      channels_(channels),
+      sample_rate_(sample_rate),
+      ring_(ring_bytes)
+{
+    char dir[PROPERTY_VALUE_MAX];
+    char path[PROPERTY_VALUE_MAX + 128];
+
+    property_get("vendor.audio.pcm_tap.dir", dir, PCM_TAP_DIR_DEFAULT);
+    /* the sequence keeps taps opened within the same second apart */
+    snprintf(path, sizeof(path), "%s/pcm_tap_%d_%s_%s_%lld_%u.wav", dir, handle,
+             tap_point_name(point), usecase, (long long)time(NULL), tap_sequence++);
+    path_ = path;
+}
+
+PcmTap::~PcmTap()
+{
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+void PcmTap::CopyIn(uint64_t pos, const void *data, size_t bytes)
+{
+    size_t offset = pos % ring_.size();
+    size_t first = std::min(bytes, ring_.size() - offset);
+
+    memcpy(&ring_[offset], data, first);
+    memcpy(&ring_[0], (const uint8_t *)data + first, bytes - first);
+}
+
+void PcmTap::CopyOut(uint64_t pos, void *data, size_t bytes)
+{
+    size_t offset = pos % ring_.size();
+    size_t first = std::min(bytes, ring_.size() - offset);
+
+    memcpy(data, &ring_[offset], first);
+    memcpy((uint8_t *)data + first, &ring_[0], bytes - first);
+}
+
+void PcmTap::Write(const void *data, size_t bytes)
+{
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    ChunkHeader header;
+
+    /* single writer, no read-modify-write needed */
+    bytes_in_.store(bytes_in_.load(std::memory_order_relaxed) + bytes,
+                    std::memory_order_relaxed);
+    if (sizeof(header) + bytes > ring_.size() - (head - tail)) {
+        pending_dropped_ += bytes;
+        bytes_dropped_.store(bytes_dropped_.load(std::memory_order_relaxed) + bytes,
+                             std::memory_order_relaxed);
+        drops_.store(drops_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+
+    header.bytes = bytes;
+    header.dropped_before = pending_dropped_;
+    CopyIn(head, &header, sizeof(header));
+    CopyIn(head + sizeof(header), data, bytes);
+    head_.store(head + sizeof(header) + bytes, std::memory_order_release);
+    pending_dropped_ = 0;
+}
+
+bool PcmTap::WriteFile(const void *data, size_t bytes)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    while (bytes) {
+        ssize_t n = write(fd_, p, bytes);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            AHAL_ERR("write to %s failed: %s", path_.c_str(), strerror(errno));
+            return false;
+        }
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+void PcmTap::UpdateHeader()
+{
+    uint32_t file_bits = tap_file_bits(format_);
+    uint32_t block_align = channels_ * file_bits / 8;
+    uint32_t data_size = (uint32_t)std::min<uint64_t>(data_bytes_, UINT32_MAX - WAV_HEADER_SIZE);
+    uint8_t header[WAV_HEADER_SIZE];
+    uint32_t value;
+    uint16_t value16;
+
+#define WAV_PUT32(offset, v) do { value = (v); memcpy(&header[offset], &value, 4); } while (0)
+#define WAV_PUT16(offset, v) do { value16 = (v); memcpy(&header[offset], &value16, 2); } while (0)
+    memcpy(&header[0], "RIFF", 4);
+    WAV_PUT32(4, WAV_HEADER_SIZE - 8 + data_size);
+    memcpy(&header[8], "WAVEfmt ", 8);
+    WAV_PUT32(16, 16);
+    WAV_PUT16(20, format_ == AUDIO_FORMAT_PCM_FLOAT ? WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM);
+    WAV_PUT16(22, channels_);
+    WAV_PUT32(24, sample_rate_);
+    WAV_PUT32(28, sample_rate_ * block_align);
+    WAV_PUT16(32, block_align);
+    WAV_PUT16(34, file_bits);
+    memcpy(&header[36], "data", 4);
+    WAV_PUT32(40, data_size);
+#undef WAV_PUT32
+#undef WAV_PUT16
+
+    if (pwrite(fd_, header, sizeof(header), 0) != sizeof(header))
+        AHAL_ERR("header update of %s failed: %s", path_.c_str(), strerror(errno));
+}
+
+bool PcmTap::Drain(std::vector<uint8_t> *scratch)
+{
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    bool wrote = false;
+
+    if (tail == head || failed_)
+        goto exit;
+
+    if (fd_ < 0) {
+        fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+        if (fd_ < 0) {
+            AHAL_ERR("cannot create %s: %s", path_.c_str(), strerror(errno));
+            failed_ = true;
+            goto exit;
+        }
+        file_open_ = true;
+        UpdateHeader();
+        lseek(fd_, WAV_HEADER_SIZE, SEEK_SET);
+        AHAL_INFO("tapping %s", path_.c_str());
+    }
+
+    while (tail != head) {
+        ChunkHeader header;
+        size_t file_bytes;
+
+        CopyOut(tail, &header, sizeof(header));
+        if (header.dropped_before) {
+            /* silence of the length dropped, in file samples */
+            file_bytes = header.dropped_before / audio_bytes_per_sample(format_) *
+                         tap_file_bits(format_) / 8;
+            scratch->assign(std::min<size_t>(file_bytes, 65536), 0);
+            for (size_t left = file_bytes; left && !failed_; ) {
+                size_t n = std::min(left, scratch->size());
+
+                failed_ = !WriteFile(scratch->data(), n);
+                left -= n;
+            }
+            silence_bytes_ += file_bytes;
+            data_bytes_ += file_bytes;
+        }
+
+        scratch->resize(header.bytes);
+        CopyOut(tail + sizeof(header), scratch->data(), header.bytes);
+        tail += sizeof(header) + header.bytes;
+        tail_.store(tail, std::memory_order_release);
+
+        file_bytes = header.bytes;
+        if (format_ == AUDIO_FORMAT_PCM_8_24_BIT) {
+            /* the container is the same size, the samples are shifted up in place */
+            memcpy_by_audio_format(scratch->data(), AUDIO_FORMAT_PCM_32_BIT, scratch->data(),
+                                   AUDIO_FORMAT_PCM_8_24_BIT,
+                                   header.bytes / audio_bytes_per_sample(format_));
+        }
+        if (!failed_)
+            failed_ = !WriteFile(scratch->data(), file_bytes);
+        data_bytes_ += file_bytes;
+        wrote = true;
+
+        head = head_.load(std::memory_order_acquire);
+    }
+
+exit:
+    if (failed_) {
+        /* keeps the stream side free of drops accounting for a dead file */
+        tail_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+    if (wrote && !failed_)
+        UpdateHeader();
+    return !failed_;
+}
+
+/* writer thread, tap_lock held: builds the taps requested by the streams */
+void PcmTap::BuildRequested()
+{
+    int32_t ring_ms = -1;
+
+    for (PcmTapSlot *slot : *tap_slots) {
+        int state = PcmTapSlot::SLOT_REQUESTED;
+        size_t frame_size;
+
+        if (!slot->state_.compare_exchange_strong(state, PcmTapSlot::SLOT_BUILDING,
+                                                  std::memory_order_acquire))
+            continue;
+        if (ring_ms < 0)
+            ring_ms = property_get_int32("vendor.audio.pcm_tap.ring_ms",
+                                         PCM_TAP_RING_MS_DEFAULT);
+        frame_size = audio_bytes_per_sample(slot->format_) * slot->channels_;
+        tap_list->push_back(std::make_unique<PcmTap>(slot->point_, slot->usecase_,
+                slot->handle_, slot->format_, slot->channels_, slot->sample_rate_,
+                (size_t)std::max(ring_ms, PCM_TAP_DRAIN_MS) * slot->sample_rate_ / 1000 *
+                frame_size));
+        slot->ready_ = tap_list->back().get();
+        slot->state_.store(PcmTapSlot::SLOT_READY, std::memory_order_release);
+    }
+}
+
+void PcmTap::WriterThread()
+{
+    std::vector<uint8_t> scratch;
+    std::unique_lock<std::mutex> lock(*tap_lock);
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_BACKGROUND);
+    for (;;) {
+        /* streams post requests without locking, they are polled while taps are on */
+        if (tap_list->empty() && !tap_points.load())
+            tap_cond->wait(lock, [] { return !tap_list->empty() || tap_points.load(); });
+        else
+            tap_cond->wait_for(lock, std::chrono::milliseconds(PCM_TAP_DRAIN_MS));
+
+        BuildRequested();
+        for (auto it = tap_list->begin(); it != tap_list->end(); ) {
+            PcmTap *tap = it->get();
+            /* everything the stream wrote before detaching is drained below */
+            bool finished = tap->detached_.load(std::memory_order_acquire);
+
+            lock.unlock();
+            tap->Drain(&scratch);
+            lock.lock();
+            if (!finished) {
+                it++;
+                continue;
+            }
+
+            char summary[512];
+
+            snprintf(summary, sizeof(summary),
+                     "%s: %llu bytes, %llu dropped in %llu drops%s",
+                     tap->file_open_ ? tap->path_.c_str() : "(no data)",
+                     (unsigned long long)tap->data_bytes_,
+                     (unsigned long long)tap->bytes_dropped_.load(),
+                     (unsigned long long)tap->drops_.load(),
+                     tap->failed_ ? ", write failed" : "");
+            AHAL_INFO("finished %s", summary);
+            tap_finished->push_back(summary);
+            if (tap_finished->size() > PCM_TAP_MAX_FINISHED)
+                tap_finished->pop_front();
+            it = tap_list->erase(it);
+        }
+    }
+}
+
+int PcmTap::SetParameters(const char *value)
+{
+    char points[256];
+    char *token, *save = NULL;
+    uint32_t mask = 0;
+
+    strlcpy(points, value, sizeof(points));
+    for (token = strtok_r(points, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(token, "out")) {
+            mask |= POINT_OUT;
+        } else if (!strcmp(token, "haptics")) {
+            mask |= POINT_HAPTICS;
+        } else if (!strcmp(token, "in")) {
+            mask |= POINT_IN;
+        } else if (!strcmp(token, "all")) {
+            mask |= POINT_OUT | POINT_HAPTICS | POINT_IN;
+        } else if (strcmp(token, "off")) {
+            AHAL_ERR("unknown tap point %s", token);
+            return -EINVAL;
+        }
+    }
+    AHAL_DBG("tap points %#x", mask);
+    std::call_once(tap_once, [] { std::thread(PcmTap::WriterThread).detach(); });
+    std::lock_guard<std::mutex> lock(*tap_lock);
+    tap_points = mask;
+    tap_generation++;
+    tap_cond->notify_one();
+
+    return 0;
+}
+
+uint32_t PcmTap::Generation()
+{
+    return tap_generation.load(std::memory_order_acquire);
+}
+
+void PcmTap::Dump(int fd)
+{
+    std::vector<std::string> lines;
+    uint32_t points = tap_points.load();
+    char line[1024];
+
+    /* formatted under the lock, written without it: the dump fd may be slow */
+    {
+        std::lock_guard<std::mutex> lock(*tap_lock);
+
+        for (auto &tap : *tap_list) {
+            snprintf(line, sizeof(line),
+                     "  handle %d %s %s: %llu bytes in, %llu dropped in %llu drops, %s\n",
+                     tap->handle_, tap_point_name(tap->point_), tap->usecase_.c_str(),
+                     (unsigned long long)tap->bytes_in_.load(),
+                     (unsigned long long)tap->bytes_dropped_.load(),
+                     (unsigned long long)tap->drops_.load(),
+                     tap->file_open_ ? tap->path_.c_str() : "no file yet");
+            lines.push_back(line);
+        }
+        for (auto &summary : *tap_finished)
+            lines.push_back("  finished " + summary + "\n");
+    }
+
+    dprintf(fd, " PCM taps:%s%s%s%s\n", points ? "" : " off",
+            points & POINT_OUT ? " out" : "", points & POINT_HAPTICS ? " haptics" : "",
+            points & POINT_IN ? " in" : "");
+    for (auto &l : lines)
+        dprintf(fd, "%s", l.c_str());
+}
+
+PcmTapSlot::PcmTapSlot(PcmTap::Point point)
+    : point_(point)
+{
+    std::lock_guard<std::mutex> lock(*tap_lock);
+
+    tap_slots->push_back(this);
+}
+
+PcmTapSlot::~PcmTapSlot()
+{
+    std::lock_guard<std::mutex> lock(*tap_lock);
+
+    /* builds run under tap_lock, so the slot is not SLOT_BUILDING here */
+    tap_slots->remove(this);
+    Detach(tap_);
+    if (state_.load(std::memory_order_acquire) == SLOT_READY)
+        Detach(ready_);
+}
+
+void PcmTapSlot::Detach(PcmTap *tap)
+{
+    if (tap)
+        tap->detached_.store(true, std::memory_order_release);
+}
+
+void PcmTapSlot::Update(const char *usecase, int handle, audio_format_t format,
+                        uint32_t channels, uint32_t sample_rate)
+{
+    uint32_t generation = PcmTap::Generation();
+    int state = state_.load(std::memory_order_acquire);
+
+    if (state == SLOT_READY) {
+        Detach(tap_);
+        tap_ = ready_;
+        state_.store(SLOT_IDLE, std::memory_order_relaxed);
+        state = SLOT_IDLE;
+    }
+    if (generation_ == generation)
+        return;
+    /* the request cannot be changed while it is built, retried on the next call */
+    if (state == SLOT_BUILDING)
+        return;
+    if (state == SLOT_REQUESTED &&
+        !state_.compare_exchange_strong(state, SLOT_IDLE, std::memory_order_relaxed))
+        return;
+
+    generation_ = generation;
+    Detach(tap_);
+    tap_ = nullptr;
+    if (!(tap_points.load() & point_) || !audio_is_linear_pcm(format) || !channels ||
+        !sample_rate)
+        return;
+    usecase_ = usecase;
+    handle_ = handle;
+    format_ = format;
+    channels_ = channels;
+    sample_rate_ = sample_rate;
+    /* picked up by the writer thread within PCM_TAP_DRAIN_MS */
+    state_.store(SLOT_REQUESTED, std::memory_order_release);
+}
+
+void PcmTapSlot::Reset()
+{
+    int state = SLOT_REQUESTED;
+
+    Detach(tap_);
+    tap_ = nullptr;
+    state_.compare_exchange_strong(state, SLOT_IDLE, std::memory_order_relaxed);
+    /* a tap still being built is picked up and dropped by the next Update */
+    generation_ = 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_PCM_TAP_H
+#define AUDIO_EXTN_PCM_TAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <system/audio.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+ * Copies of the PCM a stream exchanges with PAL, saved as WAV files.
+ *
+ * Taps are enabled with "pcm_tap=out,haptics,in" (or "all", "off"). Each
+ * stream tap point is a PcmTapSlot: on its next write or read after a change
+ * the stream posts a request, and the writer thread builds the tap with its
+ * preallocated single producer ring and hands it back through the slot. The
+ * audio thread never allocates, locks or does file I/O; it only copies its
+ * buffer into the ring. The writer thread, at background priority, drains the
+ * rings into <vendor.audio.pcm_tap.dir>/pcm_tap_<handle>_<point>_<use case>_<time>_<n>.wav
+ * every PCM_TAP_DRAIN_MS. A buffer that does not fit is dropped and counted,
+ * and replaced by as much silence in the file so it keeps its timing. A tap
+ * is finished once the stream detaches it, on standby or close.
+ */
+class PcmTap {
+public:
+    enum Point {
+        POINT_OUT = 0x1,     /* written to PAL, after format conversion */
+        POINT_HAPTICS = 0x2, /* haptics channels split from the output */
+        POINT_IN = 0x4,      /* returned to the client, after all processing */
+    };
+
+    static int SetParameters(const char *value);
+    /* bumped by every SetParameters, slots compare it with what they last saw */
+    static uint32_t Generation();
+    static void Dump(int fd);
+
+    /* copies bytes into the ring, never blocks */
+    void Write(const void *data, size_t bytes);
+
+    PcmTap(Point point, const char *usecase, int handle, audio_format_t format,
+           uint32_t channels, uint32_t sample_rate, size_t ring_bytes);
+    ~PcmTap();
+
+private:
+    friend class PcmTapSlot;
+
+    struct ChunkHeader {
+        uint32_t bytes;
+        uint32_t dropped_before;
+    };
+
+    void CopyIn(uint64_t pos, const void *data, size_t bytes);
+    void CopyOut(uint64_t pos, void *data, size_t bytes);
+    /* writer thread: moves the ring to the file, false once the file failed */
+    bool Drain(std::vector<uint8_t> *scratch);
+    bool WriteFile(const void *data, size_t bytes);
+    void UpdateHeader();
+    static void BuildRequested();
+    static void WriterThread();
+
+    const Point point_;
+    const std::string usecase_;
+    const int handle_;
+    const audio_format_t format_;
+    const uint32_t channels_;
+    const uint32_t sample_rate_;
+
+    std::vector<uint8_t> ring_;
+    std::atomic<uint64_t> head_{0}; /* written by the stream */
+    std::atomic<uint64_t> tail_{0}; /* written by the writer thread */
+    uint32_t pending_dropped_ = 0;  /* stream side, not in the ring yet */
+    /* set by the stream when it is done writing, the writer thread then finishes the tap */
+    std::atomic<bool> detached_{false};
+
+    /* statistics, written by the stream */
+    std::atomic<uint64_t> bytes_in_{0};
+    std::atomic<uint64_t> bytes_dropped_{0};
+    std::atomic<uint64_t> drops_{0};
+
+    std::string path_;
+    std::atomic<bool> file_open_{false};
+    /* writer thread state */
+    int fd_ = -1;
+    bool failed_ = false;
+    uint64_t data_bytes_ = 0;
+    uint64_t silence_bytes_ = 0;
+};
+
+/*
+ * One tap point of a stream, owned by the stream for its lifetime. Update,
+ * Reset and Write are called by the stream with its lock held.
+ */
+class PcmTapSlot {
+public:
+    explicit PcmTapSlot(PcmTap::Point point);
+    ~PcmTapSlot();
+
+    /* cheap check for the write and read paths */
+    bool NeedsUpdate() const {
+        return generation_ != PcmTap::Generation() ||
+               state_.load(std::memory_order_relaxed) == SLOT_READY;
+    }
+    /*
+     * picks up a tap built for this slot, and after a pcm_tap change requests
+     * one for the given stream configuration or drops the current one
+     */
+    void Update(const char *usecase, int handle, audio_format_t format, uint32_t channels,
+                uint32_t sample_rate);
+    /* drops the tap, finishing its file; the next Update requests a new one */
+    void Reset();
+    void Write(const void *data, size_t bytes) {
+        if (tap_)
+            tap_->Write(data, bytes);
+    }
+
+private:
+    friend class PcmTap;
+
+    /* IDLE -> REQUESTED and back, READY -> IDLE by the stream; REQUESTED ->
+     * BUILDING -> READY by the writer thread, with tap_lock held */
+    enum State {
+        SLOT_IDLE,
+        SLOT_REQUESTED,
+        SLOT_BUILDING,
+        SLOT_READY,
+    };
+
+    void Detach(PcmTap *tap);
+
+    const PcmTap::Point point_;
+    /* stream side */
+    PcmTap *tap_ = nullptr;
+    uint32_t generation_ = 0;
+    std::atomic<int> state_{SLOT_IDLE};
+    /* request, written by the stream before SLOT_REQUESTED */
+    const char *usecase_ = nullptr;
+    int handle_ = 0;
+    audio_format_t format_ = AUDIO_FORMAT_DEFAULT;
+    uint32_t channels_ = 0;
+    uint32_t sample_rate_ = 0;
+    /* written by the writer thread before SLOT_READY */
+    PcmTap *ready_ = nullptr;
+};
+
+#endif /* AUDIO_EXTN_PCM_TAP_H */
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "AHAL: StreamRecovery"
+/* #define LOG_NDEBUG 0 */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "AudioCommon.h"
+#include "StreamRecovery.h"
+
+#define RECOVERY_MIN_BACKOFF_MS 10
+#define RECOVERY_MAX_BACKOFF_MS 640
+/* the null device catches up at most this late, like a sink buffer would */
+#define RECOVERY_MAX_LATE_NS 100000000LL
+
+static uint64_t recovery_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+StreamRecovery::StreamRecovery()
+{
+}
+
+StreamRecovery::~StreamRecovery()
+{
+    Stop();
+    if (timer_fd_ >= 0)
+        close(timer_fd_);
+}
+
+int StreamRecovery::Start(uint32_t frame_size, uint32_t sample_rate,
+                          std::function<void()> close, std::function<int()> reopen)
+{
+    uint64_t now = recovery_now_ns();
+
+    if (IsActive())
+        return 0;
+    if (frame_size == 0 || sample_rate == 0) {
+        AHAL_ERR("invalid frameSize=%d, sampleRate=%d", frame_size, sample_rate);
+        return -EINVAL;
+    }
+    if (timer_fd_ < 0) {
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timer_fd_ < 0) {
+            AHAL_ERR("timerfd_create failed, %s", strerror(errno));
+            return -errno;
+        }
+    }
+    /* the worker of the previous recovery is done with the stream */
+    if (thread_.joinable())
+        thread_.join();
+
+    /* a stream failing again right after recovering does not retry at once */
+    if (end_ns_ && now - end_ns_ < RECOVERY_MAX_BACKOFF_MS * 1000000LL)
+        backoff_ms_ = NextBackoff(backoff_ms_);
+    else
+        backoff_ms_ = 0;
+    frame_size_ = frame_size;
+    sample_rate_ = sample_rate;
+    close_ = close;
+    reopen_ = reopen;
+    due_ns_ = now;
+    start_ns_ = now;
+    frames_lost_.store(0);
+    exit_ = false;
+    active_.store(true, std::memory_order_release);
+
+    thread_ = std::thread(&StreamRecovery::Worker, this);
+    return 0;
+}
+
+void StreamRecovery::Stop()
+{
+    if (!thread_.joinable() || thread_.get_id() == std::this_thread::get_id())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        exit_ = true;
+    }
+    exit_cond_.notify_all();
+    thread_.join();
+    if (active_.load()) {
+        AHAL_INFO("recovery abandoned after %llu ms, %llu frames dropped",
+                  (unsigned long long)(recovery_now_ns() - start_ns_) / 1000000,
+                  (unsigned long long)frames_lost_.load());
+        total_frames_lost_ += frames_lost_.load();
+        active_.store(false, std::memory_order_release);
+    }
+}
+
+uint32_t StreamRecovery::NextBackoff(uint32_t backoff_ms)
+{
+    return std::min(std::max(backoff_ms * 2, (uint32_t)RECOVERY_MIN_BACKOFF_MS),
+                    (uint32_t)RECOVERY_MAX_BACKOFF_MS);
+}
+
+void StreamRecovery::Worker()
+{
+    uint32_t attempts = 0;
+    int ret;
+
+    close_();
+    for (;;) {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (exit_cond_.wait_for(lock, std::chrono::milliseconds(backoff_ms_),
+                                [&] { return exit_; }))
+            return;
+        lock.unlock();
+
+        attempts++;
+        ret = reopen_();
+        if (ret == 0)
+            break;
+        backoff_ms_ = NextBackoff(backoff_ms_);
+        AHAL_DBG("reopen attempt %u failed %d, next in %u ms", attempts, ret, backoff_ms_);
+    }
+
+    end_ns_ = recovery_now_ns();
+    recoveries_++;
+    total_frames_lost_ += frames_lost_.load();
+    active_.store(false, std::memory_order_release);
+    AHAL_INFO("recovered after %u attempts in %llu ms, %llu frames dropped, "
+              "%u recoveries and %llu frames dropped so far",
+              attempts, (unsigned long long)(end_ns_ - start_ns_) / 1000000,
+              (unsigned long long)frames_lost_.load(), recoveries_,
+              (unsigned long long)total_frames_lost_);
+}
+
+size_t StreamRecovery::Consume(size_t bytes)
+{
+    uint64_t frames = bytes / frame_size_;
+    uint64_t now = recovery_now_ns();
+    struct itimerspec due;
+    uint64_t expirations;
+
+    frames_lost_ += frames;
+    if (due_ns_ + RECOVERY_MAX_LATE_NS < now)
+        due_ns_ = now;
+    due_ns_ += frames * 1000000000LL / sample_rate_;
+    if (due_ns_ <= now)
+        return bytes;
+
+    memset(&due, 0, sizeof(due));
+    due.it_value.tv_sec = due_ns_ / 1000000000LL;
+    due.it_value.tv_nsec = due_ns_ % 1000000000LL;
+    if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &due, NULL) == 0) {
+        if (read(timer_fd_, &expirations, sizeof(expirations)) < 0)
+            AHAL_ERR("timerfd read failed, %s", strerror(errno));
+    } else {
+        usleep((due_ns_ - now) / 1000);
+    }
+    return bytes;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2019-2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUDIO_EXTN_STREAM_RECOVERY_H
+#define AUDIO_EXTN_STREAM_RECOVERY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/*
+ * Recovers a PCM stream from PAL failures without stalling its client thread.
+ *
+ * Once started, the stream reads or writes go to a null device paced at real
+ * time rate by a timerfd, while a worker closes the PAL session and reopens it
+ * with exponential backoff. When a reopen succeeds the recovery is no longer
+ * active and the next read or write uses PAL again.
+ */
+class StreamRecovery {
+public:
+    StreamRecovery();
+    ~StreamRecovery();
+    /*
+     * starts a recovery unless one is in progress. close and reopen run on the
+     * worker, reopen returns 0 once the stream is usable again.
+     */
+    int Start(uint32_t frame_size, uint32_t sample_rate,
+              std::function<void()> close, std::function<int()> reopen);
+    /*
+     * abandons the recovery in progress, waiting for the worker. From the
+     * close or reopen callbacks it does nothing.
+     */
+    void Stop();
+    bool IsActive() { return active_.load(std::memory_order_acquire); }
+    /* drops bytes of stream data, returning once they would have been rendered */
+    size_t Consume(size_t bytes);
+
+private:
+    static uint32_t NextBackoff(uint32_t backoff_ms);
+    void Worker();
+
+    std::function<void()> close_;
+    std::function<int()> reopen_;
+    uint32_t frame_size_ = 0;
+    uint32_t sample_rate_ = 0;
+    int timer_fd_ = -1;
+    /* CLOCK_MONOTONIC time the data consumed so far is due, in ns */
+    uint64_t due_ns_ = 0;
+    std::atomic<bool> active_{false};
+    bool exit_ = false;
+    std::mutex lock_;
+    std::condition_variable exit_cond_;
+    std::thread thread_;
+    /* wait before the last reopen attempt, grows when recoveries follow each other */
+    uint32_t backoff_ms_ = 0;
+    uint64_t start_ns_ = 0;
+    uint64_t end_ns_ = 0;
+    /* statistics */
+    std::atomic<uint64_t> frames_lost_{0};
+    uint64_t total_frames_lost_ = 0;
+    uint32_t recoveries_ = 0;
+};
+
+#endif /* AUDIO_EXTN_STREAM_RECOVERY_H */
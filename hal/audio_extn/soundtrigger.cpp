@@ -67,8 +67,11 @@
 #include <stdlib.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include "AudioCommon.h"
 #include <cutils/list.h>
 
@@ -206,17 +209,11 @@ do {\
 extern "C" const unsigned int sthal_prop_api_version =
     STHAL_PROP_API_CURRENT_VERSION;
 
-struct sound_trigger_info  {
-    struct sound_trigger_session_info st_ses;
-    bool lab_stopped;
-    struct listnode list;
-};
-
 struct sound_trigger_audio_device {
     void *lib_handle;
     std::shared_ptr<AudioDevice> adev;
     sound_trigger_hw_call_back_t st_callback;
-    struct listnode st_ses_list;
+    /* serializes the updates of st_ses_table */
     pthread_mutex_t lock;
     unsigned int sthal_prop_api_version;
     bool st_ec_ref_enabled;
@@ -224,6 +221,29 @@ struct sound_trigger_audio_device {
 
 static struct sound_trigger_audio_device *st_dev;
 
+/*
+ * Sound trigger sessions indexed by capture handle, open addressing with linear
+ * probing. The STHAL callbacks update the table under st_dev->lock, capture
+ * paths read it without locking: st_ses_seq is odd while an update is in
+ * progress and lookups retry when it changed under them. As it changes on every
+ * update, streams also use it as the generation of their cached lookup.
+ */
+#define ST_SES_TABLE_BITS 6
+#define ST_SES_TABLE_SIZE (1 << ST_SES_TABLE_BITS)
+/* at most half full, which keeps probe sequences short */
+#define ST_SES_MAX_SESSIONS (ST_SES_TABLE_SIZE / 2)
+/* AUDIO_IO_HANDLE_NONE marks a free slot */
+#define ST_SES_FREE_SLOT AUDIO_IO_HANDLE_NONE
+
+struct st_ses_slot {
+    std::atomic<int> capture_handle;
+    std::atomic<void *> p_ses;
+};
+
+static struct st_ses_slot st_ses_table[ST_SES_TABLE_SIZE];
+static uint32_t st_ses_count;
+static std::atomic<uint32_t> st_ses_seq{2};
+
 #if LINUX_ENABLED
 static void get_library_path(char *lib_path)
 {
@@ -248,26 +268,103 @@ static void get_library_path(char *lib_path)
 #endif
 #endif
 
-static struct sound_trigger_info *
-get_sound_trigger_info(int capture_handle)
+static uint32_t st_ses_hash(int capture_handle)
+{
+    return ((uint32_t)capture_handle * 2654435761u) >> (32 - ST_SES_TABLE_BITS);
+}
+
+/* slot holding capture_handle, or the free slot ending its probe sequence */
+static uint32_t st_ses_probe(int capture_handle)
+{
+    uint32_t i = st_ses_hash(capture_handle);
+    int slot_handle;
+
+    while ((slot_handle = st_ses_table[i].capture_handle.load(std::memory_order_relaxed))
+            != ST_SES_FREE_SLOT && slot_handle != capture_handle)
+        i = (i + 1) & (ST_SES_TABLE_SIZE - 1);
+    return i;
+}
+
+/* looks capture_handle up without locking, returns the table generation it is valid for */
+static uint32_t st_ses_lookup(int capture_handle, void **p_ses)
+{
+    uint32_t seq, i;
+    void *ses;
+
+    do {
+        while ((seq = st_ses_seq.load(std::memory_order_acquire)) & 1)
+            sched_yield();
+        i = st_ses_probe(capture_handle);
+        ses = nullptr;
+        if (st_ses_table[i].capture_handle.load(std::memory_order_relaxed) == capture_handle)
+            ses = st_ses_table[i].p_ses.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while (st_ses_seq.load(std::memory_order_relaxed) != seq);
+
+    *p_ses = ses;
+    return seq;
+}
+
+/* updates are made with st_dev->lock held, between begin and end */
+static void st_ses_update_begin()
+{
+    st_ses_seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void st_ses_update_end()
+{
+    st_ses_seq.fetch_add(1, std::memory_order_release);
+}
+
+static int st_ses_insert(int capture_handle, void *p_ses)
 {
-    struct sound_trigger_info  *st_ses_info = NULL;
-    struct listnode *node;
-    AHAL_VERBOSE("list empty %d capture_handle %d",
-           list_empty(&st_dev->st_ses_list), capture_handle);
-    list_for_each(node, &st_dev->st_ses_list) {
-        st_ses_info = node_to_item(node, struct sound_trigger_info , list);
-        if (st_ses_info->st_ses.capture_handle == capture_handle)
-            return st_ses_info;
+    uint32_t i = st_ses_probe(capture_handle);
+
+    if (st_ses_table[i].capture_handle.load(std::memory_order_relaxed) != capture_handle) {
+        if (st_ses_count >= ST_SES_MAX_SESSIONS)
+            return -ENOMEM;
+        st_ses_count++;
+    }
+    st_ses_table[i].p_ses.store(p_ses, std::memory_order_relaxed);
+    st_ses_table[i].capture_handle.store(capture_handle, std::memory_order_relaxed);
+    return 0;
+}
+
+static int st_ses_remove(int capture_handle)
+{
+    uint32_t i = st_ses_probe(capture_handle);
+    uint32_t j = i, home;
+    int slot_handle;
+
+    if (st_ses_table[i].capture_handle.load(std::memory_order_relaxed) != capture_handle)
+        return -EINVAL;
+
+    /* backward shift deletion: move up entries whose probe sequence crosses the hole */
+    for (;;) {
+        j = (j + 1) & (ST_SES_TABLE_SIZE - 1);
+        slot_handle = st_ses_table[j].capture_handle.load(std::memory_order_relaxed);
+        if (slot_handle == ST_SES_FREE_SLOT)
+            break;
+        home = st_ses_hash(slot_handle);
+        if ((j > i) ? (home <= i || home > j) : (home <= i && home > j)) {
+            st_ses_table[i].p_ses.store(
+                st_ses_table[j].p_ses.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+            st_ses_table[i].capture_handle.store(slot_handle, std::memory_order_relaxed);
+            i = j;
+        }
     }
-    return NULL;
+    st_ses_table[i].capture_handle.store(ST_SES_FREE_SLOT, std::memory_order_relaxed);
+    st_ses_table[i].p_ses.store(nullptr, std::memory_order_relaxed);
+    st_ses_count--;
+    return 0;
 }
 
 extern "C" void audio_hw_call_back(sound_trigger_event_type_t event,
                                   sound_trigger_event_info_t* config)
 {
     int status = 0;
-    struct sound_trigger_info  *st_ses_info;
 
     if (!st_dev)
        return;
@@ -280,24 +377,16 @@ extern "C" void audio_hw_call_back(sound_trigger_event_type_t event,
             status = -EINVAL;
             break;
         }
-        st_ses_info = get_sound_trigger_info(config->st_ses.capture_handle);
-        if (st_ses_info) {
-            memcpy(&st_ses_info->st_ses, &config->st_ses,
-                sizeof(struct sound_trigger_session_info));
-        } else {
-            st_ses_info = (struct sound_trigger_info *)calloc(1,
-                sizeof(struct sound_trigger_info ));
-            if (!st_ses_info) {
-                AHAL_ERR("st_ses_info alloc failed");
-                status = -ENOMEM;
-                break;
-            }
-            memcpy(&st_ses_info->st_ses, &config->st_ses,
-                sizeof(struct sound_trigger_session_info));
-            AHAL_VERBOSE("add capture_handle %d st session opaque ptr %p",
-                st_ses_info->st_ses.capture_handle, st_ses_info->st_ses.p_ses);
-            list_add_tail(&st_dev->st_ses_list, &st_ses_info->list);
+        st_ses_update_begin();
+        status = st_ses_insert(config->st_ses.capture_handle, config->st_ses.p_ses);
+        st_ses_update_end();
+        if (status) {
+            AHAL_ERR("no room for capture_handle %d, %d sessions registered",
+                config->st_ses.capture_handle, st_ses_count);
+            break;
         }
+        AHAL_VERBOSE("add capture_handle %d st session opaque ptr %p",
+            config->st_ses.capture_handle, config->st_ses.p_ses);
         break;
 
     case ST_EVENT_SESSION_DEREGISTER:
@@ -306,17 +395,16 @@ extern "C" void audio_hw_call_back(sound_trigger_event_type_t event,
             status = -EINVAL;
             break;
         }
-        st_ses_info = get_sound_trigger_info(config->st_ses.capture_handle);
-        if (!st_ses_info) {
+        st_ses_update_begin();
+        status = st_ses_remove(config->st_ses.capture_handle);
+        st_ses_update_end();
+        if (status) {
             AHAL_ERR("st session opaque ptr %p not in the list!",
                   config->st_ses.p_ses);
-            status = -EINVAL;
             break;
         }
         AHAL_VERBOSE("remove capture_handle %d st session opaque ptr %p",
-              st_ses_info->st_ses.capture_handle, st_ses_info->st_ses.p_ses);
-        list_remove(&st_ses_info->list);
-        free(st_ses_info);
+              config->st_ses.capture_handle, config->st_ses.p_ses);
         break;
 
     default:
@@ -329,8 +417,6 @@ extern "C" void audio_hw_call_back(sound_trigger_event_type_t event,
 
 void* audio_extn_sound_trigger_check_and_get_session(StreamInPrimary *in_stream)
 {
-    struct sound_trigger_info *st_ses_info = nullptr;
-    struct listnode *node = nullptr;
     void *handle = nullptr;
 
     AHAL_VERBOSE("Enter");
@@ -339,21 +425,13 @@ void* audio_extn_sound_trigger_check_and_get_session(StreamInPrimary *in_stream)
         goto exit;
     }
 
-    pthread_mutex_lock(&st_dev->lock);
-    in_stream->is_st_session = false;
-    AHAL_VERBOSE("list %d capture_handle %d",
-          list_empty(&st_dev->st_ses_list), in_stream->GetHandle());
-    list_for_each(node, &st_dev->st_ses_list) {
-        st_ses_info = node_to_item(node, struct sound_trigger_info , list);
-        if (st_ses_info->st_ses.capture_handle == in_stream->GetHandle()) {
-            handle = st_ses_info->st_ses.p_ses;
-            in_stream->is_st_session = true;
-            AHAL_DBG("capture_handle %d is sound trigger",
-                  in_stream->GetHandle());
-            break;
-        }
-    }
-    pthread_mutex_unlock(&st_dev->lock);
+    AHAL_VERBOSE("%d sessions, capture_handle %d",
+          st_ses_count, in_stream->GetHandle());
+    st_ses_lookup(in_stream->GetHandle(), &handle);
+    in_stream->is_st_session = (handle != nullptr);
+    if (handle)
+        AHAL_DBG("capture_handle %d is sound trigger",
+              in_stream->GetHandle());
 
 exit:
     AHAL_VERBOSE("Exit");
@@ -363,8 +441,7 @@ exit:
 
 bool audio_extn_sound_trigger_check_session_activity(StreamInPrimary *in_stream)
 {
-    struct sound_trigger_info *st_ses_info = nullptr;
-    struct listnode *node = nullptr;
+    void *handle = nullptr;
     bool st_session_available = false;
 
     AHAL_VERBOSE("Enter");
@@ -373,19 +450,20 @@ bool audio_extn_sound_trigger_check_session_activity(StreamInPrimary *in_stream)
         goto exit;
     }
 
-    pthread_mutex_lock(&st_dev->lock);
-    AHAL_VERBOSE("list %d capture_handle %d",
-          list_empty(&st_dev->st_ses_list), in_stream->GetHandle());
-    list_for_each(node, &st_dev->st_ses_list) {
-        st_ses_info = node_to_item(node, struct sound_trigger_info, list);
-        if (st_ses_info->st_ses.capture_handle == in_stream->GetHandle()) {
-            AHAL_VERBOSE("sound trigger session available for capture_handle %d",
-                  in_stream->GetHandle());
-            st_session_available = true;
-            break;
-        }
+    /* called on every LAB read, the table is only searched after it changed */
+    if (in_stream->st_session_generation_ ==
+            st_ses_seq.load(std::memory_order_acquire)) {
+        st_session_available = in_stream->st_session_active_;
+        goto exit;
     }
-    pthread_mutex_unlock(&st_dev->lock);
+
+    in_stream->st_session_generation_ =
+        st_ses_lookup(in_stream->GetHandle(), &handle);
+    st_session_available = (handle != nullptr);
+    in_stream->st_session_active_ = st_session_available;
+    if (st_session_available)
+        AHAL_VERBOSE("sound trigger session available for capture_handle %d",
+              in_stream->GetHandle());
 
 exit:
     AHAL_VERBOSE("Exit");
@@ -440,7 +518,6 @@ int audio_extn_sound_trigger_init(std::shared_ptr<AudioDevice> adev)
 
     st_dev->adev = adev;
     st_dev->st_ec_ref_enabled = false;
-    list_init(&st_dev->st_ses_list);
 
     return 0;
 
@@ -455,18 +532,20 @@ cleanup:
 
 void audio_extn_sound_trigger_deinit(std::shared_ptr<AudioDevice> adev)
 {
-    struct sound_trigger_info *st_ses_info = NULL;
-    struct listnode *node, *temp;
+    int i;
 
     AHAL_INFO("Enter");
     if (st_dev) {
-        list_for_each_safe(node, temp, &st_dev->st_ses_list) {
-            st_ses_info = node_to_item(node, struct sound_trigger_info, list);
-            if (st_ses_info) {
-                list_remove(&st_ses_info->list);
-                free(st_ses_info);
-            }
+        pthread_mutex_lock(&st_dev->lock);
+        st_ses_update_begin();
+        for (i = 0; i < ST_SES_TABLE_SIZE; i++) {
+            st_ses_table[i].capture_handle.store(ST_SES_FREE_SLOT,
+                                                 std::memory_order_relaxed);
+            st_ses_table[i].p_ses.store(nullptr, std::memory_order_relaxed);
         }
+        st_ses_count = 0;
+        st_ses_update_end();
+        pthread_mutex_unlock(&st_dev->lock);
     }
 
     if (st_dev && (st_dev->adev == adev) && st_dev->lib_handle) {